@@ -18,18 +18,29 @@
 #define HAPI_H
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h> 
 #include <stdarg.h> 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <ctype.h> 
 #include <signal.h> 
 #include <stdbool.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <errno.h>
 #include "htengine.h"
 #ifdef SSL_ENABLE
@@ -43,6 +54,31 @@
 #define BLOCKLIST_MAX_LINES 1024
 #define BLOCKLIST_MAX_TOKENS 256
 #define BLOCKLIST_MAX_LENGTH 1024
+#define HTTP_REQUEST_TIMEOUT 30
+// NOTE: Seconds a client may stop reading before a write to it gives up
+#define HTTP_SEND_TIMEOUT 10
+#define HTTP_KEEPALIVE_TIMEOUT 5
+#define HTTP_KEEPALIVE_MAX 100
+#define HTTP_CONN_BUFFER (16 * 1024)
+#define HTTP_EPOLL_EVENTS 64
+#define HTTP_WORKER_STACK_SIZE (8 * 1024 * 1024)
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_PARAMS 64
+#define HTTP_MAX_COOKIES 32
+#define HTTP_FILE_CACHE_SIZE 128
+#define HTTP_FILE_CACHE_BUCKETS 256
+// NOTE: Seconds a cached file is trusted before it is stat()ed again
+#define HTTP_FILE_CACHE_CHECK 1
+// NOTE: Files up to this size are answered from memory
+#define HTTP_ASSET_MAX_SIZE (64 * 1024)
+// NOTE: 0 = one worker per online CPU
+#ifndef HTTP_WORKERS
+#define HTTP_WORKERS 0
+#endif
+// NOTE: Threads running blocking handle_client_f callbacks, a slow client ties up one of them
+#ifndef HTTP_HANDOFF_THREADS
+#define HTTP_HANDOFF_THREADS 64
+#endif
 
 #define SERVER_API_NAME "mfh"
 #define SERVER_API_VERSION 1.0
@@ -69,6 +105,11 @@ typedef struct {
     int cookie_count;
 } HTTP_CookieJar;
 
+typedef struct {
+    char *name;
+    char *value;
+} HTTP_Header;
+
 typedef struct {
     HTTP_Method method;
     char *route;
@@ -78,17 +119,81 @@ typedef struct {
     char *body;
     char *extracted_ip;
     HTTP_CookieJar cookie_jar;
+    HTTP_Header *headers;
+    int header_count;
+    size_t body_len;
+    // NOTE: Set when every field points into an HTTP_Parser buffer, nothing is owned
+    bool borrowed;
 } HTTP_Request;
 
+#define HTTP_PARSE_AGAIN 0
+#define HTTP_PARSE_DONE 1
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_TOO_LARGE -2
+
+typedef enum {
+    HP_METHOD,
+    HP_TARGET,
+    HP_VERSION,
+    HP_LINE_LF,
+    HP_HEADER_START,
+    HP_HEADER_NAME,
+    HP_HEADER_OWS,
+    HP_HEADER_VALUE,
+    HP_HEADERS_LF,
+    HP_BODY,
+    HP_DONE,
+} HTTP_ParseState;
+
+// NOTE: Offsets from the start of the request, so they survive the buffer being moved or grown
+typedef struct {
+    size_t off;
+    size_t len;
+} HTTP_Span;
+
+/*
+ * Incremental request parser. Feeding it the same request again after more
+ * bytes arrived resumes where it stopped, every byte is looked at once.
+ * The arrays below back the HTTP_Request it hands out, so one parser serves
+ * a whole connection without allocating per request
+ */
+typedef struct {
+    HTTP_ParseState state;
+    size_t pos;
+    size_t size;
+    size_t content_length;
+    bool has_length;
+    bool keep_alive;
+    HTTP_Method method;
+    HTTP_Span target;
+    HTTP_Span version;
+    HTTP_Span names[HTTP_MAX_HEADERS];
+    HTTP_Span values[HTTP_MAX_HEADERS];
+    int header_count;
+    char saved;
+    HTTP_Header headers[HTTP_MAX_HEADERS];
+    HTTP_Parameter params[HTTP_MAX_PARAMS];
+    HTTP_Cookie cookies[HTTP_MAX_COOKIES];
+    // NOTE: Cookie headers and form bodies are split here so the originals stay intact,
+    // reused across requests
+    char *scratch;
+    size_t scratch_cap;
+} HTTP_Parser;
+
 static char **blocklist = NULL;
 static int block_count = 0;
+// NOTE: Whether the response being written is the last one on its connection
+static _Thread_local bool http_connection_close = true;
 
 #ifdef SSL_ENABLE
 typedef void (*handle_client_f)(int, SSL_CTX *);
+// NOTE: Answers one request on a kept-alive connection, returns < 0 to close it
+typedef int (*handle_request_f)(int, HTTP_Request *, SSL *);
 void http_send_response(int client_socket, const char *status, const char *content, SSL *ssl);
 void http_send_file_response(int client_socket, char *status, const char *filepath, HtmlTemplate *tmpl, SSL *ssl);
 #else
 typedef void (*handle_client_f)(int);
+typedef int (*handle_request_f)(int, HTTP_Request *);
 void http_send_file_response(int client_socket, char *status, const char *filepath, HtmlTemplate *tmpl);
 void http_send_response(int client_socket, const char *status, const char *content);
 #endif
@@ -224,7 +329,8 @@ char* hapi_format_cookie(const char *name, const char *value, int max_age) {
 
     time_t now = time(NULL);
     now += max_age;
-    struct tm *tm_info = gmtime(&now);
+    struct tm tm_buf;
+    struct tm *tm_info = gmtime_r(&now, &tm_buf);
     char expires[32];
     strftime(expires, sizeof(expires), "%a, %d %b %Y %H:%M:%S GMT", tm_info);
 
@@ -246,6 +352,162 @@ char* hapi_format_cookie(const char *name, const char *value, int max_age) {
     return cookie_header;
 }
 
+void http_socket_set_nonblock(int fd, bool nonblock) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return;
+    fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+/*
+ * Output a worker's keep-alive connection could not send yet. Workers never
+ * wait on a client: what the socket does not take right away is queued here,
+ * files as a range of their descriptor, and sent as EPOLLOUT reports room
+ */
+struct HTTP_File;
+void http_file_release(struct HTTP_File *file);
+
+typedef struct HTTP_Chunk {
+    struct HTTP_Chunk *next;
+    // NOTE: Either a range of file or len bytes of data
+    struct HTTP_File *file;
+    off_t off;
+    off_t end;
+    size_t len;
+    size_t sent;
+    char data[];
+} HTTP_Chunk;
+
+typedef struct {
+    int fd;
+#ifdef SSL_ENABLE
+    SSL *ssl;
+#endif
+    HTTP_Chunk *head;
+    HTTP_Chunk *tail;
+} HTTP_Output;
+
+// Thread-local like http_connection_close: the queue of the connection a worker is answering, NULL elsewhere
+static _Thread_local HTTP_Output *http_output = NULL;
+
+void http_output_push(HTTP_Output *out, HTTP_Chunk *chunk) {
+    chunk->next = NULL;
+    if (out->tail) out->tail->next = chunk;
+    else out->head = chunk;
+    out->tail = chunk;
+}
+
+void http_output_pop(HTTP_Output *out) {
+    HTTP_Chunk *chunk = out->head;
+    out->head = chunk->next;
+    if (!out->head) out->tail = NULL;
+    if (chunk->file) http_file_release(chunk->file);
+    free(chunk);
+}
+
+// NOTE: One non-blocking write, returns the bytes taken, 0 if the socket is full and -1 on error
+ssize_t http_output_send(HTTP_Output *out, const char *data, size_t len) {
+#ifdef SSL_ENABLE
+    int n = SSL_write(out->ssl, data, len > INT_MAX ? INT_MAX : (int)len);
+    if (n > 0) return n;
+    int err = SSL_get_error(out->ssl, n);
+    ERR_clear_error();
+    // NOTE: Renegotiating in the middle of a response (SSL_ERROR_WANT_READ) is not supported
+    return err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+#else
+    while (1) {
+        ssize_t n = send(out->fd, data, len, MSG_DONTWAIT);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+#endif
+}
+
+// NOTE: Sends what the socket takes now unless output is already queued, the rest is queued behind it
+bool http_output_write(HTTP_Output *out, const char *data, size_t len) {
+    while (!out->head && len > 0) {
+        ssize_t n = http_output_send(out, data, len);
+        if (n < 0) {
+            http_connection_close = true;
+            return false;
+        }
+        if (n == 0) break;
+        data += n;
+        len -= n;
+    }
+    if (len == 0) return true;
+
+    HTTP_Chunk *chunk = malloc(sizeof(HTTP_Chunk) + len);
+    if (!chunk) {
+        http_connection_close = true;
+        return false;
+    }
+    memset(chunk, 0, sizeof(HTTP_Chunk));
+    memcpy(chunk->data, data, len);
+    chunk->len = len;
+    http_output_push(out, chunk);
+    return true;
+}
+
+// NOTE: False if the socket is still not ready after HTTP_SEND_TIMEOUT
+bool http_socket_wait(int fd, short events) {
+    struct pollfd pfd = { fd, events, 0 };
+    int rc;
+    do {
+        rc = poll(&pfd, 1, HTTP_SEND_TIMEOUT * 1000);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0;
+}
+
+/*
+ * Writes len bytes, picking up after short writes. On a worker what does
+ * not fit the socket is queued for EPOLLOUT; the handoff pool's threads
+ * wait for room instead, HTTP_SEND_TIMEOUT at most. A failed or timed-out
+ * write marks the connection to be closed
+ */
+#ifdef SSL_ENABLE
+bool http_write_all(int client_socket, const void *data, size_t len, SSL *ssl) {
+    if (http_output) return http_output_write(http_output, data, len);
+    const char *p = data;
+    bool ok = true;
+    http_socket_set_nonblock(client_socket, true);
+    while (ok && len > 0) {
+        int n = SSL_write(ssl, p, len > INT_MAX ? INT_MAX : (int)len);
+        if (n <= 0) {
+            int err = SSL_get_error(ssl, n);
+            ERR_clear_error();
+            // NOTE: OpenSSL wants the same write repeated once the socket is ready
+            if (err == SSL_ERROR_WANT_WRITE) ok = http_socket_wait(client_socket, POLLOUT);
+            else if (err == SSL_ERROR_WANT_READ) ok = http_socket_wait(client_socket, POLLIN);
+            else ok = false;
+            continue;
+        }
+        p += n;
+        len -= n;
+    }
+    http_socket_set_nonblock(client_socket, false);
+    if (!ok) http_connection_close = true;
+    return ok;
+}
+#else
+bool http_write_all(int client_socket, const void *data, size_t len) {
+    if (http_output) return http_output_write(http_output, data, len);
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(client_socket, p, len, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && http_socket_wait(client_socket, POLLOUT)) continue;
+            http_connection_close = true;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+#endif
+
 bool hapi_set_cookie(int client_socket, const char *name, const char *value, int max_age
 #ifdef SSL_ENABLE
     , SSL *ssl
@@ -277,7 +539,8 @@ bool hapi_set_cookie(int client_socket, const char *name, const char *value, int
 
     time_t now = time(NULL);
     now += max_age;
-    struct tm *tm_info = gmtime(&now);
+    struct tm tm_buf;
+    struct tm *tm_info = gmtime_r(&now, &tm_buf);
     char expires[32];
     strftime(expires, sizeof(expires), "%a, %d %b %Y %H:%M:%S GMT", tm_info);
 
@@ -290,7 +553,8 @@ bool hapi_set_cookie(int client_socket, const char *name, const char *value, int
         "HTTP/1.1 200 OK\r\n"
         "Set-Cookie: %s=%s; Path=/; HttpOnly; SameSite=Strict%s; Max-Age=%d; Expires=%s\r\n"
         "Content-Type: text/html\r\n"
-        "Connection: keep-alive\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: %s\r\n"
         "\r\n",
         name, value,
 #ifdef SSL_ENABLE
@@ -298,23 +562,17 @@ bool hapi_set_cookie(int client_socket, const char *name, const char *value, int
 #else
         "",
 #endif
-        max_age, expires);
+        max_age, expires, http_connection_close ? "close" : "keep-alive");
 
     if (written < 0 || (size_t)written >= required_size) {
         free(header);
         return false;
     }
 
-    bool success = false;
 #ifdef SSL_ENABLE
-    int ssl_result = SSL_write(ssl, header, written);
-    success = (ssl_result > 0);
-    if (!success) {
-        ERR_clear_error();
-    }
+    bool success = http_write_all(client_socket, header, written, ssl);
 #else
-    ssize_t send_result = send(client_socket, header, written, 0);
-    success = (send_result == written);
+    bool success = http_write_all(client_socket, header, written);
 #endif
 
     free(header);
@@ -364,16 +622,10 @@ bool hapi_remove_cookie(int client_socket, const char *name
         return false;
     }
 
-    bool success = false;
 #ifdef SSL_ENABLE
-    int ssl_result = SSL_write(ssl, response, written);
-    success = (ssl_result > 0);
-    if (!success) {
-        ERR_clear_error();
-    }
+    bool success = http_write_all(client_socket, response, written, ssl);
 #else
-    ssize_t send_result = send(client_socket, response, written, 0);
-    success = (send_result == written);
+    bool success = http_write_all(client_socket, response, written);
 #endif
 
     free(response);
@@ -406,7 +658,7 @@ char *hapi_get_cookie(const HTTP_Request *req, const char *name) {
 }
 
 void hapi_free_cookies(HTTP_Request *req) {
-    if (!req || !req->cookie_jar.cookies) {
+    if (!req || !req->cookie_jar.cookies || req->borrowed) {
         return;
     }
 
@@ -424,16 +676,28 @@ void hapi_free_cookies(HTTP_Request *req) {
 
 // Feature section
 // f = feature 
+
+// NOTE: Matches /<api>/f/<name> with or without a trailing slash
+int hapi_f_route(const HTTP_Request *req, const char *name) {
+    char route[128];
+    int len = snprintf(route, sizeof(route), "/%s/f/%s", SERVER_API_NAME, name);
+    if (!req->route || len < 0 || (size_t)len >= sizeof(route)) return 0;
+    if (strncmp(req->route, route, len) != 0) return 0;
+    return req->route[len] == '\0' || (req->route[len] == '/' && req->route[len + 1] == '\0');
+}
+
 #ifdef SSL_ENABLE 
 int hapi_f_time(HTTP_Request *req, int client_socket, SSL *ssl) {
 #else
 int hapi_f_time(HTTP_Request *req, int client_socket) {
 #endif
-    if (http_check_route(req->route, str_format("/%s/f/time", SERVER_API_NAME)) || http_check_route(req->route, str_format("/%s/f/time/", SERVER_API_NAME)) ) {
+    if (hapi_f_route(req, "time")) {
+        char now[32];
+        snprintf(now, sizeof(now), "%lld", (long long)time(NULL));
 #ifdef SSL_ENABLE
-        http_send_response(client_socket, "200 OK", str_format("%d", time(NULL)), ssl);
+        http_send_response(client_socket, "200 OK", now, ssl);
 #else 
-        http_send_response(client_socket, "200 OK", str_format("%d", time(NULL)));
+        http_send_response(client_socket, "200 OK", now);
 #endif
         return 1;
     } else {
@@ -446,12 +710,15 @@ int hapi_f_token(HTTP_Request *req, int client_socket, SSL *ssl) {
 #else
 int hapi_f_token(HTTP_Request *req, int client_socket) {
 #endif
-    if (http_check_route(req->route, str_format("/%s/f/token", SERVER_API_NAME)) || http_check_route(req->route, str_format("/%s/f/token/", SERVER_API_NAME)) ) {
+    if (hapi_f_route(req, "token")) {
+        char *token = token_generate();
+        if (!token) return 0;
 #ifdef SSL_ENABLE
-        http_send_response(client_socket, "200 OK", str_format("%s", token_generate()), ssl);
+        http_send_response(client_socket, "200 OK", token, ssl);
 #else
-        http_send_response(client_socket, "200 OK", str_format("%s", token_generate()));
+        http_send_response(client_socket, "200 OK", token);
 #endif 
+        free(token);
         return 1;
     } else {
         return 0;
@@ -490,7 +757,8 @@ void http_parse_cookies(HTTP_Request *req, const char *header) {
     
     cookie_header += 8;
     char *cookies_str = strdup(cookie_header);
-    char *token = strtok(cookies_str, "; ");
+    char *saveptr = NULL;
+    char *token = strtok_r(cookies_str, "; ", &saveptr);
     
     while (token) {
         char *eq = strchr(token, '=');
@@ -502,7 +770,7 @@ void http_parse_cookies(HTTP_Request *req, const char *header) {
             req->cookie_jar.cookies[req->cookie_jar.cookie_count].value = strdup(eq + 1);
             req->cookie_jar.cookie_count++;
         }
-        token = strtok(NULL, "; ");
+        token = strtok_r(NULL, "; ", &saveptr);
     }
     
     free(cookies_str);
@@ -511,6 +779,8 @@ void http_parse_cookies(HTTP_Request *req, const char *header) {
 
 /*
  * Calls helper functions and parses request 
+ * NOTE: Copies every field and expects the whole request in one string,
+ * the servers use HTTP_Parser instead
  */
 HTTP_Request http_parse_request(const char *request) {
     HTTP_Request result = {0};
@@ -521,7 +791,7 @@ HTTP_Request http_parse_request(const char *request) {
         result.method = HM_POST;
     } else {
         result.method = HM_UNKNOWN;
-        log_msg("ERROR", "Unsupported HTTP method: %s\n", str_dup_until(request, ' '));
+        log_msg("ERROR", "Unsupported HTTP method: %.*s\n", (int)strcspn(request, " \r\n"), request);
         return result;
     }
 
@@ -539,12 +809,13 @@ HTTP_Request http_parse_request(const char *request) {
         result.param_count = count + 1;
         result.parameters = malloc(sizeof(HTTP_Parameter) * result.param_count);
 
-        char *pair = strtok(query, "&");
+        char *saveptr = NULL;
+        char *pair = strtok_r(query, "&", &saveptr);
         int i = 0;
         while (pair && i < result.param_count) {
             result.parameters[i].key = str_dup_until(pair, '=');
             result.parameters[i].value = strdup(strchr(pair, '=') + 1);
-            pair = strtok(NULL, "&");
+            pair = strtok_r(NULL, "&", &saveptr);
             i++;
         }
     }
@@ -578,12 +849,13 @@ HTTP_Request http_parse_request(const char *request) {
                 result.parameters = malloc(sizeof(HTTP_Parameter) * result.param_count);
 
                 char *body_copy = strdup(body);
-                char *pair = strtok(body_copy, "&");
+                char *saveptr = NULL;
+                char *pair = strtok_r(body_copy, "&", &saveptr);
                 int i = 0;
                 while (pair && i < result.param_count) {
                     result.parameters[i].key = str_dup_until(pair, '=');
                     result.parameters[i].value = strdup(strchr(pair, '=') + 1);
-                    pair = strtok(NULL, "&");
+                    pair = strtok_r(NULL, "&", &saveptr);
                     i++;
                 }
                 free(body_copy);
@@ -594,6 +866,328 @@ HTTP_Request http_parse_request(const char *request) {
     return result;
 }
 
+void http_free_request(HTTP_Request *req) {
+    if (req->borrowed) {
+        memset(req, 0, sizeof(*req));
+        return;
+    }
+    hapi_free_cookies(req);
+    free(req->route);
+    free(req->host);
+    free(req->body);
+    free(req->extracted_ip);
+    if (req->parameters) {
+        for (int i = 0; i < req->param_count; i++) {
+            free(req->parameters[i].key);
+            free(req->parameters[i].value);
+        }
+        free(req->parameters);
+    }
+    memset(req, 0, sizeof(*req));
+}
+
+// NOTE: Looks a header up by name (case-insensitive), NULL if the request has none
+const char *http_get_header(const HTTP_Request *req, const char *name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].name, name) == 0) return req->headers[i].value;
+    }
+    return NULL;
+}
+
+/*
+ * Incremental parser
+ */
+void http_parser_reset(HTTP_Parser *p) {
+    p->state = HP_METHOD;
+    p->pos = 0;
+    p->size = 0;
+    p->content_length = 0;
+    p->has_length = false;
+    p->keep_alive = false;
+    p->method = HM_UNKNOWN;
+    p->header_count = 0;
+}
+
+void http_parser_init(HTTP_Parser *p) {
+    memset(p, 0, sizeof(*p));
+    http_parser_reset(p);
+}
+
+void http_parser_free(HTTP_Parser *p) {
+    free(p->scratch);
+    p->scratch = NULL;
+    p->scratch_cap = 0;
+}
+
+bool http_is_token(char c) {
+    return isalnum((unsigned char)c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+bool http_span_is(const char *buf, HTTP_Span span, const char *literal) {
+    return strlen(literal) == span.len && strncasecmp(buf + span.off, literal, span.len) == 0;
+}
+
+// NOTE: Picks up the headers that decide framing and persistence as soon as they end
+int http_parser_header(HTTP_Parser *p, const char *buf) {
+    HTTP_Span name = p->names[p->header_count];
+    HTTP_Span value = p->values[p->header_count];
+
+    if (http_span_is(buf, name, "Content-Length")) {
+        if (p->has_length || value.len == 0) return HTTP_PARSE_ERROR;
+        size_t n = 0;
+        for (size_t i = 0; i < value.len; i++) {
+            char c = buf[value.off + i];
+            if (!isdigit((unsigned char)c)) return HTTP_PARSE_ERROR;
+            n = n * 10 + (c - '0');
+            if (n > R_BUFFER_SIZE) return HTTP_PARSE_TOO_LARGE;
+        }
+        p->content_length = n;
+        p->has_length = true;
+    } else if (http_span_is(buf, name, "Transfer-Encoding")) {
+        // NOTE: Only Content-Length framing is supported
+        return HTTP_PARSE_ERROR;
+    } else if (http_span_is(buf, name, "Connection")) {
+        size_t i = 0;
+        while (i < value.len) {
+            while (i < value.len && (buf[value.off + i] == ' ' || buf[value.off + i] == ',')) i++;
+            HTTP_Span token = { value.off + i, 0 };
+            while (i < value.len && buf[value.off + i] != ',' && buf[value.off + i] != ' ') i++;
+            token.len = value.off + i - token.off;
+            if (http_span_is(buf, token, "close")) p->keep_alive = false;
+            else if (http_span_is(buf, token, "keep-alive")) p->keep_alive = true;
+        }
+    }
+    return HTTP_PARSE_AGAIN;
+}
+
+/*
+ * Parses the request at the start of buf (len bytes read so far).
+ * Returns HTTP_PARSE_DONE once it is complete, HTTP_PARSE_AGAIN if more
+ * input is needed, HTTP_PARSE_ERROR if it is malformed and
+ * HTTP_PARSE_TOO_LARGE if its body could never fit R_BUFFER_SIZE
+ */
+int http_parser_feed(HTTP_Parser *p, const char *buf, size_t len) {
+    while (p->pos < len && p->state < HP_BODY) {
+        char c = buf[p->pos];
+        switch (p->state) {
+        case HP_METHOD:
+            if (c == ' ') {
+                if (p->pos == 0) return HTTP_PARSE_ERROR;
+                if (p->pos == 3 && strncmp(buf, "GET", 3) == 0) p->method = HM_GET;
+                else if (p->pos == 4 && strncmp(buf, "POST", 4) == 0) p->method = HM_POST;
+                p->target.off = p->pos + 1;
+                p->state = HP_TARGET;
+            } else if (!http_is_token(c)) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_TARGET:
+            if (c == ' ') {
+                p->target.len = p->pos - p->target.off;
+                if (p->target.len == 0) return HTTP_PARSE_ERROR;
+                p->version.off = p->pos + 1;
+                p->state = HP_VERSION;
+            } else if ((unsigned char)c <= ' ' || c == 0x7f) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_VERSION:
+            if (c == '\r' || c == '\n') {
+                const char *v = buf + p->version.off;
+                p->version.len = p->pos - p->version.off;
+                if (p->version.len != 8 || strncmp(v, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)v[7])) {
+                    return HTTP_PARSE_ERROR;
+                }
+                // NOTE: HTTP/1.1 persists unless asked not to, HTTP/1.0 only when asked
+                p->keep_alive = v[7] != '0';
+                p->state = c == '\r' ? HP_LINE_LF : HP_HEADER_START;
+            } else if (p->pos - p->version.off >= 8) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_LINE_LF:
+            if (c != '\n') return HTTP_PARSE_ERROR;
+            p->state = HP_HEADER_START;
+            break;
+        case HP_HEADER_START:
+            if (c == '\r') {
+                p->state = HP_HEADERS_LF;
+            } else if (c == '\n') {
+                p->size = p->pos + 1 + p->content_length;
+                p->state = HP_BODY;
+            } else if (http_is_token(c) && p->header_count < HTTP_MAX_HEADERS) {
+                p->names[p->header_count].off = p->pos;
+                p->state = HP_HEADER_NAME;
+            } else {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_HEADER_NAME:
+            if (c == ':') {
+                HTTP_Span *name = &p->names[p->header_count];
+                name->len = p->pos - name->off;
+                p->state = HP_HEADER_OWS;
+            } else if (!http_is_token(c)) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_HEADER_OWS:
+            if (c == ' ' || c == '\t') break;
+            p->values[p->header_count].off = p->pos;
+            p->state = HP_HEADER_VALUE;
+            /* fallthrough */
+        case HP_HEADER_VALUE:
+            if (c == '\r' || c == '\n') {
+                HTTP_Span *value = &p->values[p->header_count];
+                size_t end = p->pos;
+                while (end > value->off && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) end--;
+                value->len = end - value->off;
+                int rc = http_parser_header(p, buf);
+                if (rc < 0) return rc;
+                p->header_count++;
+                p->state = c == '\r' ? HP_LINE_LF : HP_HEADER_START;
+            } else if (((unsigned char)c < ' ' && c != '\t') || c == 0x7f) {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case HP_HEADERS_LF:
+            if (c != '\n') return HTTP_PARSE_ERROR;
+            p->size = p->pos + 1 + p->content_length;
+            p->state = HP_BODY;
+            break;
+        default:
+            break;
+        }
+        p->pos++;
+    }
+
+    if (p->state < HP_BODY || len < p->size) return HTTP_PARSE_AGAIN;
+    p->state = HP_DONE;
+    return HTTP_PARSE_DONE;
+}
+
+// NOTE: Splits key=value pairs in place, stops quietly once HTTP_MAX_PARAMS are taken
+void http_split_params(HTTP_Request *req, char *s) {
+    while (*s && req->param_count < HTTP_MAX_PARAMS) {
+        char *pair = s;
+        char *amp = strchr(s, '&');
+        if (amp) {
+            *amp = '\0';
+            s = amp + 1;
+        } else {
+            s += strlen(s);
+        }
+        if (!*pair) continue;
+
+        char *eq = strchr(pair, '=');
+        if (eq) *eq++ = '\0';
+        else eq = pair + strlen(pair);
+        req->parameters[req->param_count].key = pair;
+        req->parameters[req->param_count].value = eq;
+        req->param_count++;
+    }
+}
+
+void http_split_cookies(HTTP_Request *req, char *s) {
+    while (*s && req->cookie_jar.cookie_count < HTTP_MAX_COOKIES) {
+        while (*s == ' ' || *s == ';') s++;
+        if (!*s) break;
+
+        char *pair = s;
+        char *semi = strchr(s, ';');
+        if (semi) {
+            *semi = '\0';
+            s = semi + 1;
+        } else {
+            s += strlen(s);
+        }
+
+        char *eq = strchr(pair, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        req->cookie_jar.cookies[req->cookie_jar.cookie_count].name = pair;
+        req->cookie_jar.cookies[req->cookie_jar.cookie_count].value = eq + 1;
+        req->cookie_jar.cookie_count++;
+    }
+}
+
+/*
+ * Fills req from a complete request at the start of buf. Every string is
+ * NUL-terminated in place, including the body, so buf[p->size] must be
+ * writable; http_parser_finish() puts that byte back
+ */
+void http_parser_request(HTTP_Parser *p, char *buf, HTTP_Request *req) {
+    memset(req, 0, sizeof(*req));
+    req->borrowed = true;
+    req->method = p->method;
+    req->parameters = p->params;
+    req->headers = p->headers;
+    req->cookie_jar.cookies = p->cookies;
+    req->extracted_ip = "NOTPROVIDED";
+
+    p->saved = buf[p->size];
+    buf[p->size] = '\0';
+
+    req->route = buf + p->target.off;
+    req->route[p->target.len] = '\0';
+    char *query = strchr(req->route, '?');
+    if (query) {
+        *query = '\0';
+        http_split_params(req, query + 1);
+    }
+
+    const char *content_type = NULL;
+    size_t cookie_size = 0;
+    for (int i = 0; i < p->header_count; i++) {
+        char *name = buf + p->names[i].off;
+        char *value = buf + p->values[i].off;
+        name[p->names[i].len] = '\0';
+        value[p->values[i].len] = '\0';
+        p->headers[i].name = name;
+        p->headers[i].value = value;
+
+        if (strcasecmp(name, "Host") == 0) req->host = value;
+        else if (strcasecmp(name, "X-Forwarded-For") == 0) req->extracted_ip = value;
+        else if (strcasecmp(name, "Content-Type") == 0) content_type = value;
+        else if (strcasecmp(name, "Cookie") == 0) cookie_size += p->values[i].len + 1;
+    }
+    req->header_count = p->header_count;
+
+    if (p->method == HM_POST || p->content_length > 0) {
+        req->body = buf + p->size - p->content_length;
+        req->body_len = p->content_length;
+    }
+
+    bool form = req->body_len > 0 && content_type && strstr(content_type, "application/x-www-form-urlencoded");
+    size_t needed = cookie_size + (form ? req->body_len + 1 : 0);
+    if (needed == 0) return;
+    if (p->scratch_cap < needed) {
+        char *scratch = realloc(p->scratch, needed);
+        if (!scratch) return;
+        p->scratch = scratch;
+        p->scratch_cap = needed;
+    }
+
+    // NOTE: Cookie values are copied first, the form body after them
+    char *s = p->scratch;
+    for (int i = 0; i < p->header_count && cookie_size > 0; i++) {
+        if (strcasecmp(p->headers[i].name, "Cookie") != 0) continue;
+        memcpy(s, p->headers[i].value, p->values[i].len + 1);
+        http_split_cookies(req, s);
+        s += p->values[i].len + 1;
+    }
+    if (form) {
+        memcpy(s, req->body, req->body_len + 1);
+        http_split_params(req, s);
+    }
+}
+
+// NOTE: Restores the byte after the request and gets ready for the next one
+void http_parser_finish(HTTP_Parser *p, char *buf) {
+    if (p->state == HP_DONE) buf[p->size] = p->saved;
+    http_parser_reset(p);
+}
+
 #ifdef SSL_ENABLE
 void ssl_init() {
     SSL_load_error_strings();
@@ -645,39 +1239,433 @@ void http_send_response(int client_socket, const char *status, const char *conte
             "HTTP/1.1 %s\r\n"
             "Server: %s\r\n"
             "Content-Length: %zu\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "%s"
             "\r\n%s",
-            status, SERVER_API_NAME, len, cookie_header, content);
+            status, SERVER_API_NAME, len, http_connection_close ? "close" : "keep-alive", cookie_header, content);
         free(cookie_header);
     } else {
         written = snprintf(response, header_size,
             "HTTP/1.1 %s\r\n"
             "Server: %s\r\n"
             "Content-Length: %zu\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "\r\n%s",
-            status, SERVER_API_NAME, len, content);
+            status, SERVER_API_NAME, len, http_connection_close ? "close" : "keep-alive", content);
     }
 
     if (written > 0 && written < (int)header_size) {
 #ifdef SSL_ENABLE
-        SSL_write(ssl, response, written);
+        http_write_all(client_socket, response, written, ssl);
 #else
-        send(client_socket, response, written, 0);
+        http_write_all(client_socket, response, written);
 #endif
     }
 
     free(response);
 }
 
+/*
+ * Open-file cache: recently served files keep their descriptor and stat
+ * result, so a hot asset costs no open()/fstat() per request. Entries are
+ * shared by all workers and refcounted; one evicted or found stale while a
+ * response is still using it is closed by its last user.
+ *
+ * Every entry carries its response headers and a strong ETag, and files up
+ * to HTTP_ASSET_MAX_SIZE also keep their body, so a repeat hit is answered
+ * from memory. Entries are watched with inotify and dropped as soon as their
+ * file changes; without a watch they are re-stat()ed instead
+ */
+typedef struct HTTP_File {
+    char *path;
+    int fd;
+    int wd;
+    struct stat st;
+    time_t checked;
+    int refs;
+    bool cached;
+    char etag[48];
+    // NOTE: Content-Type, Content-Length and ETag lines
+    char *headers;
+    size_t headers_len;
+    char *body;
+    struct HTTP_File *hnext;
+    struct HTTP_File *prev;
+    struct HTTP_File *next;
+} HTTP_File;
+
+// NOTE: head is the most recently used entry, tail the next to go
+typedef struct {
+    pthread_mutex_t lock;
+    HTTP_File *buckets[HTTP_FILE_CACHE_BUCKETS];
+    HTTP_File *head;
+    HTTP_File *tail;
+    int count;
+    int inotify_fd;
+    // NOTE: Bumped for every inotify event read, a loader compares it to spot one it may have missed
+    unsigned long events;
+} HTTP_FileCache;
+
+static HTTP_FileCache http_file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1 };
+
+unsigned long http_file_hash(const char *path) {
+    unsigned long hash = 5381;
+    while (*path) hash = hash * 33 + (unsigned char)*path++;
+    return hash % HTTP_FILE_CACHE_BUCKETS;
+}
+
+void http_file_destroy(HTTP_File *file) {
+    close(file->fd);
+    free(file->path);
+    free(file->headers);
+    free(file->body);
+    free(file);
+}
+
+void http_file_lru_unlink(HTTP_File *file) {
+    HTTP_FileCache *cache = &http_file_cache;
+    if (file->prev) file->prev->next = file->next;
+    else cache->head = file->next;
+    if (file->next) file->next->prev = file->prev;
+    else cache->tail = file->prev;
+    file->prev = file->next = NULL;
+}
+
+void http_file_lru_push(HTTP_File *file) {
+    HTTP_FileCache *cache = &http_file_cache;
+    file->prev = NULL;
+    file->next = cache->head;
+    if (cache->head) cache->head->prev = file;
+    else cache->tail = file;
+    cache->head = file;
+}
+
+// NOTE: Caller holds the lock; paths naming the same inode share one watch, it stays while any of them is cached
+void http_file_unwatch(HTTP_File *file) {
+    HTTP_FileCache *cache = &http_file_cache;
+    if (file->wd < 0) return;
+    HTTP_File *other = cache->head;
+    while (other && other->wd != file->wd) other = other->next;
+    if (!other) inotify_rm_watch(cache->inotify_fd, file->wd);
+    file->wd = -1;
+}
+
+// NOTE: Caller holds the lock, returns true when nobody uses the entry anymore
+bool http_file_cache_remove(HTTP_File *file) {
+    HTTP_FileCache *cache = &http_file_cache;
+    HTTP_File **link = &cache->buckets[http_file_hash(file->path)];
+    while (*link != file) link = &(*link)->hnext;
+    *link = file->hnext;
+    http_file_lru_unlink(file);
+    file->cached = false;
+    cache->count--;
+    http_file_unwatch(file);
+    return file->refs == 0;
+}
+
+// NOTE: A file replaced or touched since it was opened must be reopened
+bool http_file_stale(const HTTP_File *file, const struct stat *st) {
+    return st->st_ino != file->st.st_ino || st->st_dev != file->st.st_dev ||
+           st->st_size != file->st.st_size ||
+           st->st_mtim.tv_sec != file->st.st_mtim.tv_sec ||
+           st->st_mtim.tv_nsec != file->st.st_mtim.tv_nsec;
+}
+
+/*
+ * Fills in the ETag, header block and, for small files, the body.
+ * Small files are tagged by a hash of their content, so touching one
+ * without changing it keeps the tag; larger ones by inode, size and mtime
+ */
+bool http_file_load(HTTP_File *file) {
+    off_t size = file->st.st_size;
+    if (size <= HTTP_ASSET_MAX_SIZE) {
+        file->body = malloc(size > 0 ? size : 1);
+        if (!file->body || pread(file->fd, file->body, size, 0) != size) {
+            free(file->body);
+            file->body = NULL;
+        }
+    }
+
+    if (file->body) {
+        unsigned long long hash = 14695981039346656037ULL;
+        for (off_t i = 0; i < size; i++) {
+            hash = (hash ^ (unsigned char)file->body[i]) * 1099511628211ULL;
+        }
+        snprintf(file->etag, sizeof(file->etag), "\"%llx-%016llx\"", (unsigned long long)size, hash);
+    } else {
+        snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx-%llx\"",
+                 (unsigned long long)file->st.st_ino, (unsigned long long)size,
+                 (unsigned long long)file->st.st_mtim.tv_sec * 1000000000ULL + file->st.st_mtim.tv_nsec);
+    }
+
+    size_t header_size = 256;
+    file->headers = malloc(header_size);
+    if (!file->headers) return false;
+    int written = snprintf(file->headers, header_size,
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "ETag: %s\r\n",
+        mime_type_get(file->path), (long long)size, file->etag);
+    if (written < 0 || (size_t)written >= header_size) return false;
+    file->headers_len = written;
+    return true;
+}
+
+/*
+ * Returns a referenced entry for the regular file at path, opening and
+ * caching it on a miss, or NULL if it cannot be served.
+ * Every entry returned must be given back with http_file_release()
+ */
+HTTP_File *http_file_acquire(const char *path) {
+    HTTP_FileCache *cache = &http_file_cache;
+    HTTP_File *stale = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cache->lock);
+    unsigned long events = cache->events;
+    HTTP_File *file = cache->buckets[http_file_hash(path)];
+    while (file && strcmp(file->path, path) != 0) file = file->hnext;
+    if (file && file->wd < 0 && now - file->checked >= HTTP_FILE_CACHE_CHECK) {
+        struct stat st;
+        if (stat(path, &st) < 0 || http_file_stale(file, &st)) {
+            if (http_file_cache_remove(file)) stale = file;
+            file = NULL;
+        } else {
+            file->checked = now;
+        }
+    }
+    if (file) {
+        file->refs++;
+        http_file_lru_unlink(file);
+        http_file_lru_push(file);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (stale) http_file_destroy(stale);
+    if (file) return file;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    file = calloc(1, sizeof(HTTP_File));
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+    file->fd = fd;
+    file->checked = now;
+    file->refs = 1;
+    // NOTE: Watched before it is read, so a change while loading shows up in cache->events
+    file->wd = cache->inotify_fd >= 0
+        ? inotify_add_watch(cache->inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+        : -1;
+    if (fstat(fd, &file->st) < 0 || !S_ISREG(file->st.st_mode) ||
+        !(file->path = strdup(path)) || !http_file_load(file)) {
+        pthread_mutex_lock(&cache->lock);
+        http_file_unwatch(file);
+        pthread_mutex_unlock(&cache->lock);
+        http_file_destroy(file);
+        return NULL;
+    }
+
+    HTTP_File *victim = NULL;
+    pthread_mutex_lock(&cache->lock);
+    HTTP_File *raced = cache->buckets[http_file_hash(path)];
+    while (raced && strcmp(raced->path, path) != 0) raced = raced->hnext;
+    // NOTE: Another worker may have opened the same file meanwhile, or an event read since the
+    // watch was added may have been for this file and found no entry; ours is then only used once
+    if (!raced && cache->events == events) {
+        if (cache->count >= HTTP_FILE_CACHE_SIZE) {
+            HTTP_File *lru = cache->tail;
+            if (http_file_cache_remove(lru)) victim = lru;
+        }
+        unsigned long bucket = http_file_hash(path);
+        file->hnext = cache->buckets[bucket];
+        cache->buckets[bucket] = file;
+        http_file_lru_push(file);
+        file->cached = true;
+        cache->count++;
+    } else {
+        http_file_unwatch(file);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (victim) http_file_destroy(victim);
+    return file;
+}
+
+void http_file_release(HTTP_File *file) {
+    pthread_mutex_lock(&http_file_cache.lock);
+    bool last = --file->refs == 0 && !file->cached;
+    pthread_mutex_unlock(&http_file_cache.lock);
+    if (last) http_file_destroy(file);
+}
+
+void http_file_retain(HTTP_File *file) {
+    pthread_mutex_lock(&http_file_cache.lock);
+    file->refs++;
+    pthread_mutex_unlock(&http_file_cache.lock);
+}
+
+/* Sends queued output in order; returns 1 once all of it is gone, 0 while the socket is full and -1 on error */
+int http_output_flush(HTTP_Output *out) {
+    while (out->head) {
+        HTTP_Chunk *chunk = out->head;
+        if (chunk->file) {
+            ssize_t n;
+#ifdef SSL_ENABLE
+            // NOTE: A write OpenSSL asked to retry is repeated with the same length, so the same range is read
+            char buffer[16 * 1024];
+            off_t want = chunk->end - chunk->off;
+            if (want > (off_t)sizeof(buffer)) want = sizeof(buffer);
+            n = pread(chunk->file->fd, buffer, want, chunk->off);
+            // NOTE: The file shrank underneath us, the response falls short of its Content-Length
+            if (n <= 0) return -1;
+            n = http_output_send(out, buffer, n);
+            if (n > 0) chunk->off += n;
+#else
+            do {
+                n = sendfile(out->fd, chunk->file->fd, &chunk->off, chunk->end - chunk->off);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0) n = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            // NOTE: The file shrank underneath us, the response falls short of its Content-Length
+            else if (n == 0) n = -1;
+#endif
+            if (n <= 0) return n;
+            if (chunk->off < chunk->end) continue;
+        } else {
+            ssize_t n = http_output_send(out, chunk->data + chunk->sent, chunk->len - chunk->sent);
+            if (n <= 0) return n;
+            chunk->sent += n;
+            if (chunk->sent < chunk->len) continue;
+        }
+        http_output_pop(out);
+    }
+    return 1;
+}
+
+void http_output_clear(HTTP_Output *out) {
+    while (out->head) http_output_pop(out);
+}
+
+// NOTE: Queues a range of file behind what is pending and sends what fits, returns the bytes of it sent
+off_t http_output_file(HTTP_Output *out, HTTP_File *file, off_t off, off_t end) {
+    HTTP_Chunk *chunk = calloc(1, sizeof(HTTP_Chunk));
+    if (!chunk) {
+        http_connection_close = true;
+        return -1;
+    }
+    http_file_retain(file);
+    chunk->file = file;
+    chunk->off = off;
+    chunk->end = end;
+    http_output_push(out, chunk);
+
+    int rc = http_output_flush(out);
+    if (rc < 0) {
+        http_connection_close = true;
+        return -1;
+    }
+    return rc > 0 ? end - off : out->tail->off - off;
+}
+
+// NOTE: Opens the inotify descriptor the workers poll, the cache falls back to stat() without it
+int http_file_cache_watch() {
+    if (http_file_cache.inotify_fd < 0) {
+        http_file_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (http_file_cache.inotify_fd < 0) perror("inotify_init1");
+    }
+    return http_file_cache.inotify_fd;
+}
+
+// NOTE: Drops every entry whose file changed, called by the worker that got the event
+void http_file_cache_notify() {
+    HTTP_FileCache *cache = &http_file_cache;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(cache->inotify_fd, events, sizeof(events));
+        if (n <= 0) break;
+
+        for (char *p = events; p < events + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            // NOTE: IN_IGNORED means the watch is gone, IN_Q_OVERFLOW that events were lost
+            bool overflow = event->mask & IN_Q_OVERFLOW;
+
+            pthread_mutex_lock(&cache->lock);
+            cache->events++;
+            HTTP_File *file = cache->head;
+            while (file) {
+                HTTP_File *next = file->next;
+                bool changed = file->wd >= 0 && (overflow || file->wd == event->wd);
+                if (changed && http_file_cache_remove(file)) {
+                    // NOTE: Unlinked and unused, nothing can reach it anymore
+                    http_file_destroy(file);
+                }
+                file = next;
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+    }
+}
+
+// Thread-local like http_connection_close: the If-None-Match of the request being answered
+static _Thread_local const char *http_if_none_match = NULL;
+
+// NOTE: If-None-Match uses the weak comparison, W/ tags match their strong twin
+bool http_etag_match(const char *header, const char *etag) {
+    size_t etag_len = strlen(etag);
+    while (*header) {
+        while (*header == ' ' || *header == '\t' || *header == ',') header++;
+        if (*header == '*') return true;
+        if (strncmp(header, "W/", 2) == 0) header += 2;
+        size_t len = strcspn(header, ", \t");
+        if (len == etag_len && strncmp(header, etag, len) == 0) return true;
+        header += len;
+    }
+    return false;
+}
+
+// NOTE: http_write_all for an iovec array, returns the bytes sent rather than queued
+ssize_t http_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0 && !(http_output && http_output->head)) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (http_output) break;
+                if (http_socket_wait(fd, POLLOUT)) continue;
+            }
+            http_connection_close = true;
+            return -1;
+        }
+        total += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (!http_output_write(http_output, iov[i].iov_base, iov[i].iov_len)) return -1;
+    }
+    return total;
+}
+
 #ifdef SSL_ENABLE
 void http_send_file_response(int client_socket, char *status, const char *filepath, HtmlTemplate *tmpl, SSL *ssl) {
-#else 
+#else
 void http_send_file_response(int client_socket, char *status, const char *filepath, HtmlTemplate *tmpl) {
 #endif
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
+    HTTP_File *file = http_file_acquire(filepath);
+    if (!file) {
         char *not_found = "404 Not Found";
 #ifdef SSL_ENABLE
         http_send_response(client_socket, "404 Not Found", not_found, ssl);
@@ -687,11 +1675,26 @@ void http_send_file_response(int client_socket, char *status, const char *filepa
         return;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    const char *mime_type = mime_type_get(filepath);
+    off_t file_size = file->st.st_size;
+    const char *connection = http_connection_close ? "Connection: close\r\n" : "Connection: keep-alive\r\n";
+
+    if (http_if_none_match && strncmp(status, "200", 3) == 0 && http_etag_match(http_if_none_match, file->etag)) {
+        char not_modified[256];
+        int written = snprintf(not_modified, sizeof(not_modified),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "%s"
+            "\r\n",
+            file->etag, connection);
+        http_file_release(file);
+        if (written < 0 || (size_t)written >= sizeof(not_modified)) return;
+#ifdef SSL_ENABLE
+        http_write_all(client_socket, not_modified, written, ssl);
+#else
+        http_write_all(client_socket, not_modified, written);
+#endif
+        return;
+    }
 
     char *cookie_header = NULL;
     char *session_token = token_generate();
@@ -700,109 +1703,650 @@ void http_send_file_response(int client_socket, char *status, const char *filepa
         free(session_token);
     }
 
-    size_t header_size = 512 + (cookie_header ? strlen(cookie_header) : 0);
-    char *header = malloc(header_size);
-    if (!header) {
-        free(cookie_header);
-        fclose(fp);
-        return;
+    // NOTE: Only the status, the Connection line and the session cookie differ between hits
+    struct iovec iov[8];
+    int iovcnt = 0;
+    iov[iovcnt++] = (struct iovec){ "HTTP/1.1 ", 9 };
+    iov[iovcnt++] = (struct iovec){ status, strlen(status) };
+    iov[iovcnt++] = (struct iovec){ "\r\n", 2 };
+    iov[iovcnt++] = (struct iovec){ file->headers, file->headers_len };
+    iov[iovcnt++] = (struct iovec){ (char *)connection, strlen(connection) };
+    if (cookie_header) iov[iovcnt++] = (struct iovec){ cookie_header, strlen(cookie_header) };
+    iov[iovcnt++] = (struct iovec){ "\r\n", 2 };
+
+    off_t total_sent = 0;
+#ifdef SSL_ENABLE
+    size_t header_len = 0;
+    for (int i = 0; i < iovcnt; i++) header_len += iov[i].iov_len;
+    char *header = malloc(header_len);
+    if (header) {
+        size_t offset = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(header + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        http_write_all(client_socket, header, header_len, ssl);
+        free(header);
     }
+    free(cookie_header);
 
-    int written;
-    if (cookie_header) {
-        written = snprintf(header, header_size, 
-            "HTTP/1.1 %s\r\n"
-            "Content-Type: %s\r\n"
-            "Content-Length: %ld\r\n"
-            "%s"
-            "\r\n", 
-            status, mime_type, file_size, cookie_header);
-        free(cookie_header);
+    // NOTE: TLS is encrypted in user space, so a file not kept in memory goes through a buffer;
+    // a worker queues it instead and reads it as the socket drains
+    if (!file->body && http_output) {
+        off_t sent = http_output_file(http_output, file, 0, file_size);
+        total_sent = sent > 0 ? sent : 0;
     } else {
-        written = snprintf(header, header_size, 
-            "HTTP/1.1 %s\r\n"
-            "Content-Type: %s\r\n"
-            "Content-Length: %ld\r\n"
-            "\r\n", 
-            status, mime_type, file_size);
+        const size_t CHUNK_SIZE = 16 * 1024;
+        char *file_buffer = file->body ? file->body : malloc(CHUNK_SIZE);
+
+        while (file_buffer && total_sent < file_size) {
+            ssize_t bytes_read = file->body ? file_size : pread(file->fd, file_buffer, CHUNK_SIZE, total_sent);
+            // NOTE: The file shrank underneath us, the response falls short of its Content-Length
+            if (bytes_read <= 0) {
+                http_connection_close = true;
+                break;
+            }
+            if (!http_write_all(client_socket, file_buffer, bytes_read, ssl)) break;
+            total_sent += bytes_read;
+        }
+        if (file_buffer != file->body) free(file_buffer);
     }
+#else
+    if (file->body) {
+        // NOTE: Kept in memory, the whole response is one writev
+        iov[iovcnt++] = (struct iovec){ file->body, file_size };
+        size_t header_len = 0;
+        for (int i = 0; i < iovcnt - 1; i++) header_len += iov[i].iov_len;
+        ssize_t sent = http_writev_all(client_socket, iov, iovcnt);
+        total_sent = sent > (ssize_t)header_len ? sent - (ssize_t)header_len : 0;
+        free(cookie_header);
+    } else {
+        // NOTE: Corked, the headers leave in the same segment as the start of the body
+        int cork = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+        ssize_t sent = http_writev_all(client_socket, iov, iovcnt);
+        free(cookie_header);
+
+        // NOTE: The body goes from the page cache to the socket without a copy through user space.
+        // The offset is ours, so workers can share the descriptor
+        if (http_output) {
+            // NOTE: A worker queues what the socket cannot take and sends it from EPOLLOUT
+            off_t body_sent = sent >= 0 ? http_output_file(http_output, file, 0, file_size) : 0;
+            total_sent = body_sent > 0 ? body_sent : 0;
+        } else {
+            http_socket_set_nonblock(client_socket, true);
+            while (sent >= 0 && total_sent < file_size) {
+                ssize_t bytes_sent = sendfile(client_socket, file->fd, &total_sent, file_size - total_sent);
+                if (bytes_sent < 0 && errno == EINTR) continue;
+                if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                    http_socket_wait(client_socket, POLLOUT)) continue;
+                // NOTE: Failed, timed out or the file shrank underneath us;
+                // either way the response falls short of its Content-Length
+                if (bytes_sent <= 0) {
+                    http_connection_close = true;
+                    break;
+                }
+            }
+            http_socket_set_nonblock(client_socket, false);
+        }
+
+        cork = 0;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+#endif
+    http_file_release(file);
+
+    log_msg("INFO", "File transfer %s: %s (%lld/%lld bytes)\n",
+            http_output && http_output->head ? "queued" : "complete",
+            filepath, (long long)total_sent, (long long)file_size);
+}
+
+/*
+ * Pre-threaded server: every worker thread owns a SO_REUSEPORT listener and
+ * an epoll loop, so the kernel spreads connections over the workers and
+ * nothing is forked per request. A connection waits in epoll until its
+ * request has started to arrive and is then queued for the handoff pool,
+ * whose threads run the blocking handle_client_f callback. The callback
+ * owns the socket from there on as before, and a slow client only holds up
+ * its pool thread, never a worker's event loop.
+ *
+ * With a handle_request_f the worker keeps the connection instead. Input
+ * is buffered per connection and complete requests are cut out of it,
+ * several at once when the client pipelines, and answered in order. The
+ * connection then waits for the next request until the client closes it,
+ * stays idle for HTTP_KEEPALIVE_TIMEOUT or has sent HTTP_KEEPALIVE_MAX.
+ * Its socket never blocks: a response the socket cannot take at once is
+ * queued (HTTP_Output) and finished from EPOLLOUT, pipelined requests
+ * waiting behind it, and a client that takes nothing for HTTP_SEND_TIMEOUT
+ * is dropped.
+ */
+typedef struct HTTP_Conn {
+    int fd;
+    time_t deadline;
+    struct HTTP_ConnList *list;
+    struct HTTP_Conn *prev;
+    struct HTTP_Conn *next;
+#ifdef SSL_ENABLE
+    SSL *ssl;
+#endif
+    char *buf;
+    size_t len;
+    size_t cap;
+    int requests;
+    HTTP_Parser parser;
+    HTTP_Output out;
+    // NOTE: Closes once out has drained
+    bool closing;
+} HTTP_Conn;
+
+// NOTE: Everything on a list shares one timeout, so connections expire oldest first
+typedef struct HTTP_ConnList {
+    HTTP_Conn *head;
+    HTTP_Conn *tail;
+    int timeout;
+} HTTP_ConnList;
+
+typedef struct HTTP_Handoff {
+    int fd;
+    struct HTTP_Handoff *next;
+} HTTP_Handoff;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    HTTP_Handoff *head;
+    HTTP_Handoff *tail;
+    handle_client_f f;
+#ifdef SSL_ENABLE
+    SSL_CTX *ctx;
+#endif
+} HTTP_HandoffPool;
+
+static HTTP_HandoffPool http_handoff_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL,
+#ifdef SSL_ENABLE
+    NULL,
+#endif
+};
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    HTTP_HandoffPool *pool;
+    handle_client_f f;
+    handle_request_f rf;
+#ifdef SSL_ENABLE
+    SSL_CTX *ctx;
+#endif
+    HTTP_ConnList reading;
+    HTTP_ConnList idle;
+    HTTP_ConnList writing;
+    pthread_t thread;
+} HTTP_Worker;
+
+int http_listen_socket(int port, int reuse_port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(server_fd);
+        return -1;
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt (keepalive)");
+        close(server_fd);
+        return -1;
+    }
+
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt (reuseport)");
+        close(server_fd);
+        return -1;
+    }
+#else
+    (void) reuse_port;
+#endif
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("bind");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+
+    int flags = fcntl(server_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+void http_conn_unlink(HTTP_Conn *conn) {
+    HTTP_ConnList *list = conn->list;
+    if (!list) return;
+    if (conn->prev) conn->prev->next = conn->next;
+    else list->head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    else list->tail = conn->prev;
+    conn->list = NULL;
+}
+
+void http_conn_append(HTTP_ConnList *list, HTTP_Conn *conn) {
+    http_conn_unlink(conn);
+    conn->deadline = time(NULL) + list->timeout;
+    conn->list = list;
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail) list->tail->next = conn;
+    else list->head = conn;
+    list->tail = conn;
+}
+
+void http_conn_close(HTTP_Conn *conn) {
+    http_conn_unlink(conn);
+#ifdef SSL_ENABLE
+    if (conn->ssl) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+#endif
+    close(conn->fd);
+    http_output_clear(&conn->out);
+    http_parser_free(&conn->parser);
+    free(conn->buf);
+    free(conn);
+}
+
+void http_conn_watch(HTTP_Worker *w, HTTP_Conn *conn, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void http_worker_accept(HTTP_Worker *w) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
         
-    if (written > 0 && written < (int)header_size) {
+        // NOTE: Accepted sockets do not inherit O_NONBLOCK, handle_client_f gets a blocking socket
+        int client_socket = accept(w->listen_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        
+        struct timeval timeout;
+        timeout.tv_sec = HTTP_REQUEST_TIMEOUT;
+        timeout.tv_usec = 0;
+        
+        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+            perror("setsockopt (timeout)");
+            close(client_socket);
+            continue;
+        }
+        
+        // NOTE: Bounds blocking writes by handle_client_f callbacks that call send() directly
+        timeout.tv_sec = HTTP_SEND_TIMEOUT;
+        if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+            perror("setsockopt (send timeout)");
+            close(client_socket);
+            continue;
+        }
+        
+        // NOTE: Headers and body go out in separate writes, Nagle would hold the body back
+        // for the client's delayed ACK on every kept-alive response
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        HTTP_Conn *conn = calloc(1, sizeof(HTTP_Conn));
+        if (!conn) {
+            close(client_socket);
+            continue;
+        }
+        conn->fd = client_socket;
+        conn->out.fd = client_socket;
+        // NOTE: A connection the worker keeps is only ever read and written when epoll says so
+        if (w->rf) http_socket_set_nonblock(client_socket, true);
+        http_parser_init(&conn->parser);
+        http_conn_append(&w->reading, conn);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            http_conn_close(conn);
+        }
+    }
+}
+
+/*
+ * Reads what has arrived into the connection buffer, which stays
+ * NUL-terminated. Returns the bytes read, 0 when the client is gone,
+ * -1 if nothing was ready and -2 once a request outgrows R_BUFFER_SIZE
+ */
+long http_conn_read(HTTP_Conn *conn) {
+    if (conn->len + 1 >= conn->cap) {
+        if (conn->cap >= R_BUFFER_SIZE) return -2;
+        size_t cap = conn->cap ? conn->cap * 2 : HTTP_CONN_BUFFER;
+        if (cap > R_BUFFER_SIZE) cap = R_BUFFER_SIZE;
+        char *buf = realloc(conn->buf, cap);
+        if (!buf) return 0;
+        conn->buf = buf;
+        conn->cap = cap;
+    }
+    
+#ifdef SSL_ENABLE
+    int n = SSL_read(conn->ssl, conn->buf + conn->len, (int)(conn->cap - conn->len - 1));
+    if (n <= 0) {
+        int err = SSL_get_error(conn->ssl, n);
+        ERR_clear_error();
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? -1 : 0;
+    }
+#else
+    ssize_t n;
+    do {
+        n = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len - 1, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+    if (n == 0) return 0;
+#endif
+    conn->len += n;
+    conn->buf[conn->len] = '\0';
+    return n;
+}
+
+// NOTE: The rest of the response goes out on EPOLLOUT, then reading resumes or the connection closes
+void http_conn_park(HTTP_Worker *w, HTTP_Conn *conn, bool closing) {
+    conn->closing = closing;
+    http_conn_watch(w, conn, EPOLLOUT);
+    http_conn_append(&w->writing, conn);
+}
+
+/* Answers every complete request in the buffer; returns 0 once the connection should close */
+int http_conn_process(HTTP_Worker *w, HTTP_Conn *conn) {
+    size_t start = 0;
+    int keep = 1;
+    
+    HTTP_Parser *p = &conn->parser;
+    
+    // NOTE: Pipelined requests wait while a response is still queued, their answers go out after it
+    while (keep && !conn->out.head) {
+        // NOTE: A request split across reads picks up where the last call stopped
+        int rc = http_parser_feed(p, conn->buf + start, conn->len - start);
+        if (rc == HTTP_PARSE_AGAIN) break;
+        
+        http_connection_close = true;
+        if (rc == HTTP_PARSE_TOO_LARGE) {
+#ifdef SSL_ENABLE
+            http_send_response(conn->fd, "413 Payload Too Large", "Payload Too Large", conn->ssl);
+#else
+            http_send_response(conn->fd, "413 Payload Too Large", "Payload Too Large");
+#endif
+            keep = 0;
+            break;
+        }
+        if (rc < 0) {
+#ifdef SSL_ENABLE
+            http_send_response(conn->fd, "400 Bad Request", "Bad Request", conn->ssl);
+#else
+            http_send_response(conn->fd, "400 Bad Request", "Bad Request");
+#endif
+            keep = 0;
+            break;
+        }
+        
+        char *request = conn->buf + start;
+        size_t size = p->size;
+        conn->requests++;
+        http_connection_close = conn->requests >= HTTP_KEEPALIVE_MAX || !p->keep_alive;
+        keep = !http_connection_close;
+        
+        HTTP_Request req;
+        http_parser_request(p, request, &req);
+        http_if_none_match = http_get_header(&req, "If-None-Match");
+        if (req.method == HM_UNKNOWN) {
+            http_connection_close = true;
 #ifdef SSL_ENABLE
-        SSL_write(ssl, header, written);
+            http_send_response(conn->fd, "501 Not Implemented", "Not Implemented", conn->ssl);
 #else
-        send(client_socket, header, written, 0);
+            http_send_response(conn->fd, "501 Not Implemented", "Not Implemented");
 #endif
+            keep = 0;
+        } else {
+#ifdef SSL_ENABLE
+            if (w->rf(conn->fd, &req, conn->ssl) < 0) keep = 0;
+#else
+            if (w->rf(conn->fd, &req) < 0) keep = 0;
+#endif
+            // NOTE: A write failed, the client cannot be answered anymore
+            if (http_connection_close) keep = 0;
+        }
+        http_if_none_match = NULL;
+        
+        http_parser_finish(p, request);
+        start += size;
     }
     
-    free(header);
+    if (start > 0) {
+        memmove(conn->buf, conn->buf + start, conn->len - start);
+        conn->len -= start;
+        conn->buf[conn->len] = '\0';
+    }
+    if (conn->out.head) {
+        http_conn_park(w, conn, !keep);
+        return 1;
+    }
+    if (start > 0) {
+        // NOTE: A request left half-read gets a fresh HTTP_REQUEST_TIMEOUT from here
+        if (keep) http_conn_append(conn->len > 0 ? &w->reading : &w->idle, conn);
+    } else if (conn->list == &w->idle) {
+        http_conn_append(&w->reading, conn);
+    }
+    return keep;
+}
+
+void http_worker_serve(HTTP_Worker *w, HTTP_Conn *conn) {
+#ifdef SSL_ENABLE
+    if (!conn->ssl) {
+        conn->ssl = SSL_new(w->ctx);
+        if (!conn->ssl || !SSL_set_fd(conn->ssl, conn->fd)) {
+            ERR_clear_error();
+            http_conn_close(conn);
+            return;
+        }
+        // NOTE: A queued write is retried from a copy of the bytes OpenSSL was first given
+        SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        conn->out.ssl = conn->ssl;
+    }
+    if (!SSL_is_init_finished(conn->ssl)) {
+        // NOTE: The handshake advances as its records arrive, HTTP_REQUEST_TIMEOUT bounds it
+        int rc = SSL_accept(conn->ssl);
+        if (rc <= 0) {
+            int err = SSL_get_error(conn->ssl, rc);
+            ERR_clear_error();
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) http_conn_close(conn);
+            return;
+        }
+        // NOTE: The request may have come in with the handshake
+        if (!SSL_has_pending(conn->ssl)) return;
+    }
+#endif
 
-    const size_t CHUNK_SIZE = 16 * 1024;
-    char *file_buffer = malloc(CHUNK_SIZE);
+    do {
+        long n = http_conn_read(conn);
+        if (n == -1) return;
+        if (n == -2) {
+            http_connection_close = true;
+#ifdef SSL_ENABLE
+            http_send_response(conn->fd, "413 Payload Too Large", "Payload Too Large", conn->ssl);
+#else
+            http_send_response(conn->fd, "413 Payload Too Large", "Payload Too Large");
+#endif
+            if (conn->out.head) {
+                http_conn_park(w, conn, true);
+                return;
+            }
+        }
+        if (n <= 0 || !http_conn_process(w, conn)) {
+            http_conn_close(conn);
+            return;
+        }
+#ifdef SSL_ENABLE
+    } while (!conn->out.head && SSL_has_pending(conn->ssl));
+#else
+    } while (0);
+#endif
+}
+
+// NOTE: EPOLLOUT on a connection with queued output, every wake-up means the client took some of it
+void http_worker_drain(HTTP_Worker *w, HTTP_Conn *conn) {
+    int rc = http_output_flush(&conn->out);
+    if (rc < 0 || (rc > 0 && conn->closing)) {
+        http_conn_close(conn);
+        return;
+    }
+    if (rc == 0) {
+        http_conn_append(&w->writing, conn);
+        return;
+    }
     
-    if (!file_buffer) {
-        fclose(fp);
+    http_conn_watch(w, conn, EPOLLIN | EPOLLRDHUP);
+    http_conn_append(conn->len > 0 ? &w->reading : &w->idle, conn);
+    if (conn->len > 0 && !http_conn_process(w, conn)) {
+        http_conn_close(conn);
+        return;
+    }
+#ifdef SSL_ENABLE
+    // NOTE: Records decrypted before the pause sit in OpenSSL, epoll cannot report them
+    if (!conn->out.head && SSL_has_pending(conn->ssl)) http_worker_serve(w, conn);
+#endif
+}
+
+void http_worker_dispatch(HTTP_Worker *w, HTTP_Conn *conn) {
+    if (w->rf) {
+        // NOTE: Everything the handlers write goes through the connection's queue
+        http_output = &conn->out;
+        if (conn->out.head) http_worker_drain(w, conn);
+        else http_worker_serve(w, conn);
+        http_output = NULL;
         return;
     }
     
-    size_t bytes_read;
-    size_t total_sent = 0;
+    int client_socket = conn->fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+    http_conn_unlink(conn);
+    http_parser_free(&conn->parser);
+    free(conn->buf);
+    free(conn);
     
-    while ((bytes_read = fread(file_buffer, 1, CHUNK_SIZE, fp)) > 0) {
-        ssize_t bytes_sent = 0;
-        size_t remaining = bytes_read;
-        size_t offset = 0;
+    HTTP_Handoff *handoff = malloc(sizeof(HTTP_Handoff));
+    if (!handoff) {
+        close(client_socket);
+        return;
+    }
+    handoff->fd = client_socket;
+    handoff->next = NULL;
+    
+    HTTP_HandoffPool *pool = w->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = handoff;
+    else pool->head = handoff;
+    pool->tail = handoff;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// NOTE: Runs the blocking handle_client_f callbacks off the workers' event loops
+void *http_handoff_run(void *arg) {
+    HTTP_HandoffPool *pool = (HTTP_HandoffPool *)arg;
+    
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head) pthread_cond_wait(&pool->cond, &pool->lock);
+        HTTP_Handoff *handoff = pool->head;
+        pool->head = handoff->next;
+        if (!pool->head) pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
         
-        while (remaining > 0) {
-#ifdef SSL_ENABLE
-            bytes_sent = SSL_write(ssl, file_buffer + offset, remaining);
-            if (bytes_sent <= 0) {
-                int ssl_error = SSL_get_error(ssl, bytes_sent);
-                if (ssl_error == SSL_ERROR_WANT_WRITE || ssl_error == SSL_ERROR_WANT_READ) {
-                    continue;
-                } else {
-                    ERR_print_errors_fp(stderr);
-                    break;
-                }
-            }
+        int client_socket = handoff->fd;
+        free(handoff);
+#ifdef SSL_ENABLE
+        pool->f(client_socket, pool->ctx);
 #else
-            bytes_sent = send(client_socket, file_buffer + offset, remaining, 0);
-            if (bytes_sent < 0) {
-                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                    continue;
-                } else {
-                    perror("send");
-                    break;
-                }
-            }
+        pool->f(client_socket);
 #endif
-            
-            remaining -= bytes_sent;
-            offset += bytes_sent;
-            total_sent += bytes_sent;
+    }
+    return NULL;
+}
+
+void http_worker_expire(HTTP_ConnList *list, time_t now) {
+    while (list->head && list->head->deadline <= now) {
+        http_conn_close(list->head);
+    }
+}
+
+void *http_worker_run(void *arg) {
+    HTTP_Worker *w = (HTTP_Worker *)arg;
+    struct epoll_event events[HTTP_EPOLL_EVENTS];
+    
+    while (1) {
+        int n = epoll_wait(w->epoll_fd, events, HTTP_EPOLL_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
         }
         
-        if (remaining > 0) {
-            break;
+        for (int i = 0; i < n; i++) {
+            HTTP_Conn *conn = (HTTP_Conn *)events[i].data.ptr;
+            if (!conn) {
+                http_worker_accept(w);
+            } else if (events[i].data.ptr == &http_file_cache) {
+                http_file_cache_notify();
+            } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                http_conn_close(conn);
+            } else {
+                http_worker_dispatch(w, conn);
+            }
         }
+        
+        time_t now = time(NULL);
+        http_worker_expire(&w->reading, now);
+        http_worker_expire(&w->idle, now);
+        http_worker_expire(&w->writing, now);
     }
-    
-    free(file_buffer);
-    fclose(fp);
-    
-    log_msg("INFO", "File transfer complete: %s (%ld/%ld bytes)\n", 
-            filepath, total_sent, file_size);
+    return NULL;
 }
 
 extern void handle_signal(int);
-int http_run_server(int port, int *sfdG, handle_client_f f) {
-    if (!sfdG || !f || port <= 0 || port > 65535) {
+int http_run_workers(int port, int *sfdG, handle_client_f f, handle_request_f rf) {
+    if (!sfdG || (!f && !rf) || port <= 0 || port > 65535) {
         return -1;
     }
     
-    int server_fd;
-    struct sockaddr_in server_addr;
-
     if (blocklist_load("BLOCKLIST") < 0) {
         fprintf(stderr, "Warning: Failed to load blocklist\n");
     }
@@ -816,6 +2360,8 @@ int http_run_server(int port, int *sfdG, handle_client_f f) {
         perror("sigaction");
         return -1;
     }
+    // NOTE: Workers share the process, a client hanging up mid-write must not kill it
+    signal(SIGPIPE, SIG_IGN);
 
 #ifdef SSL_ENABLE 
     SSL_CTX *ctx;
@@ -828,50 +2374,70 @@ int http_run_server(int port, int *sfdG, handle_client_f f) {
     ssl_configure_context(ctx);
 #endif 
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        return -1;
-    }
-    
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        close(server_fd);
-        return -1;
+    int worker_count = HTTP_WORKERS;
+    if (worker_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? (int)cpus : 1;
     }
+#ifndef SO_REUSEPORT
+    worker_count = 1;
+#endif
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt (keepalive)");
-        close(server_fd);
+    HTTP_Worker *workers = calloc(worker_count, sizeof(HTTP_Worker));
+    if (!workers) {
+        perror("calloc");
         return -1;
     }
-    
-    *sfdG = server_fd;
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        perror("bind");
-        close(server_fd);
-        return -1;
+    int inotify_fd = http_file_cache_watch();
+    int started = 0;
+    for (int i = 0; i < worker_count; i++) {
+        HTTP_Worker *w = &workers[i];
+        w->pool = &http_handoff_pool;
+        w->f = f;
+        w->rf = rf;
+#ifdef SSL_ENABLE
+        w->ctx = ctx;
+#endif
+        w->reading.timeout = HTTP_REQUEST_TIMEOUT;
+        w->idle.timeout = HTTP_KEEPALIVE_TIMEOUT;
+        w->writing.timeout = HTTP_SEND_TIMEOUT;
+        w->listen_fd = http_listen_socket(port, worker_count > 1);
+        if (w->listen_fd < 0) break;
+        
+        w->epoll_fd = epoll_create1(0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (w->epoll_fd < 0 || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+            perror("epoll");
+            if (w->epoll_fd >= 0) close(w->epoll_fd);
+            close(w->listen_fd);
+            break;
+        }
+        // NOTE: Exclusive, a file change wakes one worker rather than all of them
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &http_file_cache;
+        if (inotify_fd >= 0 && epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0) {
+            perror("epoll_ctl (inotify)");
+        }
+        started++;
     }
-
-    if (listen(server_fd, SOMAXCONN) == -1) {
-        perror("listen");
-        close(server_fd);
+    if (started == 0) {
+        free(workers);
         return -1;
     }
+    
+    *sfdG = workers[0].listen_fd;
 
     printf("-------------------------------------------------------------------------------------\n");
     printf("MicroForgeHTTP\n");
-    char *server_ip_address = inet_ntoa(server_addr.sin_addr);
-    int server_port = ntohs(server_addr.sin_port);
     printf("- Version: %.1f\n", SERVER_API_VERSION);
     printf("- Git Hash: %s\n", GIT_HASH);
-    printf("- IP: %s:%d\n", server_ip_address, server_port);
+    printf("- IP: 0.0.0.0:%d\n", port);
+    printf("- Workers: %d\n", started);
+    printf("- Keep-Alive: %s\n", rf ? "Enabled" : "Disabled");
+    if (!rf) printf("- Handoff Threads: %d\n", HTTP_HANDOFF_THREADS);
 #ifdef SSL_ENABLE
     printf("- SSL: Enabled\n");
 #else
@@ -881,57 +2447,70 @@ int http_run_server(int port, int *sfdG, handle_client_f f) {
     printf(" LOGS:\n");
     printf("-------------------------------------------------------------------------------------\n");
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            perror("accept");
-            continue;
-        }
-        
-        struct timeval timeout;
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
-        
-        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-            perror("setsockopt (timeout)");
-            close(client_socket);
-            continue;
-        }
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-            close(server_fd);
-            
+    // NOTE: Handlers keep whole requests on their stack
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, HTTP_WORKER_STACK_SIZE);
+    if (!rf) {
+        http_handoff_pool.f = f;
 #ifdef SSL_ENABLE
-            f(client_socket, ctx);
-#else
-            f(client_socket);
+        http_handoff_pool.ctx = ctx;
 #endif
-            exit(0);
-        } 
-        else if (pid > 0) {
-            close(client_socket);
-            
-            while (waitpid(-1, NULL, WNOHANG) > 0);
-        } 
-        else {
-            perror("fork");
-            close(client_socket);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (int i = 0; i < HTTP_HANDOFF_THREADS; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, http_handoff_run, &http_handoff_pool) != 0) {
+                perror("pthread_create");
+                break;
+            }
         }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    }
+    int running = 0;
+    for (int i = 0; i < started; i++) {
+        if (pthread_create(&workers[i].thread, &attr, http_worker_run, &workers[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        running++;
+    }
+    pthread_attr_destroy(&attr);
+
+    for (int i = 0; i < running; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
 
+    for (int i = 0; i < started; i++) {
+        while (workers[i].reading.head) {
+            http_conn_close(workers[i].reading.head);
+        }
+        while (workers[i].idle.head) {
+            http_conn_close(workers[i].idle.head);
+        }
+        while (workers[i].writing.head) {
+            http_conn_close(workers[i].writing.head);
+        }
+        close(workers[i].epoll_fd);
+        close(workers[i].listen_fd);
+    }
+    free(workers);
 #ifdef SSL_ENABLE 
     SSL_CTX_free(ctx);
 #endif 
-    close(server_fd);
     blocklist_free();
-    return 0;
+    return running > 0 ? 0 : -1;
+}
+
+// NOTE: One request per connection, f owns and closes the socket
+int http_run_server(int port, int *sfdG, handle_client_f f) {
+    if (!f) return -1;
+    return http_run_workers(port, sfdG, f, NULL);
+}
+
+// NOTE: Persistent connections, the server owns the socket and calls f for each request
+int http_run_keepalive_server(int port, int *sfdG, handle_request_f f) {
+    if (!f) return -1;
+    return http_run_workers(port, sfdG, NULL, f);
 }
 
 
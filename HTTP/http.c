@@ -45,10 +45,6 @@ int handle_routes(int client_socket, HTTP_Request req, SSL *ssl) {
 #else 
 int handle_routes(int client_socket, HTTP_Request req) {
 #endif
-    HtmlTemplate *tmpl = ht_create();
-    ht_set_var(tmpl, str_format("%s_version", SERVER_API_NAME), str_format("%.1f", SERVER_API_VERSION));
-
-    char file_path[512];
 #ifdef SSL_ENABLE 
     if (hapi_f(&req, client_socket, ssl)) {
 #else 
@@ -56,6 +52,17 @@ int handle_routes(int client_socket, HTTP_Request req) {
 #endif
         return 0;
     }
+
+    HtmlTemplate *tmpl = ht_create();
+    if (tmpl) {
+        char version_name[64];
+        char version[16];
+        snprintf(version_name, sizeof(version_name), "%s_version", SERVER_API_NAME);
+        snprintf(version, sizeof(version), "%.1f", SERVER_API_VERSION);
+        ht_set_var(tmpl, version_name, version);
+    }
+
+    char file_path[512];
     if (http_check_route(req.route, "/")) {
         strcpy(file_path, "index.html");
     } else {
@@ -68,131 +75,68 @@ int handle_routes(int client_socket, HTTP_Request req) {
     http_send_file_response(client_socket, "200 OK", file_path, tmpl);
 #endif
 
+    ht_destroy(tmpl);
     return 0;
 }
 
 /*
- * Parses Request and calls helper function to handle it
+ * Logs every request and calls helper function to handle it,
+ * the connection stays open for the next one
  */
-void handle_client(int client_socket
 #ifdef SSL_ENABLE
-    , SSL_CTX *ctx
+int handle_request(int client_socket, HTTP_Request *req, SSL *ssl) {
+#else
+int handle_request(int client_socket, HTTP_Request *req) {
 #endif
-) {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     
     if (getpeername(client_socket, (struct sockaddr *)&client_addr, &client_len) < 0) {
         perror("getpeername failed");
-        close(client_socket);
-        return;
+        return -1;
     }
     
-    char *client_ip_address = inet_ntoa(client_addr.sin_addr);
+    // NOTE: Runs on worker threads, so no static-buffer libc helpers
+    char client_ip_address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip_address, sizeof(client_ip_address));
     int client_port = ntohs(client_addr.sin_port);
 
     time_t rawtime;
-    struct tm *timeinfo;
+    struct tm timeinfo;
     char time_str[20];
     
     time(&rawtime); 
-    timeinfo = localtime(&rawtime);
-    strftime(time_str, sizeof(time_str), "%d-%m %H:%M", timeinfo);
-#ifdef SSL_ENABLE
-    SSL *ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, client_socket);
-    if (SSL_accept(ssl) <= 0) {
-        SSL_free(ssl);
-        close(client_socket);
-        return;
-    }
-#endif
+    localtime_r(&rawtime, &timeinfo);
+    strftime(time_str, sizeof(time_str), "%d-%m %H:%M", &timeinfo);
+
     if (http_check_ip_address(client_ip_address)) {
         printf("[%s:%d %s] Blocked Connection: Banned IP address\n", client_ip_address, client_port, time_str);
+        http_connection_close = true;
 #ifdef SSL_ENABLE
         http_send_response(client_socket, "404 BLOCKED_IP_ADDRESS", "Your IP address is blocked!", ssl);
 #else 
         http_send_response(client_socket, "404 BLOCKED_IP_ADDRESS", "Your IP address is blocked!");
 #endif
-
-        close(client_socket);
-        return;
+        return -1;
     }
 
-    char buffer[R_BUFFER_SIZE];
-    ssize_t bytes_received;
-
-#ifdef SSL_ENABLE 
-    bytes_received = SSL_read(ssl, buffer, sizeof(buffer) - 1);
-#else
-    bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-#endif 
-
-    if (bytes_received <= 0) {
-        perror("recv");
-#ifdef SSL_ENABLE
-        SSL_free(ssl);
-#endif
-        close(client_socket);
-        return;
-    }
-    
-    buffer[bytes_received] = '\0';
-    
-
-    HTTP_Request req = http_parse_request(buffer);
-    if (req.method == HM_UNKNOWN) return;
     if (LOG_IP_ENABLED) {
-        printf("[%s:%d %s] %s %s\n", client_ip_address, client_port, time_str, http_method_to_str(req.method), req.route);
+        printf("[%s:%d %s] %s %s\n", client_ip_address, client_port, time_str, http_method_to_str(req->method), req->route);
     } else {
-        printf("[%s] %s %s\n", time_str, http_method_to_str(req.method), req.route);
+        printf("[%s] %s %s\n", time_str, http_method_to_str(req->method), req->route);
     }
 
-    char *session_token = token_generate();
-    if (session_token) {
-        bool cookie_set = hapi_set_cookie(client_socket, "mfh_session_token", session_token, 3600
-#ifdef SSL_ENABLE
-            , ssl
-#endif
-        );
-        
-        //if (!cookie_set) {
-        //    log_msg("ERROR", "Failed to set session cookie\n");
-        //}
-        (void) cookie_set;
-        free(session_token);
-    }
-
-
+    // NOTE: Responses carry the mfh_session_token cookie themselves
 #ifdef SSL_ENABLE 
-    handle_routes(client_socket, req, ssl);
+    handle_routes(client_socket, *req, ssl);
 #else 
-    handle_routes(client_socket, req);
-#endif
-
-    hapi_free_cookies(&req);
-    free(req.host);
-    free(req.route);
-    if (req.parameters) {
-        for (int i = 0; i < req.param_count; i++) {
-            free(req.parameters[i].key);
-            free(req.parameters[i].value);
-        }
-        free(req.parameters);
-    }
-    if (req.body) {
-        free(req.body);
-    }
-#ifdef SSL_ENABLE 
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
+    handle_routes(client_socket, *req);
 #endif
-    close(client_socket);
+    return 0;
 }
 
 int main() {
-    handle_client_f hcF = handle_client;
-    if (http_run_server(S_PORT, &server_fdG, hcF) < 0) {
+    if (http_run_keepalive_server(S_PORT, &server_fdG, handle_request) < 0) {
         fprintf(stderr, "ERROR: Could not run server!\n");
         return 1;
     }
@@ -233,6 +233,49 @@ void router_cleanup() {
     router = NULL;
 }
 
+/*
+ * Answers one request through the features and the routing table
+ */
+#ifdef SSL_ENABLE
+int handle_request_with_router(int client_socket, HTTP_Request *req, SSL *ssl) {
+#else
+int handle_request_with_router(int client_socket, HTTP_Request *req) {
+#endif
+    if (http_check_ip_address(req->extracted_ip)) {
+        char *blocked_msg = "Your IP address is blocked from accessing this server.";
+        http_connection_close = true;
+#ifdef SSL_ENABLE
+        http_send_response(client_socket, "403 Forbidden", blocked_msg, ssl);
+#else
+        http_send_response(client_socket, "403 Forbidden", blocked_msg);
+#endif
+        return -1;
+    }
+
+#ifdef SSL_ENABLE
+    int feature_handled = hapi_f(req, client_socket, ssl);
+#else
+    int feature_handled = hapi_f(req, client_socket);
+#endif
+
+    if (!feature_handled) {
+#ifdef SSL_ENABLE
+        int route_handled = router_handle_request(req, client_socket, ssl);
+#else
+        int route_handled = router_handle_request(req, client_socket);
+#endif
+
+        if (!route_handled) {
+#ifdef SSL_ENABLE
+            http_send_response(client_socket, "404 Not Found", "Route not found", ssl);
+#else
+            http_send_response(client_socket, "404 Not Found", "Route not found");
+#endif
+        }
+    }
+    return 0;
+}
+
 #ifdef SSL_ENABLE
 void handle_client_with_router(int client_socket, SSL_CTX *ctx) {
     char buffer[R_BUFFER_SIZE] = {0};
@@ -248,65 +291,39 @@ void handle_client_with_router(int client_socket, SSL_CTX *ctx) {
         close(client_socket);
         return;
     }
-
-    valread = SSL_read(ssl, buffer, R_BUFFER_SIZE - 1);
 #else
 void handle_client_with_router(int client_socket) {
     char buffer[R_BUFFER_SIZE] = {0};
     int valread;
-    
-    valread = read(client_socket, buffer, R_BUFFER_SIZE - 1);
 #endif
+    HTTP_Parser parser;
+    http_parser_init(&parser);
+    size_t len = 0;
+    int rc = HTTP_PARSE_AGAIN;
 
-    if (valread > 0) {
-        HTTP_Request req = http_parse_request(buffer);
-        
-        if (http_check_ip_address(req.extracted_ip)) {
-            char *blocked_msg = "Your IP address is blocked from accessing this server.";
+    // NOTE: Keeps reading until the request is complete, it may not arrive in one piece
+    while (rc == HTTP_PARSE_AGAIN && len < R_BUFFER_SIZE - 1) {
 #ifdef SSL_ENABLE
-            http_send_response(client_socket, "403 Forbidden", blocked_msg, ssl);
+        valread = SSL_read(ssl, buffer + len, R_BUFFER_SIZE - 1 - len);
 #else
-            http_send_response(client_socket, "403 Forbidden", blocked_msg);
-#endif
-        } else {
-#ifdef SSL_ENABLE
-            int feature_handled = hapi_f(&req, client_socket, ssl);
-#else
-            int feature_handled = hapi_f(&req, client_socket);
-#endif
-
-            if (!feature_handled) {
-#ifdef SSL_ENABLE
-                int route_handled = router_handle_request(&req, client_socket, ssl);
-#else
-                int route_handled = router_handle_request(&req, client_socket);
+        valread = read(client_socket, buffer + len, R_BUFFER_SIZE - 1 - len);
 #endif
+        if (valread <= 0) break;
+        len += valread;
+        rc = http_parser_feed(&parser, buffer, len);
+    }
 
-                if (!route_handled) {
+    if (rc == HTTP_PARSE_DONE) {
+        HTTP_Request req;
+        http_parser_request(&parser, buffer, &req);
 #ifdef SSL_ENABLE
-                    http_send_response(client_socket, "404 Not Found", "Route not found", ssl);
+        handle_request_with_router(client_socket, &req, ssl);
 #else
-                    http_send_response(client_socket, "404 Not Found", "Route not found");
+        handle_request_with_router(client_socket, &req);
 #endif
-                }
-            }
-        }
-
-        free(req.route);
-        free(req.host);
-        free(req.body);
-        free(req.extracted_ip);
-        
-        if (req.param_count > 0) {
-            for (int i = 0; i < req.param_count; i++) {
-                free(req.parameters[i].key);
-                free(req.parameters[i].value);
-            }
-            free(req.parameters);
-        }
-        
-        hapi_free_cookies(&req);
+        http_parser_finish(&parser, buffer);
     }
+    http_parser_free(&parser);
 
 #ifdef SSL_ENABLE
     SSL_shutdown(ssl);
@@ -320,8 +337,7 @@ void handle_client_with_router(int client_socket) {
 #define MFH_POST(path, handler) router_post(path, handler)
 #define MFH_RUN(port) do { \
     int server_fd = 0; \
-    signal(SIGCHLD, SIG_IGN); \
-    http_run_server(port, &server_fd, handle_client_with_router); \
+    http_run_keepalive_server(port, &server_fd, handle_request_with_router); \
     router_cleanup(); \
 } while(0)
 
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "xdb.h"
+
+/*
+ * Runs an XDB server with two databases stored under the given directory.
+ *
+ *   ./example 6379 /tmp/primary
+ *   ./example 6380 /tmp/replica 127.0.0.1 6379
+ *
+ * The second form starts a read-only replica of the first. Setting
+ * XDB_METRICS_PORT also serves Prometheus metrics on that port.
+ */
+
+static XDBServer* server;
+
+/* Only flags the server down; saving is not async-signal-safe and happens in main. */
+static void handle_signal(int sig) {
+    (void)sig;
+    server->server_running = 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3 && argc != 5) {
+        fprintf(stderr, "usage: %s <port> <data-dir> [<primary-host> <primary-port>]\n", argv[0]);
+        return 1;
+    }
+    
+    char main_path[1024];
+    char aux_path[1024];
+    snprintf(main_path, sizeof(main_path), "%s" PATH_SEPARATOR "main.db", argv[2]);
+    snprintf(aux_path, sizeof(aux_path), "%s" PATH_SEPARATOR "aux.db", argv[2]);
+    
+    server = xdb_server_create(atoi(argv[1]));
+    if (!server) {
+        fprintf(stderr, "failed to create server\n");
+        return 1;
+    }
+    
+    if (argc == 5 && !xdb_server_set_replicaof(server, argv[3], atoi(argv[4]))) {
+        fprintf(stderr, "replication is not available\n");
+        xdb_server_destroy(server);
+        return 1;
+    }
+    
+    if (!xdb_server_add_database(server, "main", main_path) ||
+        !xdb_server_add_database(server, "aux", aux_path)) {
+        fprintf(stderr, "failed to open databases in %s\n", argv[2]);
+        xdb_server_destroy(server);
+        return 1;
+    }
+    
+    const char* metrics_port = getenv("XDB_METRICS_PORT");
+    if (metrics_port && !xdb_server_add_listener(server, atoi(metrics_port), XDB_PROTO_METRICS)) {
+        fprintf(stderr, "invalid metrics port %s\n", metrics_port);
+        xdb_server_destroy(server);
+        return 1;
+    }
+    
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    
+    printf("XDB listening on port %s%s\n", argv[1], argc == 5 ? " (replica)" : "");
+    if (!xdb_server_start(server)) {
+        fprintf(stderr, "failed to start server\n");
+    } else {
+        xdb_server_stop(server);
+    }
+    
+    xdb_server_destroy(server);
+    return 0;
+}
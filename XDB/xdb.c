@@ -1,431 +1,8055 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
+#include <limits.h>
 #include <errno.h>
+#include <stdarg.h>
 #include "xdb.h"
 
-unsigned int hash_function(const char* key) {
-    unsigned int hash = 0;
-    while (*key) {
-        hash = (hash * 31) + (*key++);
+static int buffer_reserve(char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return 1;
+    
+    size_t new_cap = *cap == 0 ? MAX_COMMAND_SIZE : *cap;
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+    
+    char* new_buf = realloc(*buf, new_cap);
+    if (!new_buf) return 0;
+    
+    *buf = new_buf;
+    *cap = new_cap;
+    return 1;
+}
+
+static int argv_push(XDBArgv* args, char* ptr, size_t len) {
+    if (args->count == args->cap) {
+        int new_cap = args->cap == 0 ? 16 : args->cap * 2;
+        XDBArg* items = realloc(args->items, sizeof(XDBArg) * new_cap);
+        if (!items) return 0;
+        args->items = items;
+        args->cap = new_cap;
+    }
+    args->items[args->count].ptr = ptr;
+    args->items[args->count].len = len;
+    args->count++;
+    return 1;
+}
+
+/* Reads a "<prefix><number>\r\n" header. Returns bytes used, 0 if incomplete, -1 if malformed. */
+static long parse_resp_length(const char* data, size_t len, char prefix, long long* out) {
+    if (len < 1) return 0;
+    if (data[0] != prefix) return -1;
+    
+    long long value = 0;
+    int negative = 0;
+    size_t i = 1;
+    if (i < len && data[i] == '-') {
+        negative = 1;
+        i++;
+    }
+    for (; i < len && data[i] >= '0' && data[i] <= '9'; i++) {
+        value = value * 10 + (data[i] - '0');
+        if (value > XDB_MAX_QUERY_SIZE) return -1;
+    }
+    if (i + 1 >= len) return 0;
+    if (data[i] != '\r' || data[i + 1] != '\n') return -1;
+    
+    *out = negative ? -value : value;
+    return (long)(i + 2);
+}
+
+/*
+ * Parses one RESP multibulk command ("*N\r\n" followed by N "$len\r\n..."
+ * bulk strings). Arguments are referenced in place and NUL-terminated over
+ * their trailing CR. Same return convention as parse_inline_command.
+ */
+static long parse_resp_command(char* data, size_t len, XDBArgv* args) {
+    long long count = 0;
+    long pos = parse_resp_length(data, len, '*', &count);
+    if (pos <= 0) return pos;
+    if (count < 0 || count > XDB_MAX_QUERY_SIZE / 4) return -1;
+    
+    args->count = 0;
+    for (long long i = 0; i < count; i++) {
+        long long arg_len = 0;
+        long n = parse_resp_length(data + pos, len - pos, '$', &arg_len);
+        if (n <= 0) return n;
+        if (arg_len < 0) return -1;
+        pos += n;
+        
+        if ((size_t)pos + arg_len + 2 > len) return 0;
+        if (data[pos + arg_len] != '\r' || data[pos + arg_len + 1] != '\n') return -1;
+        
+        if (!argv_push(args, data + pos, (size_t)arg_len)) return -1;
+        pos += (long)arg_len + 2;
+    }
+    
+    /* Terminate only once the command is complete, so an incomplete one
+     * can be parsed again unchanged when more bytes arrive. */
+    for (int i = 0; i < args->count; i++) {
+        args->items[i].ptr[args->items[i].len] = '\0';
+    }
+    return pos;
+}
+
+static int resp_append_command(char** buf, size_t* len, size_t* cap, int argc, const XDBArg* argv) {
+    size_t needed = *len + 16;
+    for (int i = 0; i < argc; i++) {
+        needed += argv[i].len + 24;
+    }
+    if (!buffer_reserve(buf, cap, needed)) return 0;
+    
+    *len += sprintf(*buf + *len, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++) {
+        *len += sprintf(*buf + *len, "$%zu\r\n", argv[i].len);
+        memcpy(*buf + *len, argv[i].ptr, argv[i].len);
+        *len += argv[i].len;
+        (*buf)[(*len)++] = '\r';
+        (*buf)[(*len)++] = '\n';
+    }
+    return 1;
+}
+
+static const size_t slab_class_sizes[XDB_SLAB_CLASSES] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+
+static void slab_init(XDBSlab* slab) {
+    for (int i = 0; i < XDB_SLAB_CLASSES; i++) {
+        slab->classes[i].chunk_size = slab_class_sizes[i];
+        slab->classes[i].free_list = NULL;
+        slab->classes[i].pages = NULL;
+        mutex_init(&slab->classes[i].lock);
+    }
+}
+
+static void slab_destroy(XDBSlab* slab) {
+    for (int i = 0; i < XDB_SLAB_CLASSES; i++) {
+        void* page = slab->classes[i].pages;
+        while (page) {
+            void* next = *(void**)page;
+            free(page);
+            page = next;
+        }
+        mutex_destroy(&slab->classes[i].lock);
+    }
+}
+
+static int slab_class_for(size_t size) {
+    for (int i = 0; i < XDB_SLAB_CLASSES; i++) {
+        if (size <= slab_class_sizes[i]) return i;
+    }
+    return -1;
+}
+
+/* Small allocations are carved from per-class pages, anything larger goes to malloc. */
+static void* slab_alloc(XDBSlab* slab, size_t size) {
+    int cls = slab_class_for(size);
+    if (cls < 0) return malloc(size);
+    
+    XDBSlabClass* sc = &slab->classes[cls];
+    mutex_lock(&sc->lock);
+    
+    if (!sc->free_list) {
+        char* page = malloc(XDB_SLAB_PAGE_SIZE);
+        if (!page) {
+            mutex_unlock(&sc->lock);
+            return NULL;
+        }
+        *(void**)page = sc->pages;
+        sc->pages = page;
+        
+        size_t offset = sizeof(void*) > 16 ? sizeof(void*) : 16;
+        for (; offset + sc->chunk_size <= XDB_SLAB_PAGE_SIZE; offset += sc->chunk_size) {
+            void* chunk = page + offset;
+            *(void**)chunk = sc->free_list;
+            sc->free_list = chunk;
+        }
+    }
+    
+    void* chunk = sc->free_list;
+    sc->free_list = *(void**)chunk;
+    mutex_unlock(&sc->lock);
+    return chunk;
+}
+
+static void slab_free(XDBSlab* slab, void* ptr, size_t size) {
+    if (!ptr) return;
+    
+    int cls = slab_class_for(size);
+    if (cls < 0) {
+        free(ptr);
+        return;
+    }
+    
+    XDBSlabClass* sc = &slab->classes[cls];
+    mutex_lock(&sc->lock);
+    *(void**)ptr = sc->free_list;
+    sc->free_list = ptr;
+    mutex_unlock(&sc->lock);
+}
+
+static int entry_is_inline(const KeyValue* entry) {
+    return entry->value == entry->data + entry->key_len + 1;
+}
+
+static size_t entry_alloc_size(size_t key_len, size_t value_len, int inline_value) {
+    return offsetof(KeyValue, data) + key_len + 1 + (inline_value ? value_len + 1 : 0);
+}
+
+/* Bytes an entry accounts for: its slab chunk (or heap block) plus any out-of-line value. */
+static size_t entry_memory(size_t key_len, size_t value_len, int inline_value) {
+    size_t size = entry_alloc_size(key_len, value_len, inline_value);
+    int cls = slab_class_for(size);
+    if (cls >= 0) size = slab_class_sizes[cls];
+    return size + (inline_value ? 0 : value_len + 1);
+}
+
+/*
+ * Access metadata kept per entry for eviction: the high 24 bits hold the
+ * last access in seconds (wrapping every 194 days), the low 8 bits a
+ * logarithmic access counter that loses one point per
+ * XDB_LFU_DECAY_SECONDS of idleness. Readers update it under the shared
+ * lock, so it is written with relaxed atomics; a lost race loses a sample.
+ */
+static uint32_t access_now(void) {
+    return (uint32_t)time(NULL) & 0xFFFFFF;
+}
+
+static uint32_t access_idle(uint32_t access, uint32_t now) {
+    return (now - (access >> 8)) & 0xFFFFFF;
+}
+
+static uint32_t access_counter(uint32_t access, uint32_t now) {
+    uint32_t counter = access & 0xFF;
+    uint32_t periods = access_idle(access, now) / XDB_LFU_DECAY_SECONDS;
+    return periods < counter ? counter - periods : 0;
+}
+
+static uint32_t xdb_random(void) {
+    static XDB_THREAD_LOCAL uint32_t state;
+    if (state == 0) {
+        state = ((uint32_t)(uintptr_t)&state ^ (uint32_t)time(NULL)) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/* The counter grows with probability 1/((counter - XDB_LFU_INIT) * XDB_LFU_LOG_FACTOR + 1). */
+static void entry_touch(KeyValue* entry) {
+    uint32_t now = access_now();
+    uint32_t counter = access_counter(xdb_atomic_load32(&entry->access), now);
+    if (counter < 255) {
+        uint32_t base = counter > XDB_LFU_INIT ? counter - XDB_LFU_INIT : 0;
+        if (xdb_random() % (base * XDB_LFU_LOG_FACTOR + 1) == 0) counter++;
+    }
+    xdb_atomic_store32(&entry->access, now << 8 | counter);
+}
+
+/*
+ * Entries are one length-prefixed allocation holding the key and, when the
+ * whole record fits in the largest slab class, the value as well. Larger
+ * values are stored out of line.
+ */
+static KeyValue* entry_create(HashTable* ht, const char* key, size_t key_len,
+                              const char* value, size_t value_len, time_t expiry) {
+    size_t inline_size = entry_alloc_size(key_len, value_len, 1);
+    int inline_value = inline_size <= slab_class_sizes[XDB_SLAB_CLASSES - 1];
+    
+    KeyValue* entry = slab_alloc(&ht->slab, entry_alloc_size(key_len, value_len, inline_value));
+    if (!entry) return NULL;
+    
+    entry->expiry = expiry;
+    entry->heap_index = XDB_NOT_IN_HEAP;
+    entry->access = access_now() << 8 | XDB_LFU_INIT;
+    entry->refs = 1;
+    entry->type = XDB_TYPE_STRING;
+    entry->key_len = (uint32_t)key_len;
+    entry->value_len = (uint32_t)value_len;
+    memcpy(entry->data, key, key_len);
+    entry->data[key_len] = '\0';
+    
+    if (inline_value) {
+        entry->value = entry->data + key_len + 1;
+    } else {
+        entry->value = malloc(value_len + 1);
+        if (!entry->value) {
+            slab_free(&ht->slab, entry, entry_alloc_size(key_len, value_len, 0));
+            return NULL;
+        }
+    }
+    memcpy(entry->value, value, value_len);
+    entry->value[value_len] = '\0';
+    
+    xdb_atomic_add64(&ht->used_memory, (int64_t)entry_memory(key_len, value_len, inline_value));
+    return entry;
+}
+
+/* Shortest %g form that reads back as the same double. */
+static size_t format_double(double value, char* buf) {
+    int len = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        len = snprintf(buf, XDB_NUMBER_MAX, "%.*g", precision, value);
+        if (strtod(buf, NULL) == value) break;
+    }
+    return (size_t)len;
+}
+
+/* The value as text; native numbers are formatted into buf (XDB_NUMBER_MAX bytes). */
+static const char* entry_value(const KeyValue* entry, char* buf, size_t* len) {
+    if (entry->type == XDB_TYPE_INT) {
+        int64_t number;
+        memcpy(&number, entry->value, sizeof(number));
+        *len = (size_t)sprintf(buf, "%lld", (long long)number);
+        return buf;
+    }
+    if (entry->type == XDB_TYPE_DOUBLE) {
+        double number;
+        memcpy(&number, entry->value, sizeof(number));
+        *len = format_double(number, buf);
+        return buf;
+    }
+    *len = entry->value_len;
+    return entry->value;
+}
+
+/* Whole-string decimal integer: optional minus sign and digits, nothing else. */
+static int parse_int64(const char* str, size_t len, int64_t* out) {
+    char buf[XDB_NUMBER_MAX];
+    if (len == 0 || len >= sizeof(buf)) return 0;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    
+    const char* digits = buf[0] == '-' ? buf + 1 : buf;
+    if (*digits < '0' || *digits > '9') return 0;
+    
+    char* end;
+    errno = 0;
+    long long value = strtoll(buf, &end, 10);
+    if (errno || end != buf + len) return 0;
+    *out = (int64_t)value;
+    return 1;
+}
+
+static int parse_double(const char* str, size_t len, double* out) {
+    char buf[XDB_NUMBER_MAX * 2];
+    if (len == 0 || len >= sizeof(buf) || str[0] == ' ' || str[0] == '\t') return 0;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    
+    char* end;
+    errno = 0;
+    double value = strtod(buf, &end);
+    if (errno == ERANGE || end != buf + len || isnan(value)) return 0;
+    *out = value;
+    return 1;
+}
+
+static int entry_int(const KeyValue* entry, int64_t* out) {
+    if (entry->type == XDB_TYPE_INT) {
+        memcpy(out, entry->value, sizeof(*out));
+        return 1;
+    }
+    char buf[XDB_NUMBER_MAX];
+    size_t len;
+    const char* value = entry_value(entry, buf, &len);
+    return parse_int64(value, len, out);
+}
+
+static int entry_double(const KeyValue* entry, double* out) {
+    if (entry->type == XDB_TYPE_DOUBLE) {
+        memcpy(out, entry->value, sizeof(*out));
+        return 1;
+    }
+    if (entry->type == XDB_TYPE_INT) {
+        int64_t number;
+        memcpy(&number, entry->value, sizeof(number));
+        *out = (double)number;
+        return 1;
+    }
+    return parse_double(entry->value, entry->value_len, out);
+}
+
+/* Frees the entry itself; collection contents are the caller's. */
+static void entry_release(HashTable* ht, KeyValue* entry) {
+    int inline_value = entry_is_inline(entry);
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)entry_memory(entry->key_len, entry->value_len, inline_value));
+    if (!inline_value) {
+        free(entry->value);
+    }
+    slab_free(&ht->slab, entry, entry_alloc_size(entry->key_len, entry->value_len, inline_value));
+}
+
+static int entry_key_equals(const KeyValue* entry, const char* key, size_t key_len) {
+    return entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0;
+}
+
+uint64_t hash_function(const char* key, size_t key_len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int shard_index(uint64_t hash) {
+    return (int)((hash >> 32) & (XDB_SHARD_COUNT - 1));
+}
+
+static XDBShard* shard_for(HashTable* ht, uint64_t hash) {
+    return &ht->shards[shard_index(hash)];
+}
+
+static uint8_t ctrl_tag(uint32_t hash) {
+    return (uint8_t)((hash >> 25) & 0x7F);
+}
+
+static int table_init(XDBTable* table, size_t slots) {
+    table->ctrl = malloc(slots);
+    table->slots = calloc(slots, sizeof(KeyValue*));
+    if (!table->ctrl || !table->slots) {
+        free(table->ctrl);
+        free(table->slots);
+        memset(table, 0, sizeof(XDBTable));
+        return 0;
+    }
+    memset(table->ctrl, XDB_CTRL_EMPTY, slots);
+    table->mask = slots - 1;
+    table->used = 0;
+    table->tombstones = 0;
+    return 1;
+}
+
+static void table_release(XDBTable* table) {
+    free(table->ctrl);
+    free(table->slots);
+    memset(table, 0, sizeof(XDBTable));
+}
+
+static size_t table_slot_count(const XDBTable* table) {
+    return table->ctrl ? table->mask + 1 : 0;
+}
+
+static int64_t table_memory(size_t slots) {
+    return (int64_t)(slots * (1 + sizeof(KeyValue*)));
+}
+
+/* Table arrays count towards the owning HashTable's memory like entries do. */
+static int shard_table_init(XDBShard* shard, XDBTable* table, size_t slots) {
+    if (!table_init(table, slots)) return 0;
+    xdb_atomic_add64(shard->used_memory, table_memory(slots));
+    return 1;
+}
+
+static void shard_table_release(XDBShard* shard, XDBTable* table) {
+    xdb_atomic_add64(shard->used_memory, -table_memory(table_slot_count(table)));
+    table_release(table);
+}
+
+/*
+ * Linear probe for key. Control bytes carry 7 bits of the hash, and the full
+ * 32-bit hash is kept in the entry, so key bytes are only compared on a real
+ * hash match. Returns the slot index or -1.
+ */
+static long table_find(const XDBTable* table, uint32_t hash, const char* key, size_t key_len) {
+    if (!table->ctrl) return -1;
+    
+    uint8_t tag = ctrl_tag(hash);
+    size_t idx = hash & table->mask;
+    for (size_t probes = 0; probes <= table->mask; probes++) {
+        uint8_t c = table->ctrl[idx];
+        if (c == XDB_CTRL_EMPTY) return -1;
+        if (c == tag) {
+            const KeyValue* entry = table->slots[idx];
+            if (entry->hash == hash && entry_key_equals(entry, key, key_len)) {
+                return (long)idx;
+            }
+        }
+        idx = (idx + 1) & table->mask;
+    }
+    return -1;
+}
+
+/* Places an entry known to be absent from the table. */
+static void table_insert_unique(XDBTable* table, KeyValue* entry) {
+    size_t idx = entry->hash & table->mask;
+    while (table->ctrl[idx] != XDB_CTRL_EMPTY && table->ctrl[idx] != XDB_CTRL_DELETED) {
+        idx = (idx + 1) & table->mask;
+    }
+    if (table->ctrl[idx] == XDB_CTRL_DELETED) {
+        table->tombstones--;
+    }
+    table->ctrl[idx] = ctrl_tag(entry->hash);
+    table->slots[idx] = entry;
+    table->used++;
+}
+
+static void table_remove_at(XDBTable* table, size_t idx) {
+    table->slots[idx] = NULL;
+    if (table->ctrl[(idx + 1) & table->mask] == XDB_CTRL_EMPTY) {
+        table->ctrl[idx] = XDB_CTRL_EMPTY;
+    } else {
+        table->ctrl[idx] = XDB_CTRL_DELETED;
+        table->tombstones++;
+    }
+    table->used--;
+}
+
+static int table_needs_resize(const XDBTable* table) {
+    size_t slots = table_slot_count(table);
+    if ((table->used + table->tombstones + 1) * 8 > slots * 7) return 1;
+    return slots > XDB_TABLE_MIN_SLOTS && table->used * 8 < slots;
+}
+
+/*
+ * Collections. List, hash and sorted-set values live in an XDBObject that
+ * the entry's value bytes point to. Small hashes and sorted sets are packs:
+ * one allocation of length-prefixed strings with no per-element pointers.
+ * Past XDB_PACK_MAX_ENTRIES elements, or once an element is longer than
+ * XDB_PACK_MAX_VALUE, they convert to a table of entries (plus a skiplist
+ * ordering sorted-set members by score). Lists stay packed and chain packs
+ * of bounded size instead. Everything is charged to the owning HashTable's
+ * memory and only touched with the shard lock held.
+ */
+#define XDB_ERR_NOMEM -2
+#define XDB_ERR_WRONGTYPE -3
+
+typedef enum {
+    XDB_ENC_PACK,
+    XDB_ENC_CHAIN,
+    XDB_ENC_TABLE,
+    XDB_ENC_SKIPLIST
+} XDBEncoding;
+
+static const char* encoding_names[] = { "listpack", "quicklist", "hashtable", "skiplist" };
+
+typedef struct {
+    uint32_t len;
+    uint32_t count;
+    unsigned char data[];
+} XDBPack;
+
+static size_t varint_size(size_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static size_t varint_put(unsigned char* p, size_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (unsigned char)value;
+    return n;
+}
+
+static size_t varint_get(const unsigned char* p, size_t* value) {
+    size_t result = 0;
+    size_t n = 0;
+    int shift = 0;
+    do {
+        result |= (size_t)(p[n] & 0x7F) << shift;
+        shift += 7;
+    } while (p[n++] & 0x80);
+    *value = result;
+    return n;
+}
+
+static XDBPack* pack_create(HashTable* ht) {
+    XDBPack* pack = (XDBPack*)malloc(sizeof(XDBPack));
+    if (!pack) return NULL;
+    pack->len = 0;
+    pack->count = 0;
+    xdb_atomic_add64(&ht->used_memory, (int64_t)sizeof(XDBPack));
+    return pack;
+}
+
+static void pack_free(HashTable* ht, XDBPack* pack) {
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)(sizeof(XDBPack) + pack->len));
+    free(pack);
+}
+
+/* Reads the element at offset and returns the offset of the next one. */
+static size_t pack_get(const XDBPack* pack, size_t offset, const char** str, size_t* len) {
+    size_t n = varint_get(pack->data + offset, len);
+    *str = (const char*)pack->data + offset + n;
+    return offset + n + *len;
+}
+
+static size_t pack_skip(const XDBPack* pack, size_t offset, size_t elements) {
+    const char* str;
+    size_t len;
+    while (elements-- > 0) {
+        offset = pack_get(pack, offset, &str, &len);
+    }
+    return offset;
+}
+
+/* Inserts an element before offset; pack->len appends. Returns 0 if out of memory. */
+static int pack_insert(HashTable* ht, XDBPack** pack, size_t offset, const char* str, size_t len) {
+    size_t need = varint_size(len) + len;
+    XDBPack* p = (XDBPack*)realloc(*pack, sizeof(XDBPack) + (*pack)->len + need);
+    if (!p) return 0;
+    
+    memmove(p->data + offset + need, p->data + offset, p->len - offset);
+    size_t n = varint_put(p->data + offset, len);
+    memcpy(p->data + offset + n, str, len);
+    p->len += (uint32_t)need;
+    p->count++;
+    xdb_atomic_add64(&ht->used_memory, (int64_t)need);
+    *pack = p;
+    return 1;
+}
+
+static void pack_delete(HashTable* ht, XDBPack** pack, size_t offset, size_t elements) {
+    XDBPack* p = *pack;
+    size_t end = pack_skip(p, offset, elements);
+    memmove(p->data + offset, p->data + end, p->len - end);
+    p->len -= (uint32_t)(end - offset);
+    p->count -= (uint32_t)elements;
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)(end - offset));
+    
+    XDBPack* shrunk = (XDBPack*)realloc(p, sizeof(XDBPack) + p->len);
+    if (shrunk) *pack = shrunk;
+}
+
+/* Lists chain packs of at most XDB_PACK_MAX_ENTRIES elements or about XDB_LIST_NODE_SIZE bytes. */
+typedef struct {
+    XDBPack** nodes;
+    size_t node_count;
+    size_t node_cap;
+    size_t count;
+} XDBList;
+
+static void list_remove_node(HashTable* ht, XDBList* list, size_t index) {
+    pack_free(ht, list->nodes[index]);
+    memmove(list->nodes + index, list->nodes + index + 1, (list->node_count - index - 1) * sizeof(XDBPack*));
+    list->node_count--;
+}
+
+/* The end node with room for len more bytes, adding a fresh one when it is full. */
+static XDBPack** list_push_node(HashTable* ht, XDBList* list, int head, size_t len) {
+    if (list->node_count > 0) {
+        XDBPack** node = head ? &list->nodes[0] : &list->nodes[list->node_count - 1];
+        if ((*node)->count < XDB_PACK_MAX_ENTRIES && (*node)->len + len <= XDB_LIST_NODE_SIZE) return node;
+    }
+    
+    if (list->node_count == list->node_cap) {
+        size_t cap = list->node_cap ? list->node_cap * 2 : 4;
+        XDBPack** nodes = (XDBPack**)realloc(list->nodes, cap * sizeof(XDBPack*));
+        if (!nodes) return NULL;
+        xdb_atomic_add64(&ht->used_memory, (int64_t)((cap - list->node_cap) * sizeof(XDBPack*)));
+        list->nodes = nodes;
+        list->node_cap = cap;
+    }
+    
+    XDBPack* pack = pack_create(ht);
+    if (!pack) return NULL;
+    if (head) {
+        memmove(list->nodes + 1, list->nodes, list->node_count * sizeof(XDBPack*));
+        list->nodes[0] = pack;
+    } else {
+        list->nodes[list->node_count] = pack;
+    }
+    list->node_count++;
+    return head ? &list->nodes[0] : &list->nodes[list->node_count - 1];
+}
+
+static int list_push(HashTable* ht, XDBList* list, int head, const char* str, size_t len) {
+    XDBPack** node = list_push_node(ht, list, head, len);
+    if (!node) return 0;
+    if (!pack_insert(ht, node, head ? 0 : (*node)->len, str, len)) {
+        if ((*node)->count == 0) {
+            list_remove_node(ht, list, head ? 0 : list->node_count - 1);
+        }
+        return 0;
+    }
+    list->count++;
+    return 1;
+}
+
+/* Removes n elements from the head or the tail, whole packs at a time where possible. */
+static void list_drop(HashTable* ht, XDBList* list, int head, size_t n) {
+    while (n > 0) {
+        size_t index = head ? 0 : list->node_count - 1;
+        XDBPack** node = &list->nodes[index];
+        if ((*node)->count <= n) {
+            n -= (*node)->count;
+            list->count -= (*node)->count;
+            list_remove_node(ht, list, index);
+        } else {
+            size_t offset = head ? 0 : pack_skip(*node, 0, (*node)->count - n);
+            pack_delete(ht, node, offset, n);
+            list->count -= n;
+            n = 0;
+        }
+    }
+}
+
+/* Calls fn for elements start..stop, both within the list. */
+static void list_range(const XDBList* list, size_t start, size_t stop, xdb_value_f fn, void* ctx) {
+    size_t remaining = stop - start + 1;
+    size_t node = 0;
+    while (start >= list->nodes[node]->count) {
+        start -= list->nodes[node]->count;
+        node++;
+    }
+    
+    size_t offset = pack_skip(list->nodes[node], 0, start);
+    while (remaining-- > 0) {
+        if (offset == list->nodes[node]->len) {
+            node++;
+            offset = 0;
+        }
+        const char* str;
+        size_t len;
+        offset = pack_get(list->nodes[node], offset, &str, &len);
+        fn(str, len, ctx);
+    }
+}
+
+static void list_free(HashTable* ht, XDBList* list) {
+    for (size_t i = 0; i < list->node_count; i++) {
+        pack_free(ht, list->nodes[i]);
+    }
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)(list->node_cap * sizeof(XDBPack*)));
+    free(list->nodes);
+}
+
+static size_t table_size_for(size_t entries) {
+    size_t slots = XDB_TABLE_MIN_SLOTS;
+    while (slots * 7 < (entries + 1) * 16) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+/*
+ * Tables inside a collection resize in one step rather than incrementally:
+ * they belong to a single key, so the pause is bounded by its size.
+ */
+static int nested_resize(HashTable* ht, XDBTable* table, size_t entries) {
+    size_t slots = table_size_for(entries);
+    XDBTable fresh;
+    if (!table_init(&fresh, slots)) return 0;
+    
+    for (size_t i = 0; i < table_slot_count(table); i++) {
+        if (table->ctrl[i] < XDB_CTRL_EMPTY) {
+            table_insert_unique(&fresh, table->slots[i]);
+        }
+    }
+    xdb_atomic_add64(&ht->used_memory, table_memory(slots) - table_memory(table_slot_count(table)));
+    table_release(table);
+    *table = fresh;
+    return 1;
+}
+
+static KeyValue* nested_find(const XDBTable* table, const char* key, size_t key_len, long* index) {
+    long idx = table_find(table, (uint32_t)hash_function(key, key_len), key, key_len);
+    if (index) *index = idx;
+    return idx >= 0 ? table->slots[idx] : NULL;
+}
+
+/* Adds an entry for a key known to be absent. Returns NULL if out of memory. */
+static KeyValue* nested_add(HashTable* ht, XDBTable* table, const char* key, size_t key_len,
+                            const char* value, size_t value_len, XDBValueType type) {
+    if (!table->ctrl || (table->used + table->tombstones + 1) * 8 > table_slot_count(table) * 7) {
+        if (!nested_resize(ht, table, table->used + 1)) return NULL;
+    }
+    
+    KeyValue* entry = entry_create(ht, key, key_len, value, value_len, 0);
+    if (!entry) return NULL;
+    entry->hash = (uint32_t)hash_function(key, key_len);
+    entry->type = (uint8_t)type;
+    table_insert_unique(table, entry);
+    return entry;
+}
+
+static void nested_remove(HashTable* ht, XDBTable* table, size_t index) {
+    KeyValue* entry = table->slots[index];
+    table_remove_at(table, index);
+    entry_release(ht, entry);
+    if (table->used > 0 && table_needs_resize(table)) {
+        nested_resize(ht, table, table->used);
+    }
+}
+
+static void nested_free(HashTable* ht, XDBTable* table) {
+    for (size_t i = 0; i < table_slot_count(table); i++) {
+        if (table->ctrl[i] < XDB_CTRL_EMPTY) {
+            entry_release(ht, table->slots[i]);
+        }
+    }
+    xdb_atomic_add64(&ht->used_memory, -table_memory(table_slot_count(table)));
+    table_release(table);
+}
+
+typedef struct XDBSkipNode XDBSkipNode;
+
+typedef struct {
+    XDBSkipNode* forward;
+    size_t span;
+} XDBSkipLevel;
+
+/* Sorted-set node; member is the entry in the set's table that also holds the score. */
+struct XDBSkipNode {
+    double score;
+    const KeyValue* member;
+    XDBSkipNode* backward;
+    int height;
+    XDBSkipLevel level[];
+};
+
+typedef struct {
+    XDBSkipNode* header;
+    XDBSkipNode* tail;
+    size_t length;
+    int level;
+} XDBSkiplist;
+
+static int member_compare(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* Sorted-set order: by score, ties broken by member bytes. */
+static int zset_order(double a_score, const char* a, size_t a_len, double b_score, const char* b, size_t b_len) {
+    if (a_score != b_score) return a_score < b_score ? -1 : 1;
+    return member_compare(a, a_len, b, b_len);
+}
+
+static int skip_node_order(const XDBSkipNode* node, double score, const char* member, size_t len) {
+    return zset_order(node->score, node->member->data, node->member->key_len, score, member, len);
+}
+
+static XDBSkipNode* skip_node_create(HashTable* ht, int height, double score, const KeyValue* member) {
+    size_t size = sizeof(XDBSkipNode) + (size_t)height * sizeof(XDBSkipLevel);
+    XDBSkipNode* node = (XDBSkipNode*)calloc(1, size);
+    if (!node) return NULL;
+    node->score = score;
+    node->member = member;
+    node->height = height;
+    xdb_atomic_add64(&ht->used_memory, (int64_t)size);
+    return node;
+}
+
+static void skip_node_free(HashTable* ht, XDBSkipNode* node) {
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)(sizeof(XDBSkipNode) + (size_t)node->height * sizeof(XDBSkipLevel)));
+    free(node);
+}
+
+static int skip_create(HashTable* ht, XDBSkiplist* sl) {
+    sl->header = skip_node_create(ht, XDB_SKIPLIST_MAX_LEVEL, 0, NULL);
+    sl->tail = NULL;
+    sl->length = 0;
+    sl->level = 1;
+    return sl->header != NULL;
+}
+
+static void skip_free(HashTable* ht, XDBSkiplist* sl) {
+    XDBSkipNode* node = sl->header;
+    while (node) {
+        XDBSkipNode* next = node->level[0].forward;
+        skip_node_free(ht, node);
+        node = next;
+    }
+}
+
+/* Each level holds about a quarter of the nodes of the one below. */
+static int skip_random_height(void) {
+    int height = 1;
+    while (height < XDB_SKIPLIST_MAX_LEVEL && (xdb_random() & 3) == 0) {
+        height++;
+    }
+    return height;
+}
+
+/* Links a node at its position by score and member, keeping spans for rank lookups. */
+static void skip_link(XDBSkiplist* sl, XDBSkipNode* node) {
+    XDBSkipNode* update[XDB_SKIPLIST_MAX_LEVEL];
+    size_t rank[XDB_SKIPLIST_MAX_LEVEL];
+    XDBSkipNode* x = sl->header;
+    
+    for (int i = sl->level - 1; i >= 0; i--) {
+        rank[i] = i == sl->level - 1 ? 0 : rank[i + 1];
+        while (x->level[i].forward &&
+               skip_node_order(x->level[i].forward, node->score, node->member->data, node->member->key_len) < 0) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+    
+    if (node->height > sl->level) {
+        for (int i = sl->level; i < node->height; i++) {
+            rank[i] = 0;
+            update[i] = sl->header;
+            update[i]->level[i].span = sl->length;
+        }
+        sl->level = node->height;
+    }
+    
+    for (int i = 0; i < node->height; i++) {
+        node->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = node;
+        node->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = node->height; i < sl->level; i++) {
+        update[i]->level[i].span++;
+    }
+    
+    node->backward = update[0] == sl->header ? NULL : update[0];
+    if (node->level[0].forward) {
+        node->level[0].forward->backward = node;
+    } else {
+        sl->tail = node;
+    }
+    sl->length++;
+}
+
+/* Unlinks and returns the node for (score, member), or NULL if there is none. */
+static XDBSkipNode* skip_unlink(XDBSkiplist* sl, double score, const char* member, size_t len) {
+    XDBSkipNode* update[XDB_SKIPLIST_MAX_LEVEL];
+    XDBSkipNode* x = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward && skip_node_order(x->level[i].forward, score, member, len) < 0) {
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+    
+    x = x->level[0].forward;
+    if (!x || skip_node_order(x, score, member, len) != 0) return NULL;
+    
+    for (int i = 0; i < sl->level; i++) {
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
+        } else {
+            update[i]->level[i].span--;
+        }
+    }
+    if (x->level[0].forward) {
+        x->level[0].forward->backward = x->backward;
+    } else {
+        sl->tail = x->backward;
+    }
+    while (sl->level > 1 && !sl->header->level[sl->level - 1].forward) {
+        sl->level--;
+    }
+    sl->length--;
+    return x;
+}
+
+/* 1-based rank of (score, member), 0 if absent. */
+static size_t skip_rank(const XDBSkiplist* sl, double score, const char* member, size_t len) {
+    size_t rank = 0;
+    const XDBSkipNode* x = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward && skip_node_order(x->level[i].forward, score, member, len) <= 0) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (x != sl->header && skip_node_order(x, score, member, len) == 0) return rank;
+    }
+    return 0;
+}
+
+static XDBSkipNode* skip_at(const XDBSkiplist* sl, size_t rank) {
+    size_t traversed = 0;
+    XDBSkipNode* x = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward && traversed + x->level[i].span <= rank) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) return x;
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint8_t encoding;
+    union {
+        XDBPack* pack;
+        XDBList list;
+        struct {
+            XDBTable table;
+            XDBSkiplist skiplist;
+        };
+    };
+} XDBObject;
+
+static XDBObject* object_create(HashTable* ht, XDBValueType type) {
+    XDBObject* obj = (XDBObject*)calloc(1, sizeof(XDBObject));
+    if (!obj) return NULL;
+    
+    if (type == XDB_TYPE_LIST) {
+        obj->encoding = XDB_ENC_CHAIN;
+    } else {
+        obj->encoding = XDB_ENC_PACK;
+        obj->pack = pack_create(ht);
+        if (!obj->pack) {
+            free(obj);
+            return NULL;
+        }
+    }
+    xdb_atomic_add64(&ht->used_memory, (int64_t)sizeof(XDBObject));
+    return obj;
+}
+
+static void object_free(HashTable* ht, XDBObject* obj) {
+    switch (obj->encoding) {
+        case XDB_ENC_PACK:
+            pack_free(ht, obj->pack);
+            break;
+        case XDB_ENC_CHAIN:
+            list_free(ht, &obj->list);
+            break;
+        case XDB_ENC_SKIPLIST:
+            skip_free(ht, &obj->skiplist);
+            nested_free(ht, &obj->table);
+            break;
+        default:
+            nested_free(ht, &obj->table);
+            break;
+    }
+    xdb_atomic_add64(&ht->used_memory, -(int64_t)sizeof(XDBObject));
+    free(obj);
+}
+
+/* Elements in a list, fields in a hash, members in a sorted set. Packs hold pairs for the latter two. */
+static size_t object_count(const XDBObject* obj) {
+    switch (obj->encoding) {
+        case XDB_ENC_PACK: return obj->pack->count / 2;
+        case XDB_ENC_CHAIN: return obj->list.count;
+        default: return obj->table.used;
+    }
+}
+
+/* Field offset in a hash pack, or -1; the value is the element after it. */
+static long hash_pack_find(const XDBPack* pack, const char* field, size_t len) {
+    size_t offset = 0;
+    while (offset < pack->len) {
+        const char* str;
+        size_t str_len;
+        size_t value = pack_get(pack, offset, &str, &str_len);
+        if (str_len == len && memcmp(str, field, len) == 0) return (long)offset;
+        offset = pack_skip(pack, value, 1);
+    }
+    return -1;
+}
+
+static int hash_convert(HashTable* ht, XDBObject* obj) {
+    XDBPack* pack = obj->pack;
+    XDBTable table;
+    memset(&table, 0, sizeof(table));
+    if (!nested_resize(ht, &table, pack->count / 2)) return 0;
+    
+    size_t offset = 0;
+    while (offset < pack->len) {
+        const char* field;
+        const char* value;
+        size_t field_len, value_len;
+        offset = pack_get(pack, offset, &field, &field_len);
+        offset = pack_get(pack, offset, &value, &value_len);
+        if (!nested_add(ht, &table, field, field_len, value, value_len, XDB_TYPE_STRING)) {
+            nested_free(ht, &table);
+            return 0;
+        }
+    }
+    
+    pack_free(ht, pack);
+    obj->encoding = XDB_ENC_TABLE;
+    obj->table = table;
+    return 1;
+}
+
+/* Sets field to value. Returns 1 for a new field, 0 for an update or XDB_ERR_NOMEM. */
+static int hash_set(HashTable* ht, XDBObject* obj, const char* field, size_t field_len,
+                    const char* value, size_t value_len) {
+    if (obj->encoding == XDB_ENC_PACK) {
+        long offset = hash_pack_find(obj->pack, field, field_len);
+        int fits = field_len <= XDB_PACK_MAX_VALUE && value_len <= XDB_PACK_MAX_VALUE;
+        if (offset >= 0 && fits) {
+            /* Insert the new value before dropping the old one, so failure changes nothing. */
+            size_t value_offset = pack_skip(obj->pack, (size_t)offset, 1);
+            if (!pack_insert(ht, &obj->pack, value_offset, value, value_len)) return XDB_ERR_NOMEM;
+            pack_delete(ht, &obj->pack, pack_skip(obj->pack, value_offset, 1), 1);
+            return 0;
+        }
+        if (offset < 0 && fits && obj->pack->count / 2 < XDB_PACK_MAX_ENTRIES) {
+            size_t end = obj->pack->len;
+            if (!pack_insert(ht, &obj->pack, end, field, field_len)) return XDB_ERR_NOMEM;
+            if (!pack_insert(ht, &obj->pack, obj->pack->len, value, value_len)) {
+                pack_delete(ht, &obj->pack, end, 1);
+                return XDB_ERR_NOMEM;
+            }
+            return 1;
+        }
+        if (!hash_convert(ht, obj)) return XDB_ERR_NOMEM;
+    }
+    
+    long index;
+    KeyValue* entry = nested_find(&obj->table, field, field_len, &index);
+    if (entry) {
+        KeyValue* replacement = entry_create(ht, field, field_len, value, value_len, 0);
+        if (!replacement) return XDB_ERR_NOMEM;
+        replacement->hash = entry->hash;
+        obj->table.slots[index] = replacement;
+        entry_release(ht, entry);
+        return 0;
+    }
+    return nested_add(ht, &obj->table, field, field_len, value, value_len, XDB_TYPE_STRING) ? 1 : XDB_ERR_NOMEM;
+}
+
+static int hash_get(const XDBObject* obj, const char* field, size_t field_len, const char** value, size_t* value_len) {
+    if (obj->encoding == XDB_ENC_PACK) {
+        long offset = hash_pack_find(obj->pack, field, field_len);
+        if (offset < 0) return 0;
+        pack_get(obj->pack, pack_skip(obj->pack, (size_t)offset, 1), value, value_len);
+        return 1;
+    }
+    
+    KeyValue* entry = nested_find(&obj->table, field, field_len, NULL);
+    if (!entry) return 0;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return 1;
+}
+
+static int hash_delete(HashTable* ht, XDBObject* obj, const char* field, size_t field_len) {
+    if (obj->encoding == XDB_ENC_PACK) {
+        long offset = hash_pack_find(obj->pack, field, field_len);
+        if (offset < 0) return 0;
+        pack_delete(ht, &obj->pack, (size_t)offset, 2);
+        return 1;
+    }
+    
+    long index;
+    if (!nested_find(&obj->table, field, field_len, &index)) return 0;
+    nested_remove(ht, &obj->table, (size_t)index);
+    return 1;
+}
+
+static double pack_score(const char* str) {
+    double score;
+    memcpy(&score, str, sizeof(score));
+    return score;
+}
+
+/* Member offset in a sorted-set pack, or -1; the score follows as 8 raw bytes. */
+static long zset_pack_find(const XDBPack* pack, const char* member, size_t len, double* score) {
+    size_t offset = 0;
+    while (offset < pack->len) {
+        const char* str;
+        const char* raw;
+        size_t str_len, raw_len;
+        size_t next = pack_get(pack, offset, &str, &str_len);
+        next = pack_get(pack, next, &raw, &raw_len);
+        if (str_len == len && memcmp(str, member, len) == 0) {
+            if (score) *score = pack_score(raw);
+            return (long)offset;
+        }
+        offset = next;
+    }
+    return -1;
+}
+
+/* Inserts (member, score) at its sorted position and returns that offset, or -1 if out of memory. */
+static long zset_pack_insert(HashTable* ht, XDBPack** pack, const char* member, size_t len, double score) {
+    size_t offset = 0;
+    while (offset < (*pack)->len) {
+        const char* str;
+        const char* raw;
+        size_t str_len, raw_len;
+        size_t next = pack_get(*pack, offset, &str, &str_len);
+        next = pack_get(*pack, next, &raw, &raw_len);
+        if (zset_order(pack_score(raw), str, str_len, score, member, len) > 0) break;
+        offset = next;
+    }
+    
+    if (!pack_insert(ht, pack, offset, (const char*)&score, sizeof(score))) return -1;
+    if (!pack_insert(ht, pack, offset, member, len)) {
+        pack_delete(ht, pack, offset, 1);
+        return -1;
+    }
+    return (long)offset;
+}
+
+static int zset_convert(HashTable* ht, XDBObject* obj) {
+    XDBPack* pack = obj->pack;
+    XDBTable table;
+    XDBSkiplist skiplist;
+    memset(&table, 0, sizeof(table));
+    if (!skip_create(ht, &skiplist)) return 0;
+    if (!nested_resize(ht, &table, pack->count / 2)) {
+        skip_free(ht, &skiplist);
+        return 0;
+    }
+    
+    size_t offset = 0;
+    while (offset < pack->len) {
+        const char* member;
+        const char* raw;
+        size_t member_len, raw_len;
+        offset = pack_get(pack, offset, &member, &member_len);
+        offset = pack_get(pack, offset, &raw, &raw_len);
+        
+        KeyValue* entry = nested_add(ht, &table, member, member_len, raw, raw_len, XDB_TYPE_DOUBLE);
+        XDBSkipNode* node = entry ? skip_node_create(ht, skip_random_height(), pack_score(raw), entry) : NULL;
+        if (!node) {
+            skip_free(ht, &skiplist);
+            nested_free(ht, &table);
+            return 0;
+        }
+        skip_link(&skiplist, node);
+    }
+    
+    pack_free(ht, pack);
+    obj->encoding = XDB_ENC_SKIPLIST;
+    obj->table = table;
+    obj->skiplist = skiplist;
+    return 1;
+}
+
+/*
+ * Sets member's score, or adds score to the current one when incr is set
+ * (a new member starts from 0). Returns 1 if the member was added, 0 if it
+ * existed, -1 if the result is NaN or XDB_ERR_NOMEM. *result gets the score.
+ */
+static int zset_add(HashTable* ht, XDBObject* obj, const char* member, size_t len, double score,
+                    int incr, double* result) {
+    double current;
+    if (obj->encoding == XDB_ENC_PACK) {
+        long offset = zset_pack_find(obj->pack, member, len, &current);
+        if (offset >= 0) {
+            if (incr) score += current;
+            if (isnan(score)) return -1;
+            *result = score;
+            if (score == current) return 0;
+            
+            /* Insert at the new position first; the old pair may shift right. */
+            size_t before = obj->pack->len;
+            long at = zset_pack_insert(ht, &obj->pack, member, len, score);
+            if (at < 0) return XDB_ERR_NOMEM;
+            size_t old = (size_t)offset + (at <= offset ? obj->pack->len - before : 0);
+            pack_delete(ht, &obj->pack, old, 2);
+            return 0;
+        }
+        
+        if (isnan(score)) return -1;
+        *result = score;
+        if (obj->pack->count / 2 < XDB_PACK_MAX_ENTRIES && len <= XDB_PACK_MAX_VALUE) {
+            return zset_pack_insert(ht, &obj->pack, member, len, score) >= 0 ? 1 : XDB_ERR_NOMEM;
+        }
+        if (!zset_convert(ht, obj)) return XDB_ERR_NOMEM;
+    }
+    
+    KeyValue* entry = nested_find(&obj->table, member, len, NULL);
+    if (entry) {
+        memcpy(&current, entry->value, sizeof(current));
+        if (incr) score += current;
+        if (isnan(score)) return -1;
+        *result = score;
+        if (score == current) return 0;
+        
+        /* Move the existing node: no allocation, so nothing can fail half way. */
+        XDBSkipNode* node = skip_unlink(&obj->skiplist, current, member, len);
+        node->score = score;
+        memcpy(entry->value, &score, sizeof(score));
+        skip_link(&obj->skiplist, node);
+        return 0;
+    }
+    
+    if (isnan(score)) return -1;
+    *result = score;
+    XDBSkipNode* node = skip_node_create(ht, skip_random_height(), score, NULL);
+    if (!node) return XDB_ERR_NOMEM;
+    entry = nested_add(ht, &obj->table, member, len, (const char*)&score, sizeof(score), XDB_TYPE_DOUBLE);
+    if (!entry) {
+        skip_node_free(ht, node);
+        return XDB_ERR_NOMEM;
+    }
+    node->member = entry;
+    skip_link(&obj->skiplist, node);
+    return 1;
+}
+
+static int zset_score(const XDBObject* obj, const char* member, size_t len, double* score) {
+    if (obj->encoding == XDB_ENC_PACK) {
+        return zset_pack_find(obj->pack, member, len, score) >= 0;
+    }
+    KeyValue* entry = nested_find(&obj->table, member, len, NULL);
+    if (!entry) return 0;
+    memcpy(score, entry->value, sizeof(*score));
+    return 1;
+}
+
+static int zset_remove(HashTable* ht, XDBObject* obj, const char* member, size_t len) {
+    if (obj->encoding == XDB_ENC_PACK) {
+        long offset = zset_pack_find(obj->pack, member, len, NULL);
+        if (offset < 0) return 0;
+        pack_delete(ht, &obj->pack, (size_t)offset, 2);
+        return 1;
+    }
+    
+    long index;
+    KeyValue* entry = nested_find(&obj->table, member, len, &index);
+    if (!entry) return 0;
+    double score;
+    memcpy(&score, entry->value, sizeof(score));
+    skip_node_free(ht, skip_unlink(&obj->skiplist, score, member, len));
+    nested_remove(ht, &obj->table, (size_t)index);
+    return 1;
+}
+
+/* 0-based rank of member, counted from the highest score when reverse is set; -1 if absent. */
+static long zset_rank(const XDBObject* obj, const char* member, size_t len, int reverse) {
+    size_t count = object_count(obj);
+    size_t rank = 0;
+    if (obj->encoding == XDB_ENC_PACK) {
+        size_t offset = 0;
+        while (offset < obj->pack->len) {
+            const char* str;
+            size_t str_len;
+            size_t next = pack_get(obj->pack, offset, &str, &str_len);
+            if (str_len == len && memcmp(str, member, len) == 0) break;
+            offset = pack_skip(obj->pack, next, 1);
+            rank++;
+        }
+        if (rank == count) return -1;
+    } else {
+        double score;
+        if (!zset_score(obj, member, len, &score)) return -1;
+        rank = skip_rank(&obj->skiplist, score, member, len) - 1;
+    }
+    return (long)(reverse ? count - 1 - rank : rank);
+}
+
+typedef void (*xdb_score_f)(const char* member, size_t len, double score, void* ctx);
+
+/* Calls fn for ranks start..stop (both within the set), lowest score first unless reverse. */
+static void zset_range(const XDBObject* obj, size_t start, size_t stop, int reverse, xdb_score_f fn, void* ctx) {
+    size_t count = object_count(obj);
+    if (obj->encoding == XDB_ENC_PACK) {
+        size_t offsets[XDB_PACK_MAX_ENTRIES];
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            offsets[i] = offset;
+            offset = pack_skip(obj->pack, offset, 2);
+        }
+        for (size_t rank = start; rank <= stop; rank++) {
+            const char* member;
+            const char* raw;
+            size_t member_len, raw_len;
+            size_t next = pack_get(obj->pack, offsets[reverse ? count - 1 - rank : rank], &member, &member_len);
+            pack_get(obj->pack, next, &raw, &raw_len);
+            fn(member, member_len, pack_score(raw), ctx);
+        }
+        return;
+    }
+    
+    const XDBSkipNode* node = skip_at(&obj->skiplist, reverse ? count - start : start + 1);
+    for (size_t rank = start; rank <= stop && node; rank++) {
+        fn(node->member->data, node->member->key_len, node->score, ctx);
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+}
+
+/*
+ * Streams a collection as the arguments that rebuild it: list elements,
+ * hash field/value pairs, sorted-set score/member pairs with the score as
+ * text. Used for snapshots and AOF rewrites.
+ */
+static void object_each(const XDBObject* obj, XDBValueType type, xdb_value_f fn, void* ctx) {
+    char number[XDB_NUMBER_MAX];
+    const char* str;
+    size_t len;
+    
+    if (type == XDB_TYPE_LIST) {
+        if (obj->list.count > 0) list_range(&obj->list, 0, obj->list.count - 1, fn, ctx);
+    } else if (obj->encoding == XDB_ENC_PACK) {
+        size_t offset = 0;
+        while (offset < obj->pack->len) {
+            const char* raw;
+            size_t raw_len;
+            offset = pack_get(obj->pack, offset, &str, &len);
+            offset = pack_get(obj->pack, offset, &raw, &raw_len);
+            if (type == XDB_TYPE_ZSET) {
+                fn(number, format_double(pack_score(raw), number), ctx);
+                fn(str, len, ctx);
+            } else {
+                fn(str, len, ctx);
+                fn(raw, raw_len, ctx);
+            }
+        }
+    } else if (obj->encoding == XDB_ENC_SKIPLIST) {
+        for (const XDBSkipNode* node = obj->skiplist.header->level[0].forward; node; node = node->level[0].forward) {
+            fn(number, format_double(node->score, number), ctx);
+            fn(node->member->data, node->member->key_len, ctx);
+        }
+    } else {
+        for (size_t i = 0; i < table_slot_count(&obj->table); i++) {
+            if (obj->table.ctrl[i] >= XDB_CTRL_EMPTY) continue;
+            const KeyValue* entry = obj->table.slots[i];
+            fn(entry->data, entry->key_len, ctx);
+            fn(entry->value, entry->value_len, ctx);
+        }
+    }
+}
+
+static int entry_is_collection(const KeyValue* entry) {
+    return entry->type >= XDB_TYPE_LIST;
+}
+
+static XDBObject* entry_object(const KeyValue* entry) {
+    XDBObject* obj;
+    memcpy(&obj, entry->value, sizeof(obj));
+    return obj;
+}
+
+static void entry_destroy(HashTable* ht, KeyValue* entry) {
+    if (entry_is_collection(entry)) {
+        object_free(ht, entry_object(entry));
+    }
+    entry_release(ht, entry);
+}
+
+/*
+ * Entries are reference counted: the table holds one reference and every
+ * borrowed view another. Views are only taken under the shared shard lock,
+ * so with the lock held exclusively the count can only fall; when the
+ * table's is the last reference the entry is freed without an atomic
+ * read-modify-write, otherwise whoever drops the last one frees it.
+ */
+static void entry_free(HashTable* ht, KeyValue* entry) {
+    if (xdb_atomic_acquire32(&entry->refs) == 1 || xdb_atomic_dec32(&entry->refs) == 0) {
+        entry_destroy(ht, entry);
+    }
+}
+
+static int entry_pinned(KeyValue* entry) {
+    return xdb_atomic_acquire32(&entry->refs) > 1;
+}
+
+/* Moves up to `steps` slots of the draining table into the active one. */
+static void shard_rehash_step(XDBShard* shard, size_t steps) {
+    if (!shard->old.ctrl) return;
+    
+    while (steps-- > 0 && shard->rehash_pos <= shard->old.mask) {
+        size_t idx = shard->rehash_pos++;
+        if (shard->old.ctrl[idx] < XDB_CTRL_EMPTY) {
+            table_insert_unique(&shard->table, shard->old.slots[idx]);
+            shard->old.ctrl[idx] = XDB_CTRL_DELETED;
+            shard->old.slots[idx] = NULL;
+            shard->old.used--;
+        }
+    }
+    
+    if (shard->rehash_pos > shard->old.mask) {
+        shard_table_release(shard, &shard->old);
+        shard->rehash_pos = 0;
+    }
+}
+
+/*
+ * Starts moving the shard into a table sized for its live entries. The old
+ * table is drained a few slots per operation so no single call pays for the
+ * whole rehash.
+ */
+static int shard_start_rehash(XDBShard* shard, size_t min_entries) {
+    if (shard->old.ctrl) {
+        shard_rehash_step(shard, (size_t)-1);
+    }
+    
+    size_t live = shard->table.used > min_entries ? shard->table.used : min_entries;
+    size_t slots = table_size_for(live);
+    
+    XDBTable fresh;
+    if (!shard_table_init(shard, &fresh, slots)) return 0;
+    
+    shard->old = shard->table;
+    shard->table = fresh;
+    shard->rehash_pos = 0;
+    
+    if (shard->old.used == 0) {
+        shard_table_release(shard, &shard->old);
+    }
+    return 1;
+}
+
+static int shard_reserve(XDBShard* shard) {
+    if (!shard->table.ctrl) {
+        return shard_table_init(shard, &shard->table, XDB_TABLE_MIN_SLOTS);
+    }
+    if ((shard->table.used + shard->table.tombstones + 1) * 8 > table_slot_count(&shard->table) * 7) {
+        return shard_start_rehash(shard, shard->table.used + 1);
+    }
+    return 1;
+}
+
+static void heap_place(XDBExpiryHeap* heap, size_t idx, KeyValue* entry) {
+    heap->items[idx] = entry;
+    entry->heap_index = (uint32_t)idx;
+}
+
+static void heap_sift_up(XDBExpiryHeap* heap, size_t idx) {
+    KeyValue* entry = heap->items[idx];
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+        if (heap->items[parent]->expiry <= entry->expiry) break;
+        heap_place(heap, idx, heap->items[parent]);
+        idx = parent;
+    }
+    heap_place(heap, idx, entry);
+}
+
+static void heap_sift_down(XDBExpiryHeap* heap, size_t idx) {
+    KeyValue* entry = heap->items[idx];
+    for (;;) {
+        size_t child = idx * 2 + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->items[child + 1]->expiry < heap->items[child]->expiry) {
+            child++;
+        }
+        if (entry->expiry <= heap->items[child]->expiry) break;
+        heap_place(heap, idx, heap->items[child]);
+        idx = child;
+    }
+    heap_place(heap, idx, entry);
+}
+
+/* Entries the heap cannot grow for are left out and only expire lazily. */
+static void heap_push(XDBExpiryHeap* heap, KeyValue* entry) {
+    if (heap->count == heap->cap) {
+        size_t new_cap = heap->cap == 0 ? 64 : heap->cap * 2;
+        KeyValue** items = realloc(heap->items, sizeof(KeyValue*) * new_cap);
+        if (!items) return;
+        heap->items = items;
+        heap->cap = new_cap;
+    }
+    heap_place(heap, heap->count++, entry);
+    heap_sift_up(heap, heap->count - 1);
+}
+
+static void heap_remove(XDBExpiryHeap* heap, KeyValue* entry) {
+    size_t idx = entry->heap_index;
+    if (idx == XDB_NOT_IN_HEAP) return;
+    entry->heap_index = XDB_NOT_IN_HEAP;
+    
+    KeyValue* last = heap->items[--heap->count];
+    if (idx == heap->count) return;
+    heap_place(heap, idx, last);
+    heap_sift_up(heap, idx);
+    heap_sift_down(heap, last->heap_index);
+}
+
+/* Changes an entry's expiry and keeps the shard's heap in step. Called with the shard lock held. */
+static void shard_set_expiry(XDBShard* shard, KeyValue* entry, time_t expiry) {
+    entry->expiry = expiry;
+    if (expiry == 0) {
+        heap_remove(&shard->expires, entry);
+    } else if (entry->heap_index == XDB_NOT_IN_HEAP) {
+        heap_push(&shard->expires, entry);
+    } else {
+        heap_sift_up(&shard->expires, entry->heap_index);
+        heap_sift_down(&shard->expires, entry->heap_index);
+    }
+}
+
+/* Finds key in either table of the shard. */
+static KeyValue** shard_lookup(XDBShard* shard, uint32_t hash, const char* key, size_t key_len, XDBTable** owner) {
+    long idx = table_find(&shard->table, hash, key, key_len);
+    if (idx >= 0) {
+        if (owner) *owner = &shard->table;
+        return &shard->table.slots[idx];
+    }
+    
+    idx = table_find(&shard->old, hash, key, key_len);
+    if (idx >= 0) {
+        if (owner) *owner = &shard->old;
+        return &shard->old.slots[idx];
+    }
+    return NULL;
+}
+
+static void shard_remove(HashTable* ht, XDBShard* shard, XDBTable* owner, KeyValue** slot) {
+    KeyValue* entry = *slot;
+    heap_remove(&shard->expires, entry);
+    table_remove_at(owner, slot - owner->slots);
+    entry_free(ht, entry);
+    
+    if (!shard->old.ctrl && table_needs_resize(&shard->table)) {
+        shard_start_rehash(shard, 0);
+    }
+}
+
+static int shard_add(XDBShard* shard, KeyValue* entry) {
+    if (!shard_reserve(shard)) return 0;
+    table_insert_unique(&shard->table, entry);
+    if (entry->expiry > 0) {
+        heap_push(&shard->expires, entry);
+    }
+    return 1;
+}
+
+static void shard_lock_init(rwlock_t* lock) {
+    #if defined(__GLIBC__)
+    /* glibc favours readers by default, which lets a stream of GETs starve writers. */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    #else
+    rwlock_init(lock);
+    #endif
+}
+
+void init_hash_table(HashTable* ht) {
+    slab_init(&ht->slab);
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        memset(&ht->shards[i].table, 0, sizeof(XDBTable));
+        memset(&ht->shards[i].old, 0, sizeof(XDBTable));
+        ht->shards[i].rehash_pos = 0;
+        memset(&ht->shards[i].expires, 0, sizeof(XDBExpiryHeap));
+        ht->shards[i].used_memory = &ht->used_memory;
+        shard_lock_init(&ht->shards[i].lock);
+    }
+    ht->journal = NULL;
+    ht->journal_ctx = NULL;
+    ht->replicate = NULL;
+    ht->replicate_ctx = NULL;
+    ht->expire_cursor = 0;
+    ht->used_memory = 0;
+    ht->evicted = 0;
+    ht->expired = 0;
+}
+
+static void table_free_entries(HashTable* ht, XDBShard* shard, XDBTable* table) {
+    for (size_t i = 0; i < table_slot_count(table); i++) {
+        if (table->ctrl[i] < XDB_CTRL_EMPTY) {
+            entry_free(ht, table->slots[i]);
+        }
+    }
+    shard_table_release(shard, table);
+}
+
+void free_hash_table(HashTable* ht) {
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        XDBShard* shard = &ht->shards[i];
+        rwlock_wrlock(&shard->lock);
+        table_free_entries(ht, shard, &shard->table);
+        table_free_entries(ht, shard, &shard->old);
+        free(shard->expires.items);
+        memset(&shard->expires, 0, sizeof(XDBExpiryHeap));
+        rwlock_wrunlock(&shard->lock);
+        rwlock_destroy(&shard->lock);
+    }
+    slab_destroy(&ht->slab);
+}
+
+/* Reports a mutation to the attached log, if any. Must run under the shard lock. */
+static void journal_emit(HashTable* ht, int argc, const XDBArg* argv) {
+    if (ht->journal) ht->journal(ht->journal_ctx, argc, argv);
+    if (ht->replicate) ht->replicate(ht->replicate_ctx, argc, argv);
+}
+
+static void journal_set(HashTable* ht, const KeyValue* entry) {
+    if (!ht->journal && !ht->replicate) return;
+    
+    char ts[32];
+    char number[XDB_NUMBER_MAX];
+    XDBArg argv[5] = {
+        { (char*)"SET", 3 },
+        { (char*)entry->data, entry->key_len },
+        { NULL, 0 },
+        { (char*)"EXAT", 4 },
+        { ts, 0 }
+    };
+    argv[2].ptr = (char*)entry_value(entry, number, &argv[2].len);
+    argv[4].len = sprintf(ts, "%lld", (long long)entry->expiry);
+    journal_emit(ht, entry->expiry > 0 ? 5 : 3, argv);
+}
+
+static void journal_del(HashTable* ht, const char* key, size_t key_len) {
+    if (!ht->journal && !ht->replicate) return;
+    
+    XDBArg argv[2] = {
+        { (char*)"DEL", 3 },
+        { (char*)key, key_len }
+    };
+    journal_emit(ht, 2, argv);
+}
+
+static void journal_expire(HashTable* ht, const KeyValue* entry) {
+    if (!ht->journal && !ht->replicate) return;
+    
+    char ts[32];
+    XDBArg argv[3] = {
+        { (char*)"EXPIREAT", 8 },
+        { (char*)entry->data, entry->key_len },
+        { ts, 0 }
+    };
+    if (entry->expiry == 0) {
+        argv[0].ptr = (char*)"PERSIST";
+        argv[0].len = 7;
+        journal_emit(ht, 2, argv);
+        return;
+    }
+    argv[2].len = sprintf(ts, "%lld", (long long)entry->expiry);
+    journal_emit(ht, 3, argv);
+}
+
+/* Drops every entry. All shards are locked together so the flush is journaled as one step. */
+void flush_hash_table(HashTable* ht) {
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        rwlock_wrlock(&ht->shards[i].lock);
+    }
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        XDBShard* shard = &ht->shards[i];
+        table_free_entries(ht, shard, &shard->table);
+        table_free_entries(ht, shard, &shard->old);
+        memset(&shard->table, 0, sizeof(XDBTable));
+        memset(&shard->old, 0, sizeof(XDBTable));
+        shard->rehash_pos = 0;
+        shard->expires.count = 0;
+    }
+    
+    XDBArg argv[1] = { { (char*)"FLUSHDB", 7 } };
+    journal_emit(ht, 1, argv);
+    
+    for (int i = XDB_SHARD_COUNT - 1; i >= 0; i--) {
+        rwlock_wrunlock(&ht->shards[i].lock);
+    }
+}
+
+static int entry_expired(const KeyValue* entry, time_t now) {
+    return entry->expiry > 0 && entry->expiry < now;
+}
+
+/* Pops up to `limit` expired entries off the shard's heap. Called with the shard lock held. */
+static size_t shard_expire(HashTable* ht, XDBShard* shard, time_t now, size_t limit) {
+    size_t removed = 0;
+    
+    while (removed < limit && shard->expires.count > 0) {
+        KeyValue* entry = shard->expires.items[0];
+        if (!entry_expired(entry, now)) break;
+        
+        XDBTable* owner = NULL;
+        KeyValue** slot = shard_lookup(shard, entry->hash, entry->data, entry->key_len, &owner);
+        if (!slot) {
+            heap_remove(&shard->expires, entry);
+            continue;
+        }
+        journal_del(ht, entry->data, entry->key_len);
+        shard_remove(ht, shard, owner, slot);
+        removed++;
+    }
+    if (removed > 0) {
+        xdb_atomic_add64(&ht->expired, (int64_t)removed);
+    }
+    return removed;
+}
+
+static int64_t monotonic_us(void) {
+    #ifdef _WIN32
+    return (int64_t)GetTickCount64() * 1000;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    #endif
+}
+
+static int64_t monotonic_ns(void) {
+    #ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    #endif
+}
+
+/*
+ * Active expiry: visits the shards round-robin, resuming where the last call
+ * stopped, and reclaims expired entries a batch at a time so no shard lock is
+ * held for long. Stops once every shard is drained or the deadline passes.
+ */
+size_t expire_active(HashTable* ht, int64_t deadline_us) {
+    time_t now = time(NULL);
+    size_t total = 0;
+    int drained = 0;
+    
+    while (drained < XDB_SHARD_COUNT) {
+        XDBShard* shard = &ht->shards[ht->expire_cursor];
+        ht->expire_cursor = (ht->expire_cursor + 1) % XDB_SHARD_COUNT;
+        
+        rwlock_wrlock(&shard->lock);
+        size_t removed = shard_expire(ht, shard, now, XDB_EXPIRE_BATCH);
+        rwlock_wrunlock(&shard->lock);
+        
+        total += removed;
+        drained = removed < XDB_EXPIRE_BATCH ? drained + 1 : 0;
+        if (monotonic_us() >= deadline_us) break;
+    }
+    return total;
+}
+
+static KeyValue* table_sample(const XDBTable* table) {
+    if (!table->ctrl || table->used == 0) return NULL;
+    
+    size_t idx = xdb_random() & table->mask;
+    while (table->ctrl[idx] >= XDB_CTRL_EMPTY) {
+        idx = (idx + 1) & table->mask;
+    }
+    return table->slots[idx];
+}
+
+/*
+ * Samples XDB_EVICT_SAMPLES entries of the shard and evicts the worst: the
+ * longest idle under LRU, the least used under LFU. Volatile policies
+ * sample the expiry heap, so only keys with a TTL are candidates.
+ * Returns 1 if an entry was evicted.
+ */
+static int shard_evict(HashTable* ht, XDBShard* shard, XDBEvictPolicy policy) {
+    int volatile_only = policy == XDB_EVICT_VOLATILE_LRU || policy == XDB_EVICT_VOLATILE_LFU;
+    int lfu = policy == XDB_EVICT_ALLKEYS_LFU || policy == XDB_EVICT_VOLATILE_LFU;
+    uint32_t now = access_now();
+    KeyValue* victim = NULL;
+    uint32_t worst = 0;
+    
+    rwlock_wrlock(&shard->lock);
+    shard_rehash_step(shard, XDB_REHASH_STEP);
+    
+    for (int n = 0; n < XDB_EVICT_SAMPLES; n++) {
+        KeyValue* entry;
+        if (volatile_only) {
+            entry = shard->expires.count ? shard->expires.items[xdb_random() % shard->expires.count] : NULL;
+        } else {
+            size_t live = shard->table.used + shard->old.used;
+            entry = live && xdb_random() % live < shard->old.used
+                ? table_sample(&shard->old) : table_sample(&shard->table);
+        }
+        if (!entry) break;
+        
+        /* Idle time and rarity break each other's ties: the clock only ticks once a second. */
+        uint32_t idle = access_idle(entry->access, now);
+        uint32_t rarity = 255 - access_counter(entry->access, now);
+        uint32_t score = lfu ? rarity << 24 | idle : idle << 8 | rarity;
+        if (!victim || score > worst) {
+            victim = entry;
+            worst = score;
+        }
+    }
+    
+    XDBTable* owner = NULL;
+    KeyValue** slot = victim ? shard_lookup(shard, victim->hash, victim->data, victim->key_len, &owner) : NULL;
+    if (slot) {
+        journal_del(ht, victim->data, victim->key_len);
+        shard_remove(ht, shard, owner, slot);
+        xdb_atomic_add64(&ht->evicted, 1);
+    }
+    rwlock_wrunlock(&shard->lock);
+    return slot != NULL;
+}
+
+static int64_t tables_memory(HashTable** tables, int count) {
+    int64_t used = 0;
+    for (int i = 0; i < count; i++) {
+        used += xdb_atomic_load64(&tables[i]->used_memory);
+    }
+    return used;
+}
+
+/*
+ * Evicts entries until the tables together fit in limit bytes (0 means no
+ * limit). Each eviction samples a random shard, retrying elsewhere when it
+ * has nothing to give; only after as many misses as there are shards does
+ * a full sweep decide that nothing is left. Returns 0 if the limit cannot
+ * be met.
+ */
+static int evict_to_limit(HashTable** tables, int count, int64_t limit, XDBEvictPolicy policy) {
+    if (limit <= 0 || count <= 0) return 1;
+    
+    int total = count * XDB_SHARD_COUNT;
+    int misses = 0;
+    while (tables_memory(tables, count) > limit) {
+        if (policy == XDB_EVICT_NONE) return 0;
+        
+        if (misses < total) {
+            int pos = (int)(xdb_random() % (uint32_t)total);
+            HashTable* ht = tables[pos / XDB_SHARD_COUNT];
+            misses = shard_evict(ht, &ht->shards[pos % XDB_SHARD_COUNT], policy) ? 0 : misses + 1;
+            continue;
+        }
+        
+        int pos = 0;
+        while (pos < total && !shard_evict(tables[pos / XDB_SHARD_COUNT],
+                                           &tables[pos / XDB_SHARD_COUNT]->shards[pos % XDB_SHARD_COUNT], policy)) {
+            pos++;
+        }
+        if (pos == total) return 0;
+        misses = 0;
+    }
+    return 1;
+}
+
+/*
+ * Inserts or replaces key in the shard; value holds type's encoding (a
+ * native int64 or double for numbers). Called with the shard lock held
+ * exclusively.
+ */
+static int shard_store(HashTable* ht, XDBShard* shard, uint32_t hash, const char* key, size_t key_len,
+                       const char* value, size_t value_len, time_t expiry, XDBValueType type) {
+    KeyValue** slot = shard_lookup(shard, hash, key, key_len, NULL);
+    if (slot) {
+        KeyValue* entry = *slot;
+        
+        /* Rewrite in place when the new value keeps the same layout and no
+         * view is borrowing the old one; otherwise copy on write. */
+        if (entry_is_inline(entry) && !entry_pinned(entry) && !entry_is_collection(entry) &&
+            entry_alloc_size(key_len, value_len, 1) <= slab_class_sizes[XDB_SLAB_CLASSES - 1] &&
+            slab_class_for(entry_alloc_size(key_len, value_len, 1)) == 
+            slab_class_for(entry_alloc_size(key_len, entry->value_len, 1))) {
+            memcpy(entry->value, value, value_len);
+            entry->value[value_len] = '\0';
+            entry->value_len = (uint32_t)value_len;
+            entry->type = (uint8_t)type;
+            entry_touch(entry);
+            shard_set_expiry(shard, entry, expiry);
+            journal_set(ht, entry);
+            return 1;
+        }
+        
+        KeyValue* replacement = entry_create(ht, key, key_len, value, value_len, expiry);
+        if (!replacement) return 0;
+        replacement->hash = entry->hash;
+        replacement->type = (uint8_t)type;
+        replacement->access = entry->access;
+        entry_touch(replacement);
+        heap_remove(&shard->expires, entry);
+        if (expiry > 0) {
+            heap_push(&shard->expires, replacement);
+        }
+        *slot = replacement;
+        entry_free(ht, entry);
+        journal_set(ht, replacement);
+        return 1;
+    }
+    
+    KeyValue* entry = entry_create(ht, key, key_len, value, value_len, expiry);
+    if (!entry) return 0;
+    entry->hash = hash;
+    entry->type = (uint8_t)type;
+    
+    if (!shard_add(shard, entry)) {
+        entry_free(ht, entry);
+        return 0;
+    }
+    journal_set(ht, entry);
+    return 1;
+}
+
+/* Housekeeping every exclusive shard access pays for: a rehash step and a little expiry. */
+static void shard_write_begin(HashTable* ht, XDBShard* shard) {
+    rwlock_wrlock(&shard->lock);
+    shard_rehash_step(shard, XDB_REHASH_STEP);
+    
+    /* Writes also reclaim a few expired entries, so instances without a
+     * server cron still shed keys nobody reads again. */
+    shard_expire(ht, shard, time(NULL), XDB_EXPIRE_ON_WRITE);
+}
+
+int set_key_at(HashTable* ht, const char* key, size_t key_len, const char* value, size_t value_len, time_t expiry) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    shard_write_begin(ht, shard);
+    int result = shard_store(ht, shard, (uint32_t)hash, key, key_len, value, value_len, expiry, XDB_TYPE_STRING);
+    rwlock_wrunlock(&shard->lock);
+    return result;
+}
+
+int set_key(HashTable* ht, const char* key, size_t key_len, const char* value, size_t value_len, int expire_seconds) {
+    time_t expiry = expire_seconds > 0 ? time(NULL) + expire_seconds : 0;
+    return set_key_at(ht, key, key_len, value, value_len, expiry);
+}
+
+/*
+ * INCRBY/DECRBY under the shard lock. A missing key counts as 0 and a
+ * string value is parsed once; the result is kept as a native int64 with
+ * the key's TTL and journaled as a SET. Returns 1, 0 if the value is not
+ * an integer, -1 on overflow, XDB_ERR_NOMEM or XDB_ERR_WRONGTYPE.
+ */
+int incr_key(HashTable* ht, const char* key, size_t key_len, int64_t delta, int64_t* result) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    shard_write_begin(ht, shard);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    int64_t current = 0;
+    time_t expiry = 0;
+    if (slot && !entry_expired(*slot, time(NULL))) {
+        if (entry_is_collection(*slot) || !entry_int(*slot, &current)) {
+            int rc = entry_is_collection(*slot) ? XDB_ERR_WRONGTYPE : 0;
+            rwlock_wrunlock(&shard->lock);
+            return rc;
+        }
+        expiry = (*slot)->expiry;
+    }
+    
+    if ((delta > 0 && current > INT64_MAX - delta) || (delta < 0 && current < INT64_MIN - delta)) {
+        rwlock_wrunlock(&shard->lock);
+        return -1;
+    }
+    
+    int64_t next = current + delta;
+    int stored = shard_store(ht, shard, (uint32_t)hash, key, key_len, (const char*)&next, sizeof(next),
+                             expiry, XDB_TYPE_INT);
+    rwlock_wrunlock(&shard->lock);
+    if (!stored) return XDB_ERR_NOMEM;
+    
+    *result = next;
+    return 1;
+}
+
+/* INCRBYFLOAT counterpart of incr_key; -1 means the result is not finite. */
+int incr_key_float(HashTable* ht, const char* key, size_t key_len, double delta, double* result) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    shard_write_begin(ht, shard);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    double current = 0;
+    time_t expiry = 0;
+    if (slot && !entry_expired(*slot, time(NULL))) {
+        if (entry_is_collection(*slot) || !entry_double(*slot, &current)) {
+            int rc = entry_is_collection(*slot) ? XDB_ERR_WRONGTYPE : 0;
+            rwlock_wrunlock(&shard->lock);
+            return rc;
+        }
+        expiry = (*slot)->expiry;
+    }
+    
+    double next = current + delta;
+    if (!isfinite(next)) {
+        rwlock_wrunlock(&shard->lock);
+        return -1;
+    }
+    
+    int stored = shard_store(ht, shard, (uint32_t)hash, key, key_len, (const char*)&next, sizeof(next),
+                             expiry, XDB_TYPE_DOUBLE);
+    rwlock_wrunlock(&shard->lock);
+    if (!stored) return XDB_ERR_NOMEM;
+    
+    *result = next;
+    return 1;
+}
+
+/* Journals `name key items...` as one command. Must run under the shard lock. */
+static void journal_command(HashTable* ht, const char* name, const char* key, size_t key_len,
+                            size_t count, const XDBArg* items) {
+    if (!ht->journal && !ht->replicate) return;
+    
+    XDBArg stack[16];
+    XDBArg* argv = count + 2 <= 16 ? stack : (XDBArg*)malloc((count + 2) * sizeof(XDBArg));
+    if (!argv) return;
+    argv[0].ptr = (char*)name;
+    argv[0].len = strlen(name);
+    argv[1].ptr = (char*)key;
+    argv[1].len = key_len;
+    if (count > 0) memcpy(argv + 2, items, count * sizeof(XDBArg));
+    journal_emit(ht, (int)(count + 2), argv);
+    if (argv != stack) free(argv);
+}
+
+typedef long (*xdb_object_f)(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx);
+
+/*
+ * Runs fn on key's collection with the shard locked exclusively. Expired
+ * keys count as missing; a missing key gets an empty collection of type
+ * when create is set, and a collection fn leaves empty is deleted. fn
+ * journals its own changes. Returns fn's result, 0 for a missing key,
+ * XDB_ERR_WRONGTYPE or XDB_ERR_NOMEM.
+ */
+static long update_object(HashTable* ht, const char* key, size_t key_len, XDBValueType type, int create,
+                          xdb_object_f fn, void* ctx) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    shard_write_begin(ht, shard);
+    XDBTable* owner = NULL;
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, &owner);
+    if (slot && entry_expired(*slot, time(NULL))) {
+        journal_del(ht, key, key_len);
+        shard_remove(ht, shard, owner, slot);
+        xdb_atomic_add64(&ht->expired, 1);
+        slot = NULL;
+    }
+    if (slot && (*slot)->type != type) {
+        rwlock_wrunlock(&shard->lock);
+        return XDB_ERR_WRONGTYPE;
+    }
+    
+    if (!slot) {
+        if (!create) {
+            rwlock_wrunlock(&shard->lock);
+            return 0;
+        }
+        XDBObject* obj = object_create(ht, type);
+        KeyValue* entry = obj ? entry_create(ht, key, key_len, (const char*)&obj, sizeof(obj), 0) : NULL;
+        if (!entry) {
+            if (obj) object_free(ht, obj);
+            rwlock_wrunlock(&shard->lock);
+            return XDB_ERR_NOMEM;
+        }
+        entry->hash = (uint32_t)hash;
+        entry->type = (uint8_t)type;
+        if (!shard_add(shard, entry)) {
+            entry_free(ht, entry);
+            rwlock_wrunlock(&shard->lock);
+            return XDB_ERR_NOMEM;
+        }
+        slot = shard_lookup(shard, (uint32_t)hash, key, key_len, &owner);
+    }
+    
+    XDBObject* obj = entry_object(*slot);
+    XDBArg name = { (char*)key, key_len };
+    entry_touch(*slot);
+    long result = fn(ht, obj, &name, ctx);
+    if (object_count(obj) == 0) {
+        shard_remove(ht, shard, owner, slot);
+    }
+    rwlock_wrunlock(&shard->lock);
+    return result;
+}
+
+typedef void (*xdb_object_read_f)(const XDBObject* obj, void* ctx);
+
+/* Hands key's collection to fn under the shared lock. Returns 1, 0 if missing or XDB_ERR_WRONGTYPE. */
+static int read_object(HashTable* ht, const char* key, size_t key_len, XDBValueType type,
+                       xdb_object_read_f fn, void* ctx) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    rwlock_rdlock(&shard->lock);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    if (!slot || entry_expired(*slot, time(NULL))) {
+        rwlock_rdunlock(&shard->lock);
+        return 0;
+    }
+    if ((*slot)->type != type) {
+        rwlock_rdunlock(&shard->lock);
+        return XDB_ERR_WRONGTYPE;
+    }
+    entry_touch(*slot);
+    fn(entry_object(*slot), ctx);
+    rwlock_rdunlock(&shard->lock);
+    return 1;
+}
+
+/* The key's value type, or -1 if it does not exist; *encoding names its representation. */
+int key_type(HashTable* ht, const char* key, size_t key_len, const char** encoding) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    rwlock_rdlock(&shard->lock);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    int type = -1;
+    if (slot && !entry_expired(*slot, time(NULL))) {
+        const KeyValue* entry = *slot;
+        type = entry->type;
+        if (entry_is_collection(entry)) {
+            *encoding = encoding_names[entry_object(entry)->encoding];
+        } else if (entry->type == XDB_TYPE_INT) {
+            *encoding = "int";
+        } else {
+            *encoding = entry_is_inline(entry) ? "embstr" : "raw";
+        }
+    }
+    rwlock_rdunlock(&shard->lock);
+    return type;
+}
+
+typedef struct {
+    int head;
+    size_t count;
+    const XDBArg* items;
+    xdb_value_f fn;
+    void* ctx;
+    long start;
+    long stop;
+} ListUpdate;
+
+static long list_push_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    ListUpdate* update = (ListUpdate*)ctx;
+    size_t pushed = 0;
+    while (pushed < update->count &&
+           list_push(ht, &obj->list, update->head, update->items[pushed].ptr, update->items[pushed].len)) {
+        pushed++;
+    }
+    if (pushed > 0) {
+        journal_command(ht, update->head ? "LPUSH" : "RPUSH", key->ptr, key->len, pushed, update->items);
+    }
+    return pushed == update->count ? (long)obj->list.count : XDB_ERR_NOMEM;
+}
+
+/* LPUSH/RPUSH. Returns the new length or an XDB_ERR_ code; on failure a prefix may have been pushed. */
+long list_push_key(HashTable* ht, const char* key, size_t key_len, int head, size_t count, const XDBArg* values) {
+    ListUpdate update = { head, count, values, NULL, NULL, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_LIST, 1, list_push_op, &update);
+}
+
+static long list_pop_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    ListUpdate* update = (ListUpdate*)ctx;
+    XDBList* list = &obj->list;
+    if (update->fn) {
+        list_range(list, update->head ? 0 : list->count - 1, update->head ? 0 : list->count - 1,
+                   update->fn, update->ctx);
+    }
+    list_drop(ht, list, update->head, 1);
+    journal_command(ht, update->head ? "LPOP" : "RPOP", key->ptr, key->len, 0, NULL);
+    return 1;
+}
+
+/* LPOP/RPOP: hands the removed element to fn, if given, before dropping it. Returns 1, 0 if missing or an error. */
+long list_pop_key(HashTable* ht, const char* key, size_t key_len, int head, xdb_value_f fn, void* ctx) {
+    ListUpdate update = { head, 0, NULL, fn, ctx, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_LIST, 0, list_pop_op, &update);
+}
+
+/* Resolves negative indexes and clamps start..stop to a list of count elements. Returns 0 if empty. */
+static int normalize_range(long start, long stop, size_t count, size_t* from, size_t* to) {
+    long n = (long)count;
+    if (start < 0) start += n;
+    if (stop < 0) stop += n;
+    if (start < 0) start = 0;
+    if (stop >= n) stop = n - 1;
+    if (start > stop || start >= n) return 0;
+    *from = (size_t)start;
+    *to = (size_t)stop;
+    return 1;
+}
+
+static long list_trim_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    ListUpdate* update = (ListUpdate*)ctx;
+    XDBList* list = &obj->list;
+    size_t from, to;
+    if (normalize_range(update->start, update->stop, list->count, &from, &to)) {
+        list_drop(ht, list, 1, from);
+        list_drop(ht, list, 0, list->count - (to - from + 1));
+    } else {
+        list_drop(ht, list, 0, list->count);
+    }
+    
+    char start[32], stop[32];
+    XDBArg items[2] = { { start, 0 }, { stop, 0 } };
+    items[0].len = sprintf(start, "%ld", update->start);
+    items[1].len = sprintf(stop, "%ld", update->stop);
+    journal_command(ht, "LTRIM", key->ptr, key->len, 2, items);
+    return 1;
+}
+
+/* LTRIM: keeps elements start..stop, deleting the key when none remain. */
+long list_trim_key(HashTable* ht, const char* key, size_t key_len, long start, long stop) {
+    ListUpdate update = { 0, 0, NULL, NULL, NULL, start, stop };
+    return update_object(ht, key, key_len, XDB_TYPE_LIST, 0, list_trim_op, &update);
+}
+
+typedef struct {
+    size_t count;
+    const XDBArg* items;
+    int64_t delta;
+    double score;
+    int64_t int_result;
+    double result;
+} CollectionUpdate;
+
+static long hash_set_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    long added = 0;
+    size_t applied = 0;
+    for (; applied < update->count; applied++) {
+        const XDBArg* pair = update->items + applied * 2;
+        int status = hash_set(ht, obj, pair[0].ptr, pair[0].len, pair[1].ptr, pair[1].len);
+        if (status < 0) break;
+        added += status;
+    }
+    if (applied > 0) {
+        journal_command(ht, "HSET", key->ptr, key->len, applied * 2, update->items);
+    }
+    return applied == update->count ? added : XDB_ERR_NOMEM;
+}
+
+/* HSET with field/value pairs. Returns the number of new fields or an XDB_ERR_ code. */
+long hash_set_key(HashTable* ht, const char* key, size_t key_len, size_t pairs, const XDBArg* items) {
+    CollectionUpdate update = { pairs, items, 0, 0, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_HASH, 1, hash_set_op, &update);
+}
+
+static long hash_delete_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    long deleted = 0;
+    for (size_t i = 0; i < update->count; i++) {
+        deleted += hash_delete(ht, obj, update->items[i].ptr, update->items[i].len);
+    }
+    if (deleted > 0) {
+        journal_command(ht, "HDEL", key->ptr, key->len, update->count, update->items);
+    }
+    return deleted;
+}
+
+/* HDEL. Returns the number of fields removed or an XDB_ERR_ code. */
+long hash_delete_key(HashTable* ht, const char* key, size_t key_len, size_t count, const XDBArg* fields) {
+    CollectionUpdate update = { count, fields, 0, 0, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_HASH, 0, hash_delete_op, &update);
+}
+
+static long hash_incr_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    const XDBArg* field = update->items;
+    const char* value;
+    size_t value_len;
+    int64_t current = 0;
+    if (hash_get(obj, field->ptr, field->len, &value, &value_len) && !parse_int64(value, value_len, &current)) {
+        return 0;
+    }
+    
+    int64_t delta = update->delta;
+    if ((delta > 0 && current > INT64_MAX - delta) || (delta < 0 && current < INT64_MIN - delta)) return -1;
+    
+    char number[XDB_NUMBER_MAX];
+    XDBArg pair[2] = { *field, { number, 0 } };
+    update->int_result = current + delta;
+    pair[1].len = sprintf(number, "%lld", (long long)update->int_result);
+    if (hash_set(ht, obj, field->ptr, field->len, number, pair[1].len) < 0) return XDB_ERR_NOMEM;
+    journal_command(ht, "HSET", key->ptr, key->len, 2, pair);
+    return 1;
+}
+
+/* HINCRBY, journaled as an HSET of the result. Returns 1, 0 if the field is not an integer, -1 on overflow or an XDB_ERR_ code. */
+int hash_incr_key(HashTable* ht, const char* key, size_t key_len, const char* field, size_t field_len,
+                  int64_t delta, int64_t* result) {
+    XDBArg name = { (char*)field, field_len };
+    CollectionUpdate update = { 1, &name, delta, 0, 0, 0 };
+    long status = update_object(ht, key, key_len, XDB_TYPE_HASH, 1, hash_incr_op, &update);
+    if (status > 0) *result = update.int_result;
+    return (int)status;
+}
+
+static long zset_add_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    long added = 0;
+    size_t applied = 0;
+    for (; applied < update->count; applied++) {
+        const XDBArg* pair = update->items + applied * 2;
+        double score, result;
+        parse_double(pair[0].ptr, pair[0].len, &score);
+        int status = zset_add(ht, obj, pair[1].ptr, pair[1].len, score, 0, &result);
+        if (status < 0) break;
+        added += status;
+    }
+    if (applied > 0) {
+        journal_command(ht, "ZADD", key->ptr, key->len, applied * 2, update->items);
+    }
+    return applied == update->count ? added : XDB_ERR_NOMEM;
+}
+
+/* ZADD with score/member pairs. Returns the number of new members, -1 if a score is not a float or an XDB_ERR_ code. */
+long zset_add_key(HashTable* ht, const char* key, size_t key_len, size_t pairs, const XDBArg* items) {
+    for (size_t i = 0; i < pairs; i++) {
+        double score;
+        if (!parse_double(items[i * 2].ptr, items[i * 2].len, &score)) return -1;
+    }
+    CollectionUpdate update = { pairs, items, 0, 0, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_ZSET, 1, zset_add_op, &update);
+}
+
+static long zset_incr_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    const XDBArg* member = update->items;
+    int status = zset_add(ht, obj, member->ptr, member->len, update->score, 1, &update->result);
+    if (status < 0) return status;
+    
+    char number[XDB_NUMBER_MAX];
+    XDBArg pair[2] = { { number, 0 }, *member };
+    pair[0].len = format_double(update->result, number);
+    journal_command(ht, "ZADD", key->ptr, key->len, 2, pair);
+    return 1;
+}
+
+/* ZINCRBY, journaled as a ZADD of the result. Returns 1, -1 if the score would be NaN or an XDB_ERR_ code. */
+int zset_incr_key(HashTable* ht, const char* key, size_t key_len, const char* member, size_t member_len,
+                  double delta, double* result) {
+    XDBArg name = { (char*)member, member_len };
+    CollectionUpdate update = { 1, &name, 0, delta, 0, 0 };
+    long status = update_object(ht, key, key_len, XDB_TYPE_ZSET, 1, zset_incr_op, &update);
+    if (status > 0) *result = update.result;
+    return (int)status;
+}
+
+static long zset_remove_op(HashTable* ht, XDBObject* obj, const XDBArg* key, void* ctx) {
+    CollectionUpdate* update = (CollectionUpdate*)ctx;
+    long removed = 0;
+    for (size_t i = 0; i < update->count; i++) {
+        removed += zset_remove(ht, obj, update->items[i].ptr, update->items[i].len);
+    }
+    if (removed > 0) {
+        journal_command(ht, "ZREM", key->ptr, key->len, update->count, update->items);
+    }
+    return removed;
+}
+
+/* ZREM. Returns the number of members removed or an XDB_ERR_ code. */
+long zset_remove_key(HashTable* ht, const char* key, size_t key_len, size_t count, const XDBArg* members) {
+    CollectionUpdate update = { count, members, 0, 0, 0, 0 };
+    return update_object(ht, key, key_len, XDB_TYPE_ZSET, 0, zset_remove_op, &update);
+}
+
+/*
+ * Looks up key and hands the stored value to fn while the shard is still
+ * locked, so callers can serialize it without an intermediate copy.
+ * Returns 1, 0 if the key is missing or XDB_ERR_WRONGTYPE for a collection.
+ */
+int get_key_with(HashTable* ht, const char* key, size_t key_len, xdb_value_f fn, void* ctx) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    /* Readers only share the lock: expired entries are reported missing and
+     * left for a writer or the sweeper to reclaim. */
+    rwlock_rdlock(&shard->lock);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    if (!slot || entry_expired(*slot, time(NULL))) {
+        rwlock_rdunlock(&shard->lock);
+        return 0;
+    }
+    if (entry_is_collection(*slot)) {
+        rwlock_rdunlock(&shard->lock);
+        return XDB_ERR_WRONGTYPE;
+    }
+    
+    char number[XDB_NUMBER_MAX];
+    size_t len;
+    const char* value = entry_value(*slot, number, &len);
+    entry_touch(*slot);
+    fn(value, len, ctx);
+    rwlock_rdunlock(&shard->lock);
+    return 1;
+}
+
+/* Pins key's value for a view. Returns 0 if the key is missing, expired or not a string. */
+int get_key_view(HashTable* ht, const char* key, size_t key_len, XDBView* view) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    rwlock_rdlock(&shard->lock);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    if (!slot || entry_expired(*slot, time(NULL)) || entry_is_collection(*slot)) {
+        rwlock_rdunlock(&shard->lock);
+        return 0;
+    }
+    
+    KeyValue* entry = *slot;
+    xdb_atomic_inc32(&entry->refs);
+    entry_touch(entry);
+    view->data = entry_value(entry, view->number, &view->len);
+    view->pin = entry;
+    rwlock_rdunlock(&shard->lock);
+    return 1;
+}
+
+/* Drops a view's pin; frees the entry if the table let go of it meanwhile. */
+void release_key_view(HashTable* ht, XDBView* view) {
+    KeyValue* entry = (KeyValue*)view->pin;
+    if (!entry) return;
+    
+    if (xdb_atomic_dec32(&entry->refs) == 0) {
+        entry_destroy(ht, entry);
+    }
+    view->data = NULL;
+    view->len = 0;
+    view->pin = NULL;
+}
+
+typedef struct {
+    char* buf;
+    size_t size;
+} CopyTarget;
+
+static void copy_value(const char* value, size_t len, void* ctx) {
+    CopyTarget* target = (CopyTarget*)ctx;
+    if (target->size == 0) return;
+    
+    size_t n = len < target->size - 1 ? len : target->size - 1;
+    memcpy(target->buf, value, n);
+    target->buf[n] = '\0';
+}
+
+int get_key(HashTable* ht, const char* key, size_t key_len, char* value_buf, size_t buf_size) {
+    CopyTarget target = { value_buf, buf_size };
+    return get_key_with(ht, key, key_len, copy_value, &target) > 0;
+}
+
+/*
+ * Sets the key's expiry, or clears it when expiry is 0. A time that has
+ * already passed deletes the key. Returns 0 if the key does not exist or,
+ * when clearing, had no expiry to begin with.
+ */
+int set_expiry(HashTable* ht, const char* key, size_t key_len, time_t expiry) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    time_t now = time(NULL);
+    
+    rwlock_wrlock(&shard->lock);
+    shard_rehash_step(shard, XDB_REHASH_STEP);
+    
+    XDBTable* owner = NULL;
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, &owner);
+    if (slot && entry_expired(*slot, now)) {
+        journal_del(ht, key, key_len);
+        shard_remove(ht, shard, owner, slot);
+        xdb_atomic_add64(&ht->expired, 1);
+        slot = NULL;
+    }
+    if (!slot || (expiry == 0 && (*slot)->expiry == 0)) {
+        rwlock_wrunlock(&shard->lock);
+        return 0;
+    }
+    
+    if (expiry > 0 && expiry <= now) {
+        shard_remove(ht, shard, owner, slot);
+        journal_del(ht, key, key_len);
+    } else {
+        shard_set_expiry(shard, *slot, expiry);
+        journal_expire(ht, *slot);
+    }
+    rwlock_wrunlock(&shard->lock);
+    return 1;
+}
+
+/* Fetches the key's expiry (0 if it has none). Returns 0 if the key does not exist. */
+int get_expiry(HashTable* ht, const char* key, size_t key_len, time_t* expiry) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    rwlock_rdlock(&shard->lock);
+    KeyValue** slot = shard_lookup(shard, (uint32_t)hash, key, key_len, NULL);
+    int found = slot && !entry_expired(*slot, time(NULL));
+    if (found) {
+        *expiry = (*slot)->expiry;
+    }
+    rwlock_rdunlock(&shard->lock);
+    return found;
+}
+
+static uint64_t reverse_bits64(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+/*
+ * Reports the live entries whose home slot is idx. Linear probing keeps them
+ * in the run of occupied slots that starts there, so the walk stops at the
+ * first empty slot.
+ */
+static size_t table_scan_bucket(const XDBTable* table, size_t idx, time_t now, xdb_key_f fn, void* ctx) {
+    size_t home = idx;
+    size_t reported = 0;
+    for (size_t probes = 0; probes <= table->mask; probes++) {
+        uint8_t c = table->ctrl[idx];
+        if (c == XDB_CTRL_EMPTY) break;
+        if (c < XDB_CTRL_EMPTY) {
+            const KeyValue* entry = table->slots[idx];
+            if ((entry->hash & table->mask) == home && !entry_expired(entry, now)) {
+                fn(entry->data, entry->key_len, ctx);
+                reported++;
+            }
+        }
+        idx = (idx + 1) & table->mask;
+    }
+    return reported;
+}
+
+/*
+ * Visits home bucket v of the shard and returns the next cursor, 0 once the
+ * shard is done. While a rehash is in flight the bucket is read from the
+ * smaller table and all buckets expanding it from the larger one.
+ */
+static uint64_t shard_scan_step(XDBShard* shard, uint64_t v, time_t now, size_t* reported,
+                                xdb_key_f fn, void* ctx) {
+    const XDBTable* small = &shard->table;
+    const XDBTable* large = &shard->old;
+    if (!small->ctrl) return 0;
+    if (!large->ctrl) {
+        large = small;
+    } else if (small->mask > large->mask) {
+        small = &shard->old;
+        large = &shard->table;
+    }
+    
+    uint64_t m0 = small->mask;
+    uint64_t m1 = large->mask;
+    *reported += table_scan_bucket(small, v & m0, now, fn, ctx);
+    if (large != small) {
+        do {
+            *reported += table_scan_bucket(large, v & m1, now, fn, ctx);
+            v = (((v | m0) + 1) & ~m0) | (v & m0);
+        } while (v & (m0 ^ m1));
+    }
+    
+    /* Increment the reversed cursor so buckets already visited at a smaller
+     * size are never revisited after a grow, and shrinking only repeats. */
+    v |= ~m0;
+    v = reverse_bits64(v);
+    v++;
+    return reverse_bits64(v);
+}
+
+/*
+ * Cursor iteration over the keyspace. The low bits of the cursor select a
+ * shard and the rest is a reverse-binary bucket cursor within it, so only
+ * one shard's read lock is held at a time and only for about count
+ * buckets. fn is called with the lock held. Returns the next cursor, 0 when
+ * the iteration is complete.
+ */
+uint64_t scan_keys(HashTable* ht, uint64_t cursor, size_t count, xdb_key_f fn, void* ctx) {
+    size_t shard_index = (size_t)(cursor % XDB_SHARD_COUNT);
+    uint64_t v = cursor / XDB_SHARD_COUNT;
+    size_t reported = 0;
+    if (count == 0) count = 1;
+    /* Sparse tables would otherwise walk a whole shard to fill count. */
+    size_t budget = count * 10;
+    time_t now = time(NULL);
+    
+    while (shard_index < XDB_SHARD_COUNT && reported < count && budget > 0) {
+        XDBShard* shard = &ht->shards[shard_index];
+        rwlock_rdlock(&shard->lock);
+        do {
+            v = shard_scan_step(shard, v, now, &reported, fn, ctx);
+        } while (v != 0 && reported < count && --budget > 0);
+        rwlock_rdunlock(&shard->lock);
+        
+        if (v == 0) {
+            shard_index++;
+        }
+    }
+    
+    if (shard_index == XDB_SHARD_COUNT) return 0;
+    return v * XDB_SHARD_COUNT + shard_index;
+}
+
+static int shard_delete(HashTable* ht, XDBShard* shard, uint32_t hash, const char* key, size_t key_len) {
+    XDBTable* owner = NULL;
+    KeyValue** slot = shard_lookup(shard, hash, key, key_len, &owner);
+    if (!slot) return 0;
+    
+    shard_remove(ht, shard, owner, slot);
+    journal_del(ht, key, key_len);
+    return 1;
+}
+
+int delete_key(HashTable* ht, const char* key, size_t key_len) {
+    uint64_t hash = hash_function(key, key_len);
+    XDBShard* shard = shard_for(ht, hash);
+    
+    rwlock_wrlock(&shard->lock);
+    shard_rehash_step(shard, XDB_REHASH_STEP);
+    int result = shard_delete(ht, shard, (uint32_t)hash, key, key_len);
+    rwlock_wrunlock(&shard->lock);
+    return result;
+}
+
+/*
+ * Batch support: keys are hashed once and bucketed by shard with a counting
+ * sort, so each shard is locked once per batch and its keys are processed
+ * back to back while its table is hot in cache.
+ */
+typedef struct {
+    uint64_t* hashes;
+    size_t* order;
+    size_t starts[XDB_SHARD_COUNT + 1];
+} ShardBatch;
+
+static int shard_batch_init(ShardBatch* batch, size_t count, const XDBArg* keys, size_t stride) {
+    batch->hashes = (uint64_t*)malloc(sizeof(uint64_t) * (count ? count : 1));
+    batch->order = (size_t*)malloc(sizeof(size_t) * (count ? count : 1));
+    if (!batch->hashes || !batch->order) {
+        free(batch->hashes);
+        free(batch->order);
+        return 0;
+    }
+    
+    size_t counts[XDB_SHARD_COUNT] = {0};
+    for (size_t i = 0; i < count; i++) {
+        const XDBArg* key = &keys[i * stride];
+        batch->hashes[i] = hash_function(key->ptr, key->len);
+        counts[(batch->hashes[i] >> 32) & (XDB_SHARD_COUNT - 1)]++;
+    }
+    
+    batch->starts[0] = 0;
+    for (int s = 0; s < XDB_SHARD_COUNT; s++) {
+        batch->starts[s + 1] = batch->starts[s] + counts[s];
+        counts[s] = batch->starts[s];
+    }
+    for (size_t i = 0; i < count; i++) {
+        batch->order[counts[(batch->hashes[i] >> 32) & (XDB_SHARD_COUNT - 1)]++] = i;
+    }
+    return 1;
+}
+
+static void shard_batch_free(ShardBatch* batch) {
+    free(batch->hashes);
+    free(batch->order);
+}
+
+/*
+ * Stores count key/value pairs laid out as pairs[2 * i] and pairs[2 * i + 1].
+ * Each shard's group is applied atomically, the batch as a whole is not.
+ * Returns the number of pairs stored.
+ */
+size_t set_keys(HashTable* ht, size_t count, const XDBArg* pairs, time_t expiry) {
+    ShardBatch batch;
+    if (!shard_batch_init(&batch, count, pairs, 2)) return 0;
+    
+    size_t stored = 0;
+    for (int s = 0; s < XDB_SHARD_COUNT; s++) {
+        if (batch.starts[s] == batch.starts[s + 1]) continue;
+        
+        XDBShard* shard = &ht->shards[s];
+        shard_write_begin(ht, shard);
+        for (size_t n = batch.starts[s]; n < batch.starts[s + 1]; n++) {
+            size_t i = batch.order[n];
+            const XDBArg* key = &pairs[i * 2];
+            const XDBArg* value = &pairs[i * 2 + 1];
+            stored += shard_store(ht, shard, (uint32_t)batch.hashes[i], key->ptr, key->len,
+                                  value->ptr, value->len, expiry, XDB_TYPE_STRING);
+        }
+        rwlock_wrunlock(&shard->lock);
+    }
+    
+    shard_batch_free(&batch);
+    return stored;
+}
+
+size_t delete_keys(HashTable* ht, size_t count, const XDBArg* keys) {
+    ShardBatch batch;
+    if (!shard_batch_init(&batch, count, keys, 1)) return 0;
+    
+    size_t deleted = 0;
+    for (int s = 0; s < XDB_SHARD_COUNT; s++) {
+        if (batch.starts[s] == batch.starts[s + 1]) continue;
+        
+        XDBShard* shard = &ht->shards[s];
+        rwlock_wrlock(&shard->lock);
+        shard_rehash_step(shard, XDB_REHASH_STEP);
+        for (size_t n = batch.starts[s]; n < batch.starts[s + 1]; n++) {
+            size_t i = batch.order[n];
+            deleted += shard_delete(ht, shard, (uint32_t)batch.hashes[i], keys[i].ptr, keys[i].len);
+        }
+        rwlock_wrunlock(&shard->lock);
+    }
+    
+    shard_batch_free(&batch);
+    return deleted;
+}
+
+/* Receives the i-th requested value, or NULL for a missing key. */
+typedef void (*xdb_multi_value_f)(size_t index, const char* value, size_t len, void* ctx);
+
+/*
+ * Looks up all keys with the shards involved read-locked together (in shard
+ * order, so concurrent batches cannot deadlock), then hands the values to fn
+ * in request order. The result is a consistent view across shards.
+ * Returns the number of keys found, or -1 if out of memory.
+ */
+long get_keys_with(HashTable* ht, size_t count, const XDBArg* keys, xdb_multi_value_f fn, void* ctx) {
+    ShardBatch batch;
+    if (!shard_batch_init(&batch, count, keys, 1)) return -1;
+    
+    KeyValue** found = (KeyValue**)malloc(sizeof(KeyValue*) * (count ? count : 1));
+    if (!found) {
+        shard_batch_free(&batch);
+        return -1;
+    }
+    
+    time_t now = time(NULL);
+    long hits = 0;
+    for (int s = 0; s < XDB_SHARD_COUNT; s++) {
+        if (batch.starts[s] == batch.starts[s + 1]) continue;
+        
+        XDBShard* shard = &ht->shards[s];
+        rwlock_rdlock(&shard->lock);
+        for (size_t n = batch.starts[s]; n < batch.starts[s + 1]; n++) {
+            size_t i = batch.order[n];
+            KeyValue** slot = shard_lookup(shard, (uint32_t)batch.hashes[i], keys[i].ptr, keys[i].len, NULL);
+            found[i] = slot && !entry_expired(*slot, now) && !entry_is_collection(*slot) ? *slot : NULL;
+            if (found[i]) {
+                entry_touch(found[i]);
+                hits++;
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (found[i]) {
+            char number[XDB_NUMBER_MAX];
+            size_t len;
+            const char* value = entry_value(found[i], number, &len);
+            fn(i, value, len, ctx);
+        } else {
+            fn(i, NULL, 0, ctx);
+        }
+    }
+    
+    for (int s = XDB_SHARD_COUNT - 1; s >= 0; s--) {
+        if (batch.starts[s] != batch.starts[s + 1]) {
+            rwlock_rdunlock(&ht->shards[s].lock);
+        }
+    }
+    
+    free(found);
+    shard_batch_free(&batch);
+    return hits;
+}
+
+#ifdef _WIN32
+    #include <io.h>
+    #define fsync_fd(fd) _commit(fd)
+    #define AOF_OPEN_FLAGS (O_WRONLY | O_APPEND | O_CREAT | O_BINARY)
+#else
+    #include <sys/wait.h>
+    #include <sys/mman.h>
+    #include <netdb.h>
+    #ifdef __linux__
+        #define fsync_fd(fd) fdatasync(fd)
+    #else
+        #define fsync_fd(fd) fsync(fd)
+    #endif
+    #define AOF_OPEN_FLAGS (O_WRONLY | O_APPEND | O_CREAT)
+#endif
+
+/*
+ * Snapshot format, version 2. All integers are little-endian.
+ *
+ *   header  "XDBSNAP\0" | u32 version | u32 header size | u64 created | u32 flags | u32 crc
+ *   blocks  u32 shard | u32 entries | u32 payload size | u32 payload crc | payload
+ *   entry   u32 key len | u32 value len | i64 expiry | u8 type | key | value
+ *   index   per block: u64 offset | u32 shard | u32 entries
+ *   footer  u64 index offset | u64 blocks | u64 entries | u32 index crc | u32 crc
+ *
+ * Every block holds entries of a single shard, so the index tells the loader
+ * how large to make each table before inserting anything. Checksums are
+ * CRC32C. A collection's value is its elements in the order object_each
+ * streams them, each as u32 len | bytes. Version 1 entries have no type
+ * byte and are all strings. Files without the magic are read with the
+ * original loader.
+ */
+#define XDB_SNAPSHOT_MAGIC "XDBSNAP"
+#define XDB_SNAPSHOT_VERSION 2
+#define XDB_SNAPSHOT_HEADER_SIZE 32
+#define XDB_SNAPSHOT_BLOCK_HEADER_SIZE 16
+#define XDB_SNAPSHOT_ENTRY_HEADER_SIZE 17
+#define XDB_SNAPSHOT_V1_ENTRY_HEADER_SIZE 16
+#define XDB_SNAPSHOT_INDEX_ENTRY_SIZE 16
+#define XDB_SNAPSHOT_FOOTER_SIZE 32
+#define XDB_SNAPSHOT_BLOCK_SIZE (64 * 1024)
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void put_le64(unsigned char* p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Slicing-by-8 tables for the Castagnoli polynomial. Filling them twice is harmless. */
+static uint32_t crc32c_table[8][256];
+static volatile int crc32c_ready;
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78U & (0U - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+    crc32c_ready = 1;
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char* p, size_t len) {
+    if (!crc32c_ready) crc32c_init();
+    
+    while (len >= 8) {
+        uint32_t lo = get_le32(p) ^ crc;
+        uint32_t hi = get_le32(p + 4);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    #if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hw(0xFFFFFFFFU, p, len);
+    }
+    #endif
+    return ~crc32c_soft(0xFFFFFFFFU, p, len);
+}
+
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+    unsigned char* block;
+    size_t block_len;
+    size_t block_cap;
+    uint32_t block_shard;
+    uint32_t block_entries;
+    unsigned char* index;
+    size_t index_len;
+    size_t index_cap;
+    uint64_t blocks;
+    uint64_t entries;
+    int ok;
+} SnapshotWriter;
+
+static void snapshot_put(SnapshotWriter* w, const void* data, size_t len) {
+    if (w->ok && len > 0 && fwrite(data, 1, len, w->file) != len) {
+        w->ok = 0;
+    }
+    w->offset += len;
+}
+
+static void snapshot_flush_block(SnapshotWriter* w) {
+    if (w->block_entries == 0) return;
+    
+    if (!buffer_reserve((char**)&w->index, &w->index_cap, w->index_len + XDB_SNAPSHOT_INDEX_ENTRY_SIZE)) {
+        w->ok = 0;
+        return;
+    }
+    unsigned char* idx = w->index + w->index_len;
+    put_le64(idx, w->offset);
+    put_le32(idx + 8, w->block_shard);
+    put_le32(idx + 12, w->block_entries);
+    w->index_len += XDB_SNAPSHOT_INDEX_ENTRY_SIZE;
+    
+    unsigned char header[XDB_SNAPSHOT_BLOCK_HEADER_SIZE];
+    put_le32(header, w->block_shard);
+    put_le32(header + 4, w->block_entries);
+    put_le32(header + 8, (uint32_t)w->block_len);
+    put_le32(header + 12, crc32c(w->block, w->block_len));
+    snapshot_put(w, header, sizeof(header));
+    snapshot_put(w, w->block, w->block_len);
+    
+    w->blocks++;
+    w->entries += w->block_entries;
+    w->block_len = 0;
+    w->block_entries = 0;
+}
+
+/* Appends one collection element to the block being written. */
+static void snapshot_write_element(const char* value, size_t len, void* ctx) {
+    SnapshotWriter* w = (SnapshotWriter*)ctx;
+    if (!w->ok) return;
+    if (!buffer_reserve((char**)&w->block, &w->block_cap, w->block_len + 4 + len)) {
+        w->ok = 0;
+        return;
+    }
+    put_le32(w->block + w->block_len, (uint32_t)len);
+    memcpy(w->block + w->block_len + 4, value, len);
+    w->block_len += 4 + len;
+}
+
+static void snapshot_write_table(SnapshotWriter* w, const XDBTable* table, time_t now) {
+    for (size_t i = 0; i < table_slot_count(table) && w->ok; i++) {
+        if (table->ctrl[i] >= XDB_CTRL_EMPTY) continue;
+        
+        const KeyValue* entry = table->slots[i];
+        if (entry->expiry != 0 && entry->expiry <= now) continue;
+        
+        /* Numbers are saved as text and load back as strings until the next INCR. */
+        char number[XDB_NUMBER_MAX];
+        size_t value_len = 0;
+        const char* value = entry_is_collection(entry) ? "" : entry_value(entry, number, &value_len);
+        size_t size = XDB_SNAPSHOT_ENTRY_HEADER_SIZE + entry->key_len + value_len;
+        if (w->block_len > 0 && w->block_len + size > XDB_SNAPSHOT_BLOCK_SIZE) {
+            snapshot_flush_block(w);
+        }
+        if (!buffer_reserve((char**)&w->block, &w->block_cap, w->block_len + size)) {
+            w->ok = 0;
+            return;
+        }
+        
+        size_t start = w->block_len;
+        unsigned char* p = w->block + start;
+        put_le64(p + 8, (uint64_t)(int64_t)entry->expiry);
+        p[16] = entry_is_collection(entry) ? entry->type : XDB_TYPE_STRING;
+        memcpy(p + XDB_SNAPSHOT_ENTRY_HEADER_SIZE, entry->data, entry->key_len);
+        memcpy(p + XDB_SNAPSHOT_ENTRY_HEADER_SIZE + entry->key_len, value, value_len);
+        w->block_len += size;
+        if (entry_is_collection(entry)) {
+            object_each(entry_object(entry), (XDBValueType)entry->type, snapshot_write_element, w);
+            if (!w->ok) return;
+            value_len = w->block_len - start - XDB_SNAPSHOT_ENTRY_HEADER_SIZE - entry->key_len;
+        }
+        put_le32(w->block + start, entry->key_len);
+        put_le32(w->block + start + 4, (uint32_t)value_len);
+        w->block_entries++;
+    }
+}
+
+/*
+ * Writes the snapshot to "<filename>.tmp" and renames it over the old file
+ * once it is on disk, so a crash mid-save never leaves a truncated snapshot.
+ * A forked child passes lock_shards = 0 since nothing else runs in it.
+ */
+static int write_snapshot(HashTable* ht, const char* filename, int lock_shards) {
+    size_t path_len = strlen(filename);
+    char* temp_path = (char*)malloc(path_len + 5);
+    if (!temp_path) return 0;
+    memcpy(temp_path, filename, path_len);
+    memcpy(temp_path + path_len, ".tmp", 5);
+    
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) {
+        free(temp_path);
+        return 0;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    
+    SnapshotWriter w;
+    memset(&w, 0, sizeof(w));
+    w.file = file;
+    w.ok = 1;
+    
+    time_t now = time(NULL);
+    unsigned char header[XDB_SNAPSHOT_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, XDB_SNAPSHOT_MAGIC, sizeof(XDB_SNAPSHOT_MAGIC));
+    put_le32(header + 8, XDB_SNAPSHOT_VERSION);
+    put_le32(header + 12, XDB_SNAPSHOT_HEADER_SIZE);
+    put_le64(header + 16, (uint64_t)now);
+    put_le32(header + 24, 0);
+    put_le32(header + 28, crc32c(header, 28));
+    snapshot_put(&w, header, sizeof(header));
+    
+    for (int i = 0; i < XDB_SHARD_COUNT && w.ok; i++) {
+        XDBShard* shard = &ht->shards[i];
+        if (lock_shards) rwlock_rdlock(&shard->lock);
+        w.block_shard = (uint32_t)i;
+        snapshot_write_table(&w, &shard->table, now);
+        snapshot_write_table(&w, &shard->old, now);
+        if (lock_shards) rwlock_rdunlock(&shard->lock);
+        snapshot_flush_block(&w);
+    }
+    
+    unsigned char footer[XDB_SNAPSHOT_FOOTER_SIZE];
+    put_le64(footer, w.offset);
+    put_le64(footer + 8, w.blocks);
+    put_le64(footer + 16, w.entries);
+    put_le32(footer + 24, crc32c(w.index, w.index_len));
+    put_le32(footer + 28, crc32c(footer, 28));
+    snapshot_put(&w, w.index, w.index_len);
+    snapshot_put(&w, footer, sizeof(footer));
+    
+    free(w.block);
+    free(w.index);
+    
+    int ok = w.ok && fflush(file) == 0 && fsync_fd(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    
+    #ifdef _WIN32
+    if (ok) remove(filename);
+    #endif
+    ok = ok && rename(temp_path, filename) == 0;
+    if (!ok) remove(temp_path);
+    
+    free(temp_path);
+    return ok;
+}
+
+int save_to_file(HashTable* ht, const char* filename) {
+    return write_snapshot(ht, filename, 1);
+}
+
+/* Maps the whole file read-only. Windows reads it into memory instead. */
+static const unsigned char* snapshot_map(const char* filename, size_t* len) {
+    #ifdef _WIN32
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+    
+    unsigned char* data = NULL;
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (unsigned char*)malloc((size_t)size);
+        if (data && fread(data, 1, (size_t)size, file) != (size_t)size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    *len = data ? (size_t)size : 0;
+    return data;
+    #else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *len = (size_t)st.st_size;
+    return (const unsigned char*)data;
+    #endif
+}
+
+static void snapshot_unmap(const unsigned char* data, size_t len) {
+    #ifdef _WIN32
+    (void)len;
+    free((void*)data);
+    #else
+    munmap((void*)data, len);
+    #endif
+}
+
+/* Rebuilds a collection from its saved elements. Returns NULL if they are damaged or memory runs out. */
+static XDBObject* snapshot_load_object(HashTable* ht, XDBValueType type, const unsigned char* p, size_t len) {
+    XDBObject* obj = object_create(ht, type);
+    if (!obj) return NULL;
+    
+    XDBArg items[2];
+    size_t group = type == XDB_TYPE_LIST ? 1 : 2;
+    size_t n = 0;
+    const unsigned char* end = p + len;
+    while (p < end) {
+        if ((size_t)(end - p) < 4 || (size_t)(end - p) - 4 < get_le32(p)) break;
+        items[n].ptr = (char*)p + 4;
+        items[n].len = get_le32(p);
+        p += 4 + items[n].len;
+        if (++n < group) continue;
+        n = 0;
+        
+        int ok;
+        double score, result;
+        if (type == XDB_TYPE_LIST) {
+            ok = list_push(ht, &obj->list, 0, items[0].ptr, items[0].len);
+        } else if (type == XDB_TYPE_HASH) {
+            ok = hash_set(ht, obj, items[0].ptr, items[0].len, items[1].ptr, items[1].len) >= 0;
+        } else {
+            ok = parse_double(items[0].ptr, items[0].len, &score) &&
+                 zset_add(ht, obj, items[1].ptr, items[1].len, score, 0, &result) >= 0;
+        }
+        if (!ok) break;
+    }
+    
+    if (p != end || n != 0 || object_count(obj) == 0) {
+        object_free(ht, obj);
+        return NULL;
+    }
+    return obj;
+}
+
+/* Inserts the entries of one block. Returns 0 if the block is damaged. */
+static int snapshot_load_block(HashTable* ht, const unsigned char* data, size_t len, uint64_t offset, time_t now,
+                               uint32_t version) {
+    size_t entry_header = version == 1 ? XDB_SNAPSHOT_V1_ENTRY_HEADER_SIZE : XDB_SNAPSHOT_ENTRY_HEADER_SIZE;
+    if (offset > len || len - offset < XDB_SNAPSHOT_BLOCK_HEADER_SIZE) return 0;
+    
+    const unsigned char* header = data + offset;
+    uint32_t entries = get_le32(header + 4);
+    uint32_t payload_len = get_le32(header + 8);
+    const unsigned char* p = header + XDB_SNAPSHOT_BLOCK_HEADER_SIZE;
+    
+    if (len - offset - XDB_SNAPSHOT_BLOCK_HEADER_SIZE < payload_len) return 0;
+    if (crc32c(p, payload_len) != get_le32(header + 12)) return 0;
+    
+    const unsigned char* end = p + payload_len;
+    for (uint32_t i = 0; i < entries; i++) {
+        if ((size_t)(end - p) < entry_header) return 0;
+        uint32_t key_len = get_le32(p);
+        uint32_t value_len = get_le32(p + 4);
+        time_t expiry = (time_t)(int64_t)get_le64(p + 8);
+        XDBValueType type = version == 1 ? XDB_TYPE_STRING : (XDBValueType)p[16];
+        p += entry_header;
+        if ((size_t)(end - p) < (uint64_t)key_len + value_len) return 0;
+        
+        const char* key = (const char*)p;
+        const char* value = (const char*)p + key_len;
+        p += (size_t)key_len + value_len;
+        if (expiry != 0 && expiry <= now) continue;
+        
+        uint64_t hash = hash_function(key, key_len);
+        XDBShard* shard = shard_for(ht, hash);
+        
+        rwlock_wrlock(&shard->lock);
+        shard_rehash_step(shard, XDB_REHASH_STEP);
+        KeyValue* entry;
+        if (type >= XDB_TYPE_LIST && type <= XDB_TYPE_ZSET) {
+            XDBObject* obj = snapshot_load_object(ht, type, (const unsigned char*)value, value_len);
+            entry = obj ? entry_create(ht, key, key_len, (const char*)&obj, sizeof(obj), expiry) : NULL;
+            if (entry) {
+                entry->type = (uint8_t)type;
+            } else if (obj) {
+                object_free(ht, obj);
+            }
+        } else {
+            entry = entry_create(ht, key, key_len, value, value_len, expiry);
+        }
+        if (entry) {
+            entry->hash = (uint32_t)hash;
+            if (!shard_add(shard, entry)) {
+                entry_free(ht, entry);
+            }
+        }
+        rwlock_wrunlock(&shard->lock);
+    }
+    return 1;
+}
+
+/* Walks the index, sizing every shard up front. Returns 0 if the index is unusable. */
+static int snapshot_load_indexed(HashTable* ht, const unsigned char* data, size_t len, time_t now, uint32_t version) {
+    const unsigned char* footer = data + len - XDB_SNAPSHOT_FOOTER_SIZE;
+    if (crc32c(footer, 28) != get_le32(footer + 28)) return 0;
+    
+    uint64_t index_offset = get_le64(footer);
+    uint64_t blocks = get_le64(footer + 8);
+    size_t index_space = len - XDB_SNAPSHOT_FOOTER_SIZE;
+    if (index_offset < XDB_SNAPSHOT_HEADER_SIZE || index_offset > index_space ||
+        blocks != (index_space - index_offset) / XDB_SNAPSHOT_INDEX_ENTRY_SIZE) {
+        return 0;
+    }
+    
+    const unsigned char* index = data + index_offset;
+    if (crc32c(index, (size_t)blocks * XDB_SNAPSHOT_INDEX_ENTRY_SIZE) != get_le32(footer + 24)) return 0;
+    
+    size_t shard_entries[XDB_SHARD_COUNT] = {0};
+    for (uint64_t i = 0; i < blocks; i++) {
+        uint32_t shard = get_le32(index + i * XDB_SNAPSHOT_INDEX_ENTRY_SIZE + 8);
+        if (shard < XDB_SHARD_COUNT) {
+            shard_entries[shard] += get_le32(index + i * XDB_SNAPSHOT_INDEX_ENTRY_SIZE + 12);
+        }
+    }
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        XDBShard* shard = &ht->shards[i];
+        rwlock_wrlock(&shard->lock);
+        if (shard_entries[i] > 0 && shard->table.used == 0 && !shard->old.ctrl) {
+            shard_start_rehash(shard, shard_entries[i]);
+        }
+        rwlock_wrunlock(&shard->lock);
+    }
+    
+    for (uint64_t i = 0; i < blocks; i++) {
+        snapshot_load_block(ht, data, index_offset, get_le64(index + i * XDB_SNAPSHOT_INDEX_ENTRY_SIZE), now, version);
+    }
+    return 1;
+}
+
+/* Fallback when the footer or index is damaged: follow the blocks from the start. */
+static void snapshot_load_sequential(HashTable* ht, const unsigned char* data, size_t len, time_t now,
+                                     uint32_t version) {
+    uint64_t offset = XDB_SNAPSHOT_HEADER_SIZE;
+    while (snapshot_load_block(ht, data, len, offset, now, version)) {
+        offset += XDB_SNAPSHOT_BLOCK_HEADER_SIZE + get_le32(data + offset + 8);
+    }
+}
+
+/* Reader for snapshots written before the versioned format. */
+static void load_legacy_file(HashTable* ht, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return;
+    }
+    
+    char* key = NULL;
+    char* value = NULL;
+    size_t key_cap = 0;
+    size_t value_cap = 0;
+    
+    while (!feof(file)) {
+        size_t key_len, value_len;
+        time_t expiry;
+        
+        if (fread(&key_len, sizeof(size_t), 1, file) != 1) {
+            break;
+        }
+        
+        if (key_len > XDB_MAX_ENTRY_SIZE || !buffer_reserve(&key, &key_cap, key_len + 1)) {
+            break;
+        }
+        
+        if (fread(key, 1, key_len, file) != key_len) {
+            break;
+        }
+        
+        if (fread(&value_len, sizeof(size_t), 1, file) != 1) {
+            break;
+        }
+        
+        if (value_len > XDB_MAX_ENTRY_SIZE || !buffer_reserve(&value, &value_cap, value_len + 1)) {
+            break;
+        }
+        
+        if (fread(value, 1, value_len, file) != value_len) {
+            break;
+        }
+        
+        if (fread(&expiry, sizeof(time_t), 1, file) != 1) {
+            break;
+        }
+        
+        if (expiry == 0 || expiry > time(NULL)) {
+            uint64_t hash = hash_function(key, key_len);
+            XDBShard* shard = shard_for(ht, hash);
+            
+            rwlock_wrlock(&shard->lock);
+            shard_rehash_step(shard, XDB_REHASH_STEP);
+            KeyValue* entry = entry_create(ht, key, key_len, value, value_len, expiry);
+            if (entry) {
+                entry->hash = (uint32_t)hash;
+                if (!shard_add(shard, entry)) {
+                    entry_free(ht, entry);
+                }
+            }
+            rwlock_wrunlock(&shard->lock);
+        }
+    }
+    
+    free(key);
+    free(value);
+    fclose(file);
+}
+
+void load_from_file(HashTable* ht, const char* filename) {
+    size_t len = 0;
+    const unsigned char* data = snapshot_map(filename, &len);
+    if (!data) return;
+    
+    if (len < XDB_SNAPSHOT_HEADER_SIZE + XDB_SNAPSHOT_FOOTER_SIZE ||
+        memcmp(data, XDB_SNAPSHOT_MAGIC, sizeof(XDB_SNAPSHOT_MAGIC)) != 0) {
+        snapshot_unmap(data, len);
+        load_legacy_file(ht, filename);
+        return;
+    }
+    
+    uint32_t version = get_le32(data + 8);
+    if ((version == 1 || version == XDB_SNAPSHOT_VERSION) && crc32c(data, 28) == get_le32(data + 28)) {
+        time_t now = time(NULL);
+        if (!snapshot_load_indexed(ht, data, len, now, version)) {
+            snapshot_load_sequential(ht, data, len, now, version);
+        }
+    }
+    snapshot_unmap(data, len);
+}
+
+struct XDBAof {
+    int fd;
+    char* path;
+    char* temp_path;
+    XDBAofPolicy policy;
+    HashTable* ht;
+    char* buf;
+    size_t len;
+    size_t cap;
+    char* spare;
+    size_t spare_cap;
+    uint64_t appended;
+    uint64_t written;
+    uint64_t synced;
+    int syncing;
+    int write_error;
+    long long size;
+    long long base_size;
+    time_t last_fsync;
+    int64_t fsync_us;
+    int64_t rewrite_started_us;
+    int64_t rewrite_us;
+    int rewriting;
+    #ifndef _WIN32
+    pid_t rewrite_pid;
+    #endif
+    char* rewrite_buf;
+    size_t rewrite_len;
+    size_t rewrite_cap;
+    int running;
+    thread_t thread;
+    mutex_t lock;
+    cond_t cond;
+};
+
+typedef struct {
+    XDBAof* aof;
+    uint64_t seq;
+} XDBPendingSync;
+
+/* Appends made by this thread that must be durable before its replies go out. */
+static XDB_THREAD_LOCAL XDBPendingSync pending_syncs[MAX_DB_COUNT];
+static XDB_THREAD_LOCAL int pending_sync_count;
+
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        long n = write(fd, data, (unsigned int)len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Writes out the buffered tail with the lock dropped. Only one thread is in
+ * here at a time; appends that arrive meanwhile pile up in aof->buf and are
+ * committed together by the next leader.
+ */
+static void aof_write_locked(XDBAof* aof, int do_sync) {
+    char* data = aof->buf;
+    size_t data_cap = aof->cap;
+    size_t len = aof->len;
+    uint64_t target = aof->appended;
+    
+    aof->buf = aof->spare;
+    aof->cap = aof->spare_cap;
+    aof->spare = NULL;
+    aof->spare_cap = 0;
+    aof->len = 0;
+    aof->syncing = 1;
+    mutex_unlock(&aof->lock);
+    
+    int ok = len == 0 || write_all(aof->fd, data, len);
+    int64_t fsync_us = 0;
+    if (ok && do_sync) {
+        int64_t start = monotonic_us();
+        ok = fsync_fd(aof->fd) == 0;
+        fsync_us = monotonic_us() - start;
+    }
+    
+    mutex_lock(&aof->lock);
+    aof->spare = data;
+    aof->spare_cap = data_cap;
+    aof->syncing = 0;
+    if (ok) {
+        aof->size += len;
+        aof->written = target;
+        if (do_sync) {
+            aof->synced = target;
+            aof->last_fsync = time(NULL);
+            aof->fsync_us = fsync_us;
+        }
+    } else {
+        aof->write_error = errno ? errno : EIO;
+        aof->written = target;
+        aof->synced = target;
+    }
+    cond_broadcast(&aof->cond);
+}
+
+static void aof_sync_to(XDBAof* aof, uint64_t seq) {
+    mutex_lock(&aof->lock);
+    while (aof->synced < seq) {
+        if (aof->syncing) {
+            cond_wait(&aof->cond, &aof->lock);
+        } else {
+            aof_write_locked(aof, 1);
+        }
+    }
+    mutex_unlock(&aof->lock);
+}
+
+/* Journal hook, called with the shard lock held. */
+static void aof_feed(void* ctx, int argc, const XDBArg* argv) {
+    XDBAof* aof = (XDBAof*)ctx;
+    
+    mutex_lock(&aof->lock);
+    size_t before = aof->len;
+    if (!resp_append_command(&aof->buf, &aof->len, &aof->cap, argc, argv)) {
+        aof->write_error = ENOMEM;
+        mutex_unlock(&aof->lock);
+        return;
+    }
+    aof->appended += aof->len - before;
+    
+    if (aof->rewriting &&
+        buffer_reserve(&aof->rewrite_buf, &aof->rewrite_cap, aof->rewrite_len + aof->len - before)) {
+        memcpy(aof->rewrite_buf + aof->rewrite_len, aof->buf + before, aof->len - before);
+        aof->rewrite_len += aof->len - before;
+    }
+    uint64_t seq = aof->appended;
+    mutex_unlock(&aof->lock);
+    
+    if (aof->policy != XDB_AOF_ALWAYS) return;
+    
+    for (int i = 0; i < pending_sync_count; i++) {
+        if (pending_syncs[i].aof == aof) {
+            pending_syncs[i].seq = seq;
+            return;
+        }
+    }
+    if (pending_sync_count < MAX_DB_COUNT) {
+        pending_syncs[pending_sync_count].aof = aof;
+        pending_syncs[pending_sync_count].seq = seq;
+        pending_sync_count++;
+    } else {
+        aof_sync_to(aof, seq);
+    }
+}
+
+/* Waits until everything this thread journaled under the always policy is on disk. */
+void journal_sync_pending(void) {
+    for (int i = 0; i < pending_sync_count; i++) {
+        aof_sync_to(pending_syncs[i].aof, pending_syncs[i].seq);
+    }
+    pending_sync_count = 0;
+}
+
+typedef struct {
+    int fd;
+    char buf[65536];
+    size_t len;
+    int ok;
+} AofWriter;
+
+static void aof_writer_put(AofWriter* w, const char* data, size_t len) {
+    if (!w->ok) return;
+    if (w->len + len > sizeof(w->buf)) {
+        w->ok = write_all(w->fd, w->buf, w->len);
+        w->len = 0;
+        if (len > sizeof(w->buf)) {
+            w->ok = w->ok && write_all(w->fd, data, len);
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void aof_writer_bulk(AofWriter* w, const char* data, size_t len) {
+    char header[32];
+    int n = sprintf(header, "$%zu\r\n", len);
+    aof_writer_put(w, header, n);
+    aof_writer_put(w, data, len);
+    aof_writer_put(w, "\r\n", 2);
+}
+
+/* Collections are rewritten as RPUSH/HSET/ZADD commands of at most this many elements. */
+#define XDB_AOF_REWRITE_BATCH 64
+
+typedef struct {
+    AofWriter* w;
+    const KeyValue* entry;
+    const char* command;
+    size_t remaining;
+    size_t batch;
+    size_t group;
+} AofObjectWriter;
+
+static void aof_write_element(const char* value, size_t len, void* ctx) {
+    AofObjectWriter* o = (AofObjectWriter*)ctx;
+    if (o->batch == 0) {
+        size_t limit = XDB_AOF_REWRITE_BATCH * o->group;
+        o->batch = o->remaining < limit ? o->remaining : limit;
+        
+        char header[32];
+        int n = sprintf(header, "*%zu\r\n", o->batch + 2);
+        aof_writer_put(o->w, header, n);
+        aof_writer_bulk(o->w, o->command, strlen(o->command));
+        aof_writer_bulk(o->w, o->entry->data, o->entry->key_len);
+    }
+    aof_writer_bulk(o->w, value, len);
+    o->batch--;
+    o->remaining--;
+}
+
+static void aof_write_object(AofWriter* w, const KeyValue* entry) {
+    static const char* commands[] = { "RPUSH", "HSET", "ZADD" };
+    XDBObject* obj = entry_object(entry);
+    AofObjectWriter o;
+    o.w = w;
+    o.entry = entry;
+    o.command = commands[entry->type - XDB_TYPE_LIST];
+    o.group = entry->type == XDB_TYPE_LIST ? 1 : 2;
+    o.remaining = object_count(obj) * o.group;
+    o.batch = 0;
+    object_each(obj, (XDBValueType)entry->type, aof_write_element, &o);
+    
+    if (entry->expiry > 0) {
+        char ts[32];
+        int n = sprintf(ts, "%lld", (long long)entry->expiry);
+        aof_writer_put(w, "*3\r\n$8\r\nEXPIREAT\r\n", 18);
+        aof_writer_bulk(w, entry->data, entry->key_len);
+        aof_writer_bulk(w, ts, n);
+    }
+}
+
+static void aof_write_table(AofWriter* w, const XDBTable* table, time_t now) {
+    for (size_t i = 0; i < table_slot_count(table); i++) {
+        if (table->ctrl[i] >= XDB_CTRL_EMPTY) continue;
+        
+        const KeyValue* entry = table->slots[i];
+        if (entry->expiry > 0 && entry->expiry <= now) continue;
+        if (entry_is_collection(entry)) {
+            aof_write_object(w, entry);
+            continue;
+        }
+        
+        char number[XDB_NUMBER_MAX];
+        size_t value_len;
+        const char* value = entry_value(entry, number, &value_len);
+        if (entry->expiry > 0) {
+            char ts[32];
+            int n = sprintf(ts, "%lld", (long long)entry->expiry);
+            aof_writer_put(w, "*5\r\n$3\r\nSET\r\n", 13);
+            aof_writer_bulk(w, entry->data, entry->key_len);
+            aof_writer_bulk(w, value, value_len);
+            aof_writer_bulk(w, "EXAT", 4);
+            aof_writer_bulk(w, ts, n);
+        } else {
+            aof_writer_put(w, "*3\r\n$3\r\nSET\r\n", 13);
+            aof_writer_bulk(w, entry->data, entry->key_len);
+            aof_writer_bulk(w, value, value_len);
+        }
+    }
+}
+
+/* Serializes the table as SET commands, or RPUSH/HSET/ZADD for collections. Callers make sure nothing mutates it meanwhile. */
+static int write_dataset(HashTable* ht, int fd) {
+    AofWriter* w = malloc(sizeof(AofWriter));
+    if (!w) return 0;
+    w->fd = fd;
+    w->len = 0;
+    w->ok = 1;
+    
+    time_t now = time(NULL);
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        aof_write_table(w, &ht->shards[i].table, now);
+        aof_write_table(w, &ht->shards[i].old, now);
+    }
+    
+    if (w->ok && w->len > 0) {
+        w->ok = write_all(fd, w->buf, w->len);
+    }
+    int ok = w->ok;
+    free(w);
+    return ok;
+}
+
+static int aof_write_dataset(HashTable* ht, int fd) {
+    return write_dataset(ht, fd) && fsync_fd(fd) == 0;
+}
+
+static void lock_all_shards(HashTable* ht) {
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        rwlock_wrlock(&ht->shards[i].lock);
+    }
+}
+
+static void unlock_all_shards(HashTable* ht) {
+    for (int i = XDB_SHARD_COUNT - 1; i >= 0; i--) {
+        rwlock_wrunlock(&ht->shards[i].lock);
+    }
+}
+
+/* Swaps the freshly written temp file in as the live log. Called with aof->lock held. */
+static int aof_install_rewrite(XDBAof* aof, int fd) {
+    while (aof->syncing) {
+        cond_wait(&aof->cond, &aof->lock);
+    }
+    
+    if (aof->rewrite_len > 0 && !write_all(fd, aof->rewrite_buf, aof->rewrite_len)) return 0;
+    if (fsync_fd(fd) != 0) return 0;
+    
+    #ifdef _WIN32
+    close(aof->fd);
+    remove(aof->path);
+    #endif
+    if (rename(aof->temp_path, aof->path) != 0) return 0;
+    
+    #ifndef _WIN32
+    close(aof->fd);
+    #endif
+    aof->fd = fd;
+    
+    struct stat st;
+    aof->size = fstat(fd, &st) == 0 ? (long long)st.st_size : 0;
+    aof->base_size = aof->size;
+    
+    /* Everything still buffered is already part of the rewritten file. */
+    aof->len = 0;
+    aof->written = aof->appended;
+    aof->synced = aof->appended;
+    aof->last_fsync = time(NULL);
+    return 1;
+}
+
+static void aof_reset_rewrite(XDBAof* aof) {
+    aof->rewriting = 0;
+    free(aof->rewrite_buf);
+    aof->rewrite_buf = NULL;
+    aof->rewrite_len = 0;
+    aof->rewrite_cap = 0;
+}
+
+/* Compacts the log in the calling thread while every shard is locked. */
+static int aof_rewrite_sync(XDBAof* aof) {
+    int fd = open(aof->temp_path, AOF_OPEN_FLAGS | O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    
+    int64_t start = monotonic_us();
+    lock_all_shards(aof->ht);
+    int ok = aof_write_dataset(aof->ht, fd);
+    
+    mutex_lock(&aof->lock);
+    if (ok && !aof->rewriting) {
+        ok = aof_install_rewrite(aof, fd);
+        aof->rewrite_us = monotonic_us() - start;
+    } else {
+        ok = 0;
+    }
+    mutex_unlock(&aof->lock);
+    unlock_all_shards(aof->ht);
+    
+    if (!ok) {
+        close(fd);
+        remove(aof->temp_path);
+    }
+    return ok;
+}
+
+/*
+ * Starts a background rewrite. On POSIX systems a forked child writes the
+ * dataset as of the fork while the parent keeps serving and collects the
+ * mutations made since then in rewrite_buf.
+ */
+int aof_rewrite_background(XDBAof* aof) {
+    if (!aof) return 0;
+    
+    #ifdef _WIN32
+    return aof_rewrite_sync(aof);
+    #else
+    lock_all_shards(aof->ht);
+    mutex_lock(&aof->lock);
+    
+    if (aof->rewriting) {
+        mutex_unlock(&aof->lock);
+        unlock_all_shards(aof->ht);
+        return 0;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(aof->temp_path, AOF_OPEN_FLAGS | O_TRUNC, 0644);
+        int ok = fd >= 0 && aof_write_dataset(aof->ht, fd);
+        _exit(ok ? 0 : 1);
+    }
+    
+    if (pid > 0) {
+        aof->rewriting = 1;
+        aof->rewrite_pid = pid;
+        aof->rewrite_len = 0;
+        aof->rewrite_started_us = monotonic_us();
+    }
+    
+    mutex_unlock(&aof->lock);
+    unlock_all_shards(aof->ht);
+    return pid > 0;
+    #endif
+}
+
+#ifndef _WIN32
+static void aof_check_rewrite_child(XDBAof* aof, int options) {
+    int status = 0;
+    pid_t r = waitpid(aof->rewrite_pid, &status, options);
+    if (r == 0) return;
+    
+    int ok = r == aof->rewrite_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int fd = ok ? open(aof->temp_path, AOF_OPEN_FLAGS, 0644) : -1;
+    
+    mutex_lock(&aof->lock);
+    if (fd < 0 || !aof_install_rewrite(aof, fd)) {
+        if (fd >= 0) close(fd);
+        remove(aof->temp_path);
+    }
+    aof->rewrite_us = monotonic_us() - aof->rewrite_started_us;
+    aof_reset_rewrite(aof);
+    mutex_unlock(&aof->lock);
+}
+#endif
+
+#ifdef _WIN32
+static DWORD WINAPI aof_flusher(LPVOID arg) {
+#else
+static void* aof_flusher(void* arg) {
+#endif
+    XDBAof* aof = (XDBAof*)arg;
+    
+    while (aof->running) {
+        sleep_ms(100);
+        
+        mutex_lock(&aof->lock);
+        time_t now = time(NULL);
+        int sync_due = aof->policy == XDB_AOF_ALWAYS ||
+                       (aof->policy == XDB_AOF_EVERYSEC && now - aof->last_fsync >= 1);
+        if (!aof->syncing && (aof->len > 0 || (sync_due && aof->written > aof->synced))) {
+            aof_write_locked(aof, sync_due);
+        }
+        
+        int rewriting = aof->rewriting;
+        int rewrite_due = !rewriting && aof->size >= XDB_AOF_REWRITE_MIN_SIZE &&
+                          aof->size >= aof->base_size * 2;
+        mutex_unlock(&aof->lock);
+        
+        #ifndef _WIN32
+        if (rewriting) {
+            aof_check_rewrite_child(aof, WNOHANG);
+        }
+        #endif
+        if (rewrite_due) {
+            aof_rewrite_background(aof);
+        }
+    }
+    
+    return 0;
+}
+
+static void aof_apply(HashTable* ht, XDBArgv* args) {
+    if (args->count == 1 && strcasecmp(args->items[0].ptr, "FLUSHDB") == 0) {
+        flush_hash_table(ht);
+        return;
+    }
+    if (args->count < 2) return;
+    
+    const char* name = args->items[0].ptr;
+    XDBArg* key = &args->items[1];
+    
+    if (strcasecmp(name, "SET") == 0 && args->count >= 3) {
+        time_t expiry = 0;
+        if (args->count >= 5 && strcasecmp(args->items[3].ptr, "EXAT") == 0) {
+            expiry = (time_t)atoll(args->items[4].ptr);
+        }
+        if (expiry > 0 && expiry <= time(NULL)) {
+            delete_key(ht, key->ptr, key->len);
+        } else {
+            set_key_at(ht, key->ptr, key->len, args->items[2].ptr, args->items[2].len, expiry);
+        }
+    } else if (strcasecmp(name, "DEL") == 0) {
+        for (int i = 1; i < args->count; i++) {
+            delete_key(ht, args->items[i].ptr, args->items[i].len);
+        }
+    } else if (strcasecmp(name, "EXPIREAT") == 0 && args->count >= 3) {
+        set_expiry(ht, key->ptr, key->len, (time_t)atoll(args->items[2].ptr));
+    } else if (strcasecmp(name, "PERSIST") == 0) {
+        set_expiry(ht, key->ptr, key->len, 0);
+    } else if ((strcasecmp(name, "RPUSH") == 0 || strcasecmp(name, "LPUSH") == 0) && args->count >= 3) {
+        list_push_key(ht, key->ptr, key->len, name[0] == 'L' || name[0] == 'l', args->count - 2, args->items + 2);
+    } else if (strcasecmp(name, "RPOP") == 0 || strcasecmp(name, "LPOP") == 0) {
+        list_pop_key(ht, key->ptr, key->len, name[0] == 'L' || name[0] == 'l', NULL, NULL);
+    } else if (strcasecmp(name, "LTRIM") == 0 && args->count >= 4) {
+        list_trim_key(ht, key->ptr, key->len, atol(args->items[2].ptr), atol(args->items[3].ptr));
+    } else if (strcasecmp(name, "HSET") == 0 && args->count >= 4 && args->count % 2 == 0) {
+        hash_set_key(ht, key->ptr, key->len, (size_t)(args->count - 2) / 2, args->items + 2);
+    } else if (strcasecmp(name, "HDEL") == 0 && args->count >= 3) {
+        hash_delete_key(ht, key->ptr, key->len, args->count - 2, args->items + 2);
+    } else if (strcasecmp(name, "ZADD") == 0 && args->count >= 4 && args->count % 2 == 0) {
+        zset_add_key(ht, key->ptr, key->len, (size_t)(args->count - 2) / 2, args->items + 2);
+    } else if (strcasecmp(name, "ZREM") == 0 && args->count >= 3) {
+        zset_remove_key(ht, key->ptr, key->len, args->count - 2, args->items + 2);
+    }
+}
+
+/* Replays the log into ht. A torn final command is cut off so appends resume cleanly. */
+static int aof_replay(HashTable* ht, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    char* data = size > 0 ? malloc(size) : NULL;
+    if (size > 0 && (!data || fread(data, 1, size, file) != (size_t)size)) {
+        free(data);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    
+    XDBArgv args = {0};
+    long pos = 0;
+    while (pos < size) {
+        long n = parse_resp_command(data + pos, size - pos, &args);
+        if (n <= 0) break;
+        aof_apply(ht, &args);
+        pos += n;
+    }
+    
+    if (pos < size) {
+        #ifdef _WIN32
+        int fd = open(path, O_WRONLY | O_BINARY);
+        if (fd >= 0) {
+            _chsize(fd, pos);
+            close(fd);
+        }
+        #else
+        if (truncate(path, pos) != 0) {
+            pos = size;
+        }
+        #endif
+    }
+    
+    free(args.items);
+    free(data);
+    return 1;
+}
+
+int aof_exists(const char* db_path) {
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s.aof", db_path);
+    return stat(path, &st) == 0;
+}
+
+/*
+ * Attaches an append-only log to ht. An existing log is replayed into the
+ * table; otherwise the log is seeded from the current contents.
+ */
+XDBAof* aof_open(HashTable* ht, const char* db_path, XDBAofPolicy policy) {
+    XDBAof* aof = (XDBAof*)calloc(1, sizeof(XDBAof));
+    if (!aof) return NULL;
+    
+    size_t path_len = strlen(db_path);
+    aof->path = malloc(path_len + 5);
+    aof->temp_path = malloc(path_len + 9);
+    if (!aof->path || !aof->temp_path) {
+        free(aof->path);
+        free(aof->temp_path);
+        free(aof);
+        return NULL;
+    }
+    sprintf(aof->path, "%s.aof", db_path);
+    sprintf(aof->temp_path, "%s.aof.tmp", db_path);
+    
+    aof->ht = ht;
+    aof->policy = policy;
+    aof->last_fsync = time(NULL);
+    mutex_init(&aof->lock);
+    cond_init(&aof->cond);
+    
+    struct stat st;
+    int existing = stat(aof->path, &st) == 0;
+    if (existing) {
+        aof_replay(ht, aof->path);
+    }
+    
+    aof->fd = open(aof->path, AOF_OPEN_FLAGS, 0644);
+    if (aof->fd < 0 || (!existing && !aof_rewrite_sync(aof))) {
+        if (aof->fd >= 0) close(aof->fd);
+        mutex_destroy(&aof->lock);
+        cond_destroy(&aof->cond);
+        free(aof->path);
+        free(aof->temp_path);
+        free(aof);
+        return NULL;
+    }
+    
+    if (fstat(aof->fd, &st) == 0) {
+        aof->size = (long long)st.st_size;
+    }
+    aof->base_size = aof->size;
+    
+    ht->journal = aof_feed;
+    ht->journal_ctx = aof;
+    
+    aof->running = 1;
+    thread_create(&aof->thread, aof_flusher, aof);
+    return aof;
+}
+
+void aof_close(XDBAof* aof) {
+    if (!aof) return;
+    
+    aof->running = 0;
+    thread_join(aof->thread);
+    
+    #ifndef _WIN32
+    if (aof->rewriting) {
+        aof_check_rewrite_child(aof, 0);
+    }
+    #endif
+    
+    mutex_lock(&aof->lock);
+    if (aof->ht->journal_ctx == aof) {
+        aof->ht->journal = NULL;
+        aof->ht->journal_ctx = NULL;
+    }
+    while (aof->syncing) {
+        cond_wait(&aof->cond, &aof->lock);
+    }
+    if (aof->len > 0 || aof->written > aof->synced) {
+        aof_write_locked(aof, aof->policy != XDB_AOF_NO);
+    }
+    mutex_unlock(&aof->lock);
+    
+    close(aof->fd);
+    mutex_destroy(&aof->lock);
+    cond_destroy(&aof->cond);
+    free(aof->buf);
+    free(aof->spare);
+    free(aof->rewrite_buf);
+    free(aof->path);
+    free(aof->temp_path);
+    free(aof);
+}
+
+Database* create_database(const char* name, const char* db_path, XDBAofPolicy aof_policy) {
+    Database* db = (Database*)malloc(sizeof(Database));
+    if (!db) return NULL;
+    
+    strncpy(db->name, name, MAX_DB_NAME_SIZE - 1);
+    db->name[MAX_DB_NAME_SIZE - 1] = '\0';
+    
+    db->store = (HashTable*)malloc(sizeof(HashTable));
+    if (!db->store) {
+        free(db);
+        return NULL;
+    }
+    
+    db->db_path = strdup(db_path);
+    db->aof = NULL;
+    init_hash_table(db->store);
+    
+    /* With AOF on, an existing log supersedes the snapshot. */
+    if (aof_policy == XDB_AOF_OFF || !aof_exists(db->db_path)) {
+        load_from_file(db->store, db->db_path);
+    }
+    
+    if (aof_policy != XDB_AOF_OFF) {
+        db->aof = aof_open(db->store, db->db_path, aof_policy);
+        if (!db->aof) {
+            free_hash_table(db->store);
+            free(db->store);
+            free(db->db_path);
+            free(db);
+            return NULL;
+        }
+    }
+    
+    return db;
+}
+
+void destroy_database(Database* db) {
+    if (!db) return;
+    
+    save_to_file(db->store, db->db_path);
+    aof_close(db->aof);
+    free_hash_table(db->store);
+    free(db->store);
+    free(db->db_path);
+    free(db);
+}
+
+/*
+ * Server statistics. Every thread that runs commands (a reactor, or a
+ * client thread in thread mode) owns an XDBStats that only it updates, so
+ * counting takes no locks; INFO and the metrics endpoint add them up on
+ * demand. Owners write with relaxed atomic stores so readers never see a
+ * torn value. Command latencies go into log-linear histograms: exact below
+ * 2^XDB_LATENCY_SUB_BITS ticks, then 2^XDB_LATENCY_SUB_BITS buckets per
+ * power of two, which keeps every bucket within 12.5% of its values.
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t total_ticks;
+    uint64_t buckets[XDB_LATENCY_BUCKETS];
+} XDBCommandStats;
+
+struct XDBStats {
+    uint64_t hits;
+    uint64_t misses;
+    int command_count;
+    XDBCommandStats* commands;
+    XDBStats* next;
+};
+
+struct XDBMetrics {
+    mutex_t lock;
+    XDBStats* threads;
+    XDBStats* retired;
+    const char** names;
+    int command_count;
+    time_t started;
+    int64_t started_ns;
+    uint64_t started_ticks;
+    uint64_t connections;
+    
+    /* Sampled by the cron once a second; guarded by db_mutex. */
+    uint64_t ops_total;
+    int64_t ops_sampled_us;
+    uint64_t ops_per_sec;
+    
+    /* Snapshot timings; guarded by db_mutex. */
+    time_t last_save;
+    int64_t save_started_us;
+    int64_t save_us;
+    int64_t fork_us;
+};
+
+#define stat_add(counter, n) xdb_atomic_store64(&(counter), xdb_atomic_load64(&(counter)) + (n))
+
+/*
+ * Clock for command latencies. On x86-64 it reads the time-stamp counter,
+ * several times cheaper than clock_gettime; ticks become nanoseconds only
+ * when reported, at the rate measured against the monotonic clock since
+ * the metrics were created. Elsewhere a tick is a nanosecond.
+ */
+static uint64_t latency_ticks(void) {
+    #if defined(__x86_64__) && defined(__GNUC__)
+    return __builtin_ia32_rdtsc();
+    #else
+    return (uint64_t)monotonic_ns();
+    #endif
+}
+
+static int highest_bit(uint64_t value) {
+    #if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+    #else
+    int bit = 0;
+    while (value >>= 1) bit++;
+    return bit;
+    #endif
+}
+
+static int latency_bucket(uint64_t ns) {
+    const uint64_t sub = 1 << XDB_LATENCY_SUB_BITS;
+    if (ns < sub) return (int)ns;
+    
+    int shift = highest_bit(ns) - XDB_LATENCY_SUB_BITS;
+    int idx = (shift + 1) * (int)sub + (int)((ns >> shift) & (sub - 1));
+    return idx < XDB_LATENCY_BUCKETS ? idx : XDB_LATENCY_BUCKETS - 1;
+}
+
+/* The largest latency, in ticks, that falls into bucket idx. */
+static uint64_t latency_bucket_max(int idx) {
+    const int sub = 1 << XDB_LATENCY_SUB_BITS;
+    if (idx < sub) return (uint64_t)idx;
+    
+    int shift = idx / sub - 1;
+    return (((uint64_t)(sub + idx % sub) + 1) << shift) - 1;
+}
+
+static XDBStats* stats_create(int command_count) {
+    XDBStats* stats = (XDBStats*)calloc(1, sizeof(XDBStats));
+    if (!stats) return NULL;
+    
+    stats->commands = (XDBCommandStats*)calloc(command_count, sizeof(XDBCommandStats));
+    if (!stats->commands) {
+        free(stats);
+        return NULL;
+    }
+    stats->command_count = command_count;
+    return stats;
+}
+
+static void stats_free(XDBStats* stats) {
+    if (!stats) return;
+    free(stats->commands);
+    free(stats);
+}
+
+static void stats_record(XDBStats* stats, int command, uint64_t start) {
+    uint64_t ticks = latency_ticks() - start;
+    XDBCommandStats* cs = &stats->commands[command];
+    if ((int64_t)ticks < 0) ticks = 0;
+    stat_add(cs->calls, 1);
+    stat_add(cs->total_ticks, ticks);
+    stat_add(cs->buckets[latency_bucket(ticks)], 1);
+}
+
+static void stats_keyspace(ClientInfo* client, uint64_t hits, uint64_t misses) {
+    XDBStats* stats = client->stats;
+    if (!stats) return;
+    stat_add(stats->hits, hits);
+    stat_add(stats->misses, misses);
+}
+
+/* Adds src into dst; dst is private to the caller or guarded by the metrics lock. */
+static void stats_merge(XDBStats* dst, XDBStats* src) {
+    dst->hits += xdb_atomic_load64(&src->hits);
+    dst->misses += xdb_atomic_load64(&src->misses);
+    for (int i = 0; i < dst->command_count; i++) {
+        XDBCommandStats* to = &dst->commands[i];
+        XDBCommandStats* from = &src->commands[i];
+        to->calls += xdb_atomic_load64(&from->calls);
+        to->total_ticks += xdb_atomic_load64(&from->total_ticks);
+        for (int b = 0; b < XDB_LATENCY_BUCKETS; b++) {
+            to->buckets[b] += xdb_atomic_load64(&from->buckets[b]);
+        }
+    }
+}
+
+static XDBMetrics* metrics_create(const char** names, int command_count) {
+    XDBMetrics* metrics = (XDBMetrics*)calloc(1, sizeof(XDBMetrics));
+    if (!metrics) return NULL;
+    
+    metrics->retired = stats_create(command_count);
+    if (!metrics->retired) {
+        free(metrics);
+        return NULL;
+    }
+    metrics->names = names;
+    metrics->command_count = command_count;
+    metrics->started = time(NULL);
+    metrics->started_ns = monotonic_ns();
+    metrics->started_ticks = latency_ticks();
+    mutex_init(&metrics->lock);
+    return metrics;
+}
+
+static void metrics_destroy(XDBMetrics* metrics) {
+    if (!metrics) return;
+    
+    while (metrics->threads) {
+        XDBStats* next = metrics->threads->next;
+        stats_free(metrics->threads);
+        metrics->threads = next;
+    }
+    stats_free(metrics->retired);
+    free(metrics->names);
+    mutex_destroy(&metrics->lock);
+    free(metrics);
+}
+
+/* Gives a command-running thread its counters. Statistics are best effort: NULL just means none are kept. */
+static XDBStats* metrics_attach(XDBMetrics* metrics) {
+    XDBStats* stats = stats_create(metrics->command_count);
+    if (!stats) return NULL;
+    
+    mutex_lock(&metrics->lock);
+    stats->next = metrics->threads;
+    metrics->threads = stats;
+    mutex_unlock(&metrics->lock);
+    return stats;
+}
+
+/* Folds an exiting thread's counters into the totals and frees them. */
+static void metrics_detach(XDBMetrics* metrics, XDBStats* stats) {
+    if (!stats) return;
+    
+    mutex_lock(&metrics->lock);
+    XDBStats** link = &metrics->threads;
+    while (*link && *link != stats) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = stats->next;
+    stats_merge(metrics->retired, stats);
+    mutex_unlock(&metrics->lock);
+    stats_free(stats);
+}
+
+/* Sums every thread's counters into a fresh XDBStats the caller frees. */
+static XDBStats* metrics_collect(XDBMetrics* metrics) {
+    XDBStats* total = stats_create(metrics->command_count);
+    if (!total) return NULL;
+    
+    mutex_lock(&metrics->lock);
+    stats_merge(total, metrics->retired);
+    for (XDBStats* stats = metrics->threads; stats; stats = stats->next) {
+        stats_merge(total, stats);
+    }
+    mutex_unlock(&metrics->lock);
+    return total;
+}
+
+static uint64_t metrics_total_calls(XDBMetrics* metrics) {
+    uint64_t total = 0;
+    mutex_lock(&metrics->lock);
+    for (int i = 0; i < metrics->command_count; i++) {
+        total += metrics->retired->commands[i].calls;
+        for (XDBStats* stats = metrics->threads; stats; stats = stats->next) {
+            total += xdb_atomic_load64(&stats->commands[i].calls);
+        }
+    }
+    mutex_unlock(&metrics->lock);
+    return total;
+}
+
+static double metrics_ns_per_tick(XDBMetrics* metrics) {
+    int64_t ns = monotonic_ns() - metrics->started_ns;
+    uint64_t ticks = latency_ticks() - metrics->started_ticks;
+    return ns > 0 && ticks > 0 ? (double)ns / (double)ticks : 1.0;
+}
+
+/* Refreshes the ops/sec figure once a second. Called from the cron with db_mutex held. */
+static void metrics_sample_ops(XDBMetrics* metrics) {
+    int64_t now = monotonic_us();
+    int64_t elapsed = now - metrics->ops_sampled_us;
+    if (elapsed < 1000000) return;
+    
+    uint64_t total = metrics_total_calls(metrics);
+    if (metrics->ops_sampled_us > 0) {
+        metrics->ops_per_sec = (total - metrics->ops_total) * 1000000 / (uint64_t)elapsed;
+    }
+    metrics->ops_total = total;
+    metrics->ops_sampled_us = now;
+}
+
+#ifndef _WIN32
+/* Reaps the snapshot child if it has exited (or waits for it without WNOHANG). Called with db_mutex held. */
+static void snapshot_reap(XDBServer* server, int options) {
+    if (server->save_pid <= 0) return;
+    
+    int status = 0;
+    pid_t r = waitpid(server->save_pid, &status, options);
+    if (r == 0) return;
+    
+    server->save_ok = r == server->save_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    server->save_pid = 0;
+    server->metrics->save_us = monotonic_us() - server->metrics->save_started_us;
+    if (server->save_ok) {
+        server->metrics->last_save = time(NULL);
+    }
+}
+#endif
+
+/*
+ * Snapshots one database, or all of them when db_index is -1, without
+ * blocking writers. On POSIX systems the shards are locked only for the
+ * fork; the child writes its copy-on-write view of the dataset and renames
+ * the result into place while the parent keeps serving. Returns 1 when the
+ * save was started, 0 if one is already running and -1 on failure.
+ * Called with db_mutex held.
+ */
+static int server_bgsave(XDBServer* server, int db_index) {
+    int first = db_index < 0 ? 0 : db_index;
+    int last = db_index < 0 ? server->db_count - 1 : db_index;
+    
+    #ifdef _WIN32
+    int64_t start = monotonic_us();
+    int ok = 1;
+    for (int i = first; i <= last; i++) {
+        ok = save_to_file(server->databases[i].store, server->databases[i].db_path) && ok;
+    }
+    server->save_ok = ok;
+    server->metrics->save_us = monotonic_us() - start;
+    if (ok) server->metrics->last_save = time(NULL);
+    return ok ? 1 : -1;
+    #else
+    snapshot_reap(server, WNOHANG);
+    if (server->save_pid > 0) return 0;
+    
+    for (int i = first; i <= last; i++) {
+        lock_all_shards(server->databases[i].store);
+    }
+    
+    int64_t start = monotonic_us();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int ok = 1;
+        for (int i = first; i <= last; i++) {
+            ok = write_snapshot(server->databases[i].store, server->databases[i].db_path, 0) && ok;
+        }
+        _exit(ok ? 0 : 1);
+    }
+    int64_t fork_us = monotonic_us() - start;
+    
+    for (int i = last; i >= first; i--) {
+        unlock_all_shards(server->databases[i].store);
+    }
+    
+    if (pid < 0) return -1;
+    server->save_pid = pid;
+    server->metrics->save_started_us = start;
+    server->metrics->fork_us = fork_us;
+    return 1;
+    #endif
+}
+
+/*
+ * Replication. A primary keeps the RESP-encoded mutation stream in a ring
+ * backlog once the first replica attaches; every byte has a stream offset.
+ * A replica connects with PSYNC <replid> <offset>: if the primary still has
+ * everything after that offset it answers +CONTINUE and streams from there,
+ * otherwise it answers +FULLRESYNC <replid> <offset>, forks, and the child
+ * sends the dataset of every database as SELECTDB/SET commands closed by
+ * SYNCEND, after which the parent streams the backlog from <offset>.
+ * Databases are matched by index, so replicas must be configured with the
+ * same databases as their primary.
+ */
+typedef enum {
+    XDB_REPL_CONNECTING,
+    XDB_REPL_SYNCING,
+    XDB_REPL_CONNECTED
+} XDBReplState;
+
+typedef struct {
+    XDBReplication* repl;
+    int db_index;
+} XDBReplFeed;
+
+/* A replica being served, from its PSYNC request on. */
+typedef struct XDBReplLink {
+    XDBServer* server;
+    socket_t sock;
+    char replid[XDB_REPLID_SIZE + 1];
+    long long offset;
+    struct XDBReplLink* next;
+} XDBReplLink;
+
+struct XDBReplication {
+    mutex_t lock;
+    cond_t cond;
+    char replid[XDB_REPLID_SIZE + 1];
+    
+    /* Primary side; the backlog holds stream bytes [offset - backlog_len, offset). */
+    char* backlog;
+    size_t backlog_len;
+    uint64_t offset;
+    /* Bumped when the stream loses a command; links from an older epoch drop their replica. */
+    uint64_t epoch;
+    int active;
+    int last_db;
+    char* scratch;
+    size_t scratch_cap;
+    XDBReplFeed feeds[MAX_DB_COUNT];
+    XDBReplLink* links;
+    int link_count;
+    int stopping;
+    
+    /* Replica side. */
+    char* master_host;
+    int master_port;
+    int running;
+    thread_t thread;
+    socket_t master_sock;
+    XDBReplState state;
+    uint64_t applied;
+    int db_index;
+};
+
+static int server_is_replica(XDBServer* server) {
+    return server->repl && server->repl->master_host;
+}
+
+static void repl_generate_id(char* out) {
+    unsigned char bytes[XDB_REPLID_SIZE / 2];
+    #ifdef _WIN32
+    int fd = -1;
+    #else
+    int fd = open("/dev/urandom", O_RDONLY);
+    #endif
+    if (fd < 0 || read(fd, bytes, sizeof(bytes)) != (int)sizeof(bytes)) {
+        srand((unsigned)time(NULL) ^ (unsigned)(uintptr_t)out);
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            bytes[i] = (unsigned char)rand();
+        }
+    }
+    if (fd >= 0) close(fd);
+    
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        sprintf(out + i * 2, "%02x", bytes[i]);
+    }
+}
+
+static XDBReplication* repl_create(void) {
+    XDBReplication* repl = (XDBReplication*)calloc(1, sizeof(XDBReplication));
+    if (!repl) return NULL;
+    
+    mutex_init(&repl->lock);
+    cond_init(&repl->cond);
+    repl_generate_id(repl->replid);
+    repl->last_db = -1;
+    repl->master_sock = INVALID_SOCKET;
+    for (int i = 0; i < MAX_DB_COUNT; i++) {
+        repl->feeds[i].repl = repl;
+        repl->feeds[i].db_index = i;
+    }
+    return repl;
+}
+
+static void repl_destroy(XDBReplication* repl) {
+    if (!repl) return;
+    mutex_destroy(&repl->lock);
+    cond_destroy(&repl->cond);
+    free(repl->backlog);
+    free(repl->scratch);
+    free(repl->master_host);
+    free(repl);
+}
+
+/* Copies data into the ring at the current offset. Called with repl->lock held. */
+static void repl_backlog_put(XDBReplication* repl, const char* data, size_t len) {
+    while (len > 0) {
+        size_t pos = (size_t)(repl->offset % XDB_REPL_BACKLOG_SIZE);
+        size_t n = XDB_REPL_BACKLOG_SIZE - pos;
+        if (n > len) n = len;
+        memcpy(repl->backlog + pos, data, n);
+        repl->offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void repl_append_locked(XDBReplication* repl, int argc, const XDBArg* argv) {
+    size_t len = 0;
+    if (!resp_append_command(&repl->scratch, &len, &repl->scratch_cap, argc, argv)) {
+        /*
+         * The stream would have a hole; a new replid refuses partial resyncs
+         * across it and the epoch makes every live link hang up.
+         */
+        repl->backlog_len = 0;
+        repl->epoch++;
+        repl_generate_id(repl->replid);
+        cond_broadcast(&repl->cond);
+        return;
+    }
+    repl_backlog_put(repl, repl->scratch, len);
+    repl->backlog_len += len;
+    if (repl->backlog_len > XDB_REPL_BACKLOG_SIZE) {
+        repl->backlog_len = XDB_REPL_BACKLOG_SIZE;
+    }
+    cond_broadcast(&repl->cond);
+}
+
+/* Replicate hook, called with the shard lock held. */
+static void repl_feed(void* ctx, int argc, const XDBArg* argv) {
+    XDBReplFeed* feed = (XDBReplFeed*)ctx;
+    XDBReplication* repl = feed->repl;
+    
+    mutex_lock(&repl->lock);
+    if (repl->last_db != feed->db_index) {
+        char index[16];
+        XDBArg select[2] = {
+            { (char*)"SELECTDB", 8 },
+            { index, (size_t)sprintf(index, "%d", feed->db_index) }
+        };
+        repl_append_locked(repl, 2, select);
+        repl->last_db = feed->db_index;
+    }
+    repl_append_locked(repl, argc, argv);
+    mutex_unlock(&repl->lock);
+}
+
+/* Keeps idle links alive and lets replicas notice a dead primary. */
+static void repl_ping(XDBReplication* repl) {
+    XDBArg ping[1] = { { (char*)"PING", 4 } };
+    
+    mutex_lock(&repl->lock);
+    if (repl->link_count > 0) {
+        repl_append_locked(repl, 1, ping);
+    }
+    mutex_unlock(&repl->lock);
+}
+
+/* Starts feeding db_index into the stream if replicas are being served. Called with db_mutex held. */
+static void repl_attach(XDBServer* server, int db_index) {
+    XDBReplication* repl = server->repl;
+    if (!repl->active) return;
+    
+    HashTable* ht = server->databases[db_index].store;
+    ht->replicate = repl_feed;
+    ht->replicate_ctx = &repl->feeds[db_index];
+}
+
+static void reply_append(ClientInfo* client, const char* data, size_t len) {
+    XDBReplyChunk* tail = client->reply_tail;
+    
+    if (tail && tail->cap - tail->len >= len) {
+        memcpy(tail->data + tail->len, data, len);
+        tail->len += len;
+        client->reply_bytes += len;
+        return;
+    }
+    
+    size_t cap = len > XDB_REPLY_CHUNK ? len : XDB_REPLY_CHUNK;
+    XDBReplyChunk* chunk = (XDBReplyChunk*)malloc(sizeof(XDBReplyChunk) + cap);
+    if (!chunk) {
+        client->closing = 1;
+        return;
+    }
+    
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->cap = cap;
+    chunk->sent = 0;
+    chunk->pending = 0;
+    memcpy(chunk->data, data, len);
+    
+    if (tail) tail->next = chunk;
+    else client->reply_head = chunk;
+    client->reply_tail = chunk;
+    client->reply_bytes += len;
+}
+
+static void reply_string(ClientInfo* client, const char* str) {
+    reply_append(client, str, strlen(str));
+}
+
+static void reply_printf(ClientInfo* client, const char* format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    
+    if (len < 0) return;
+    if ((size_t)len < sizeof(buf)) {
+        reply_append(client, buf, len);
+        return;
+    }
+    
+    char* big = malloc(len + 1);
+    if (!big) {
+        client->closing = 1;
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(big, len + 1, format, args);
+    va_end(args);
+    reply_append(client, big, len);
+    free(big);
+}
+
+static void reply_bulk(ClientInfo* client, const char* data, size_t len) {
+    reply_printf(client, "$%zu\r\n", len);
+    reply_append(client, data, len);
+    reply_append(client, "\r\n", 2);
+}
+
+static void reply_free(ClientInfo* client) {
+    XDBReplyChunk* chunk = client->reply_head;
+    while (chunk) {
+        XDBReplyChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    client->reply_head = NULL;
+    client->reply_tail = NULL;
+    client->reply_bytes = 0;
+}
+
+/* Writes out every queued reply, one writev per batch of chunks. */
+static void client_flush(ClientInfo* client) {
+    while (client->reply_head && !client->reply_head->pending) {
+        if (client->reply_head->len == 0) {
+            XDBReplyChunk* empty = client->reply_head;
+            client->reply_head = empty->next;
+            if (!client->reply_head) client->reply_tail = NULL;
+            free(empty);
+            continue;
+        }
+        
+        #ifdef _WIN32
+        XDBReplyChunk* chunk = client->reply_head;
+        int sent = send(client->client_sock, chunk->data + chunk->sent, (int)(chunk->len - chunk->sent), 0);
+        if (sent == SOCKET_ERROR) {
+            client->closing = 1;
+            return;
+        }
+        #else
+        struct iovec iov[XDB_MAX_IOV];
+        int iovcnt = 0;
+        for (XDBReplyChunk* chunk = client->reply_head; chunk && !chunk->pending && iovcnt < XDB_MAX_IOV; chunk = chunk->next) {
+            iov[iovcnt].iov_base = chunk->data + chunk->sent;
+            iov[iovcnt].iov_len = chunk->len - chunk->sent;
+            iovcnt++;
+        }
+        
+        ssize_t sent = writev(client->client_sock, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->closing = 1;
+            }
+            return;
+        }
+        #endif
+        
+        client->reply_bytes -= sent;
+        while (sent > 0) {
+            XDBReplyChunk* chunk = client->reply_head;
+            size_t left = chunk->len - chunk->sent;
+            if ((size_t)sent < left) {
+                chunk->sent += sent;
+                break;
+            }
+            sent -= left;
+            client->reply_head = chunk->next;
+            if (!client->reply_head) client->reply_tail = NULL;
+            free(chunk);
+        }
+    }
+}
+
+#ifdef XDB_USE_EPOLL
+/*
+ * Reactors talk to each other through messages. Each reactor's inbox is a
+ * lock-free multi-producer stack drained by its own thread, with an
+ * eventfd to wake it when the stack goes from empty to non-empty.
+ */
+typedef enum {
+    XDB_MSG_REQUEST,
+    XDB_MSG_REPLY,
+    XDB_MSG_PUBSUB
+} XDBMessageKind;
+
+struct XDBMessage {
+    XDBMessage* next;
+    XDBMessageKind kind;
+    ClientInfo* client;
+    XDBReactor* origin;
+    XDBReplyChunk* slot;
+    int db_index;
+    char* data;
+    size_t len;
+    size_t cap;
+    XDBReplyChunk* reply_head;
+    XDBReplyChunk* reply_tail;
+    size_t reply_bytes;
+    struct XDBSubscriber* subscriber;
+};
+
+static void reactor_post(XDBReactor* target, XDBMessage* msg) {
+    XDBMessage* head = __atomic_load_n(&target->inbox, __ATOMIC_RELAXED);
+    do {
+        msg->next = head;
+    } while (!__atomic_compare_exchange_n(&target->inbox, &head, msg, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    
+    if (head == NULL) {
+        uint64_t one = 1;
+        ssize_t n = write(target->event_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+#endif
+
+/*
+ * Pub/sub, on the model of the xevent dispatcher: a registry maps each
+ * channel to its subscribers and PUBLISH fans a message out to all of
+ * them. Publishing never writes to a subscriber's socket. The message is
+ * encoded once and copied into each subscriber's outbox, and the reactor
+ * owning the connection is woken to move the outbox onto the reply list
+ * and flush it. A subscriber whose backlog passes XDB_PUBSUB_HARD_LIMIT,
+ * or stays over XDB_PUBSUB_SOFT_LIMIT for XDB_PUBSUB_SOFT_SECONDS, is
+ * disconnected instead of buffering without bound.
+ */
+typedef struct XDBChannel {
+    struct XDBChannel* next;
+    uint64_t hash;
+    struct XDBSubscriber** subscribers;
+    size_t count;
+    size_t cap;
+    size_t name_len;
+    char name[];
+} XDBChannel;
+
+/* Shared by publishers and the owning thread; channels and client are only touched by the owner. */
+typedef struct XDBSubscriber {
+    mutex_t lock;
+    int refs;
+    ClientInfo* client;
+    void* reactor;
+    XDBReplyChunk* head;
+    XDBReplyChunk* tail;
+    size_t bytes;
+    int notified;
+    int overflow;
+    time_t soft_since;
+    XDBChannel** channels;
+    size_t channel_count;
+    size_t channel_cap;
+    #ifdef XDB_USE_EPOLL
+    XDBMessage wakeup;
+    #endif
+} XDBSubscriber;
+
+struct XDBPubSub {
+    mutex_t lock;
+    XDBChannel** buckets;
+    size_t bucket_count;
+    size_t channel_count;
+};
+
+static XDBPubSub* pubsub_create(void) {
+    XDBPubSub* ps = (XDBPubSub*)calloc(1, sizeof(XDBPubSub));
+    if (!ps) return NULL;
+    
+    ps->bucket_count = XDB_TABLE_MIN_SLOTS;
+    ps->buckets = (XDBChannel**)calloc(ps->bucket_count, sizeof(XDBChannel*));
+    if (!ps->buckets) {
+        free(ps);
+        return NULL;
+    }
+    mutex_init(&ps->lock);
+    return ps;
+}
+
+static void pubsub_destroy(XDBPubSub* ps) {
+    if (!ps) return;
+    for (size_t i = 0; i < ps->bucket_count; i++) {
+        XDBChannel* channel = ps->buckets[i];
+        while (channel) {
+            XDBChannel* next = channel->next;
+            free(channel->subscribers);
+            free(channel);
+            channel = next;
+        }
+    }
+    free(ps->buckets);
+    mutex_destroy(&ps->lock);
+    free(ps);
+}
+
+/* Returns the link holding the channel, or the empty link at the end of its chain. */
+static XDBChannel** pubsub_slot(XDBPubSub* ps, const char* name, size_t len, uint64_t hash) {
+    XDBChannel** link = &ps->buckets[hash & (ps->bucket_count - 1)];
+    while (*link && ((*link)->hash != hash || (*link)->name_len != len || memcmp((*link)->name, name, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/* Doubles the buckets; if that fails the chains just get longer. */
+static void pubsub_grow(XDBPubSub* ps) {
+    size_t count = ps->bucket_count * 2;
+    XDBChannel** buckets = (XDBChannel**)calloc(count, sizeof(XDBChannel*));
+    if (!buckets) return;
+    
+    for (size_t i = 0; i < ps->bucket_count; i++) {
+        XDBChannel* channel = ps->buckets[i];
+        while (channel) {
+            XDBChannel* next = channel->next;
+            channel->next = buckets[channel->hash & (count - 1)];
+            buckets[channel->hash & (count - 1)] = channel;
+            channel = next;
+        }
+    }
+    free(ps->buckets);
+    ps->buckets = buckets;
+    ps->bucket_count = count;
+}
+
+/* Returns the array of pointers doubled in capacity, or NULL leaving it untouched. */
+static void* pointers_grow(void* items, size_t* cap) {
+    size_t next = *cap ? *cap * 2 : 4;
+    void* grown = realloc(items, next * sizeof(void*));
+    if (grown) *cap = next;
+    return grown;
+}
+
+/* Adds sub to the channel and returns its subscription count, or -1 when out of memory. */
+static int pubsub_subscribe(XDBPubSub* ps, XDBSubscriber* sub, const char* name, size_t len) {
+    uint64_t hash = hash_function(name, len);
+    int result = -1;
+    
+    mutex_lock(&ps->lock);
+    XDBChannel** link = pubsub_slot(ps, name, len, hash);
+    XDBChannel* channel = *link;
+    for (size_t i = 0; channel && i < channel->count; i++) {
+        if (channel->subscribers[i] == sub) {
+            result = (int)sub->channel_count;
+            goto done;
+        }
+    }
+    
+    if (sub->channel_count == sub->channel_cap) {
+        XDBChannel** grown = (XDBChannel**)pointers_grow(sub->channels, &sub->channel_cap);
+        if (!grown) goto done;
+        sub->channels = grown;
+    }
+    if (!channel) {
+        channel = (XDBChannel*)calloc(1, sizeof(XDBChannel) + len + 1);
+        if (!channel) goto done;
+        channel->hash = hash;
+        channel->name_len = len;
+        memcpy(channel->name, name, len);
+        *link = channel;
+        ps->channel_count++;
+    }
+    if (channel->count == channel->cap) {
+        XDBSubscriber** grown = (XDBSubscriber**)pointers_grow(channel->subscribers, &channel->cap);
+        if (!grown) {
+            if (channel->count == 0) {
+                *link = channel->next;
+                free(channel);
+                ps->channel_count--;
+            }
+            goto done;
+        }
+        channel->subscribers = grown;
+    }
+    
+    channel->subscribers[channel->count++] = sub;
+    sub->channels[sub->channel_count++] = channel;
+    result = (int)sub->channel_count;
+    if (ps->channel_count > ps->bucket_count) {
+        pubsub_grow(ps);
+    }
+    
+done:
+    mutex_unlock(&ps->lock);
+    return result;
+}
+
+/* Removes sub from the channel at link, freeing the channel once nobody listens. Called with ps->lock held. */
+static void pubsub_detach(XDBPubSub* ps, XDBChannel** link, XDBSubscriber* sub) {
+    XDBChannel* channel = *link;
+    for (size_t i = 0; i < channel->count; i++) {
+        if (channel->subscribers[i] == sub) {
+            channel->subscribers[i] = channel->subscribers[--channel->count];
+            break;
+        }
+    }
+    for (size_t i = 0; i < sub->channel_count; i++) {
+        if (sub->channels[i] == channel) {
+            sub->channels[i] = sub->channels[--sub->channel_count];
+            break;
+        }
+    }
+    
+    if (channel->count == 0) {
+        *link = channel->next;
+        free(channel->subscribers);
+        free(channel);
+        ps->channel_count--;
+    }
+}
+
+/* Returns how many channels sub is left subscribed to. */
+static int pubsub_unsubscribe(XDBPubSub* ps, XDBSubscriber* sub, const char* name, size_t len) {
+    mutex_lock(&ps->lock);
+    XDBChannel** link = pubsub_slot(ps, name, len, hash_function(name, len));
+    if (*link) {
+        pubsub_detach(ps, link, sub);
+    }
+    int count = (int)sub->channel_count;
+    mutex_unlock(&ps->lock);
+    return count;
+}
+
+static void reply_subscription(ClientInfo* client, const char* kind, const char* name, size_t len, int count) {
+    reply_printf(client, "*3\r\n$%zu\r\n%s\r\n", strlen(kind), kind);
+    if (name) reply_bulk(client, name, len);
+    else reply_string(client, "$-1\r\n");
+    reply_printf(client, ":%d\r\n", count);
+}
+
+/* Leaves every channel, confirming each one to client unless it is NULL. */
+static void pubsub_unsubscribe_all(XDBPubSub* ps, XDBSubscriber* sub, ClientInfo* client) {
+    mutex_lock(&ps->lock);
+    while (sub->channel_count > 0) {
+        XDBChannel* channel = sub->channels[sub->channel_count - 1];
+        if (client) {
+            reply_subscription(client, "unsubscribe", channel->name, channel->name_len, (int)sub->channel_count - 1);
+        }
+        pubsub_detach(ps, pubsub_slot(ps, channel->name, channel->name_len, channel->hash), sub);
+    }
+    mutex_unlock(&ps->lock);
+}
+
+static void subscriber_release(XDBSubscriber* sub) {
+    if (xdb_atomic_dec32(&sub->refs) != 0) return;
+    
+    XDBReplyChunk* chunk = sub->head;
+    while (chunk) {
+        XDBReplyChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(sub->channels);
+    mutex_destroy(&sub->lock);
+    free(sub);
+}
+
+#ifndef XDB_USE_EPOLL
+/*
+ * Thread-per-client connections wake up this often to pick up published
+ * messages, and a subscriber that stops reading holds its thread up no
+ * longer than that before the output limits are checked.
+ */
+static void socket_set_poll_timeout(socket_t sock) {
+    #ifdef _WIN32
+    DWORD timeout = XDB_PUBSUB_POLL_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+    #else
+    struct timeval timeout = { 0, XDB_PUBSUB_POLL_MS * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    #endif
+}
+
+static int socket_timed_out(void) {
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+    #else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+    #endif
+}
+#endif
+
+static XDBSubscriber* client_subscriber(ClientInfo* client) {
+    if (client->subscriber) return (XDBSubscriber*)client->subscriber;
+    
+    XDBSubscriber* sub = (XDBSubscriber*)calloc(1, sizeof(XDBSubscriber));
+    if (!sub) return NULL;
+    mutex_init(&sub->lock);
+    sub->refs = 1;
+    sub->client = client;
+    sub->reactor = client->reactor;
+    #ifdef XDB_USE_EPOLL
+    sub->wakeup.kind = XDB_MSG_PUBSUB;
+    sub->wakeup.subscriber = sub;
+    #else
+    socket_set_poll_timeout(client->client_sock);
+    #endif
+    client->subscriber = sub;
+    return sub;
+}
+
+static size_t pubsub_channel_count(XDBPubSub* ps) {
+    mutex_lock(&ps->lock);
+    size_t count = ps->channel_count;
+    mutex_unlock(&ps->lock);
+    return count;
+}
+
+static int client_subscribed(ClientInfo* client) {
+    return client->subscriber && ((XDBSubscriber*)client->subscriber)->channel_count > 0;
+}
+
+/* Copies frame into the outbox; returns 1 if the owner has to be woken for it. */
+static int subscriber_push(XDBSubscriber* sub, const char* frame, size_t len) {
+    mutex_lock(&sub->lock);
+    if (!sub->overflow && sub->bytes + len > XDB_PUBSUB_HARD_LIMIT) {
+        sub->overflow = 1;
+    } else if (!sub->overflow) {
+        XDBReplyChunk* tail = sub->tail;
+        if (tail && tail->cap - tail->len >= len) {
+            memcpy(tail->data + tail->len, frame, len);
+            tail->len += len;
+            sub->bytes += len;
+        } else {
+            size_t cap = len > XDB_REPLY_CHUNK ? len : XDB_REPLY_CHUNK;
+            XDBReplyChunk* chunk = (XDBReplyChunk*)malloc(sizeof(XDBReplyChunk) + cap);
+            if (chunk) {
+                chunk->next = NULL;
+                chunk->len = len;
+                chunk->cap = cap;
+                chunk->sent = 0;
+                chunk->pending = 0;
+                memcpy(chunk->data, frame, len);
+                if (tail) tail->next = chunk;
+                else sub->head = chunk;
+                sub->tail = chunk;
+                sub->bytes += len;
+            } else {
+                sub->overflow = 1;
+            }
+        }
+    }
+    
+    int wake = !sub->notified;
+    sub->notified = 1;
+    mutex_unlock(&sub->lock);
+    return wake;
+}
+
+/* Hands the subscriber to its reactor; the embedded message carries a reference until delivered. */
+static void subscriber_wake(XDBSubscriber* sub) {
+    #ifdef XDB_USE_EPOLL
+    if (!sub->reactor) return;
+    xdb_atomic_inc32(&sub->refs);
+    reactor_post((XDBReactor*)sub->reactor, &sub->wakeup);
+    #else
+    (void)sub;
+    #endif
+}
+
+/* Queues the message for every subscriber of channel and returns how many there were, or -1. */
+static int pubsub_publish(XDBPubSub* ps, const char* channel, size_t channel_len, const char* message, size_t len) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "*3\r\n$7\r\nmessage\r\n$%zu\r\n", channel_len);
+    char trailer[32];
+    int trailer_len = snprintf(trailer, sizeof(trailer), "\r\n$%zu\r\n", len);
+    
+    size_t frame_len = header_len + channel_len + trailer_len + len + 2;
+    char* frame = (char*)malloc(frame_len);
+    if (!frame) return -1;
+    char* p = frame;
+    memcpy(p, header, header_len);
+    p += header_len;
+    memcpy(p, channel, channel_len);
+    p += channel_len;
+    memcpy(p, trailer, trailer_len);
+    p += trailer_len;
+    memcpy(p, message, len);
+    memcpy(p + len, "\r\n", 2);
+    
+    int receivers = 0;
+    mutex_lock(&ps->lock);
+    XDBChannel* target = *pubsub_slot(ps, channel, channel_len, hash_function(channel, channel_len));
+    if (target) {
+        for (size_t i = 0; i < target->count; i++) {
+            if (subscriber_push(target->subscribers[i], frame, frame_len)) {
+                subscriber_wake(target->subscribers[i]);
+            }
+        }
+        receivers = (int)target->count;
+    }
+    mutex_unlock(&ps->lock);
+    
+    free(frame);
+    return receivers;
+}
+
+/*
+ * Flushes the client's replies together with any published messages
+ * waiting in its outbox, then applies the output limits. Runs on the
+ * thread owning the connection.
+ */
+static void client_deliver(ClientInfo* client) {
+    XDBSubscriber* sub = (XDBSubscriber*)client->subscriber;
+    if (!sub) {
+        client_flush(client);
+        return;
+    }
+    
+    mutex_lock(&sub->lock);
+    if (sub->head) {
+        if (client->reply_tail) client->reply_tail->next = sub->head;
+        else client->reply_head = sub->head;
+        client->reply_tail = sub->tail;
+        client->reply_bytes += sub->bytes;
+        sub->head = NULL;
+        sub->tail = NULL;
+        sub->bytes = 0;
+    }
+    int overflow = sub->overflow;
+    sub->notified = 0;
+    mutex_unlock(&sub->lock);
+    
+    client_flush(client);
+    
+    if (overflow || client->reply_bytes > XDB_PUBSUB_HARD_LIMIT) {
+        client->closing = 1;
+    } else if (client->reply_bytes > XDB_PUBSUB_SOFT_LIMIT) {
+        time_t now = time(NULL);
+        if (!sub->soft_since) sub->soft_since = now;
+        else if (now - sub->soft_since >= XDB_PUBSUB_SOFT_SECONDS) client->closing = 1;
+    } else {
+        sub->soft_since = 0;
+    }
+}
+
+/* Called as the connection goes away; queued messages are freed with the last reference. */
+static void pubsub_drop_client(XDBPubSub* ps, ClientInfo* client) {
+    XDBSubscriber* sub = (XDBSubscriber*)client->subscriber;
+    if (!sub) return;
+    
+    pubsub_unsubscribe_all(ps, sub, NULL);
+    sub->client = NULL;
+    client->subscriber = NULL;
+    subscriber_release(sub);
+}
+
+/*
+ * Parses one newline terminated inline command from data. Tokens are
+ * NUL-terminated in place and referenced from args without copying.
+ * Returns the number of bytes consumed, 0 if the command is incomplete
+ * and -1 on a protocol error.
+ */
+static long parse_inline_command(char* data, size_t len, XDBArgv* args) {
+    char* newline = memchr(data, '\n', len);
+    if (!newline) return 0;
+    
+    char* end = newline;
+    if (end > data && end[-1] == '\r') end--;
+    *end = '\0';
+    
+    args->count = 0;
+    char* p = data;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        
+        char* token = p;
+        while (p < end && *p != ' ' && *p != '\t') p++;
+        *p = '\0';
+        if (!argv_push(args, token, p - token)) return -1;
+        p++;
+    }
+    
+    return (newline - data) + 1;
+}
+
+/* Parses a [set] after its opening bracket: ranges, ^ negation and escapes. Advances *pi past the ]. */
+static int glob_class(const char* p, size_t plen, size_t* pi, unsigned char ch) {
+    size_t i = *pi;
+    int negate = i < plen && p[i] == '^';
+    if (negate) i++;
+    
+    int matched = 0;
+    while (i < plen && p[i] != ']') {
+        unsigned char lo = (unsigned char)p[i];
+        if (lo == '\\' && i + 1 < plen) lo = (unsigned char)p[++i];
+        if (i + 2 < plen && p[i + 1] == '-' && p[i + 2] != ']') {
+            unsigned char hi = (unsigned char)p[i + 2];
+            if (hi == '\\' && i + 3 < plen) hi = (unsigned char)p[++i + 2];
+            i += 2;
+            if (lo > hi) {
+                unsigned char t = lo;
+                lo = hi;
+                hi = t;
+            }
+            if (ch >= lo && ch <= hi) matched = 1;
+        } else if (ch == lo) {
+            matched = 1;
+        }
+        i++;
+    }
+    *pi = i < plen ? i + 1 : i;
+    return matched != negate;
+}
+
+/*
+ * Glob match of s against p: *, ?, [set] and backslash escapes. A star
+ * remembers where to resume, so mismatches backtrack linearly instead of
+ * recursing.
+ */
+static int glob_match(const char* p, size_t plen, const char* s, size_t slen) {
+    size_t pi = 0;
+    size_t si = 0;
+    size_t star = (size_t)-1;
+    size_t resume = 0;
+    
+    while (si < slen) {
+        if (pi < plen && p[pi] == '*') {
+            star = ++pi;
+            resume = si;
+            continue;
+        }
+        if (pi < plen) {
+            size_t next = pi + 1;
+            int ok;
+            if (p[pi] == '?') {
+                ok = 1;
+            } else if (p[pi] == '[') {
+                ok = glob_class(p, plen, &next, (unsigned char)s[si]);
+            } else if (p[pi] == '\\' && pi + 1 < plen) {
+                next = pi + 2;
+                ok = p[pi + 1] == s[si];
+            } else {
+                ok = p[pi] == s[si];
+            }
+            if (ok) {
+                pi = next;
+                si++;
+                continue;
+            }
+        }
+        if (star == (size_t)-1) return 0;
+        pi = star;
+        si = ++resume;
+    }
+    
+    while (pi < plen && p[pi] == '*') pi++;
+    return pi == plen;
+}
+
+static Database* client_db(XDBServer* server, ClientInfo* client) {
+    if (client->current_db_index >= server->db_count) return NULL;
+    return &server->databases[client->current_db_index];
+}
+
+/* SET key value [seconds | EX seconds | EXAT unix-time] */
+static void cmd_set(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    XDBArg* key = &args->items[1];
+    XDBArg* value = &args->items[2];
+    time_t expiry = 0;
+    
+    if (args->count > 4 && (strcasecmp(args->items[3].ptr, "EX") == 0 || strcasecmp(args->items[3].ptr, "EXAT") == 0)) {
+        int64_t when;
+        time_t now = time(NULL);
+        int relative = strcasecmp(args->items[3].ptr, "EX") == 0;
+        if (!parse_int64(args->items[4].ptr, args->items[4].len, &when) || when <= 0 ||
+            (relative && when > INT64_MAX - now)) {
+            reply_string(client, "-ERR invalid expire time in 'set' command\r\n");
+            return;
+        }
+        expiry = relative ? now + when : (time_t)when;
+    } else if (args->count > 3) {
+        int expire_seconds = atoi(args->items[3].ptr);
+        expiry = expire_seconds > 0 ? time(NULL) + expire_seconds : 0;
+    }
+    
+    Database* db = client_db(server, client);
+    if (db && set_key_at(db->store, key->ptr, key->len, value->ptr, value->len, expiry)) {
+        reply_string(client, "+OK\r\n");
+    } else {
+        reply_string(client, "-ERR failed to set key\r\n");
+    }
+}
+
+static void reply_wrongtype(ClientInfo* client) {
+    reply_string(client, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+}
+
+static void reply_bulk_value(const char* value, size_t len, void* ctx) {
+    reply_bulk((ClientInfo*)ctx, value, len);
+}
+
+static void cmd_get(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    XDBArg* key = &args->items[1];
+    
+    Database* db = client_db(server, client);
+    int status = db ? get_key_with(db->store, key->ptr, key->len, reply_bulk_value, client) : 0;
+    if (status == XDB_ERR_WRONGTYPE) {
+        reply_wrongtype(client);
+    } else if (!status) {
+        reply_string(client, "$-1\r\n");
+        stats_keyspace(client, 0, 1);
+    } else {
+        stats_keyspace(client, 1, 0);
+    }
+}
+
+/* DEL/MDEL key [key ...] */
+static void cmd_del(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    Database* db = client_db(server, client);
+    size_t deleted = 0;
+    if (db && args->count == 2) {
+        deleted = delete_key(db->store, args->items[1].ptr, args->items[1].len);
+    } else if (db) {
+        deleted = delete_keys(db->store, args->count - 1, args->items + 1);
+    }
+    reply_printf(client, ":%zu\r\n", deleted);
+}
+
+/* MSET key value [key value ...] */
+static void cmd_mset(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    if (args->count % 2 == 0) {
+        reply_string(client, "-ERR wrong number of arguments for MSET\r\n");
+        return;
+    }
+    
+    size_t pairs = (args->count - 1) / 2;
+    Database* db = client_db(server, client);
+    if (db && set_keys(db->store, pairs, args->items + 1, 0) == pairs) {
+        reply_string(client, "+OK\r\n");
+    } else {
+        reply_string(client, "-ERR failed to set keys\r\n");
+    }
+}
+
+typedef struct {
+    ClientInfo* client;
+    size_t count;
+} MultiReply;
+
+static void reply_multi_value(size_t index, const char* value, size_t len, void* ctx) {
+    MultiReply* reply = (MultiReply*)ctx;
+    if (index == 0) {
+        reply_printf(reply->client, "*%zu\r\n", reply->count);
+    }
+    if (value) {
+        reply_bulk(reply->client, value, len);
+    } else {
+        reply_string(reply->client, "$-1\r\n");
+    }
+}
+
+/* MGET key [key ...] */
+static void cmd_mget(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    MultiReply reply = { client, (size_t)args->count - 1 };
+    Database* db = client_db(server, client);
+    if (!db) {
+        reply_string(client, "-ERR invalid database\r\n");
+    } else {
+        long hits = get_keys_with(db->store, reply.count, args->items + 1, reply_multi_value, &reply);
+        if (hits < 0) {
+            reply_string(client, "-ERR out of memory\r\n");
+        } else {
+            stats_keyspace(client, (uint64_t)hits, reply.count - (uint64_t)hits);
+        }
+    }
+}
+
+static void reply_incr(XDBServer* server, ClientInfo* client, XDBArg* key, int64_t delta) {
+    Database* db = client_db(server, client);
+    int64_t result = 0;
+    int status = db ? incr_key(db->store, key->ptr, key->len, delta, &result) : XDB_ERR_NOMEM;
+    if (status > 0) {
+        reply_printf(client, ":%lld\r\n", (long long)result);
+    } else if (status == 0) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+    } else if (status == -1) {
+        reply_string(client, "-ERR increment or decrement would overflow\r\n");
+    } else if (status == XDB_ERR_WRONGTYPE) {
+        reply_wrongtype(client);
+    } else {
+        reply_string(client, "-ERR failed to set key\r\n");
+    }
+}
+
+static void cmd_incr(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_incr(server, client, &args->items[1], 1);
+}
+
+static void cmd_decr(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_incr(server, client, &args->items[1], -1);
+}
+
+static void cmd_incrby(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int64_t delta;
+    if (!parse_int64(args->items[2].ptr, args->items[2].len, &delta)) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    reply_incr(server, client, &args->items[1], delta);
+}
+
+static void cmd_decrby(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int64_t delta;
+    if (!parse_int64(args->items[2].ptr, args->items[2].len, &delta) || delta == INT64_MIN) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    reply_incr(server, client, &args->items[1], -delta);
+}
+
+/* INCRBYFLOAT key delta */
+static void cmd_incrbyfloat(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    double delta;
+    if (!parse_double(args->items[2].ptr, args->items[2].len, &delta)) {
+        reply_string(client, "-ERR value is not a valid float\r\n");
+        return;
+    }
+    
+    Database* db = client_db(server, client);
+    double result = 0;
+    int status = db ? incr_key_float(db->store, args->items[1].ptr, args->items[1].len, delta, &result) : XDB_ERR_NOMEM;
+    if (status > 0) {
+        char number[XDB_NUMBER_MAX];
+        reply_bulk(client, number, format_double(result, number));
+    } else if (status == 0) {
+        reply_string(client, "-ERR value is not a valid float\r\n");
+    } else if (status == -1) {
+        reply_string(client, "-ERR increment would produce NaN or Infinity\r\n");
+    } else if (status == XDB_ERR_WRONGTYPE) {
+        reply_wrongtype(client);
+    } else {
+        reply_string(client, "-ERR failed to set key\r\n");
+    }
+}
+
+/* Replies with a collection update's count, or the error it failed with. */
+static void reply_object_count(ClientInfo* client, long result) {
+    if (result >= 0) {
+        reply_printf(client, ":%ld\r\n", result);
+    } else if (result == XDB_ERR_WRONGTYPE) {
+        reply_wrongtype(client);
+    } else {
+        reply_string(client, "-ERR out of memory\r\n");
+    }
+}
+
+typedef struct {
+    ClientInfo* client;
+    XDBArgv* args;
+    long start;
+    long stop;
+    int reverse;
+    int withscores;
+} ObjectQuery;
+
+/*
+ * Runs a read-only collection command: fn replies while the shard is
+ * locked. A missing key gets the missing reply, if any. Returns the
+ * read_object status.
+ */
+static int reply_object_query(XDBServer* server, ObjectQuery* query, XDBValueType type,
+                              xdb_object_read_f fn, const char* missing) {
+    XDBArg* key = &query->args->items[1];
+    Database* db = client_db(server, query->client);
+    if (!db) {
+        reply_string(query->client, "-ERR invalid database\r\n");
+        return XDB_ERR_NOMEM;
+    }
+    
+    int status = read_object(db->store, key->ptr, key->len, type, fn, query);
+    if (status == XDB_ERR_WRONGTYPE) {
+        reply_wrongtype(query->client);
+    } else if (status == 0 && missing) {
+        reply_string(query->client, missing);
+    }
+    stats_keyspace(query->client, status > 0, status == 0);
+    return status;
+}
+
+static int parse_index(ClientInfo* client, const XDBArg* arg, long* out) {
+    int64_t value;
+    if (!parse_int64(arg->ptr, arg->len, &value) || value < LONG_MIN || value > LONG_MAX) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return 0;
+    }
+    *out = (long)value;
+    return 1;
+}
+
+static void query_count(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    reply_printf(query->client, ":%zu\r\n", object_count(obj));
+}
+
+static void reply_push(XDBServer* server, ClientInfo* client, XDBArgv* args, int head) {
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    long result = db ? list_push_key(db->store, key->ptr, key->len, head, args->count - 2, args->items + 2)
+                     : XDB_ERR_NOMEM;
+    reply_object_count(client, result);
+}
+
+/* LPUSH key element [element ...] */
+static void cmd_lpush(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_push(server, client, args, 1);
+}
+
+static void cmd_rpush(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_push(server, client, args, 0);
+}
+
+static void reply_pop(XDBServer* server, ClientInfo* client, XDBArgv* args, int head) {
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    long result = db ? list_pop_key(db->store, key->ptr, key->len, head, reply_bulk_value, client) : 0;
+    if (result == 0) {
+        reply_string(client, "$-1\r\n");
+    } else if (result < 0) {
+        reply_object_count(client, result);
+    }
+}
+
+static void cmd_lpop(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_pop(server, client, args, 1);
+}
+
+static void cmd_rpop(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_pop(server, client, args, 0);
+}
+
+static void cmd_llen(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_LIST, query_count, ":0\r\n");
+}
+
+static void query_list_range(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    size_t from, to;
+    if (!normalize_range(query->start, query->stop, obj->list.count, &from, &to)) {
+        reply_string(query->client, "*0\r\n");
+        return;
+    }
+    reply_printf(query->client, "*%zu\r\n", to - from + 1);
+    list_range(&obj->list, from, to, reply_bulk_value, query->client);
+}
+
+/* LRANGE key start stop; negative indexes count from the tail. */
+static void cmd_lrange(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    if (!parse_index(client, &args->items[2], &query.start) || !parse_index(client, &args->items[3], &query.stop)) {
+        return;
+    }
+    reply_object_query(server, &query, XDB_TYPE_LIST, query_list_range, "*0\r\n");
+}
+
+static void query_list_index(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    size_t from, to;
+    if (query->start == -1 - (long)obj->list.count ||
+        !normalize_range(query->start, query->start, obj->list.count, &from, &to)) {
+        reply_string(query->client, "$-1\r\n");
+        return;
+    }
+    list_range(&obj->list, from, from, reply_bulk_value, query->client);
+}
+
+static void cmd_lindex(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    if (!parse_index(client, &args->items[2], &query.start)) return;
+    reply_object_query(server, &query, XDB_TYPE_LIST, query_list_index, "$-1\r\n");
+}
+
+/* LTRIM key start stop */
+static void cmd_ltrim(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    long start, stop;
+    if (!parse_index(client, &args->items[2], &start) || !parse_index(client, &args->items[3], &stop)) return;
+    
+    Database* db = client_db(server, client);
+    long result = db ? list_trim_key(db->store, args->items[1].ptr, args->items[1].len, start, stop) : 0;
+    if (result < 0) {
+        reply_object_count(client, result);
+    } else {
+        reply_string(client, "+OK\r\n");
+    }
+}
+
+/* HSET key field value [field value ...] */
+static void cmd_hset(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    if (args->count % 2 != 0) {
+        reply_string(client, "-ERR wrong number of arguments for HSET\r\n");
+        return;
+    }
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    reply_object_count(client, db ? hash_set_key(db->store, key->ptr, key->len, (size_t)(args->count - 2) / 2,
+                                                 args->items + 2) : XDB_ERR_NOMEM);
+}
+
+static void reply_hash_field(ClientInfo* client, const XDBObject* obj, const XDBArg* field) {
+    const char* value;
+    size_t len;
+    if (hash_get(obj, field->ptr, field->len, &value, &len)) {
+        reply_bulk(client, value, len);
+    } else {
+        reply_string(client, "$-1\r\n");
+    }
+}
+
+static void query_hash_get(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    reply_hash_field(query->client, obj, &query->args->items[2]);
+}
+
+static void cmd_hget(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_HASH, query_hash_get, "$-1\r\n");
+}
+
+static void query_hash_mget(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    reply_printf(query->client, "*%d\r\n", query->args->count - 2);
+    for (int i = 2; i < query->args->count; i++) {
+        reply_hash_field(query->client, obj, &query->args->items[i]);
+    }
+}
+
+/* HMGET key field [field ...] */
+static void cmd_hmget(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    if (reply_object_query(server, &query, XDB_TYPE_HASH, query_hash_mget, NULL) == 0) {
+        reply_printf(client, "*%d\r\n", args->count - 2);
+        for (int i = 2; i < args->count; i++) {
+            reply_string(client, "$-1\r\n");
+        }
+    }
+}
+
+/* HDEL key field [field ...] */
+static void cmd_hdel(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    reply_object_count(client, db ? hash_delete_key(db->store, key->ptr, key->len, args->count - 2, args->items + 2) : 0);
+}
+
+static void cmd_hlen(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_HASH, query_count, ":0\r\n");
+}
+
+static void query_hash_exists(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    const char* value;
+    size_t len;
+    const XDBArg* field = &query->args->items[2];
+    reply_string(query->client, hash_get(obj, field->ptr, field->len, &value, &len) ? ":1\r\n" : ":0\r\n");
+}
+
+static void cmd_hexists(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_HASH, query_hash_exists, ":0\r\n");
+}
+
+static void query_hash_all(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    reply_printf(query->client, "*%zu\r\n", object_count(obj) * 2);
+    object_each(obj, XDB_TYPE_HASH, reply_bulk_value, query->client);
+}
+
+static void cmd_hgetall(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_HASH, query_hash_all, "*0\r\n");
+}
+
+/* HINCRBY key field delta */
+static void cmd_hincrby(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int64_t delta;
+    if (!parse_int64(args->items[3].ptr, args->items[3].len, &delta)) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    
+    Database* db = client_db(server, client);
+    int64_t result = 0;
+    int status = db ? hash_incr_key(db->store, args->items[1].ptr, args->items[1].len,
+                                    args->items[2].ptr, args->items[2].len, delta, &result) : XDB_ERR_NOMEM;
+    if (status > 0) {
+        reply_printf(client, ":%lld\r\n", (long long)result);
+    } else if (status == 0) {
+        reply_string(client, "-ERR hash value is not an integer\r\n");
+    } else if (status == -1) {
+        reply_string(client, "-ERR increment or decrement would overflow\r\n");
+    } else {
+        reply_object_count(client, status);
+    }
+}
+
+/* ZADD key score member [score member ...] */
+static void cmd_zadd(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    if (args->count % 2 != 0) {
+        reply_string(client, "-ERR wrong number of arguments for ZADD\r\n");
+        return;
+    }
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    long result = db ? zset_add_key(db->store, key->ptr, key->len, (size_t)(args->count - 2) / 2, args->items + 2)
+                     : XDB_ERR_NOMEM;
+    if (result == -1) {
+        reply_string(client, "-ERR value is not a valid float\r\n");
+    } else {
+        reply_object_count(client, result);
+    }
+}
+
+static void reply_score(ClientInfo* client, double score) {
+    char number[XDB_NUMBER_MAX];
+    reply_bulk(client, number, format_double(score, number));
+}
+
+/* ZINCRBY key delta member */
+static void cmd_zincrby(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    double delta;
+    if (!parse_double(args->items[2].ptr, args->items[2].len, &delta)) {
+        reply_string(client, "-ERR value is not a valid float\r\n");
+        return;
+    }
+    
+    Database* db = client_db(server, client);
+    double result = 0;
+    int status = db ? zset_incr_key(db->store, args->items[1].ptr, args->items[1].len,
+                                    args->items[3].ptr, args->items[3].len, delta, &result) : XDB_ERR_NOMEM;
+    if (status > 0) {
+        reply_score(client, result);
+    } else if (status == -1) {
+        reply_string(client, "-ERR resulting score is not a number (NaN)\r\n");
+    } else {
+        reply_object_count(client, status);
+    }
+}
+
+static void query_zset_score(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    const XDBArg* member = &query->args->items[2];
+    double score;
+    if (zset_score(obj, member->ptr, member->len, &score)) {
+        reply_score(query->client, score);
+    } else {
+        reply_string(query->client, "$-1\r\n");
+    }
+}
+
+static void cmd_zscore(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_ZSET, query_zset_score, "$-1\r\n");
+}
+
+/* ZREM key member [member ...] */
+static void cmd_zrem(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    Database* db = client_db(server, client);
+    XDBArg* key = &args->items[1];
+    reply_object_count(client, db ? zset_remove_key(db->store, key->ptr, key->len, args->count - 2, args->items + 2) : 0);
+}
+
+static void cmd_zcard(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_ZSET, query_count, ":0\r\n");
+}
+
+static void query_zset_rank(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    const XDBArg* member = &query->args->items[2];
+    long rank = zset_rank(obj, member->ptr, member->len, query->reverse);
+    if (rank >= 0) {
+        reply_printf(query->client, ":%ld\r\n", rank);
+    } else {
+        reply_string(query->client, "$-1\r\n");
+    }
+}
+
+static void cmd_zrank(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 0, 0 };
+    reply_object_query(server, &query, XDB_TYPE_ZSET, query_zset_rank, "$-1\r\n");
+}
+
+static void cmd_zrevrank(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    ObjectQuery query = { client, args, 0, 0, 1, 0 };
+    reply_object_query(server, &query, XDB_TYPE_ZSET, query_zset_rank, "$-1\r\n");
+}
+
+static void reply_range_member(const char* member, size_t len, double score, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    reply_bulk(query->client, member, len);
+    if (query->withscores) {
+        reply_score(query->client, score);
+    }
+}
+
+static void query_zset_range(const XDBObject* obj, void* ctx) {
+    ObjectQuery* query = (ObjectQuery*)ctx;
+    size_t from, to;
+    if (!normalize_range(query->start, query->stop, object_count(obj), &from, &to)) {
+        reply_string(query->client, "*0\r\n");
+        return;
+    }
+    reply_printf(query->client, "*%zu\r\n", (to - from + 1) * (query->withscores ? 2 : 1));
+    zset_range(obj, from, to, query->reverse, reply_range_member, query);
+}
+
+/* ZRANGE/ZREVRANGE key start stop [WITHSCORES] */
+static void reply_zset_range(XDBServer* server, ClientInfo* client, XDBArgv* args, int reverse) {
+    ObjectQuery query = { client, args, 0, 0, reverse, 0 };
+    if (args->count > 5 || (args->count == 5 && strcasecmp(args->items[4].ptr, "WITHSCORES") != 0)) {
+        reply_string(client, "-ERR syntax error\r\n");
+        return;
+    }
+    if (!parse_index(client, &args->items[2], &query.start) || !parse_index(client, &args->items[3], &query.stop)) {
+        return;
+    }
+    query.withscores = args->count == 5;
+    reply_object_query(server, &query, XDB_TYPE_ZSET, query_zset_range, "*0\r\n");
+}
+
+static void cmd_zrange(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_zset_range(server, client, args, 0);
+}
+
+static void cmd_zrevrange(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_zset_range(server, client, args, 1);
+}
+
+static void cmd_type(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    static const char* names[] = { "string", "string", "string", "list", "hash", "zset" };
+    const char* encoding;
+    Database* db = client_db(server, client);
+    int type = db ? key_type(db->store, args->items[1].ptr, args->items[1].len, &encoding) : -1;
+    reply_printf(client, "+%s\r\n", type >= 0 ? names[type] : "none");
+}
+
+/* OBJECT ENCODING key */
+static void cmd_object(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    if (strcasecmp(args->items[1].ptr, "ENCODING") != 0) {
+        reply_string(client, "-ERR unknown subcommand\r\n");
+        return;
+    }
+    const char* encoding;
+    Database* db = client_db(server, client);
+    if (db && key_type(db->store, args->items[2].ptr, args->items[2].len, &encoding) >= 0) {
+        reply_bulk(client, encoding, strlen(encoding));
+    } else {
+        reply_string(client, "$-1\r\n");
+    }
+}
+
+static void reply_expiry_result(XDBServer* server, ClientInfo* client, XDBArg* key, time_t expiry) {
+    Database* db = client_db(server, client);
+    if (db && set_expiry(db->store, key->ptr, key->len, expiry)) {
+        reply_string(client, ":1\r\n");
+    } else {
+        reply_string(client, ":0\r\n");
+    }
+}
+
+/* EXPIRE key seconds; zero or negative seconds delete the key. */
+static void cmd_expire(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int64_t seconds;
+    if (!parse_int64(args->items[2].ptr, args->items[2].len, &seconds)) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    time_t now = time(NULL);
+    if (seconds > INT64_MAX - now) {
+        reply_string(client, "-ERR invalid expire time in 'expire' command\r\n");
+        return;
+    }
+    time_t expiry = now + seconds;
+    reply_expiry_result(server, client, &args->items[1], expiry > 0 ? expiry : 1);
+}
+
+static void cmd_expireat(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int64_t expiry;
+    if (!parse_int64(args->items[2].ptr, args->items[2].len, &expiry)) {
+        reply_string(client, "-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    reply_expiry_result(server, client, &args->items[1], expiry > 0 ? (time_t)expiry : 1);
+}
+
+static void cmd_persist(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    reply_expiry_result(server, client, &args->items[1], 0);
+}
+
+/* TTL key: seconds left, -1 for a key without expiry, -2 for a missing key. */
+static void cmd_ttl(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    XDBArg* key = &args->items[1];
+    time_t expiry = 0;
+    
+    Database* db = client_db(server, client);
+    if (!db || !get_expiry(db->store, key->ptr, key->len, &expiry)) {
+        reply_string(client, ":-2\r\n");
+    } else if (expiry == 0) {
+        reply_string(client, ":-1\r\n");
+    } else {
+        time_t left = expiry - time(NULL);
+        reply_printf(client, ":%lld\r\n", (long long)(left > 0 ? left : 0));
+    }
+}
+
+static void cmd_selectdb(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int db_index = atoi(args->items[1].ptr);
+    
+    if (db_index >= 0 && db_index < server->db_count) {
+        client->current_db_index = db_index;
+        reply_printf(client, "+OK switched to DB %d (%s)\r\n", 
+                     db_index, server->databases[db_index].name);
+    } else {
+        reply_string(client, "-ERR invalid database index\r\n");
+    }
+}
+
+static void cmd_listdbs(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)args;
+    
+    reply_printf(client, "*%d\r\n", server->db_count);
+    for (int i = 0; i < server->db_count; i++) {
+        reply_printf(client, "$%zu\r\n%d:%s\r\n", strlen(server->databases[i].name) + 2, 
+                     i, server->databases[i].name);
+    }
+}
+
+typedef struct {
+    const char* pattern;
+    size_t pattern_len;
+    char* data;
+    size_t len;
+    size_t cap;
+    size_t count;
+    int failed;
+} ScanReply;
+
+/* Encodes matching keys while the shard is locked; the reply goes out once the cursor is known. */
+static void scan_reply_key(const char* key, size_t len, void* ctx) {
+    ScanReply* reply = (ScanReply*)ctx;
+    if (reply->failed) return;
+    if (reply->pattern && !glob_match(reply->pattern, reply->pattern_len, key, len)) return;
+    
+    if (!buffer_reserve(&reply->data, &reply->cap, reply->len + len + 32)) {
+        reply->failed = 1;
+        return;
+    }
+    reply->len += (size_t)sprintf(reply->data + reply->len, "$%zu\r\n", len);
+    memcpy(reply->data + reply->len, key, len);
+    memcpy(reply->data + reply->len + len, "\r\n", 2);
+    reply->len += len + 2;
+    reply->count++;
+}
+
+/* SCAN cursor [MATCH pattern] [COUNT count] */
+static void cmd_scan(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    char* end;
+    errno = 0;
+    uint64_t cursor = strtoull(args->items[1].ptr, &end, 10);
+    if (errno || end == args->items[1].ptr || *end || args->items[1].ptr[0] == '-') {
+        reply_string(client, "-ERR invalid cursor\r\n");
+        return;
+    }
+    
+    ScanReply reply = {0};
+    size_t count = 10;
+    for (int i = 2; i < args->count; i += 2) {
+        const char* option = args->items[i].ptr;
+        if (i + 1 >= args->count) {
+            reply_string(client, "-ERR syntax error\r\n");
+            return;
+        }
+        if (strcasecmp(option, "MATCH") == 0) {
+            reply.pattern = args->items[i + 1].ptr;
+            reply.pattern_len = args->items[i + 1].len;
+        } else if (strcasecmp(option, "COUNT") == 0) {
+            long long n = atoll(args->items[i + 1].ptr);
+            if (n < 1) {
+                reply_string(client, "-ERR syntax error\r\n");
+                return;
+            }
+            count = (size_t)n;
+        } else {
+            reply_string(client, "-ERR syntax error\r\n");
+            return;
+        }
+    }
+    /* A lone * matches everything; skip the per-key match. */
+    if (reply.pattern && reply.pattern_len == 1 && reply.pattern[0] == '*') {
+        reply.pattern = NULL;
+    }
+    
+    Database* db = client_db(server, client);
+    if (!db) {
+        reply_string(client, "-ERR invalid database\r\n");
+        return;
+    }
+    
+    uint64_t next = scan_keys(db->store, cursor, count, scan_reply_key, &reply);
+    if (reply.failed) {
+        reply_string(client, "-ERR out of memory\r\n");
+    } else {
+        char number[24];
+        int len = snprintf(number, sizeof(number), "%llu", (unsigned long long)next);
+        reply_string(client, "*2\r\n");
+        reply_bulk(client, number, (size_t)len);
+        reply_printf(client, "*%zu\r\n", reply.count);
+        if (reply.len > 0) reply_append(client, reply.data, reply.len);
+    }
+    free(reply.data);
+}
+
+static void reply_bgsave(ClientInfo* client, int result, const char* started) {
+    if (result > 0) {
+        reply_string(client, started);
+    } else if (result == 0) {
+        reply_string(client, "-ERR background save already in progress\r\n");
+    } else {
+        reply_string(client, "-ERR background save failed to start\r\n");
+    }
+}
+
+static void cmd_save(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)args;
+    
+    mutex_lock(&server->db_mutex);
+    Database* db = client_db(server, client);
+    if (db) {
+        reply_bgsave(client, server_bgsave(server, client->current_db_index), "+OK\r\n");
+    } else {
+        reply_string(client, "-ERR invalid database\r\n");
+    }
+    mutex_unlock(&server->db_mutex);
+}
+
+static void cmd_saveall(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)args;
+    
+    mutex_lock(&server->db_mutex);
+    reply_bgsave(client, server_bgsave(server, -1), "+OK saving all databases in background\r\n");
+    mutex_unlock(&server->db_mutex);
+}
+
+static void cmd_bgrewriteaof(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)args;
+    
+    mutex_lock(&server->db_mutex);
+    Database* db = client_db(server, client);
+    if (!db || !db->aof) {
+        reply_string(client, "-ERR AOF is not enabled for this database\r\n");
+    } else if (aof_rewrite_background(db->aof)) {
+        reply_string(client, "+Background append only file rewriting started\r\n");
+    } else {
+        reply_string(client, "-ERR AOF rewrite already in progress\r\n");
+    }
+    mutex_unlock(&server->db_mutex);
+}
+
+static void cmd_ping(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)server;
+    (void)args;
+    /* Subscribed connections only receive multibulks. */
+    if (client_subscribed(client)) {
+        reply_string(client, "*2\r\n$4\r\npong\r\n$0\r\n\r\n");
+    } else {
+        reply_string(client, "+PONG\r\n");
+    }
+}
+
+/* SUBSCRIBE channel [channel ...]: from then on the connection receives messages published there. */
+static void cmd_subscribe(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    XDBSubscriber* sub = client_subscriber(client);
+    if (!sub) {
+        reply_string(client, "-ERR out of memory\r\n");
+        return;
+    }
+    
+    for (int i = 1; i < args->count; i++) {
+        int count = pubsub_subscribe(server->pubsub, sub, args->items[i].ptr, args->items[i].len);
+        if (count < 0) {
+            reply_string(client, "-ERR out of memory\r\n");
+            return;
+        }
+        reply_subscription(client, "subscribe", args->items[i].ptr, args->items[i].len, count);
+    }
+}
+
+/* UNSUBSCRIBE [channel ...]: without channels, leaves all of them. */
+static void cmd_unsubscribe(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    XDBSubscriber* sub = (XDBSubscriber*)client->subscriber;
+    
+    if (args->count == 1) {
+        if (client_subscribed(client)) {
+            pubsub_unsubscribe_all(server->pubsub, sub, client);
+        } else {
+            reply_subscription(client, "unsubscribe", NULL, 0, 0);
+        }
+        return;
+    }
+    
+    for (int i = 1; i < args->count; i++) {
+        int count = sub ? pubsub_unsubscribe(server->pubsub, sub, args->items[i].ptr, args->items[i].len) : 0;
+        reply_subscription(client, "unsubscribe", args->items[i].ptr, args->items[i].len, count);
+    }
+}
+
+/* PUBLISH channel message: replies with the number of subscribers it was queued for. */
+static void cmd_publish(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    int receivers = pubsub_publish(server->pubsub, args->items[1].ptr, args->items[1].len,
+                                   args->items[2].ptr, args->items[2].len);
+    if (receivers < 0) {
+        reply_string(client, "-ERR out of memory\r\n");
+    } else {
+        reply_printf(client, ":%d\r\n", receivers);
+    }
+}
+
+static void cmd_flushdb(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    (void)args;
+    
+    Database* db = client_db(server, client);
+    if (db) {
+        flush_hash_table(db->store);
+        reply_string(client, "+OK\r\n");
+    } else {
+        reply_string(client, "-ERR invalid database\r\n");
+    }
+}
+
+/* PSYNC replid offset: the connection becomes a replication link once earlier replies are sent. */
+static void cmd_psync(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    #ifdef _WIN32
+    (void)server;
+    (void)args;
+    reply_string(client, "-ERR replication is not supported on this platform\r\n");
+    #else
+    if (server_is_replica(server)) {
+        reply_string(client, "-ERR replicas do not serve replicas\r\n");
+        return;
+    }
+    
+    XDBReplLink* link = (XDBReplLink*)calloc(1, sizeof(XDBReplLink));
+    if (!link) {
+        reply_string(client, "-ERR out of memory\r\n");
+        return;
+    }
+    snprintf(link->replid, sizeof(link->replid), "%s", args->items[1].ptr);
+    link->offset = atoll(args->items[2].ptr);
+    client->replica = link;
+    client->closing = 1;
+    #endif
+}
+
+/* ROLE: master, replication id, stream offset, replica count; or replica, primary host/port, link state, offset. */
+static void cmd_role(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    static const char* states[] = {"connecting", "sync", "connected"};
+    XDBReplication* repl = server->repl;
+    (void)args;
+    
+    mutex_lock(&repl->lock);
+    if (server_is_replica(server)) {
+        const char* state = states[repl->state];
+        reply_printf(client, "*5\r\n$7\r\nreplica\r\n$%zu\r\n%s\r\n:%d\r\n$%zu\r\n%s\r\n:%llu\r\n",
+                     strlen(repl->master_host), repl->master_host, repl->master_port,
+                     strlen(state), state, (unsigned long long)repl->applied);
+    } else {
+        reply_printf(client, "*4\r\n$6\r\nmaster\r\n$%zu\r\n%s\r\n:%llu\r\n:%d\r\n",
+                     strlen(repl->replid), repl->replid, (unsigned long long)repl->offset, repl->link_count);
+    }
+    mutex_unlock(&repl->lock);
+}
+
+static const char* evict_policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-lru", "volatile-lfu"
+};
+
+static int parse_evict_policy(const char* name, XDBEvictPolicy* policy) {
+    for (int i = 0; i < (int)(sizeof(evict_policy_names) / sizeof(evict_policy_names[0])); i++) {
+        if (strcasecmp(name, evict_policy_names[i]) == 0) {
+            *policy = (XDBEvictPolicy)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Byte counts with an optional k/kb, m/mb or g/gb suffix (powers of 1000 and 1024). */
+static int parse_memory(const char* text, int64_t* bytes) {
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) return 0;
+    
+    static const struct { const char* suffix; int64_t scale; } units[] = {
+        {"", 1}, {"k", 1000}, {"kb", 1024}, {"m", 1000000}, {"mb", 1024 * 1024},
+        {"g", 1000000000}, {"gb", 1024LL * 1024 * 1024}
+    };
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strcasecmp(end, units[i].suffix) == 0) {
+            *bytes = value * units[i].scale;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void format_bytes(char* buf, size_t size, int64_t bytes) {
+    static const char units[] = "KMGT";
+    double value = (double)bytes;
+    int unit = -1;
+    while (value >= 1024 && unit < 3) {
+        value /= 1024;
+        unit++;
+    }
+    if (unit < 0) {
+        snprintf(buf, size, "%lldB", (long long)bytes);
+    } else {
+        snprintf(buf, size, "%.2f%c", value, units[unit]);
+    }
+}
+
+static int server_tables(XDBServer* server, HashTable** tables) {
+    int count = server->db_count;
+    for (int i = 0; i < count; i++) {
+        tables[i] = server->databases[i].store;
+    }
+    return count;
+}
+
+/*
+ * Brings the server's databases back under maxmemory before a command that
+ * may grow them. Replicas never evict: they mirror their primary's keys.
+ */
+static int server_reclaim_memory(XDBServer* server) {
+    int64_t limit = xdb_atomic_load64(&server->maxmemory);
+    if (limit <= 0 || server_is_replica(server)) return 1;
+    
+    HashTable* tables[MAX_DB_COUNT];
+    int count = server_tables(server, tables);
+    XDBEvictPolicy policy = (XDBEvictPolicy)xdb_atomic_load32(&server->maxmemory_policy);
+    return evict_to_limit(tables, count, limit, policy);
+}
+
+/* Growable text for INFO and the metrics page; output is cut short if memory runs out. */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} XDBText;
+
+static void text_printf(XDBText* text, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0 || !buffer_reserve(&text->data, &text->cap, text->len + len + 1)) return;
+    
+    va_start(args, format);
+    vsnprintf(text->data + text->len, len + 1, format, args);
+    va_end(args);
+    text->len += len;
+}
+
+typedef struct {
+    size_t keys;
+    size_t expires;
+    size_t longest_probe;
+    uint64_t total_probe;
+} XDBKeyspaceStats;
+
+/* Probe length is how far past its home slot an entry sits: the open-addressing chain length. */
+static void table_probe_stats(const XDBTable* table, XDBKeyspaceStats* out) {
+    for (size_t i = 0; i < table_slot_count(table); i++) {
+        if (table->ctrl[i] >= XDB_CTRL_EMPTY) continue;
+        
+        size_t probe = (i - (table->slots[i]->hash & table->mask)) & table->mask;
+        out->total_probe += probe;
+        if (probe > out->longest_probe) out->longest_probe = probe;
+    }
+}
+
+/* Visits every slot with the shard locks shared, so it costs time in proportion to the table. */
+static void keyspace_stats(HashTable* ht, XDBKeyspaceStats* out) {
+    memset(out, 0, sizeof(XDBKeyspaceStats));
+    for (int i = 0; i < XDB_SHARD_COUNT; i++) {
+        XDBShard* shard = &ht->shards[i];
+        rwlock_rdlock(&shard->lock);
+        out->keys += shard->table.used + shard->old.used;
+        out->expires += shard->expires.count;
+        table_probe_stats(&shard->table, out);
+        table_probe_stats(&shard->old, out);
+        rwlock_rdunlock(&shard->lock);
+    }
+}
+
+/* Everything INFO and the metrics page report, gathered in one pass with db_mutex held. */
+typedef struct {
+    XDBStats* totals;
+    double ns_per_tick;
+    int db_count;
+    int with_keyspace;
+    XDBKeyspaceStats keyspace[MAX_DB_COUNT];
+    int64_t used_memory;
+    int64_t maxmemory;
+    XDBEvictPolicy policy;
+    int64_t evicted;
+    int64_t expired;
+    int aof_enabled;
+    int aof_rewriting;
+    int aof_ok;
+    int64_t aof_fsync_us;
+    int64_t aof_rewrite_us;
+} XDBReport;
+
+static int report_collect(XDBServer* server, XDBReport* report, int with_keyspace) {
+    memset(report, 0, sizeof(XDBReport));
+    report->totals = metrics_collect(server->metrics);
+    if (!report->totals) return 0;
+    report->ns_per_tick = metrics_ns_per_tick(server->metrics);
+    
+    HashTable* tables[MAX_DB_COUNT];
+    report->db_count = server_tables(server, tables);
+    report->with_keyspace = with_keyspace;
+    report->used_memory = tables_memory(tables, report->db_count);
+    report->maxmemory = xdb_atomic_load64(&server->maxmemory);
+    report->policy = (XDBEvictPolicy)xdb_atomic_load32(&server->maxmemory_policy);
+    report->aof_ok = 1;
+    
+    for (int i = 0; i < report->db_count; i++) {
+        report->evicted += xdb_atomic_load64(&tables[i]->evicted);
+        report->expired += xdb_atomic_load64(&tables[i]->expired);
+        if (with_keyspace) {
+            keyspace_stats(tables[i], &report->keyspace[i]);
+        }
+        
+        XDBAof* aof = server->databases[i].aof;
+        if (!aof) continue;
+        mutex_lock(&aof->lock);
+        report->aof_enabled = 1;
+        report->aof_rewriting |= aof->rewriting;
+        report->aof_ok &= aof->write_error == 0;
+        if (aof->fsync_us > report->aof_fsync_us) report->aof_fsync_us = aof->fsync_us;
+        if (aof->rewrite_us > report->aof_rewrite_us) report->aof_rewrite_us = aof->rewrite_us;
+        mutex_unlock(&aof->lock);
+    }
+    return 1;
+}
+
+static uint64_t report_total_calls(const XDBReport* report) {
+    uint64_t total = 0;
+    for (int i = 0; i < report->totals->command_count; i++) {
+        total += report->totals->commands[i].calls;
+    }
+    return total;
+}
+
+/* Upper bound, in ticks, of the q-quantile of a command's latencies. */
+static uint64_t latency_percentile(const XDBCommandStats* cs, double q) {
+    double target = q * (double)cs->calls;
+    uint64_t rank = (uint64_t)target;
+    if ((double)rank < target || rank == 0) rank++;
+    
+    uint64_t seen = 0;
+    for (int b = 0; b < XDB_LATENCY_BUCKETS; b++) {
+        seen += cs->buckets[b];
+        if (seen >= rank) return latency_bucket_max(b);
+    }
+    return latency_bucket_max(XDB_LATENCY_BUCKETS - 1);
+}
+
+static void lowercase_name(char* out, size_t size, const char* name) {
+    size_t i = 0;
+    for (; name[i] && i + 1 < size; i++) {
+        out[i] = (char)((name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 32 : name[i]);
+    }
+    out[i] = '\0';
+}
+
+static int info_wants(const char* section, const char* name, int in_default) {
+    if (strcasecmp(section, name) == 0 || strcasecmp(section, "all") == 0) return 1;
+    return in_default && strcasecmp(section, "default") == 0;
+}
+
+/*
+ * INFO [section]: a bulk string of "field:value" lines grouped under
+ * "# Section" headers. The default sections are server, stats, memory,
+ * persistence and keyspace; "all" adds commandstats and latencystats.
+ * The keyspace section walks every table to find probe lengths.
+ */
+static void info_render(XDBServer* server, const XDBReport* report, const char* section, XDBText* text) {
+    XDBMetrics* metrics = server->metrics;
+    XDBStats* totals = report->totals;
+    
+    if (info_wants(section, "server", 1)) {
+        #ifdef XDB_USE_EPOLL
+        int reactors = server->reactor_count;
+        #else
+        int reactors = 0;
+        #endif
+        text_printf(text, "# Server\r\nuptime_in_seconds:%lld\r\nrole:%s\r\ntcp_port:%d\r\n"
+                    "reactors:%d\r\nshared_nothing:%d\r\ndatabases:%d\r\n\r\n",
+                    (long long)(time(NULL) - metrics->started), server_is_replica(server) ? "replica" : "master",
+                    server->port, reactors, server->shared_nothing, report->db_count);
+    }
+    if (info_wants(section, "stats", 1)) {
+        text_printf(text, "# Stats\r\ntotal_connections_received:%llu\r\ntotal_commands_processed:%llu\r\n"
+                    "instantaneous_ops_per_sec:%llu\r\nkeyspace_hits:%llu\r\nkeyspace_misses:%llu\r\n"
+                    "expired_keys:%lld\r\nevicted_keys:%lld\r\npubsub_channels:%zu\r\n\r\n",
+                    (unsigned long long)xdb_atomic_load64(&metrics->connections),
+                    (unsigned long long)report_total_calls(report), (unsigned long long)metrics->ops_per_sec,
+                    (unsigned long long)totals->hits, (unsigned long long)totals->misses,
+                    (long long)report->expired, (long long)report->evicted, pubsub_channel_count(server->pubsub));
+    }
+    if (info_wants(section, "memory", 1)) {
+        char used_human[32], limit_human[32];
+        format_bytes(used_human, sizeof(used_human), report->used_memory);
+        format_bytes(limit_human, sizeof(limit_human), report->maxmemory);
+        text_printf(text, "# Memory\r\nused_memory:%lld\r\nused_memory_human:%s\r\nmaxmemory:%lld\r\n"
+                    "maxmemory_human:%s\r\nmaxmemory_policy:%s\r\nevicted_keys:%lld\r\n\r\n",
+                    (long long)report->used_memory, used_human, (long long)report->maxmemory, limit_human,
+                    evict_policy_names[report->policy], (long long)report->evicted);
+    }
+    if (info_wants(section, "persistence", 1)) {
+        text_printf(text, "# Persistence\r\nrdb_bgsave_in_progress:%d\r\nrdb_last_save_time:%lld\r\n"
+                    "rdb_last_bgsave_status:%s\r\nrdb_last_bgsave_time_usec:%lld\r\nrdb_last_fork_usec:%lld\r\n"
+                    "aof_enabled:%d\r\naof_rewrite_in_progress:%d\r\naof_last_rewrite_time_usec:%lld\r\n"
+                    "aof_last_fsync_usec:%lld\r\naof_last_write_status:%s\r\n\r\n",
+                    server->save_pid > 0, (long long)metrics->last_save, server->save_ok ? "ok" : "err",
+                    (long long)metrics->save_us, (long long)metrics->fork_us,
+                    report->aof_enabled, report->aof_rewriting, (long long)report->aof_rewrite_us,
+                    (long long)report->aof_fsync_us, report->aof_ok ? "ok" : "err");
+    }
+    if (info_wants(section, "commandstats", 0)) {
+        text_printf(text, "# Commandstats\r\n");
+        for (int i = 0; i < totals->command_count; i++) {
+            const XDBCommandStats* cs = &totals->commands[i];
+            if (cs->calls == 0) continue;
+            char name[32];
+            lowercase_name(name, sizeof(name), metrics->names[i]);
+            double usec = (double)cs->total_ticks * report->ns_per_tick / 1000.0;
+            text_printf(text, "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f\r\n", name,
+                        (unsigned long long)cs->calls, (unsigned long long)usec, usec / (double)cs->calls);
+        }
+        text_printf(text, "\r\n");
+    }
+    if (info_wants(section, "latencystats", 0)) {
+        text_printf(text, "# Latencystats\r\n");
+        for (int i = 0; i < totals->command_count; i++) {
+            const XDBCommandStats* cs = &totals->commands[i];
+            if (cs->calls == 0) continue;
+            char name[32];
+            lowercase_name(name, sizeof(name), metrics->names[i]);
+            double usec_per_tick = report->ns_per_tick / 1000.0;
+            text_printf(text, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n", name,
+                        latency_percentile(cs, 0.5) * usec_per_tick, latency_percentile(cs, 0.99) * usec_per_tick,
+                        latency_percentile(cs, 0.999) * usec_per_tick);
+        }
+        text_printf(text, "\r\n");
+    }
+    if (report->with_keyspace) {
+        text_printf(text, "# Keyspace\r\n");
+        for (int i = 0; i < report->db_count; i++) {
+            const XDBKeyspaceStats* ks = &report->keyspace[i];
+            text_printf(text, "db%d:name=%s,keys=%zu,expires=%zu,longest_probe=%zu,avg_probe=%.2f\r\n",
+                        i, server->databases[i].name, ks->keys, ks->expires, ks->longest_probe,
+                        ks->keys ? (double)ks->total_probe / (double)ks->keys : 0.0);
+        }
+        text_printf(text, "\r\n");
+    }
+}
+
+static void cmd_info(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    const char* section = args->count > 1 ? args->items[1].ptr : "default";
+    XDBText text = {0};
+    XDBReport report;
+    
+    mutex_lock(&server->db_mutex);
+    if (report_collect(server, &report, info_wants(section, "keyspace", 1))) {
+        info_render(server, &report, section, &text);
+    }
+    mutex_unlock(&server->db_mutex);
+    
+    stats_free(report.totals);
+    reply_bulk(client, text.data ? text.data : "", text.len);
+    free(text.data);
+}
+
+/* Bucket bounds of the exported latency histograms, in ns. */
+static const uint64_t metrics_latency_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+    2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 1000000000
+};
+
+static void metrics_render_histogram(XDBText* text, const char* name, const XDBCommandStats* cs, double ns_per_tick) {
+    uint64_t count = 0;
+    int b = 0;
+    for (size_t i = 0; i < sizeof(metrics_latency_bounds) / sizeof(metrics_latency_bounds[0]); i++) {
+        while (b < XDB_LATENCY_BUCKETS && latency_bucket_max(b) * ns_per_tick <= metrics_latency_bounds[i]) {
+            count += cs->buckets[b++];
+        }
+        text_printf(text, "xdb_command_duration_seconds_bucket{cmd=\"%s\",le=\"%g\"} %llu\n",
+                    name, metrics_latency_bounds[i] / 1e9, (unsigned long long)count);
+    }
+    text_printf(text, "xdb_command_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %llu\n"
+                "xdb_command_duration_seconds_sum{cmd=\"%s\"} %.9f\n"
+                "xdb_command_duration_seconds_count{cmd=\"%s\"} %llu\n",
+                name, (unsigned long long)cs->calls, name, cs->total_ticks * ns_per_tick / 1e9,
+                name, (unsigned long long)cs->calls);
+}
+
+/* The same figures as INFO, in the Prometheus text exposition format. */
+static void metrics_render(XDBServer* server, const XDBReport* report, XDBText* text) {
+    XDBMetrics* metrics = server->metrics;
+    XDBStats* totals = report->totals;
+    
+    text_printf(text,
+                "# TYPE xdb_uptime_seconds gauge\nxdb_uptime_seconds %lld\n"
+                "# TYPE xdb_connections_received_total counter\nxdb_connections_received_total %llu\n"
+                "# TYPE xdb_ops_per_second gauge\nxdb_ops_per_second %llu\n"
+                "# TYPE xdb_keyspace_hits_total counter\nxdb_keyspace_hits_total %llu\n"
+                "# TYPE xdb_keyspace_misses_total counter\nxdb_keyspace_misses_total %llu\n"
+                "# TYPE xdb_expired_keys_total counter\nxdb_expired_keys_total %lld\n"
+                "# TYPE xdb_evicted_keys_total counter\nxdb_evicted_keys_total %lld\n"
+                "# TYPE xdb_used_memory_bytes gauge\nxdb_used_memory_bytes %lld\n"
+                "# TYPE xdb_maxmemory_bytes gauge\nxdb_maxmemory_bytes %lld\n"
+                "# TYPE xdb_rdb_last_save_timestamp_seconds gauge\nxdb_rdb_last_save_timestamp_seconds %lld\n"
+                "# TYPE xdb_rdb_last_bgsave_duration_seconds gauge\nxdb_rdb_last_bgsave_duration_seconds %.6f\n"
+                "# TYPE xdb_rdb_last_fork_duration_seconds gauge\nxdb_rdb_last_fork_duration_seconds %.6f\n"
+                "# TYPE xdb_aof_last_fsync_duration_seconds gauge\nxdb_aof_last_fsync_duration_seconds %.6f\n"
+                "# TYPE xdb_aof_last_rewrite_duration_seconds gauge\nxdb_aof_last_rewrite_duration_seconds %.6f\n",
+                (long long)(time(NULL) - metrics->started),
+                (unsigned long long)xdb_atomic_load64(&metrics->connections),
+                (unsigned long long)metrics->ops_per_sec,
+                (unsigned long long)totals->hits, (unsigned long long)totals->misses,
+                (long long)report->expired, (long long)report->evicted,
+                (long long)report->used_memory, (long long)report->maxmemory,
+                (long long)metrics->last_save, metrics->save_us / 1e6, metrics->fork_us / 1e6,
+                report->aof_fsync_us / 1e6, report->aof_rewrite_us / 1e6);
+    
+    static const char* keyspace_names[] = {"xdb_keys", "xdb_expiring_keys", "xdb_longest_probe"};
+    for (int m = 0; m < 3; m++) {
+        text_printf(text, "# TYPE %s gauge\n", keyspace_names[m]);
+        for (int i = 0; i < report->db_count; i++) {
+            const XDBKeyspaceStats* ks = &report->keyspace[i];
+            size_t value = m == 0 ? ks->keys : m == 1 ? ks->expires : ks->longest_probe;
+            text_printf(text, "%s{db=\"%s\"} %zu\n", keyspace_names[m], server->databases[i].name, value);
+        }
+    }
+    
+    text_printf(text, "# TYPE xdb_command_duration_seconds histogram\n");
+    for (int i = 0; i < totals->command_count; i++) {
+        if (totals->commands[i].calls == 0) continue;
+        char name[32];
+        lowercase_name(name, sizeof(name), metrics->names[i]);
+        metrics_render_histogram(text, name, &totals->commands[i], report->ns_per_tick);
+    }
+}
+
+static const char* find_header_end(const char* data, size_t len) {
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n') {
+            return data + i + 4;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Metrics listeners speak just enough HTTP/1.1 for a scraper: every request
+ * head gets the metrics page for GET /metrics and a 404 otherwise, on a
+ * connection kept open for the next scrape. Request bodies are not
+ * supported. Returns the number of bytes consumed.
+ */
+static size_t client_serve_metrics(XDBServer* server, ClientInfo* client, const char* data, size_t len) {
+    size_t consumed = 0;
+    
+    while (consumed < len && !client->closing) {
+        const char* request = data + consumed;
+        const char* end = find_header_end(request, len - consumed);
+        if (!end) {
+            if (len - consumed > XDB_MAX_HTTP_HEADER) client->closing = 1;
+            break;
+        }
+        consumed = end - data;
+        
+        int found = end - request > 12 && strncmp(request, "GET /metrics", 12) == 0 &&
+                    (request[12] == ' ' || request[12] == '?');
+        XDBText body = {0};
+        XDBReport report;
+        if (found) {
+            mutex_lock(&server->db_mutex);
+            if (report_collect(server, &report, 1)) {
+                metrics_render(server, &report, &body);
+            }
+            mutex_unlock(&server->db_mutex);
+            stats_free(report.totals);
+        }
+        
+        reply_printf(client, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                     found ? "200 OK" : "404 Not Found", body.len);
+        if (body.len > 0) reply_append(client, body.data, body.len);
+        free(body.data);
+    }
+    return consumed;
+}
+
+/* CONFIG GET parameter | CONFIG SET parameter value, for maxmemory and maxmemory-policy. */
+static void cmd_config(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    const char* action = args->items[1].ptr;
+    
+    if (strcasecmp(action, "GET") == 0 && args->count == 3) {
+        const char* pattern = args->items[2].ptr;
+        int all = strcmp(pattern, "*") == 0;
+        int memory = all || strcasecmp(pattern, "maxmemory") == 0;
+        int policy = all || strcasecmp(pattern, "maxmemory-policy") == 0;
+        
+        reply_printf(client, "*%d\r\n", (memory + policy) * 2);
+        if (memory) {
+            char value[32];
+            int len = snprintf(value, sizeof(value), "%lld", (long long)xdb_atomic_load64(&server->maxmemory));
+            reply_bulk(client, "maxmemory", 9);
+            reply_bulk(client, value, (size_t)len);
+        }
+        if (policy) {
+            const char* name = evict_policy_names[xdb_atomic_load32(&server->maxmemory_policy)];
+            reply_bulk(client, "maxmemory-policy", 16);
+            reply_bulk(client, name, strlen(name));
+        }
+    } else if (strcasecmp(action, "SET") == 0 && args->count == 4) {
+        const char* name = args->items[2].ptr;
+        const char* value = args->items[3].ptr;
+        int64_t bytes;
+        XDBEvictPolicy policy;
+        
+        if (strcasecmp(name, "maxmemory") == 0) {
+            if (!parse_memory(value, &bytes)) {
+                reply_string(client, "-ERR invalid maxmemory value\r\n");
+                return;
+            }
+            xdb_atomic_store64(&server->maxmemory, bytes);
+        } else if (strcasecmp(name, "maxmemory-policy") == 0) {
+            if (!parse_evict_policy(value, &policy)) {
+                reply_string(client, "-ERR invalid maxmemory-policy value\r\n");
+                return;
+            }
+            xdb_atomic_store32(&server->maxmemory_policy, policy);
+        } else {
+            reply_string(client, "-ERR Unsupported CONFIG parameter\r\n");
+            return;
+        }
+        reply_string(client, "+OK\r\n");
+    } else {
+        reply_string(client, "-ERR invalid syntax\r\n");
+    }
+}
+
+typedef void (*xdb_command_f)(XDBServer*, ClientInfo*, XDBArgv*);
+
+/* Commands that change data; replicas refuse them from clients. */
+#define XDB_CMD_WRITE 0x1
+/* Commands that may grow the dataset; refused when maxmemory cannot be met by eviction. */
+#define XDB_CMD_DENYOOM 0x2
+/* Commands a connection may still issue while subscribed to channels. */
+#define XDB_CMD_PUBSUB 0x4
+
+/*
+ * Key positions are first_key..last_key in steps of key_step; a negative
+ * last_key counts from the end and first_key 0 means the command has none.
+ */
+typedef struct {
+    const char* name;
+    xdb_command_f handler;
+    int min_args;
+    int flags;
+    int first_key;
+    int last_key;
+    int key_step;
+} XDBCommand;
+
+static const XDBCommand command_table[] = {
+    {"SET", cmd_set, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"GET", cmd_get, 2, 0, 1, 1, 1},
+    {"DEL", cmd_del, 2, XDB_CMD_WRITE, 1, -1, 1},
+    {"MSET", cmd_mset, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, -1, 2},
+    {"MGET", cmd_mget, 2, 0, 1, -1, 1},
+    {"MDEL", cmd_del, 2, XDB_CMD_WRITE, 1, -1, 1},
+    {"INCR", cmd_incr, 2, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"DECR", cmd_decr, 2, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"INCRBY", cmd_incrby, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"DECRBY", cmd_decrby, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"INCRBYFLOAT", cmd_incrbyfloat, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"LPUSH", cmd_lpush, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"RPUSH", cmd_rpush, 3, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"LPOP", cmd_lpop, 2, XDB_CMD_WRITE, 1, 1, 1},
+    {"RPOP", cmd_rpop, 2, XDB_CMD_WRITE, 1, 1, 1},
+    {"LLEN", cmd_llen, 2, 0, 1, 1, 1},
+    {"LRANGE", cmd_lrange, 4, 0, 1, 1, 1},
+    {"LINDEX", cmd_lindex, 3, 0, 1, 1, 1},
+    {"LTRIM", cmd_ltrim, 4, XDB_CMD_WRITE, 1, 1, 1},
+    {"HSET", cmd_hset, 4, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"HGET", cmd_hget, 3, 0, 1, 1, 1},
+    {"HMGET", cmd_hmget, 3, 0, 1, 1, 1},
+    {"HDEL", cmd_hdel, 3, XDB_CMD_WRITE, 1, 1, 1},
+    {"HLEN", cmd_hlen, 2, 0, 1, 1, 1},
+    {"HEXISTS", cmd_hexists, 3, 0, 1, 1, 1},
+    {"HGETALL", cmd_hgetall, 2, 0, 1, 1, 1},
+    {"HINCRBY", cmd_hincrby, 4, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"ZADD", cmd_zadd, 4, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"ZINCRBY", cmd_zincrby, 4, XDB_CMD_WRITE | XDB_CMD_DENYOOM, 1, 1, 1},
+    {"ZSCORE", cmd_zscore, 3, 0, 1, 1, 1},
+    {"ZREM", cmd_zrem, 3, XDB_CMD_WRITE, 1, 1, 1},
+    {"ZCARD", cmd_zcard, 2, 0, 1, 1, 1},
+    {"ZRANK", cmd_zrank, 3, 0, 1, 1, 1},
+    {"ZREVRANK", cmd_zrevrank, 3, 0, 1, 1, 1},
+    {"ZRANGE", cmd_zrange, 4, 0, 1, 1, 1},
+    {"ZREVRANGE", cmd_zrevrange, 4, 0, 1, 1, 1},
+    {"TYPE", cmd_type, 2, 0, 1, 1, 1},
+    {"OBJECT", cmd_object, 3, 0, 2, 2, 1},
+    {"EXPIRE", cmd_expire, 3, XDB_CMD_WRITE, 1, 1, 1},
+    {"EXPIREAT", cmd_expireat, 3, XDB_CMD_WRITE, 1, 1, 1},
+    {"PERSIST", cmd_persist, 2, XDB_CMD_WRITE, 1, 1, 1},
+    {"TTL", cmd_ttl, 2, 0, 1, 1, 1},
+    {"FLUSHDB", cmd_flushdb, 1, XDB_CMD_WRITE, 0, 0, 0},
+    {"SELECTDB", cmd_selectdb, 2, 0, 0, 0, 0},
+    {"LISTDBS", cmd_listdbs, 1, 0, 0, 0, 0},
+    {"SCAN", cmd_scan, 2, 0, 0, 0, 0},
+    {"SAVE", cmd_save, 1, 0, 0, 0, 0},
+    {"SAVEALL", cmd_saveall, 1, 0, 0, 0, 0},
+    {"BGREWRITEAOF", cmd_bgrewriteaof, 1, 0, 0, 0, 0},
+    {"PING", cmd_ping, 1, XDB_CMD_PUBSUB, 0, 0, 0},
+    {"SUBSCRIBE", cmd_subscribe, 2, XDB_CMD_PUBSUB, 0, 0, 0},
+    {"UNSUBSCRIBE", cmd_unsubscribe, 1, XDB_CMD_PUBSUB, 0, 0, 0},
+    {"PUBLISH", cmd_publish, 3, 0, 0, 0, 0},
+    {"PSYNC", cmd_psync, 3, 0, 0, 0, 0},
+    {"ROLE", cmd_role, 1, 0, 0, 0, 0},
+    {"INFO", cmd_info, 1, 0, 0, 0, 0},
+    {"CONFIG", cmd_config, 2, 0, 0, 0, 0},
+};
+
+/* Statistics index commands by their position in command_table. */
+static XDBMetrics* server_metrics_create(void) {
+    int count = (int)(sizeof(command_table) / sizeof(command_table[0]));
+    const char** names = (const char**)malloc(sizeof(const char*) * count);
+    if (!names) return NULL;
+    for (int i = 0; i < count; i++) {
+        names[i] = command_table[i].name;
+    }
+    
+    XDBMetrics* metrics = metrics_create(names, count);
+    if (!metrics) free(names);
+    return metrics;
+}
+
+#ifdef XDB_USE_EPOLL
+/*
+ * Shared-nothing mode. Reactor i owns the shards s with s % reactor_count
+ * == i in every database and is the only thread that runs keyed commands
+ * against them. A command for keys owned elsewhere is re-encoded into a
+ * message for the owner, and a pending chunk keeps its place in the
+ * client's reply list so pipelined replies still go out in order. Keyless
+ * commands wait until the client's forwarded commands have completed.
+ */
+
+static XDBMessage* message_create(ClientInfo* client, XDBArgv* args) {
+    XDBMessage* msg = (XDBMessage*)calloc(1, sizeof(XDBMessage));
+    if (!msg) return NULL;
+    
+    if (!resp_append_command(&msg->data, &msg->len, &msg->cap, args->count, args->items)) {
+        free(msg->data);
+        free(msg);
+        return NULL;
+    }
+    msg->client = client;
+    msg->origin = (XDBReactor*)client->reactor;
+    msg->db_index = client->current_db_index;
+    return msg;
+}
+
+static void message_free(XDBMessage* msg) {
+    XDBReplyChunk* chunk = msg->reply_head;
+    while (chunk) {
+        XDBReplyChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(msg->data);
+    free(msg);
+}
+
+/* Returns the reactor owning every key of the command, or -1 if they belong to several. */
+static int command_owner(XDBServer* server, const XDBCommand* command, XDBArgv* args) {
+    int last = command->last_key < 0 ? args->count + command->last_key : command->last_key;
+    int owner = -1;
+    
+    for (int i = command->first_key; i <= last && i < args->count; i += command->key_step) {
+        uint64_t hash = hash_function(args->items[i].ptr, args->items[i].len);
+        int reactor = shard_index(hash) % server->reactor_count;
+        if (owner >= 0 && reactor != owner) return -1;
+        owner = reactor;
+    }
+    return owner;
+}
+
+/*
+ * Sends the command to the reactor owning its keys when that is not the
+ * client's own, or holds a keyless command back behind forwarded ones.
+ * Returns 1 if the command was dealt with here and 0 if it should run now.
+ */
+static int client_forward(XDBServer* server, ClientInfo* client, const XDBCommand* command, XDBArgv* args) {
+    XDBReactor* reactor = (XDBReactor*)client->reactor;
+    if (!server->shared_nothing || !reactor) return 0;
+    
+    int owner = reactor->index;
+    if (command->first_key == 0) {
+        if (client->in_flight == 0) return 0;
+    } else {
+        owner = command_owner(server, command, args);
+        if (owner < 0) {
+            reply_string(client, "-CROSSSLOT Keys in request don't belong to the same worker\r\n");
+            return 1;
+        }
+        if (owner == reactor->index) return 0;
+    }
+    
+    XDBMessage* msg = message_create(client, args);
+    XDBReplyChunk* slot = owner != reactor->index ? (XDBReplyChunk*)calloc(1, sizeof(XDBReplyChunk)) : NULL;
+    if (!msg || (owner != reactor->index && !slot)) {
+        if (msg) message_free(msg);
+        free(slot);
+        reply_string(client, "-ERR out of memory\r\n");
+        return 1;
+    }
+    
+    if (!slot) {
+        client->deferred = msg;
+        client->blocked = 1;
+        return 1;
+    }
+    
+    slot->pending = 1;
+    if (client->reply_tail) client->reply_tail->next = slot;
+    else client->reply_head = slot;
+    client->reply_tail = slot;
+    
+    msg->kind = XDB_MSG_REQUEST;
+    msg->slot = slot;
+    client->in_flight++;
+    reactor_post(&server->reactors[owner], msg);
+    return 1;
+}
+#else
+#define client_forward(server, client, command, args) 0
+#endif
+
+static void execute_command(XDBServer* server, ClientInfo* client, XDBArgv* args) {
+    if (args->count == 0) return;
+    
+    const char* name = args->items[0].ptr;
+    for (size_t i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
+        if (strcasecmp(name, command_table[i].name) == 0) {
+            if (args->count < command_table[i].min_args) {
+                reply_string(client, "-ERR invalid syntax\r\n");
+            } else if (client_subscribed(client) && !(command_table[i].flags & XDB_CMD_PUBSUB)) {
+                reply_string(client, "-ERR only SUBSCRIBE / UNSUBSCRIBE / PING allowed in this context\r\n");
+            } else if ((command_table[i].flags & XDB_CMD_WRITE) && server_is_replica(server)) {
+                reply_string(client, "-READONLY You can't write against a read only replica.\r\n");
+            } else if ((command_table[i].flags & XDB_CMD_DENYOOM) && !server_reclaim_memory(server)) {
+                reply_string(client, "-OOM command not allowed when used memory > 'maxmemory'.\r\n");
+            } else if (!client_forward(server, client, &command_table[i], args)) {
+                uint64_t start = client->stats ? latency_ticks() : 0;
+                command_table[i].handler(server, client, args);
+                if (client->stats) stats_record(client->stats, (int)i, start);
+            }
+            return;
+        }
     }
-    return hash % HASH_TABLE_SIZE;
+    
+    reply_string(client, "-ERR unknown command\r\n");
 }
 
-void init_hash_table(HashTable* ht) {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        ht->buckets[i].entries = NULL;
-        ht->buckets[i].size = 0;
-        ht->buckets[i].capacity = 0;
-        mutex_init(&ht->locks[i]);
+/* Runs every complete command in data and returns how many bytes were consumed. */
+static size_t client_process_commands(XDBServer* server, ClientInfo* client, char* data, size_t len, XDBArgv* args) {
+    if (client->protocol == XDB_PROTO_METRICS) {
+        return client_serve_metrics(server, client, data, len);
+    }
+    
+    size_t consumed = 0;
+    
+    while (consumed < len && !client->closing && !client->blocked && client->in_flight < XDB_MAX_IN_FLIGHT) {
+        long n = client->protocol == XDB_PROTO_RESP && data[consumed] == '*'
+            ? parse_resp_command(data + consumed, len - consumed, args)
+            : parse_inline_command(data + consumed, len - consumed, args);
+        if (n == 0) break;
+        if (n < 0) {
+            reply_string(client, "-ERR protocol error\r\n");
+            client->closing = 1;
+            break;
+        }
+        consumed += n;
+        execute_command(server, client, args);
     }
+    
+    return consumed;
 }
 
-void free_hash_table(HashTable* ht) {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        mutex_lock(&ht->locks[i]);
-        free(ht->buckets[i].entries);
-        mutex_unlock(&ht->locks[i]);
-        mutex_destroy(&ht->locks[i]);
+/* Appends freshly received bytes to the client and runs what is complete. */
+static void client_feed(XDBServer* server, ClientInfo* client, char* scratch, size_t n, XDBArgv* args) {
+    char* data = scratch;
+    size_t len = n;
+    
+    /* Bytes left over from a previous read are completed in the per-client buffer,
+     * otherwise commands are parsed straight out of the scratch space. */
+    if (client->read_len > 0) {
+        if (!buffer_reserve(&client->read_buf, &client->read_cap, client->read_len + n)) {
+            client->closing = 1;
+            return;
+        }
+        memcpy(client->read_buf + client->read_len, scratch, n);
+        client->read_len += n;
+        data = client->read_buf;
+        len = client->read_len;
     }
+    
+    size_t consumed = client_process_commands(server, client, data, len, args);
+    size_t remaining = len - consumed;
+    
+    if (remaining > XDB_MAX_QUERY_SIZE) {
+        client->closing = 1;
+        return;
+    }
+    
+    if (remaining == 0) {
+        free(client->read_buf);
+        client->read_buf = NULL;
+        client->read_len = 0;
+        client->read_cap = 0;
+    } else if (data == scratch) {
+        if (!buffer_reserve(&client->read_buf, &client->read_cap, remaining)) {
+            client->closing = 1;
+            return;
+        }
+        memcpy(client->read_buf, scratch + consumed, remaining);
+        client->read_len = remaining;
+    } else {
+        memmove(client->read_buf, client->read_buf + consumed, remaining);
+        client->read_len = remaining;
+    }
+}
+
+#ifndef _WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int repl_send_all(socket_t sock, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
 }
 
-int set_key(HashTable* ht, const char* key, const char* value, int expire_seconds) {
-    unsigned int index = hash_function(key);
-    Bucket* bucket = &ht->buckets[index];
+/*
+ * Sends the replica a point-in-time copy of every database. The shards are
+ * locked only across the fork; the child streams its copy-on-write view
+ * while the parent waits for it. Returns the stream offset the copy
+ * corresponds to, or -1 on failure.
+ */
+static long long repl_full_sync(XDBServer* server, XDBReplLink* link) {
+    XDBReplication* repl = server->repl;
     
-    mutex_lock(&ht->locks[index]);
+    mutex_lock(&server->db_mutex);
+    int db_count = server->db_count;
+    for (int i = 0; i < db_count; i++) {
+        lock_all_shards(server->databases[i].store);
+    }
     
-    for (int i = 0; i < bucket->size; i++) {
-        if (strcmp(bucket->entries[i].key, key) == 0) {
-            strncpy(bucket->entries[i].value, value, MAX_VALUE_SIZE - 1);
-            bucket->entries[i].value[MAX_VALUE_SIZE - 1] = '\0';
-            
-            if (expire_seconds > 0) {
-                bucket->entries[i].expiry = time(NULL) + expire_seconds;
-            } else {
-                bucket->entries[i].expiry = 0;
-            }
-            
-            mutex_unlock(&ht->locks[index]);
-            return 1;
+    mutex_lock(&repl->lock);
+    if (!repl->active) {
+        repl->backlog = malloc(XDB_REPL_BACKLOG_SIZE);
+        repl->active = repl->backlog != NULL;
+    }
+    uint64_t offset = repl->offset;
+    repl->last_db = -1;
+    int active = repl->active;
+    mutex_unlock(&repl->lock);
+    
+    pid_t pid = -1;
+    if (active) {
+        for (int i = 0; i < db_count; i++) {
+            repl_attach(server, i);
+        }
+        pid = fork();
+    }
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        char header[128];
+        int n = snprintf(header, sizeof(header), "+FULLRESYNC %s %llu\r\n",
+                         repl->replid, (unsigned long long)offset);
+        int ok = write_all(link->sock, header, n);
+        for (int i = 0; i < db_count && ok; i++) {
+            char index[16];
+            int index_len = sprintf(index, "%d", i);
+            n = snprintf(header, sizeof(header), "*2\r\n$8\r\nSELECTDB\r\n$%d\r\n%s\r\n", index_len, index);
+            ok = write_all(link->sock, header, n) && write_dataset(server->databases[i].store, link->sock);
         }
+        ok = ok && write_all(link->sock, "*1\r\n$7\r\nSYNCEND\r\n", 17);
+        _exit(ok ? 0 : 1);
     }
     
-    if (bucket->size >= bucket->capacity) {
-        int new_capacity = bucket->capacity == 0 ? 2 : bucket->capacity * 2;
-        KeyValue* new_entries = realloc(bucket->entries, sizeof(KeyValue) * new_capacity);
-        if (!new_entries) {
-            mutex_unlock(&ht->locks[index]);
-            return 0;
+    for (int i = db_count - 1; i >= 0; i--) {
+        unlock_all_shards(server->databases[i].store);
+    }
+    mutex_unlock(&server->db_mutex);
+    
+    if (pid < 0) return -1;
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    return (long long)offset;
+}
+
+static void* repl_link_run(void* arg) {
+    XDBReplLink* link = (XDBReplLink*)arg;
+    XDBServer* server = link->server;
+    XDBReplication* repl = server->repl;
+    char* chunk = malloc(XDB_REPL_CHUNK);
+    uint64_t pos = 0;
+    int ok = chunk != NULL;
+    char replid[XDB_REPLID_SIZE + 1];
+    
+    mutex_lock(&repl->lock);
+    uint64_t epoch = repl->epoch;
+    memcpy(replid, repl->replid, sizeof(replid));
+    int partial = ok && repl->active && strcmp(link->replid, repl->replid) == 0 &&
+                  link->offset >= 0 && (uint64_t)link->offset <= repl->offset &&
+                  (uint64_t)link->offset >= repl->offset - repl->backlog_len;
+    mutex_unlock(&repl->lock);
+    
+    if (partial) {
+        char header[64];
+        int n = snprintf(header, sizeof(header), "+CONTINUE %s\r\n", replid);
+        pos = (uint64_t)link->offset;
+        ok = repl_send_all(link->sock, header, n);
+    } else if (ok) {
+        long long offset = repl_full_sync(server, link);
+        ok = offset >= 0;
+        pos = (uint64_t)offset;
+    }
+    
+    mutex_lock(&repl->lock);
+    while (ok && !repl->stopping) {
+        /* The stream lost a command since this link started; the replica must resync in full. */
+        if (epoch != repl->epoch) break;
+        if (pos == repl->offset) {
+            cond_wait(&repl->cond, &repl->lock);
+            continue;
         }
-        bucket->entries = new_entries;
-        bucket->capacity = new_capacity;
+        /* Fell out of the backlog; the replica reconnects and resyncs in full. */
+        if (pos < repl->offset - repl->backlog_len) break;
+        
+        size_t len = repl->offset - pos > XDB_REPL_CHUNK ? XDB_REPL_CHUNK : (size_t)(repl->offset - pos);
+        size_t start = (size_t)(pos % XDB_REPL_BACKLOG_SIZE);
+        size_t first = XDB_REPL_BACKLOG_SIZE - start < len ? XDB_REPL_BACKLOG_SIZE - start : len;
+        memcpy(chunk, repl->backlog + start, first);
+        memcpy(chunk + first, repl->backlog, len - first);
+        mutex_unlock(&repl->lock);
+        
+        ok = repl_send_all(link->sock, chunk, len);
+        pos += len;
+        mutex_lock(&repl->lock);
     }
     
-    KeyValue* entry = &bucket->entries[bucket->size++];
-    strncpy(entry->key, key, MAX_KEY_SIZE - 1);
-    entry->key[MAX_KEY_SIZE - 1] = '\0';
-    strncpy(entry->value, value, MAX_VALUE_SIZE - 1);
-    entry->value[MAX_VALUE_SIZE - 1] = '\0';
+    XDBReplLink** prev = &repl->links;
+    while (*prev && *prev != link) prev = &(*prev)->next;
+    if (*prev) *prev = link->next;
+    repl->link_count--;
+    cond_broadcast(&repl->cond);
+    mutex_unlock(&repl->lock);
     
-    if (expire_seconds > 0) {
-        entry->expiry = time(NULL) + expire_seconds;
-    } else {
-        entry->expiry = 0;
+    close_socket(link->sock);
+    free(chunk);
+    free(link);
+    return NULL;
+}
+
+/*
+ * Takes over a client that issued PSYNC once its pending replies are out.
+ * On success the link thread owns the socket; otherwise the caller closes it.
+ */
+static int repl_start_link(XDBServer* server, ClientInfo* client) {
+    XDBReplication* repl = server->repl;
+    XDBReplLink* link = (XDBReplLink*)client->replica;
+    client->replica = NULL;
+    
+    int flags = fcntl(client->client_sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(client->client_sock, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        free(link);
+        return 0;
+    }
+    struct timeval timeout = {XDB_REPL_TIMEOUT, 0};
+    setsockopt(client->client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    client->closing = 0;
+    client_flush(client);
+    if (client->closing) {
+        free(link);
+        return 0;
+    }
+    
+    link->server = server;
+    link->sock = client->client_sock;
+    
+    mutex_lock(&repl->lock);
+    if (repl->stopping) {
+        mutex_unlock(&repl->lock);
+        free(link);
+        return 0;
     }
+    link->next = repl->links;
+    repl->links = link;
+    repl->link_count++;
+    mutex_unlock(&repl->lock);
     
-    mutex_unlock(&ht->locks[index]);
+    thread_t thread;
+    if (thread_create(&thread, repl_link_run, link) != 0) {
+        mutex_lock(&repl->lock);
+        repl->links = link->next;
+        repl->link_count--;
+        mutex_unlock(&repl->lock);
+        free(link);
+        return 0;
+    }
+    thread_detach(thread);
     return 1;
 }
 
-int get_key(HashTable* ht, const char* key, char* value_buf, size_t buf_size) {
-    unsigned int index = hash_function(key);
-    Bucket* bucket = &ht->buckets[index];
+static socket_t repl_connect(const char* host, int port) {
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    char service[16];
     
-    mutex_lock(&ht->locks[index]);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(service, "%d", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0) return INVALID_SOCKET;
     
-    for (int i = 0; i < bucket->size; i++) {
-        if (strcmp(bucket->entries[i].key, key) == 0) {
-            if (bucket->entries[i].expiry > 0 && bucket->entries[i].expiry < time(NULL)) {
-                memmove(&bucket->entries[i], &bucket->entries[i + 1], 
-                        sizeof(KeyValue) * (bucket->size - i - 1));
-                bucket->size--;
-                mutex_unlock(&ht->locks[index]);
-                return 0;
-            }
-            
-            strncpy(value_buf, bucket->entries[i].value, buf_size - 1);
-            value_buf[buf_size - 1] = '\0';
-            mutex_unlock(&ht->locks[index]);
-            return 1;
-        }
+    socket_t sock = INVALID_SOCKET;
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == INVALID_SOCKET) continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close_socket(sock);
+        sock = INVALID_SOCKET;
     }
+    freeaddrinfo(result);
     
-    mutex_unlock(&ht->locks[index]);
-    return 0;
+    if (sock != INVALID_SOCKET) {
+        /* The primary pings every XDB_REPL_PING_INTERVAL seconds, so silence means it is gone. */
+        struct timeval timeout = {XDB_REPL_TIMEOUT, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return sock;
 }
 
-int delete_key(HashTable* ht, const char* key) {
-    unsigned int index = hash_function(key);
-    Bucket* bucket = &ht->buckets[index];
-    
-    mutex_lock(&ht->locks[index]);
+typedef struct {
+    socket_t sock;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+} XDBReplReader;
+
+static int repl_reader_fill(XDBReplReader* r) {
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (!buffer_reserve(&r->buf, &r->cap, r->len + XDB_READ_CHUNK)) return 0;
     
-    for (int i = 0; i < bucket->size; i++) {
-        if (strcmp(bucket->entries[i].key, key) == 0) {
-            memmove(&bucket->entries[i], &bucket->entries[i + 1], 
-                    sizeof(KeyValue) * (bucket->size - i - 1));
-            bucket->size--;
-            mutex_unlock(&ht->locks[index]);
+    for (;;) {
+        ssize_t n = recv(r->sock, r->buf + r->len, r->cap - r->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        r->len += n;
+        return 1;
+    }
+}
+
+static int repl_read_line(XDBReplReader* r, char* line, size_t size) {
+    for (;;) {
+        char* newline = r->len > r->pos ? memchr(r->buf + r->pos, '\n', r->len - r->pos) : NULL;
+        if (newline) {
+            size_t n = newline - (r->buf + r->pos);
+            size_t copy = n < size - 1 ? n : size - 1;
+            memcpy(line, r->buf + r->pos, copy);
+            if (copy > 0 && line[copy - 1] == '\r') copy--;
+            line[copy] = '\0';
+            r->pos += n + 1;
             return 1;
         }
+        if (!repl_reader_fill(r)) return 0;
+    }
+}
+
+/* Reads the next command from the primary. Returns its size on the wire, or 0 once the link is gone. */
+static long repl_read_command(XDBReplReader* r, XDBArgv* args) {
+    for (;;) {
+        long n = r->len > r->pos ? parse_resp_command(r->buf + r->pos, r->len - r->pos, args) : 0;
+        if (n < 0) return 0;
+        if (n > 0) {
+            r->pos += n;
+            return n;
+        }
+        if (!repl_reader_fill(r)) return 0;
     }
+}
+
+/* Applies one command from the primary. Returns 0 for the SYNCEND that closes a full resync. */
+static int repl_apply(XDBServer* server, XDBArgv* args) {
+    XDBReplication* repl = server->repl;
+    if (args->count == 0) return 1;
     
-    mutex_unlock(&ht->locks[index]);
-    return 0;
+    const char* name = args->items[0].ptr;
+    if (strcasecmp(name, "SYNCEND") == 0) return 0;
+    if (strcasecmp(name, "PING") == 0) return 1;
+    if (strcasecmp(name, "SELECTDB") == 0 && args->count >= 2) {
+        repl->db_index = atoi(args->items[1].ptr);
+        return 1;
+    }
+    if (repl->db_index >= 0 && repl->db_index < server->db_count) {
+        aof_apply(server->databases[repl->db_index].store, args);
+    }
+    return 1;
 }
 
-void save_to_file(HashTable* ht, const char* filename) {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        return;
+/* Loads the dataset that follows +FULLRESYNC into freshly flushed databases. */
+static int repl_load_full(XDBServer* server, XDBReplReader* reader, XDBArgv* args, const char* line) {
+    XDBReplication* repl = server->repl;
+    char replid[XDB_REPLID_SIZE + 1];
+    unsigned long long offset = 0;
+    if (sscanf(line, "+FULLRESYNC %40s %llu", replid, &offset) != 2) return 0;
+    
+    mutex_lock(&repl->lock);
+    repl->state = XDB_REPL_SYNCING;
+    repl->replid[0] = '\0';
+    mutex_unlock(&repl->lock);
+    
+    for (int i = 0; i < server->db_count; i++) {
+        flush_hash_table(server->databases[i].store);
     }
+    repl->db_index = -1;
     
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        mutex_lock(&ht->locks[i]);
-        Bucket* bucket = &ht->buckets[i];
-        
-        for (int j = 0; j < bucket->size; j++) {
-            KeyValue* entry = &bucket->entries[j];
-            if (entry->expiry == 0 || entry->expiry > time(NULL)) {
-                size_t key_len = strlen(entry->key);
-                size_t value_len = strlen(entry->value);
-                
-                fwrite(&key_len, sizeof(size_t), 1, file);
-                fwrite(entry->key, 1, key_len, file);
-                fwrite(&value_len, sizeof(size_t), 1, file);
-                fwrite(entry->value, 1, value_len, file);
-                fwrite(&entry->expiry, sizeof(time_t), 1, file);
-            }
-        }
-        
-        mutex_unlock(&ht->locks[i]);
+    long n;
+    while ((n = repl_read_command(reader, args)) > 0 && repl_apply(server, args)) {
     }
+    if (n <= 0) return 0;
     
-    fclose(file);
+    mutex_lock(&repl->lock);
+    strcpy(repl->replid, replid);
+    repl->applied = offset;
+    mutex_unlock(&repl->lock);
+    return 1;
 }
 
-void load_from_file(HashTable* ht, const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        return;
-    }
+/* Replica side: keeps a link to the primary up and applies its stream. */
+static void* repl_replica_run(void* arg) {
+    XDBServer* server = (XDBServer*)arg;
+    XDBReplication* repl = server->repl;
+    XDBReplReader reader = {0};
+    XDBArgv args = {0};
+    char line[256];
     
-    while (!feof(file)) {
-        size_t key_len, value_len;
-        time_t expiry;
-        char key[MAX_KEY_SIZE];
-        char value[MAX_VALUE_SIZE];
-        
-        if (fread(&key_len, sizeof(size_t), 1, file) != 1) {
-            break;
+    while (repl->running) {
+        socket_t sock = repl_connect(repl->master_host, repl->master_port);
+        if (sock == INVALID_SOCKET) {
+            sleep_ms(1000);
+            continue;
         }
         
-        if (key_len >= MAX_KEY_SIZE) {
+        mutex_lock(&repl->lock);
+        if (!repl->running) {
+            mutex_unlock(&repl->lock);
+            close_socket(sock);
             break;
         }
+        repl->master_sock = sock;
+        repl->state = XDB_REPL_CONNECTING;
+        int n = repl->replid[0]
+            ? snprintf(line, sizeof(line), "PSYNC %s %llu\r\n", repl->replid, (unsigned long long)repl->applied)
+            : snprintf(line, sizeof(line), "PSYNC ? -1\r\n");
+        mutex_unlock(&repl->lock);
         
-        if (fread(key, 1, key_len, file) != key_len) {
-            break;
+        reader.sock = sock;
+        reader.len = 0;
+        reader.pos = 0;
+        
+        int ok = repl_send_all(sock, line, n) && repl_read_line(&reader, line, sizeof(line));
+        if (ok && strncmp(line, "+FULLRESYNC ", 12) == 0) {
+            ok = repl_load_full(server, &reader, &args, line);
+        } else if (!ok || strncmp(line, "+CONTINUE", 9) != 0) {
+            ok = 0;
         }
-        key[key_len] = '\0';
         
-        if (fread(&value_len, sizeof(size_t), 1, file) != 1) {
-            break;
+        if (ok) {
+            mutex_lock(&repl->lock);
+            repl->state = XDB_REPL_CONNECTED;
+            mutex_unlock(&repl->lock);
+            
+            long consumed;
+            while ((consumed = repl_read_command(&reader, &args)) > 0) {
+                repl_apply(server, &args);
+                journal_sync_pending();
+                mutex_lock(&repl->lock);
+                repl->applied += consumed;
+                mutex_unlock(&repl->lock);
+            }
         }
         
-        if (value_len >= MAX_VALUE_SIZE) {
+        mutex_lock(&repl->lock);
+        repl->master_sock = INVALID_SOCKET;
+        repl->state = XDB_REPL_CONNECTING;
+        mutex_unlock(&repl->lock);
+        close_socket(sock);
+        
+        if (repl->running) sleep_ms(1000);
+    }
+    
+    free(reader.buf);
+    free(args.items);
+    return NULL;
+}
+
+static void repl_start(XDBServer* server) {
+    XDBReplication* repl = server->repl;
+    repl->stopping = 0;
+    if (!server_is_replica(server)) return;
+    
+    repl->running = 1;
+    if (thread_create(&repl->thread, repl_replica_run, server) != 0) {
+        repl->running = 0;
+    }
+}
+
+/* Closes every link and stops the replica thread; returns once none of them touch the databases. */
+static void repl_stop(XDBServer* server) {
+    XDBReplication* repl = server->repl;
+    
+    mutex_lock(&repl->lock);
+    int was_running = repl->running;
+    repl->running = 0;
+    repl->stopping = 1;
+    if (repl->master_sock != INVALID_SOCKET) {
+        shutdown(repl->master_sock, SHUT_RDWR);
+    }
+    for (XDBReplLink* link = repl->links; link; link = link->next) {
+        shutdown(link->sock, SHUT_RDWR);
+    }
+    cond_broadcast(&repl->cond);
+    while (repl->link_count > 0) {
+        cond_wait(&repl->cond, &repl->lock);
+    }
+    mutex_unlock(&repl->lock);
+    
+    if (was_running) {
+        thread_join(repl->thread);
+    }
+}
+#else
+#define repl_start_link(server, client) 0
+#define repl_start(server) ((void)(server))
+#define repl_stop(server) ((void)(server))
+#endif
+
+#ifndef XDB_USE_EPOLL
+#ifdef _WIN32
+DWORD WINAPI handle_client(LPVOID arg) {
+#else
+void* handle_client(void* arg) {
+#endif
+    ClientInfo* info = (ClientInfo*)arg;
+    XDBServer* server = (XDBServer*)info->server;
+    char* buffer = malloc(XDB_READ_CHUNK);
+    XDBArgv args = {0};
+    
+    info->current_db_index = 0;
+    info->stats = metrics_attach(server->metrics);
+    
+    while (buffer && server->server_running && !info->closing) {
+        int bytes_received = recv(info->client_sock, buffer, XDB_READ_CHUNK, 0);
+        if (bytes_received < 0 && info->subscriber && socket_timed_out()) {
+            client_deliver(info);
+            continue;
+        }
+        if (bytes_received <= 0) {
             break;
         }
         
-        if (fread(value, 1, value_len, file) != value_len) {
+        client_feed(server, info, buffer, bytes_received, &args);
+        journal_sync_pending();
+        client_deliver(info);
+    }
+    pubsub_drop_client(server->pubsub, info);
+    
+    if (!info->replica || !repl_start_link(server, info)) {
+        close_socket(info->client_sock);
+    }
+    metrics_detach(server->metrics, info->stats);
+    reply_free(info);
+    free(info->read_buf);
+    free(info);
+    free(args.items);
+    free(buffer);
+    
+    mutex_lock(&server->client_mutex);
+    server->client_count--;
+    mutex_unlock(&server->client_mutex);
+    
+    return 0;
+}
+#else
+static int set_nonblocking(socket_t sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static socket_t create_listen_socket(int port, int reuse_port) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+#else
+    if (reuse_port) {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+#endif
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    
+    if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR ||
+        listen(sock, SOMAXCONN) == SOCKET_ERROR ||
+        set_nonblocking(sock) < 0) {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+    
+    return sock;
+}
+
+static void client_close(XDBReactor* reactor, ClientInfo* client) {
+    /* Owners of forwarded commands still hold references; the last reply closes it. */
+    if (client->in_flight > 0) {
+        client->closing = 1;
+        return;
+    }
+    if (client->deferred) {
+        message_free((XDBMessage*)client->deferred);
+        client->deferred = NULL;
+    }
+    pubsub_drop_client(((XDBServer*)client->server)->pubsub, client);
+    
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->client_sock, NULL);
+    if (!client->replica || !repl_start_link((XDBServer*)client->server, client)) {
+        close_socket(client->client_sock);
+    }
+    
+    if (client->prev) client->prev->next = client->next;
+    else reactor->clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+    reactor->client_count--;
+    
+    reply_free(client);
+    free(client->read_buf);
+    free(client);
+}
+
+static void client_on_readable(XDBServer* server, XDBReactor* reactor, ClientInfo* client) {
+    while (!client->closing) {
+        ssize_t n = recv(client->client_sock, reactor->scratch, XDB_READ_CHUNK, 0);
+        if (n == 0) {
+            /* Forwarded commands are outstanding; finish the input before closing. */
+            if (client->in_flight > 0) client->hangup = 1;
+            else client->closing = 1;
             break;
         }
-        value[value_len] = '\0';
-        
-        if (fread(&expiry, sizeof(time_t), 1, file) != 1) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->closing = 1;
+            }
             break;
         }
         
-        if (expiry == 0 || expiry > time(NULL)) {
-            unsigned int index = hash_function(key);
-            Bucket* bucket = &ht->buckets[index];
-            
-            mutex_lock(&ht->locks[index]);
-            
-            if (bucket->size >= bucket->capacity) {
-                int new_capacity = bucket->capacity == 0 ? 2 : bucket->capacity * 2;
-                KeyValue* new_entries = realloc(bucket->entries, sizeof(KeyValue) * new_capacity);
-                if (!new_entries) {
-                    mutex_unlock(&ht->locks[index]);
-                    continue;
-                }
-                bucket->entries = new_entries;
-                bucket->capacity = new_capacity;
-            }
-            
-            KeyValue* entry = &bucket->entries[bucket->size++];
-            strncpy(entry->key, key, MAX_KEY_SIZE - 1);
-            entry->key[MAX_KEY_SIZE - 1] = '\0';
-            strncpy(entry->value, value, MAX_VALUE_SIZE - 1);
-            entry->value[MAX_VALUE_SIZE - 1] = '\0';
-            entry->expiry = expiry;
-            
-            mutex_unlock(&ht->locks[index]);
+        client_feed(server, client, reactor->scratch, n, &reactor->args);
+    }
+    
+    /* Everything produced by this read batch goes out together, once the
+     * writes behind it are as durable as the AOF policy asks for. */
+    journal_sync_pending();
+    client_flush(client);
+}
+
+/* Runs a command forwarded by another reactor and posts the reply back to it. */
+static void reactor_serve_request(XDBServer* server, XDBReactor* reactor, XDBMessage* msg) {
+    ClientInfo proxy;
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.client_sock = INVALID_SOCKET;
+    proxy.current_db_index = msg->db_index;
+    proxy.server = server;
+    proxy.reactor = reactor;
+    proxy.stats = reactor->stats;
+    
+    if (parse_resp_command(msg->data, msg->len, &reactor->args) > 0) {
+        execute_command(server, &proxy, &reactor->args);
+    }
+    journal_sync_pending();
+    
+    msg->kind = XDB_MSG_REPLY;
+    msg->reply_head = proxy.reply_head;
+    msg->reply_tail = proxy.reply_tail;
+    msg->reply_bytes = proxy.reply_bytes;
+    reactor_post(msg->origin, msg);
+}
+
+/*
+ * Puts the owner's reply in place of its pending chunk, then runs a held
+ * back keyless command once nothing is in flight and carries on with the
+ * input that arrived meanwhile.
+ */
+static void reactor_complete_request(XDBServer* server, XDBReactor* reactor, XDBMessage* msg) {
+    ClientInfo* client = msg->client;
+    XDBReplyChunk* slot = msg->slot;
+    
+    slot->pending = 0;
+    if (msg->reply_head) {
+        msg->reply_tail->next = slot->next;
+        slot->next = msg->reply_head;
+        if (client->reply_tail == slot) client->reply_tail = msg->reply_tail;
+        client->reply_bytes += msg->reply_bytes;
+        msg->reply_head = NULL;
+    }
+    message_free(msg);
+    client->in_flight--;
+    
+    if (client->in_flight == 0 && client->deferred && !client->closing) {
+        XDBMessage* deferred = (XDBMessage*)client->deferred;
+        client->deferred = NULL;
+        client->blocked = 0;
+        if (parse_resp_command(deferred->data, deferred->len, &reactor->args) > 0) {
+            execute_command(server, client, &reactor->args);
         }
+        message_free(deferred);
     }
     
-    fclose(file);
+    if (!client->closing && !client->blocked) {
+        client_feed(server, client, reactor->scratch, 0, &reactor->args);
+        journal_sync_pending();
+    }
+    /* A client that hung up while waiting still gets what it asked for. */
+    if (client->hangup && client->in_flight == 0 && !client->blocked) {
+        client->closing = 1;
+    }
+    client_flush(client);
+    if (client->closing) {
+        client_close(reactor, client);
+    }
 }
 
-Database* create_database(const char* name, const char* db_path) {
-    Database* db = (Database*)malloc(sizeof(Database));
-    if (!db) return NULL;
+/* Delivers what was published to a subscriber since it was last woken. */
+static void reactor_deliver_messages(XDBReactor* reactor, XDBMessage* msg) {
+    XDBSubscriber* sub = msg->subscriber;
+    ClientInfo* client = sub->client;
     
-    strncpy(db->name, name, MAX_DB_NAME_SIZE - 1);
-    db->name[MAX_DB_NAME_SIZE - 1] = '\0';
+    if (client) {
+        client_deliver(client);
+        if (client->closing) {
+            client_close(reactor, client);
+        }
+    }
+    subscriber_release(sub);
+}
+
+static void reactor_drain_inbox(XDBServer* server, XDBReactor* reactor) {
+    uint64_t count;
+    while (read(reactor->event_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
     
-    db->store = (HashTable*)malloc(sizeof(HashTable));
-    if (!db->store) {
-        free(db);
-        return NULL;
+    XDBMessage* msg = __atomic_exchange_n(&reactor->inbox, NULL, __ATOMIC_ACQUIRE);
+    XDBMessage* ordered = NULL;
+    while (msg) {
+        XDBMessage* next = msg->next;
+        msg->next = ordered;
+        ordered = msg;
+        msg = next;
+    }
+    
+    while (ordered) {
+        XDBMessage* next = ordered->next;
+        if (ordered->kind == XDB_MSG_REQUEST) {
+            reactor_serve_request(server, reactor, ordered);
+        } else if (ordered->kind == XDB_MSG_REPLY) {
+            reactor_complete_request(server, reactor, ordered);
+        } else {
+            reactor_deliver_messages(reactor, ordered);
+        }
+        ordered = next;
+    }
+}
+
+static void reactor_accept(XDBServer* server, XDBReactor* reactor, XDBListener* listener) {
+    while (server->server_running) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        
+        socket_t client_sock = accept(listener->sock, (struct sockaddr*)&client_addr, &addr_len);
+        if (client_sock == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        
+        ClientInfo* client = (ClientInfo*)calloc(1, sizeof(ClientInfo));
+        if (!client || set_nonblocking(client_sock) < 0) {
+            free(client);
+            close_socket(client_sock);
+            continue;
+        }
+        
+        client->client_sock = client_sock;
+        client->client_addr = client_addr;
+        client->current_db_index = 0;
+        client->protocol = listener->protocol;
+        client->server = server;
+        client->reactor = reactor;
+        client->stats = reactor->stats;
+        xdb_atomic_add64(&server->metrics->connections, 1);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            free(client);
+            close_socket(client_sock);
+            continue;
+        }
+        
+        client->next = reactor->clients;
+        if (reactor->clients) reactor->clients->prev = client;
+        reactor->clients = client;
+        reactor->client_count++;
     }
-    
-    db->db_path = strdup(db_path);
-    init_hash_table(db->store);
-    load_from_file(db->store, db->db_path);
-    
-    return db;
-}
-
-void destroy_database(Database* db) {
-    if (!db) return;
-    
-    save_to_file(db->store, db->db_path);
-    free_hash_table(db->store);
-    free(db->store);
-    free(db->db_path);
-    free(db);
 }
 
-#ifdef _WIN32
-DWORD WINAPI handle_client(LPVOID arg) {
-#else
-void* handle_client(void* arg) {
-#endif
-    ClientInfo* info = (ClientInfo*)arg;
-    XDBServer* server = (XDBServer*)info->server;
-    socket_t client_sock = info->client_sock;
-    char buffer[MAX_COMMAND_SIZE];
-    char response[MAX_VALUE_SIZE + 128];
-    
-    info->current_db_index = 0;
+static void* reactor_run(void* arg) {
+    XDBReactor* reactor = (XDBReactor*)arg;
+    XDBServer* server = (XDBServer*)reactor->server;
+    struct epoll_event events[XDB_EPOLL_EVENTS];
+    reactor->scratch = malloc(XDB_READ_CHUNK);
+    if (!reactor->scratch) return NULL;
     
     while (server->server_running) {
-        int bytes_received = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0) {
+        int n = epoll_wait(reactor->epoll_fd, events, XDB_EPOLL_EVENTS, 100);
+        if (n < 0) {
+            if (errno == EINTR) continue;
             break;
         }
         
-        buffer[bytes_received] = '\0';
-        
-        char* cmd = strtok(buffer, " \r\n");
-        if (!cmd) continue;
-        
-        if (strcmp(cmd, "SET") == 0) {
-            char* key = strtok(NULL, " \r\n");
-            char* value = strtok(NULL, " \r\n");
-            char* expire_str = strtok(NULL, " \r\n");
-            
-            if (!key || !value) {
-                strcpy(response, "-ERR invalid syntax\r\n");
-            } else {
-                int expire_seconds = expire_str ? atoi(expire_str) : 0;
-                mutex_lock(&server->db_mutex);
-                if (info->current_db_index < server->db_count && 
-                    set_key(server->databases[info->current_db_index].store, key, value, expire_seconds)) {
-                    strcpy(response, "+OK\r\n");
-                } else {
-                    strcpy(response, "-ERR failed to set key\r\n");
-                }
-                mutex_unlock(&server->db_mutex);
+        int inbox_ready = 0;
+        for (int i = 0; i < n; i++) {
+            XDBListener* listener = (XDBListener*)events[i].data.ptr;
+            if (listener >= reactor->listeners && listener < reactor->listeners + reactor->listener_count) {
+                reactor_accept(server, reactor, listener);
+                continue;
             }
-        } else if (strcmp(cmd, "GET") == 0) {
-            char* key = strtok(NULL, " \r\n");
-            
-            if (!key) {
-                strcpy(response, "-ERR invalid syntax\r\n");
-            } else {
-                char value[MAX_VALUE_SIZE];
-                mutex_lock(&server->db_mutex);
-                if (info->current_db_index < server->db_count && 
-                    get_key(server->databases[info->current_db_index].store, key, value, sizeof(value))) {
-                    sprintf(response, "$%zu\r\n%s\r\n", strlen(value), value);
-                } else {
-                    strcpy(response, "$-1\r\n");
-                }
-                mutex_unlock(&server->db_mutex);
+            if (events[i].data.ptr == &reactor->inbox) {
+                inbox_ready = 1;
+                continue;
             }
-        } else if (strcmp(cmd, "DEL") == 0) {
-            char* key = strtok(NULL, " \r\n");
             
-            if (!key) {
-                strcpy(response, "-ERR invalid syntax\r\n");
-            } else {
-                mutex_lock(&server->db_mutex);
-                if (info->current_db_index < server->db_count && 
-                    delete_key(server->databases[info->current_db_index].store, key)) {
-                    strcpy(response, ":1\r\n");
-                } else {
-                    strcpy(response, ":0\r\n");
-                }
-                mutex_unlock(&server->db_mutex);
-            }
-        } else if (strcmp(cmd, "SELECTDB") == 0) {
-            char* db_index_str = strtok(NULL, " \r\n");
+            ClientInfo* client = (ClientInfo*)events[i].data.ptr;
+            uint32_t mask = events[i].events;
             
-            if (!db_index_str) {
-                strcpy(response, "-ERR invalid syntax\r\n");
-            } else {
-                int db_index = atoi(db_index_str);
-                mutex_lock(&server->db_mutex);
-                if (db_index >= 0 && db_index < server->db_count) {
-                    info->current_db_index = db_index;
-                    sprintf(response, "+OK switched to DB %d (%s)\r\n", 
-                            db_index, server->databases[db_index].name);
-                } else {
-                    strcpy(response, "-ERR invalid database index\r\n");
-                }
-                mutex_unlock(&server->db_mutex);
+            if (mask & EPOLLIN) {
+                client_on_readable(server, reactor, client);
             }
-        } else if (strcmp(cmd, "LISTDBS") == 0) {
-            mutex_lock(&server->db_mutex);
-            sprintf(response, "*%d\r\n", server->db_count);
-            char temp[MAX_DB_NAME_SIZE + 32];
-            
-            for (int i = 0; i < server->db_count; i++) {
-                sprintf(temp, "$%zu\r\n%d:%s\r\n", strlen(server->databases[i].name) + 2, 
-                        i, server->databases[i].name);
-                strcat(response, temp);
+            if ((mask & EPOLLOUT) && !client->closing) {
+                client_flush(client);
             }
-            mutex_unlock(&server->db_mutex);
-        } else if (strcmp(cmd, "SAVE") == 0) {
-            mutex_lock(&server->db_mutex);
-            if (info->current_db_index < server->db_count) {
-                save_to_file(server->databases[info->current_db_index].store, 
-                             server->databases[info->current_db_index].db_path);
-                strcpy(response, "+OK\r\n");
-            } else {
-                strcpy(response, "-ERR invalid database\r\n");
+            if ((mask & EPOLLRDHUP) && client->in_flight > 0) {
+                client->hangup = 1;
+            } else if ((mask & (EPOLLERR | EPOLLHUP)) ||
+                       ((mask & EPOLLRDHUP) && !client->reply_head)) {
+                client->closing = 1;
             }
-            mutex_unlock(&server->db_mutex);
-        } else if (strcmp(cmd, "SAVEALL") == 0) {
-            mutex_lock(&server->db_mutex);
-            for (int i = 0; i < server->db_count; i++) {
-                save_to_file(server->databases[i].store, server->databases[i].db_path);
+            if (client->closing) {
+                client_close(reactor, client);
             }
-            strcpy(response, "+OK all databases saved\r\n");
-            mutex_unlock(&server->db_mutex);
-        } else if (strcmp(cmd, "PING") == 0) {
-            strcpy(response, "+PONG\r\n");
-        } else {
-            strcpy(response, "-ERR unknown command\r\n");
         }
         
-        send(client_sock, response, strlen(response), 0);
+        /* Last, since replies can close clients that still have events in this batch. */
+        if (inbox_ready) {
+            reactor_drain_inbox(server, reactor);
+        }
     }
     
-    close_socket(client_sock);
-    free(info);
-    
-    mutex_lock(&server->client_mutex);
-    server->client_count--;
-    mutex_unlock(&server->client_mutex);
+    /* Replies still in flight are dropped with the inboxes once every reactor has stopped. */
+    while (reactor->clients) {
+        reactor->clients->in_flight = 0;
+        client_close(reactor, reactor->clients);
+    }
     
-    return 0;
+    free(reactor->scratch);
+    free(reactor->args.items);
+    return NULL;
 }
+#endif
 
+/*
+ * Runs every 100 ms: sweeps expired keys within XDB_EXPIRE_BUDGET_US, reaps
+ * finished snapshot children, starts an autosave every
+ * XDB_AUTOSAVE_INTERVAL seconds, pings replicas and samples ops/sec. Replicas leave expiry
+ * to their primary, which streams the resulting deletes.
+ */
 #ifdef _WIN32
-DWORD WINAPI server_autosave(LPVOID arg) {
+DWORD WINAPI server_cron(LPVOID arg) {
 #else
-void* server_autosave(void* arg) {
+void* server_cron(void* arg) {
 #endif
     XDBServer* server = (XDBServer*)arg;
+    time_t last_save = time(NULL);
+    time_t last_ping = last_save;
     
     while (server->server_running) {
-        sleep_ms(30000);
+        sleep_ms(100);
         
         mutex_lock(&server->db_mutex);
-        for (int i = 0; i < server->db_count; i++) {
-            save_to_file(server->databases[i].store, server->databases[i].db_path);
+        int64_t deadline = monotonic_us() + XDB_EXPIRE_BUDGET_US;
+        for (int i = 0; i < server->db_count && !server_is_replica(server); i++) {
+            expire_active(server->databases[i].store, deadline);
+        }
+        journal_sync_pending();
+        
+        #ifndef _WIN32
+        snapshot_reap(server, WNOHANG);
+        #endif
+        time_t now = time(NULL);
+        if (now - last_save >= XDB_AUTOSAVE_INTERVAL && server_bgsave(server, -1) != 0) {
+            last_save = now;
+        }
+        if (now - last_ping >= XDB_REPL_PING_INTERVAL) {
+            repl_ping(server->repl);
+            last_ping = now;
         }
+        metrics_sample_ops(server->metrics);
         mutex_unlock(&server->db_mutex);
     }
     
     return 0;
 }
 
+static void server_close_listeners(XDBServer* server) {
+    for (int i = 0; i < server->listener_count; i++) {
+        if (server->listeners[i].sock != INVALID_SOCKET) {
+            close_socket(server->listeners[i].sock);
+            server->listeners[i].sock = INVALID_SOCKET;
+        }
+    }
+}
+
+#ifdef XDB_USE_EPOLL
+/*
+ * Reactor i > 0 gets its own SO_REUSEPORT socket per listener so the kernel
+ * spreads connections; without SO_REUSEPORT the reactors share the server's
+ * socket and race on accept.
+ */
+static int reactor_open_listeners(XDBServer* server, XDBReactor* reactor) {
+    for (int j = 0; j < server->listener_count; j++) {
+        XDBListener* listener = &reactor->listeners[j];
+        *listener = server->listeners[j];
+        if (reactor->index > 0) {
+            listener->sock = create_listen_socket(listener->port, 1);
+            if (listener->sock == INVALID_SOCKET) {
+                listener->sock = server->listeners[j].sock;
+            }
+        }
+        reactor->listener_count = j + 1;
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = listener;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listener->sock, &ev) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void reactor_close_listeners(XDBServer* server, XDBReactor* reactor) {
+    for (int j = 0; j < reactor->listener_count; j++) {
+        if (reactor->listeners[j].sock != server->listeners[j].sock) {
+            close_socket(reactor->listeners[j].sock);
+        }
+    }
+    reactor->listener_count = 0;
+}
+
+static int reactor_open_inbox(XDBReactor* reactor) {
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->event_fd < 0) return 0;
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &reactor->inbox;
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &ev) == 0;
+}
+
+/* Frees whatever is left in the inbox once no reactor can post to it any more. */
+static void reactor_close_inbox(XDBReactor* reactor) {
+    XDBMessage* msg = reactor->inbox;
+    while (msg) {
+        XDBMessage* next = msg->next;
+        if (msg->kind == XDB_MSG_PUBSUB) subscriber_release(msg->subscriber);
+        else message_free(msg);
+        msg = next;
+    }
+    reactor->inbox = NULL;
+    if (reactor->event_fd >= 0) {
+        close(reactor->event_fd);
+        reactor->event_fd = -1;
+    }
+}
+
+static int server_start_reactors(XDBServer* server) {
+    signal(SIGPIPE, SIG_IGN);
+    
+    int count = server->reactor_count;
+    server->reactors = (XDBReactor*)calloc(count, sizeof(XDBReactor));
+    if (!server->reactors) return 0;
+    
+    for (int i = 0; i < server->listener_count; i++) {
+        server->listeners[i].sock = create_listen_socket(server->listeners[i].port, count > 1);
+        if (server->listeners[i].sock == INVALID_SOCKET) {
+            server_close_listeners(server);
+            free(server->reactors);
+            server->reactors = NULL;
+            return 0;
+        }
+    }
+    
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        XDBReactor* reactor = &server->reactors[i];
+        reactor->index = i;
+        reactor->server = server;
+        reactor->event_fd = -1;
+        
+        reactor->epoll_fd = epoll_create1(0);
+        if (reactor->epoll_fd < 0) break;
+        
+        if (!reactor_open_listeners(server, reactor) ||
+            !reactor_open_inbox(reactor)) {
+            reactor_close_listeners(server, reactor);
+            reactor_close_inbox(reactor);
+            close(reactor->epoll_fd);
+            break;
+        }
+        started++;
+    }
+    
+    /* Shard ownership is spread over the reactors that actually came up. */
+    server->reactor_count = started;
+    if (started == 0) {
+        server_close_listeners(server);
+        free(server->reactors);
+        server->reactors = NULL;
+        return 0;
+    }
+    
+    server->server_running = 1;
+    thread_create(&server->cron_thread, server_cron, server);
+    repl_start(server);
+    
+    for (int i = 0; i < started; i++) {
+        server->reactors[i].stats = metrics_attach(server->metrics);
+        thread_create(&server->reactors[i].thread, reactor_run, &server->reactors[i]);
+    }
+    
+    for (int i = 0; i < started; i++) {
+        thread_join(server->reactors[i].thread);
+        close(server->reactors[i].epoll_fd);
+        reactor_close_listeners(server, &server->reactors[i]);
+    }
+    for (int i = 0; i < started; i++) {
+        reactor_close_inbox(&server->reactors[i]);
+        metrics_detach(server->metrics, server->reactors[i].stats);
+    }
+    server_close_listeners(server);
+    repl_stop(server);
+    thread_join(server->cron_thread);
+    
+    free(server->reactors);
+    server->reactors = NULL;
+    return 1;
+}
+#endif
+
 XDBServer* xdb_server_create(int port) {
     XDBServer* server = (XDBServer*)malloc(sizeof(XDBServer));
     if (!server) return NULL;
     
+    /* Allocated at full size so command handlers can index it without db_mutex. */
+    server->databases = (Database*)calloc(MAX_DB_COUNT, sizeof(Database));
+    server->repl = repl_create();
+    server->metrics = server_metrics_create();
+    server->pubsub = pubsub_create();
+    if (!server->databases || !server->repl || !server->metrics || !server->pubsub) {
+        free(server->databases);
+        repl_destroy(server->repl);
+        metrics_destroy(server->metrics);
+        pubsub_destroy(server->pubsub);
+        free(server);
+        return NULL;
+    }
+    
     server->port = port > 0 ? port : DEFAULT_PORT;
+    server->listeners[0].port = server->port;
+    server->listeners[0].protocol = XDB_PROTO_RESP;
+    server->listeners[0].sock = INVALID_SOCKET;
+    server->listener_count = 1;
     server->server_running = 0;
     server->client_count = 0;
     server->db_count = 0;
-    server->databases = NULL;
+    server->reactors = NULL;
+    server->reactor_count = 1;
+    server->shared_nothing = 0;
+    server->maxmemory = 0;
+    server->maxmemory_policy = XDB_EVICT_NONE;
+    server->aof_policy = XDB_AOF_OFF;
+    server->save_pid = 0;
+    server->save_ok = 1;
     
     mutex_init(&server->client_mutex);
     mutex_init(&server->db_mutex);
@@ -445,120 +8069,248 @@ int xdb_server_add_database(XDBServer* server, const char* name, const char* db_
         }
     }
     
-    Database* new_dbs = (Database*)realloc(server->databases, 
-                                         sizeof(Database) * (server->db_count + 1));
-    if (!new_dbs) {
-        mutex_unlock(&server->db_mutex);
-        return 0;
-    }
-    server->databases = new_dbs;
-    
-    Database* db = create_database(name, db_path);
+    Database* db = create_database(name, db_path, server->aof_policy);
     if (!db) {
         mutex_unlock(&server->db_mutex);
         return 0;
     }
     
-    server->databases[server->db_count++] = *db;
+    server->databases[server->db_count] = *db;
     free(db);
+    repl_attach(server, server->db_count);
+    server->db_count++;
     
     mutex_unlock(&server->db_mutex);
     return 1;
 }
 
-int xdb_server_start(XDBServer* server) {
-    if (server->server_running || server->db_count == 0) {
-        return 0;
-    }
+/*
+ * Caps the memory the server's databases account for (0 removes the cap).
+ * Writes that would exceed it first evict keys by policy and fail with an
+ * OOM error when nothing more can be evicted. Can be changed while running.
+ */
+int xdb_server_set_maxmemory(XDBServer* server, size_t bytes, XDBEvictPolicy policy) {
+    if (!server || policy < XDB_EVICT_NONE || policy > XDB_EVICT_VOLATILE_LFU) return 0;
+    xdb_atomic_store64(&server->maxmemory, (int64_t)bytes);
+    xdb_atomic_store32(&server->maxmemory_policy, policy);
+    return 1;
+}
+
+int xdb_server_set_aof(XDBServer* server, XDBAofPolicy policy) {
+    if (!server || server->server_running) return 0;
+    server->aof_policy = policy;
+    return 1;
+}
+
+/*
+ * Makes the server a read-only replica of host:port once started, or a
+ * primary again when host is NULL. The replica needs the same databases,
+ * in the same order, as its primary.
+ */
+int xdb_server_set_replicaof(XDBServer* server, const char* host, int port) {
+    if (!server || server->server_running) return 0;
     
     #ifdef _WIN32
-    WSADATA wsa_data;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-        return 0;
+    return host == NULL;
+    #else
+    char* copy = NULL;
+    if (host) {
+        if (port <= 0 || !(copy = strdup(host))) return 0;
+    }
+    
+    XDBReplication* repl = server->repl;
+    free(repl->master_host);
+    repl->master_host = copy;
+    repl->master_port = port;
+    repl->applied = 0;
+    if (host) {
+        repl->replid[0] = '\0';
+    } else {
+        repl_generate_id(repl->replid);
     }
+    return 1;
     #endif
+}
+
+/* Listens on another port, or changes the protocol of one already configured. */
+int xdb_server_add_listener(XDBServer* server, int port, XDBProtocol protocol) {
+    if (!server || server->server_running || port <= 0) return 0;
     
-    server->server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->server_sock == INVALID_SOCKET) {
-        return 0;
+    for (int i = 0; i < server->listener_count; i++) {
+        if (server->listeners[i].port == port) {
+            server->listeners[i].protocol = protocol;
+            return 1;
+        }
+    }
+    if (server->listener_count >= XDB_MAX_LISTENERS) return 0;
+    
+    XDBListener* listener = &server->listeners[server->listener_count++];
+    listener->port = port;
+    listener->protocol = protocol;
+    listener->sock = INVALID_SOCKET;
+    return 1;
+}
+
+int xdb_server_set_reactors(XDBServer* server, int count) {
+    if (!server || server->server_running || count < 1 || count > XDB_MAX_REACTORS) return 0;
+    server->reactor_count = count;
+    return 1;
+}
+
+/*
+ * Partitions the keyspace over the reactors: each one runs the commands for
+ * the shards it owns and forwards the rest, and multi-key commands must
+ * stay within one owner. Needs the epoll reactors.
+ */
+int xdb_server_set_shared_nothing(XDBServer* server, int enabled) {
+    if (!server || server->server_running) return 0;
+    #ifdef XDB_USE_EPOLL
+    server->shared_nothing = enabled != 0;
+    return 1;
+    #else
+    return enabled == 0;
+    #endif
+}
+
+#ifndef XDB_USE_EPOLL
+static socket_t open_blocking_listener(int port) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        return INVALID_SOCKET;
     }
     
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(server->port);
+    server_addr.sin_port = htons(port);
     
     #ifdef _WIN32
     char opt = 1;
     #else
     int opt = 1;
     #endif
-    setsockopt(server->server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR ||
+        listen(sock, 10) == SOCKET_ERROR) {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+    
+    return sock;
+}
+
+static void server_accept_thread_client(XDBServer* server, XDBListener* listener) {
+    struct sockaddr_in client_addr;
+    #ifdef _WIN32
+    int addr_len = sizeof(client_addr);
+    #else
+    socklen_t addr_len = sizeof(client_addr);
+    #endif
+    
+    socket_t client_sock = accept(listener->sock, (struct sockaddr*)&client_addr, &addr_len);
+    if (client_sock == INVALID_SOCKET) {
+        return;
+    }
+    
+    mutex_lock(&server->client_mutex);
+    if (server->client_count >= MAX_CLIENTS) {
+        close_socket(client_sock);
+        mutex_unlock(&server->client_mutex);
+        return;
+    }
+    
+    ClientInfo* client_info = (ClientInfo*)calloc(1, sizeof(ClientInfo));
+    if (!client_info) {
+        close_socket(client_sock);
+        mutex_unlock(&server->client_mutex);
+        return;
+    }
+    
+    client_info->client_sock = client_sock;
+    client_info->client_addr = client_addr;
+    client_info->protocol = listener->protocol;
+    client_info->server = server;
+    xdb_atomic_add64(&server->metrics->connections, 1);
     
-    if (bind(server->server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        close_socket(server->server_sock);
+    thread_create(&server->client_threads[server->client_count], handle_client, client_info);
+    server->client_count++;
+    mutex_unlock(&server->client_mutex);
+}
+#endif
+
+int xdb_server_start(XDBServer* server) {
+    if (server->server_running || server->db_count == 0) {
         return 0;
     }
     
-    if (listen(server->server_sock, 10) == SOCKET_ERROR) {
-        close_socket(server->server_sock);
+    #ifdef XDB_USE_EPOLL
+    return server_start_reactors(server);
+    #else
+    #ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
         return 0;
     }
+    #endif
+    
+    for (int i = 0; i < server->listener_count; i++) {
+        server->listeners[i].sock = open_blocking_listener(server->listeners[i].port);
+        if (server->listeners[i].sock == INVALID_SOCKET) {
+            server_close_listeners(server);
+            return 0;
+        }
+    }
     
     server->server_running = 1;
     
-    thread_create(&server->autosave_thread, server_autosave, server);
+    thread_create(&server->cron_thread, server_cron, server);
+    repl_start(server);
     
     while (server->server_running) {
-        struct sockaddr_in client_addr;
-        #ifdef _WIN32
-        int addr_len = sizeof(client_addr);
-        #else
-        socklen_t addr_len = sizeof(client_addr);
-        #endif
-        
-        socket_t client_sock = accept(server->server_sock, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_sock == INVALID_SOCKET) {
-            continue;
+        fd_set ready;
+        FD_ZERO(&ready);
+        socket_t max_sock = 0;
+        for (int i = 0; i < server->listener_count; i++) {
+            FD_SET(server->listeners[i].sock, &ready);
+            if (server->listeners[i].sock > max_sock) max_sock = server->listeners[i].sock;
         }
         
-        mutex_lock(&server->client_mutex);
-        if (server->client_count >= MAX_CLIENTS) {
-            close_socket(client_sock);
-            mutex_unlock(&server->client_mutex);
+        struct timeval timeout = {0, 100000};
+        if (select((int)max_sock + 1, &ready, NULL, NULL, &timeout) <= 0) {
             continue;
         }
         
-        ClientInfo* client_info = (ClientInfo*)malloc(sizeof(ClientInfo));
-        if (!client_info) {
-            close_socket(client_sock);
-            mutex_unlock(&server->client_mutex);
-            continue;
+        for (int i = 0; i < server->listener_count; i++) {
+            if (FD_ISSET(server->listeners[i].sock, &ready)) {
+                server_accept_thread_client(server, &server->listeners[i]);
+            }
         }
-        
-        client_info->client_sock = client_sock;
-        client_info->client_addr = client_addr;
-        client_info->server = server;
-        
-        thread_create(&server->client_threads[server->client_count], handle_client, client_info);
-        server->client_count++;
-        mutex_unlock(&server->client_mutex);
     }
     
+    server_close_listeners(server);
+    repl_stop(server);
+    thread_join(server->cron_thread);
     return 1;
+    #endif
 }
 
+/*
+ * Stops a running server and saves every database. It may also be called
+ * once xdb_server_start has returned, after a signal handler only cleared
+ * server_running; the databases are saved all the same.
+ */
 void xdb_server_stop(XDBServer* server) {
-    if (!server->server_running) {
-        return;
+    if (server->server_running) {
+        server->server_running = 0;
+        sleep_ms(1000);
     }
     
-    server->server_running = 0;
-    close_socket(server->server_sock);
-    
-    sleep_ms(1000);
-    
     mutex_lock(&server->db_mutex);
+    #ifndef _WIN32
+    snapshot_reap(server, 0);
+    #endif
     for (int i = 0; i < server->db_count; i++) {
         save_to_file(server->databases[i].store, server->databases[i].db_path);
     }
@@ -569,6 +8321,11 @@ void xdb_server_stop(XDBServer* server) {
     #endif
 }
 
+int xdb_server_publish(XDBServer* server, const char* channel, const char* message) {
+    if (!server || !channel || !message) return -1;
+    return pubsub_publish(server->pubsub, channel, strlen(channel), message, strlen(message));
+}
+
 void xdb_server_destroy(XDBServer* server) {
     if (server->server_running) {
         xdb_server_stop(server);
@@ -576,6 +8333,7 @@ void xdb_server_destroy(XDBServer* server) {
     
     mutex_lock(&server->db_mutex);
     for (int i = 0; i < server->db_count; i++) {
+        aof_close(server->databases[i].aof);
         free_hash_table(server->databases[i].store);
         free(server->databases[i].store);
         free(server->databases[i].db_path);
@@ -583,6 +8341,9 @@ void xdb_server_destroy(XDBServer* server) {
     free(server->databases);
     mutex_unlock(&server->db_mutex);
     
+    repl_destroy(server->repl);
+    metrics_destroy(server->metrics);
+    pubsub_destroy(server->pubsub);
     mutex_destroy(&server->client_mutex);
     mutex_destroy(&server->db_mutex);
     free(server);
@@ -590,31 +8351,165 @@ void xdb_server_destroy(XDBServer* server) {
 
 
 XDBInstance* xdb_instance_create(const char* name, const char* db_path) {
+    return xdb_instance_create_with_aof(name, db_path, XDB_AOF_OFF);
+}
+
+XDBInstance* xdb_instance_create_with_aof(const char* name, const char* db_path, XDBAofPolicy policy) {
     XDBInstance* instance = (XDBInstance*)malloc(sizeof(XDBInstance));
     if (!instance) return NULL;
     
-    instance->db = create_database(name, db_path);
+    instance->db = create_database(name, db_path, policy);
     if (!instance->db) {
         free(instance);
         return NULL;
     }
+    instance->maxmemory = 0;
+    instance->maxmemory_policy = XDB_EVICT_NONE;
     
     return instance;
 }
 
-int xdb_instance_set(XDBInstance* instance, const char* key, const char* value, int expire_seconds) {
+/* Same contract as xdb_server_set_maxmemory, for the instance's one database. */
+int xdb_instance_set_maxmemory(XDBInstance* instance, size_t bytes, XDBEvictPolicy policy) {
+    if (!instance || policy < XDB_EVICT_NONE || policy > XDB_EVICT_VOLATILE_LFU) return 0;
+    xdb_atomic_store64(&instance->maxmemory, (int64_t)bytes);
+    xdb_atomic_store32(&instance->maxmemory_policy, policy);
+    return 1;
+}
+
+size_t xdb_instance_used_memory(XDBInstance* instance) {
     if (!instance || !instance->db) return 0;
-    return set_key(instance->db->store, key, value, expire_seconds);
+    return (size_t)xdb_atomic_load64(&instance->db->store->used_memory);
+}
+
+static int instance_reclaim_memory(XDBInstance* instance) {
+    XDBEvictPolicy policy = (XDBEvictPolicy)xdb_atomic_load32(&instance->maxmemory_policy);
+    return evict_to_limit(&instance->db->store, 1, xdb_atomic_load64(&instance->maxmemory), policy);
+}
+
+int xdb_instance_set(XDBInstance* instance, const char* key, const char* value, int expire_seconds) {
+    if (!instance || !instance->db || !instance_reclaim_memory(instance)) return 0;
+    int result = set_key(instance->db->store, key, strlen(key), value, strlen(value), expire_seconds);
+    journal_sync_pending();
+    return result;
 }
 
 int xdb_instance_get(XDBInstance* instance, const char* key, char* value_buf, size_t buf_size) {
     if (!instance || !instance->db) return 0;
-    return get_key(instance->db->store, key, value_buf, buf_size);
+    return get_key(instance->db->store, key, strlen(key), value_buf, buf_size);
+}
+
+int xdb_instance_get_view(XDBInstance* instance, const char* key, XDBView* view) {
+    if (!view) return 0;
+    view->data = NULL;
+    view->len = 0;
+    view->pin = NULL;
+    if (!instance || !instance->db) return 0;
+    return get_key_view(instance->db->store, key, strlen(key), view);
+}
+
+void xdb_instance_release_view(XDBInstance* instance, XDBView* view) {
+    if (!instance || !instance->db || !view) return;
+    release_key_view(instance->db->store, view);
+}
+
+int xdb_instance_incr(XDBInstance* instance, const char* key, int64_t delta, int64_t* result) {
+    if (!instance || !instance->db || !result) return 0;
+    if (!instance_reclaim_memory(instance)) return 0;
+    int status = incr_key(instance->db->store, key, strlen(key), delta, result);
+    journal_sync_pending();
+    return status > 0;
+}
+
+int xdb_instance_incr_float(XDBInstance* instance, const char* key, double delta, double* result) {
+    if (!instance || !instance->db || !result) return 0;
+    if (!instance_reclaim_memory(instance)) return 0;
+    int status = incr_key_float(instance->db->store, key, strlen(key), delta, result);
+    journal_sync_pending();
+    return status > 0;
+}
+
+typedef struct {
+    const char* pattern;
+    size_t pattern_len;
+    xdb_key_f fn;
+    void* ctx;
+} InstanceScan;
+
+static void instance_scan_key(const char* key, size_t len, void* ctx) {
+    InstanceScan* scan = (InstanceScan*)ctx;
+    if (!scan->pattern || glob_match(scan->pattern, scan->pattern_len, key, len)) {
+        scan->fn(key, len, scan->ctx);
+    }
+}
+
+uint64_t xdb_instance_scan(XDBInstance* instance, uint64_t cursor, size_t count,
+                           const char* pattern, xdb_key_f fn, void* ctx) {
+    if (!instance || !instance->db || !fn) return 0;
+    InstanceScan scan = { pattern, pattern ? strlen(pattern) : 0, fn, ctx };
+    return scan_keys(instance->db->store, cursor, count, instance_scan_key, &scan);
 }
 
 int xdb_instance_delete(XDBInstance* instance, const char* key) {
     if (!instance || !instance->db) return 0;
-    return delete_key(instance->db->store, key);
+    int result = delete_key(instance->db->store, key, strlen(key));
+    journal_sync_pending();
+    return result;
+}
+
+/* Stores count pairs with one lock acquisition per shard touched. Returns the number stored. */
+int xdb_instance_mset(XDBInstance* instance, const char** keys, const char** values, size_t count, int expire_seconds) {
+    if (!instance || !instance->db || !instance_reclaim_memory(instance)) return 0;
+    
+    XDBArg* pairs = (XDBArg*)malloc(sizeof(XDBArg) * 2 * (count ? count : 1));
+    if (!pairs) return 0;
+    for (size_t i = 0; i < count; i++) {
+        pairs[i * 2].ptr = (char*)keys[i];
+        pairs[i * 2].len = strlen(keys[i]);
+        pairs[i * 2 + 1].ptr = (char*)values[i];
+        pairs[i * 2 + 1].len = strlen(values[i]);
+    }
+    
+    time_t expiry = expire_seconds > 0 ? time(NULL) + expire_seconds : 0;
+    size_t stored = set_keys(instance->db->store, count, pairs, expiry);
+    journal_sync_pending();
+    free(pairs);
+    return (int)stored;
+}
+
+typedef struct {
+    char** bufs;
+    size_t size;
+} MultiCopy;
+
+static void copy_multi_value(size_t index, const char* value, size_t len, void* ctx) {
+    MultiCopy* copy = (MultiCopy*)ctx;
+    CopyTarget target = { copy->bufs[index], copy->size };
+    if (value) {
+        copy_value(value, len, &target);
+    } else if (copy->size > 0) {
+        copy->bufs[index][0] = '\0';
+    }
+}
+
+/*
+ * Fetches count keys into value_bufs[i] (each buf_size bytes, truncated like
+ * xdb_instance_get; missing keys leave an empty string). Returns the number found.
+ */
+int xdb_instance_mget(XDBInstance* instance, const char** keys, size_t count, char** value_bufs, size_t buf_size) {
+    if (!instance || !instance->db) return 0;
+    
+    XDBArg* args = (XDBArg*)malloc(sizeof(XDBArg) * (count ? count : 1));
+    if (!args) return 0;
+    for (size_t i = 0; i < count; i++) {
+        args[i].ptr = (char*)keys[i];
+        args[i].len = strlen(keys[i]);
+    }
+    
+    MultiCopy copy = { value_bufs, buf_size };
+    long found = get_keys_with(instance->db->store, count, args, copy_multi_value, &copy);
+    free(args);
+    return found > 0 ? (int)found : 0;
 }
 
 void xdb_instance_save(XDBInstance* instance) {
@@ -2,6 +2,10 @@
 #ifndef XDB_H
 #define XDB_H
 
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
@@ -14,18 +18,44 @@
     #define mutex_lock(m) EnterCriticalSection(m)
     #define mutex_unlock(m) LeaveCriticalSection(m)
     #define mutex_destroy(m) DeleteCriticalSection(m)
+    typedef SRWLOCK rwlock_t;
+    #define rwlock_init(l) InitializeSRWLock(l)
+    #define rwlock_rdlock(l) AcquireSRWLockShared(l)
+    #define rwlock_wrlock(l) AcquireSRWLockExclusive(l)
+    #define rwlock_rdunlock(l) ReleaseSRWLockShared(l)
+    #define rwlock_wrunlock(l) ReleaseSRWLockExclusive(l)
+    #define rwlock_destroy(l) ((void)(l))
+    typedef CONDITION_VARIABLE cond_t;
+    #define cond_init(c) InitializeConditionVariable(c)
+    #define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+    #define cond_broadcast(c) WakeAllConditionVariable(c)
+    #define cond_destroy(c) ((void)(c))
+    #define XDB_THREAD_LOCAL __declspec(thread)
     #define thread_create(t, f, arg) *t = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)f, arg, 0, NULL)
     #define thread_join(t) WaitForSingleObject(t, INFINITE)
+    #define thread_detach(t) CloseHandle(t)
     #define close_socket(s) closesocket(s)
     #define sleep_ms(ms) Sleep(ms)
     #define PATH_SEPARATOR "\\"
+    #define strtok_r strtok_s
+    #define strcasecmp _stricmp
+    #define xdb_atomic_add64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+    #define xdb_atomic_load64(p) InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0)
+    #define xdb_atomic_store64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+    #define xdb_atomic_load32(p) ((uint32_t)InterlockedCompareExchange((volatile LONG*)(p), 0, 0))
+    #define xdb_atomic_acquire32(p) xdb_atomic_load32(p)
+    #define xdb_atomic_store32(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+    #define xdb_atomic_inc32(p) ((uint32_t)InterlockedIncrement((volatile LONG*)(p)))
+    #define xdb_atomic_dec32(p) ((uint32_t)InterlockedDecrement((volatile LONG*)(p)))
 #else
     #include <unistd.h>
+    #include <strings.h>
     #include <pthread.h>
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <sys/stat.h>
+    #include <sys/uio.h>
     #include <fcntl.h>
     #include <signal.h>
     typedef int socket_t;
@@ -35,13 +65,41 @@
     #define mutex_lock(m) pthread_mutex_lock(m)
     #define mutex_unlock(m) pthread_mutex_unlock(m)
     #define mutex_destroy(m) pthread_mutex_destroy(m)
+    typedef pthread_rwlock_t rwlock_t;
+    #define rwlock_init(l) pthread_rwlock_init(l, NULL)
+    #define rwlock_rdlock(l) pthread_rwlock_rdlock(l)
+    #define rwlock_wrlock(l) pthread_rwlock_wrlock(l)
+    #define rwlock_rdunlock(l) pthread_rwlock_unlock(l)
+    #define rwlock_wrunlock(l) pthread_rwlock_unlock(l)
+    #define rwlock_destroy(l) pthread_rwlock_destroy(l)
+    typedef pthread_cond_t cond_t;
+    #define cond_init(c) pthread_cond_init(c, NULL)
+    #define cond_wait(c, m) pthread_cond_wait(c, m)
+    #define cond_broadcast(c) pthread_cond_broadcast(c)
+    #define cond_destroy(c) pthread_cond_destroy(c)
+    #define XDB_THREAD_LOCAL __thread
     #define thread_create(t, f, arg) pthread_create(t, NULL, f, arg)
     #define thread_join(t) pthread_join(t, NULL)
+    #define thread_detach(t) pthread_detach(t)
     #define close_socket(s) close(s)
     #define sleep_ms(ms) usleep(ms * 1000)
     #define PATH_SEPARATOR "/"
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
+    #define xdb_atomic_add64(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+    #define xdb_atomic_load64(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+    #define xdb_atomic_store64(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+    #define xdb_atomic_load32(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+    #define xdb_atomic_acquire32(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+    #define xdb_atomic_store32(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+    #define xdb_atomic_inc32(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+    #define xdb_atomic_dec32(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+#if defined(__linux__) && !defined(XDB_NO_EPOLL)
+    #define XDB_USE_EPOLL
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
 #endif
 
 #define MAX_KEY_SIZE 128
@@ -49,67 +107,344 @@
 #define MAX_COMMAND_SIZE 4224
 #define MAX_CLIENTS 100
 #define DEFAULT_PORT 6379
-#define HASH_TABLE_SIZE 1024
+#define XDB_SHARD_COUNT 64
+#define XDB_TABLE_MIN_SLOTS 16
+#define XDB_REHASH_STEP 16
+#define XDB_AOF_REWRITE_MIN_SIZE (64 * 1024 * 1024)
+#define XDB_AUTOSAVE_INTERVAL 30
 #define MAX_DB_COUNT 16
 #define MAX_DB_NAME_SIZE 64
+#define XDB_MAX_REACTORS 64
+#define XDB_MAX_LISTENERS 8
+#define XDB_EPOLL_EVENTS 256
+#define XDB_READ_CHUNK 16384
+#define XDB_MAX_QUERY_SIZE (64 * 1024 * 1024)
+#define XDB_MAX_ENTRY_SIZE (512 * 1024 * 1024)
+#define XDB_SLAB_CLASSES 11
+#define XDB_SLAB_PAGE_SIZE (64 * 1024)
+#define XDB_REPLY_CHUNK 16384
+#define XDB_MAX_IOV 64
+#define XDB_MAX_IN_FLIGHT 1024
+#define XDB_EXPIRE_BATCH 64
+#define XDB_EXPIRE_ON_WRITE 2
+#define XDB_EXPIRE_BUDGET_US 25000
+#define XDB_REPLID_SIZE 40
+#define XDB_REPL_BACKLOG_SIZE (8 * 1024 * 1024)
+#define XDB_REPL_CHUNK (64 * 1024)
+#define XDB_REPL_PING_INTERVAL 10
+#define XDB_REPL_TIMEOUT 60
+#define XDB_EVICT_SAMPLES 5
+#define XDB_LFU_INIT 5
+#define XDB_LFU_LOG_FACTOR 10
+#define XDB_LFU_DECAY_SECONDS 60
+#define XDB_LATENCY_SUB_BITS 3
+#define XDB_LATENCY_BUCKETS 304
+#define XDB_MAX_HTTP_HEADER 8192
+#define XDB_NUMBER_MAX 32
+#define XDB_PACK_MAX_ENTRIES 128
+#define XDB_PACK_MAX_VALUE 64
+#define XDB_LIST_NODE_SIZE 8192
+#define XDB_SKIPLIST_MAX_LEVEL 32
+#define XDB_PUBSUB_HARD_LIMIT (32 * 1024 * 1024)
+#define XDB_PUBSUB_SOFT_LIMIT (8 * 1024 * 1024)
+#define XDB_PUBSUB_SOFT_SECONDS 60
+#define XDB_PUBSUB_POLL_MS 50
+
+/*
+ * How an entry's value bytes are encoded. Counters hold a native int64 or
+ * double in place of the text, so INCR and friends skip parsing and
+ * formatting; readers still see the decimal string. Lists, hashes and
+ * sorted sets keep a pointer to their collection in the value bytes.
+ */
+typedef enum {
+    XDB_TYPE_STRING,
+    XDB_TYPE_INT,
+    XDB_TYPE_DOUBLE,
+    XDB_TYPE_LIST,
+    XDB_TYPE_HASH,
+    XDB_TYPE_ZSET
+} XDBValueType;
 
 typedef struct {
-    char key[MAX_KEY_SIZE];
-    char value[MAX_VALUE_SIZE];
+    char* value;
     time_t expiry;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t hash;
+    uint32_t heap_index;
+    uint32_t access;
+    uint32_t refs;
+    uint8_t type;
+    char data[];
 } KeyValue;
 
+#define XDB_NOT_IN_HEAP UINT32_MAX
+
+#define XDB_CTRL_EMPTY 0x80
+#define XDB_CTRL_DELETED 0xFE
+
+/* Open-addressing table: one control byte (7 hash bits, or empty/deleted) per slot. */
+typedef struct {
+    uint8_t* ctrl;
+    KeyValue** slots;
+    size_t mask;
+    size_t used;
+    size_t tombstones;
+} XDBTable;
+
+/* Binary min-heap of the shard's entries that carry an expiry, soonest first. */
+typedef struct {
+    KeyValue** items;
+    size_t count;
+    size_t cap;
+} XDBExpiryHeap;
+
+/*
+ * Independently locked slice of a HashTable; `old` is non-empty while a
+ * rehash drains into `table`. Lookups share the lock, anything that changes
+ * the shard (including rehash steps and expiry) takes it exclusively.
+ */
 typedef struct {
-    KeyValue* entries;
-    int size;
-    int capacity;
-} Bucket;
+    XDBTable table;
+    XDBTable old;
+    size_t rehash_pos;
+    XDBExpiryHeap expires;
+    int64_t* used_memory;
+    rwlock_t lock;
+} XDBShard;
 
 typedef struct {
-    Bucket buckets[HASH_TABLE_SIZE];
-    mutex_t locks[HASH_TABLE_SIZE];
+    size_t chunk_size;
+    void* free_list;
+    void* pages;
+    mutex_t lock;
+} XDBSlabClass;
+
+typedef struct {
+    XDBSlabClass classes[XDB_SLAB_CLASSES];
+} XDBSlab;
+
+typedef struct {
+    char* ptr;
+    size_t len;
+} XDBArg;
+
+/* Receives every mutation as a command argv while the affected shard is still locked. */
+typedef void (*xdb_journal_f)(void* ctx, int argc, const XDBArg* argv);
+
+typedef struct {
+    XDBShard shards[XDB_SHARD_COUNT];
+    XDBSlab slab;
+    xdb_journal_f journal;
+    void* journal_ctx;
+    xdb_journal_f replicate;
+    void* replicate_ctx;
+    int expire_cursor;
+    int64_t used_memory;
+    int64_t evicted;
+    int64_t expired;
 } HashTable;
 
+typedef void (*xdb_value_f)(const char* value, size_t len, void* ctx);
+typedef void (*xdb_key_f)(const char* key, size_t len, void* ctx);
+
+typedef enum {
+    XDB_AOF_OFF,
+    XDB_AOF_ALWAYS,
+    XDB_AOF_EVERYSEC,
+    XDB_AOF_NO
+} XDBAofPolicy;
+
+/* What gives way once a maxmemory limit is reached. Volatile policies only evict keys with a TTL. */
+typedef enum {
+    XDB_EVICT_NONE,
+    XDB_EVICT_ALLKEYS_LRU,
+    XDB_EVICT_ALLKEYS_LFU,
+    XDB_EVICT_VOLATILE_LRU,
+    XDB_EVICT_VOLATILE_LFU
+} XDBEvictPolicy;
+
+typedef struct XDBAof XDBAof;
+
 typedef struct {
     char name[MAX_DB_NAME_SIZE];
     HashTable* store;
     char* db_path;
+    XDBAof* aof;
 } Database;
 
 typedef struct {
+    XDBArg* items;
+    int count;
+    int cap;
+} XDBArgv;
+
+/* Wire protocol spoken on a listener. Replies are RESP except on metrics listeners. */
+typedef enum {
+    XDB_PROTO_RESP,     /* RESP2 multibulk requests, inline lines also accepted */
+    XDB_PROTO_INLINE,   /* legacy space-separated lines only */
+    XDB_PROTO_METRICS   /* HTTP GET /metrics, answered in Prometheus text format */
+} XDBProtocol;
+
+typedef struct {
+    int port;
+    XDBProtocol protocol;
+    socket_t sock;
+} XDBListener;
+
+/* A pending chunk holds the place of a reply another reactor has yet to produce. */
+typedef struct XDBReplyChunk {
+    struct XDBReplyChunk* next;
+    size_t len;
+    size_t cap;
+    size_t sent;
+    int pending;
+    char data[];
+} XDBReplyChunk;
+
+typedef struct XDBStats XDBStats;
+
+typedef struct ClientInfo {
     socket_t client_sock;
     struct sockaddr_in client_addr;
     int current_db_index;
+    XDBProtocol protocol;
     void* server;
+    char* read_buf;
+    size_t read_len;
+    size_t read_cap;
+    XDBReplyChunk* reply_head;
+    XDBReplyChunk* reply_tail;
+    size_t reply_bytes;
+    int closing;
+    int blocked;
+    int hangup;
+    int in_flight;
+    void* deferred;
+    void* replica;
+    void* subscriber;
+    void* reactor;
+    XDBStats* stats;
+    struct ClientInfo* prev;
+    struct ClientInfo* next;
 } ClientInfo;
 
+typedef struct XDBMessage XDBMessage;
+
+typedef struct {
+    int index;
+    int epoll_fd;
+    int event_fd;
+    XDBMessage* inbox;
+    XDBListener listeners[XDB_MAX_LISTENERS];
+    int listener_count;
+    thread_t thread;
+    ClientInfo* clients;
+    int client_count;
+    char* scratch;
+    XDBArgv args;
+    XDBStats* stats;
+    void* server;
+} XDBReactor;
+
+typedef struct XDBReplication XDBReplication;
+typedef struct XDBMetrics XDBMetrics;
+typedef struct XDBPubSub XDBPubSub;
+
 typedef struct {
     Database* databases;
     int db_count;
-    socket_t server_sock;
+    XDBListener listeners[XDB_MAX_LISTENERS];
+    int listener_count;
     int port;
-    int server_running;
+    /* Cleared from signal handlers as well as stop, read by every server thread. */
+    volatile sig_atomic_t server_running;
     thread_t client_threads[MAX_CLIENTS];
-    thread_t autosave_thread;
+    thread_t cron_thread;
     int client_count;
     mutex_t client_mutex;
     mutex_t db_mutex;
+    XDBReactor* reactors;
+    int reactor_count;
+    XDBAofPolicy aof_policy;
+    int shared_nothing;
+    int64_t maxmemory;
+    XDBEvictPolicy maxmemory_policy;
+    #ifdef _WIN32
+    int save_pid;
+    #else
+    pid_t save_pid;
+    #endif
+    int save_ok;
+    XDBReplication* repl;
+    XDBMetrics* metrics;
+    XDBPubSub* pubsub;
 } XDBServer;
 
 XDBServer* xdb_server_create(int port);
 int xdb_server_add_database(XDBServer* server, const char* name, const char* db_path);
+int xdb_server_add_listener(XDBServer* server, int port, XDBProtocol protocol);
+int xdb_server_set_reactors(XDBServer* server, int count);
+int xdb_server_set_shared_nothing(XDBServer* server, int enabled);
+int xdb_server_set_aof(XDBServer* server, XDBAofPolicy policy);
+int xdb_server_set_replicaof(XDBServer* server, const char* host, int port);
+int xdb_server_set_maxmemory(XDBServer* server, size_t bytes, XDBEvictPolicy policy);
 int xdb_server_start(XDBServer* server);
 void xdb_server_stop(XDBServer* server);
+/* Sends message to every client subscribed to channel; returns how many there were, or -1. */
+int xdb_server_publish(XDBServer* server, const char* channel, const char* message);
 void xdb_server_destroy(XDBServer* server);
 
 typedef struct {
     Database* db;
+    int64_t maxmemory;
+    XDBEvictPolicy maxmemory_policy;
 } XDBInstance;
 
 XDBInstance* xdb_instance_create(const char* name, const char* db_path);
+XDBInstance* xdb_instance_create_with_aof(const char* name, const char* db_path, XDBAofPolicy policy);
 int xdb_instance_set(XDBInstance* instance, const char* key, const char* value, int expire_seconds);
 int xdb_instance_get(XDBInstance* instance, const char* key, char* value_buf, size_t buf_size);
 int xdb_instance_delete(XDBInstance* instance, const char* key);
+int xdb_instance_mset(XDBInstance* instance, const char** keys, const char** values, size_t count, int expire_seconds);
+int xdb_instance_mget(XDBInstance* instance, const char** keys, size_t count, char** value_bufs, size_t buf_size);
+int xdb_instance_set_maxmemory(XDBInstance* instance, size_t bytes, XDBEvictPolicy policy);
+
+/*
+ * A read-only value borrowed from the store without copying. The bytes
+ * (NUL-terminated, len not counting the NUL) stay valid and unchanged
+ * until the view is released, even if the key is overwritten, deleted or
+ * evicted meanwhile. Numeric values are formatted into the view itself, so
+ * a view must not be copied. Every view must be released before the
+ * instance is destroyed.
+ */
+typedef struct {
+    const char* data;
+    size_t len;
+    void* pin;
+    char number[XDB_NUMBER_MAX];
+} XDBView;
+
+int xdb_instance_get_view(XDBInstance* instance, const char* key, XDBView* view);
+void xdb_instance_release_view(XDBInstance* instance, XDBView* view);
+
+/*
+ * Atomically adds delta to the key's integer (or float) value, creating it
+ * from 0 when missing, and stores the result. Returns 0 if the value is
+ * not a number, or if the result would overflow or be non-finite.
+ */
+int xdb_instance_incr(XDBInstance* instance, const char* key, int64_t delta, int64_t* result);
+int xdb_instance_incr_float(XDBInstance* instance, const char* key, double delta, double* result);
+
+/*
+ * Calls fn for roughly count keys matching the glob pattern (NULL for all)
+ * and returns the cursor to continue from; start and finish at 0. Keys
+ * present for the whole iteration are reported at least once, even across
+ * resizes. fn runs under a shard lock and must not call back into the instance.
+ */
+uint64_t xdb_instance_scan(XDBInstance* instance, uint64_t cursor, size_t count,
+                           const char* pattern, xdb_key_f fn, void* ctx);
+size_t xdb_instance_used_memory(XDBInstance* instance);
 void xdb_instance_save(XDBInstance* instance);
 void xdb_instance_destroy(XDBInstance* instance);
 